@@ -0,0 +1,103 @@
+/*
+ * benchmark_block_sizes.cpp
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+// Compares combinations of the block sizes of the nodes and the
+// leaves of the fractal tree (see ftree_with_block_sizes) on random
+// insertions, point lookups and a range search, with the same memory
+// pool for all of them. Large leaves make range searches read fewer,
+// larger blocks; small nodes make flushing their buffers cheaper.
+// For each phase, the time and the number and volume of the reads
+// and writes are reported.
+
+#include "../include/fractal_tree/fractal_tree.h"
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using key_type = int;
+using data_type = int;
+using value_type = std::pair<key_type, data_type>;
+constexpr size_t RawMemoryPoolSize = 16 * 1024 * 1024;
+
+constexpr int num_values = 1 << 23;
+constexpr int num_lookups = 1 << 16;
+constexpr int range_size = num_values / 8;
+
+struct phase_result {
+    double seconds;
+    unsigned reads;
+    unsigned writes;
+    uint64_t read_volume;
+    uint64_t write_volume;
+};
+
+phase_result get_result(const foxxll::stats_data& data) {
+    return phase_result { data.get_elapsed_time(),
+                          static_cast<unsigned>(data.get_read_count()),
+                          static_cast<unsigned>(data.get_write_count()),
+                          static_cast<uint64_t>(data.get_read_volume()),
+                          static_cast<uint64_t>(data.get_write_volume()) };
+}
+
+template <size_t RawNodeBlockSize, size_t RawLeafBlockSize>
+void benchmark_block_sizes(const std::vector<value_type>& values, const std::vector<key_type>& lookup_keys) {
+    using ftree_type = stxxl::ftree_with_block_sizes<key_type, data_type, RawNodeBlockSize, RawLeafBlockSize, RawMemoryPoolSize>;
+    ftree_type f;
+    foxxll::stats* stats = foxxll::stats::get_instance();
+
+    foxxll::stats_data insert_begin(*stats);
+    for (const value_type& val : values)
+        f.insert(val);
+    phase_result insert = get_result(foxxll::stats_data(*stats) - insert_begin);
+
+    foxxll::stats_data find_begin(*stats);
+    for (key_type key : lookup_keys)
+        f.find(key);
+    phase_result find = get_result(foxxll::stats_data(*stats) - find_begin);
+
+    foxxll::stats_data range_begin(*stats);
+    f.range_find(num_values / 2, num_values / 2 + range_size - 1);
+    phase_result range = get_result(foxxll::stats_data(*stats) - range_begin);
+
+    std::cout << RawNodeBlockSize << "," << RawLeafBlockSize << "," << f.num_nodes() << "," << f.num_leaves();
+    for (const phase_result& res : { insert, find, range })
+        std::cout << "," << res.seconds << "," << res.reads << "," << res.writes
+                  << "," << res.read_volume << "," << res.write_volume;
+    std::cout << std::endl;
+}
+
+int main() {
+    std::vector<value_type> values(num_values);
+    for (int i = 0; i < num_values; i++)
+        values[i] = value_type(i, i);
+    std::shuffle(values.begin(), values.end(), std::mt19937(42));
+
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<key_type> key_dist(0, num_values - 1);
+    std::vector<key_type> lookup_keys(num_lookups);
+    for (key_type& key : lookup_keys)
+        key = key_dist(gen);
+
+    std::cout << "NODE_BLOCK_SIZE,LEAF_BLOCK_SIZE,NODES,LEAVES";
+    for (const char* phase : { "INSERT", "FIND", "RANGE" })
+        std::cout << "," << phase << "_SECONDS," << phase << "_READS," << phase << "_WRITES,"
+                  << phase << "_READ_BYTES," << phase << "_WRITE_BYTES";
+    std::cout << std::endl;
+
+    // Leaves have to take the buffer of a node, so they
+    // are at least as large as the nodes.
+    benchmark_block_sizes<4 * 1024, 4 * 1024>(values, lookup_keys);
+    benchmark_block_sizes<4 * 1024, 64 * 1024>(values, lookup_keys);
+    benchmark_block_sizes<4 * 1024, 256 * 1024>(values, lookup_keys);
+    benchmark_block_sizes<16 * 1024, 16 * 1024>(values, lookup_keys);
+    benchmark_block_sizes<16 * 1024, 64 * 1024>(values, lookup_keys);
+    benchmark_block_sizes<16 * 1024, 256 * 1024>(values, lookup_keys);
+    benchmark_block_sizes<64 * 1024, 64 * 1024>(values, lookup_keys);
+    benchmark_block_sizes<64 * 1024, 256 * 1024>(values, lookup_keys);
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * benchmark_cache_policies.cpp
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+// Compares the cache replacement policies of the fractal tree
+// on a mixed workload: point lookups on a small set of hot
+// keys, interleaved with large range searches over cold keys.
+// For each policy, the I/Os of the point lookups that directly
+// follow a range search are reported separately, as these are
+// the ones a scan-sensitive policy makes expensive.
+
+#include "../include/fractal_tree/fractal_tree.h"
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using key_type = int;
+using data_type = int;
+using value_type = std::pair<key_type, data_type>;
+constexpr unsigned RawBlockSize = 4096;
+constexpr unsigned RawMemoryPoolSize = 64 * RawBlockSize;
+
+constexpr int num_values = 1 << 20;
+constexpr int num_hot_keys = 8;
+constexpr int num_rounds = 20;
+constexpr int num_lookups_per_round = 16 * num_hot_keys;
+constexpr int range_size = num_values / 8;
+
+struct result {
+    double seconds;
+    unsigned point_reads;
+    unsigned scan_reads;
+    unsigned writes;
+};
+
+template <template <typename, typename, unsigned> class CachePolicy>
+result benchmark_policy(const std::vector<value_type>& values, const std::vector<key_type>& hot_keys) {
+    using ftree_type = stxxl::ftree<key_type, data_type, RawBlockSize, RawMemoryPoolSize,
+                                    foxxll::default_alloc_strategy, CachePolicy>;
+    ftree_type f;
+    for (const value_type& val : values)
+        f.insert(val);
+
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> hot_dist(0, num_hot_keys - 1);
+    std::uniform_int_distribution<int> range_dist(0, num_values - range_size);
+
+    // Warm up the cache with the hot keys.
+    for (int i = 0; i < num_lookups_per_round; i++)
+        f.find(hot_keys[hot_dist(gen)]);
+
+    foxxll::stats* stats = foxxll::stats::get_instance();
+    result res { 0, 0, 0, 0 };
+    for (int round = 0; round < num_rounds; round++) {
+        int low = range_dist(gen);
+        foxxll::stats_data scan_begin(*stats);
+        f.range_find(low, low + range_size - 1);
+        foxxll::stats_data scan_data = foxxll::stats_data(*stats) - scan_begin;
+
+        foxxll::stats_data points_begin(*stats);
+        for (int i = 0; i < num_lookups_per_round; i++)
+            f.find(hot_keys[hot_dist(gen)]);
+        foxxll::stats_data points_data = foxxll::stats_data(*stats) - points_begin;
+
+        res.seconds += scan_data.get_elapsed_time() + points_data.get_elapsed_time();
+        res.scan_reads += scan_data.get_read_count();
+        res.point_reads += points_data.get_read_count();
+        res.writes += scan_data.get_write_count() + points_data.get_write_count();
+    }
+    return res;
+}
+
+void print_result(const std::string& policy, const result& res) {
+    std::cout << policy << ","
+              << res.seconds << ","
+              << res.point_reads << ","
+              << res.scan_reads << ","
+              << res.writes << std::endl;
+}
+
+int main() {
+    std::vector<value_type> values(num_values);
+    for (int i = 0; i < num_values; i++)
+        values[i] = value_type(i, i);
+    std::shuffle(values.begin(), values.end(), std::mt19937(42));
+
+    // The hot keys are spread over the key space, so each
+    // lives in its own leaf; together they fit into the cache.
+    std::vector<key_type> hot_keys(num_hot_keys);
+    for (int i = 0; i < num_hot_keys; i++)
+        hot_keys[i] = i * (num_values / num_hot_keys);
+
+    std::cout << "POLICY,SECONDS,POINT_READS,SCAN_READS,WRITES" << std::endl;
+    print_result("LRU", benchmark_policy<stxxl::fractal_tree::lru_policy>(values, hot_keys));
+    print_result("CLOCK", benchmark_policy<stxxl::fractal_tree::clock_policy>(values, hot_keys));
+    print_result("2Q", benchmark_policy<stxxl::fractal_tree::two_queue_policy>(values, hot_keys));
+    print_result("ARC", benchmark_policy<stxxl::fractal_tree::arc_policy>(values, hot_keys));
+
+    return 0;
+}
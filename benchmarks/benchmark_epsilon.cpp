@@ -0,0 +1,115 @@
+/*
+ * benchmark_epsilon.cpp
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+// Compares the epsilon of the nodes of the fractal tree (see
+// node_parameters): nodes with room for B items have about B^epsilon
+// values and the rest of their block for their buffer. Small
+// epsilons flush more items per write (cheaper insertions), large
+// ones make the tree shallower (cheaper lookups). For each epsilon,
+// a tree with half of the values runs an insert-heavy mix (15 of 16
+// operations are insertions) and another one a lookup-heavy mix (15
+// of 16 are lookups), with the same block and memory pool sizes. For
+// each mix, the time and the number of reads and writes are reported.
+
+#include "../include/fractal_tree/fractal_tree.h"
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <ratio>
+#include <vector>
+
+using key_type = int;
+using data_type = int;
+using value_type = std::pair<key_type, data_type>;
+constexpr size_t RawBlockSize = 16 * 1024;
+constexpr size_t RawMemoryPoolSize = 16 * 1024 * 1024;
+
+constexpr int num_values = 1 << 23;
+constexpr int num_operations = 1 << 20;
+
+struct phase_result {
+    double seconds;
+    unsigned reads;
+    unsigned writes;
+};
+
+phase_result get_result(const foxxll::stats_data& data) {
+    return phase_result { data.get_elapsed_time(),
+                          static_cast<unsigned>(data.get_read_count()),
+                          static_cast<unsigned>(data.get_write_count()) };
+}
+
+// Run num_operations operations on the tree, of which lookups_per_16
+// in every 16 are lookups of random keys and the others insert the
+// next of the values.
+template <typename ftree_type>
+phase_result run_mix(ftree_type& f, const std::vector<value_type>& values, int& next_value, int lookups_per_16) {
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<key_type> key_dist(0, num_values - 1);
+    foxxll::stats* stats = foxxll::stats::get_instance();
+
+    foxxll::stats_data begin(*stats);
+    for (int i = 0; i < num_operations; i++) {
+        if (i % 16 < lookups_per_16)
+            f.find(key_dist(gen));
+        else
+            f.insert(values[next_value++ % num_values]);
+    }
+    return get_result(foxxll::stats_data(*stats) - begin);
+}
+
+template <typename Epsilon>
+void benchmark_epsilon(const std::vector<value_type>& values) {
+    using ftree_type = stxxl::ftree<key_type, data_type, RawBlockSize, RawMemoryPoolSize,
+                                    foxxll::default_alloc_strategy, stxxl::fractal_tree::lru_policy,
+                                    stxxl::fractal_tree::default_packed_leaves,
+                                    stxxl::fractal_tree::default_block_compression,
+                                    stxxl::fractal_tree::lz_block_codec, Epsilon>;
+    using node_type = stxxl::fractal_tree::node<key_type, data_type, RawBlockSize,
+                                                stxxl::fractal_tree::default_pivot_layout,
+                                                stxxl::fractal_tree::default_buffer_filter, Epsilon>;
+
+    // Both mixes start from a tree with half of the values.
+    ftree_type insert_heavy_tree;
+    int next_value = 0;
+    for (; next_value < num_values / 2; next_value++)
+        insert_heavy_tree.insert(values[next_value]);
+    phase_result insert_heavy = run_mix(insert_heavy_tree, values, next_value, 1);
+
+    ftree_type lookup_heavy_tree;
+    next_value = 0;
+    for (; next_value < num_values / 2; next_value++)
+        lookup_heavy_tree.insert(values[next_value]);
+    phase_result lookup_heavy = run_mix(lookup_heavy_tree, values, next_value, 15);
+
+    std::cout << static_cast<double>(Epsilon::num) / Epsilon::den << ","
+              << node_type::max_num_values_in_node << "," << node_type::max_num_buffer_items_in_node << ","
+              << lookup_heavy_tree.depth();
+    for (const phase_result& res : { insert_heavy, lookup_heavy })
+        std::cout << "," << res.seconds << "," << res.reads << "," << res.writes;
+    std::cout << std::endl;
+}
+
+int main() {
+    std::vector<value_type> values(num_values);
+    for (int i = 0; i < num_values; i++)
+        values[i] = value_type(i, i);
+    std::shuffle(values.begin(), values.end(), std::mt19937(42));
+
+    std::cout << "EPSILON,NODE_VALUES,NODE_BUFFER_ITEMS,DEPTH";
+    for (const char* mix : { "INSERT_HEAVY", "LOOKUP_HEAVY" })
+        std::cout << "," << mix << "_SECONDS," << mix << "_READS," << mix << "_WRITES";
+    std::cout << std::endl;
+
+    benchmark_epsilon<std::ratio<3, 10>>(values);
+    benchmark_epsilon<std::ratio<2, 5>>(values);
+    benchmark_epsilon<std::ratio<1, 2>>(values);
+    benchmark_epsilon<std::ratio<3, 5>>(values);
+    benchmark_epsilon<std::ratio<7, 10>>(values);
+    benchmark_epsilon<std::ratio<4, 5>>(values);
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * benchmark_node_search.cpp
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+// Compares the pivot layouts of inner nodes (see pivot_layout in
+// key_search.h): values_find on random keys in full nodes that
+// together are much larger than the CPU caches (like the nodes of
+// a tree whose node cache is large). As on the way down a tree,
+// the node of each search depends on the result of the previous
+// one, so the cache misses of the searches do not overlap.
+// Reports the nanoseconds per values_find for each layout, key
+// type, and block size.
+
+#include "../include/fractal_tree/node.h"
+#include <chrono>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+using stxxl::fractal_tree::pivot_layout;
+
+constexpr size_t nodes_size = 256 * 1024 * 1024;
+constexpr int num_finds = 1 << 22;
+
+template <typename KeyType, unsigned RawBlockSize, pivot_layout Layout>
+double benchmark_layout() {
+    using node_type = stxxl::fractal_tree::node<KeyType, KeyType, RawBlockSize, Layout>;
+    using value_type = typename node_type::value_type;
+    constexpr int num_values = node_type::max_num_values_in_node;
+    constexpr int num_nodes = nodes_size / RawBlockSize;
+
+    // Node i has the keys i, i + num_nodes, i + 2 * num_nodes, ...
+    std::vector<node_type> nodes;
+    std::vector<typename node_type::block_type*> blocks;
+    nodes.reserve(num_nodes);
+    for (int i = 0; i < num_nodes; i++) {
+        nodes.emplace_back(i, typename node_type::bid_type());
+        blocks.push_back(new typename node_type::block_type);
+        nodes[i].set_block(blocks[i]);
+        std::vector<value_type> values;
+        std::vector<int> nodeIDs(num_values + 1);
+        std::iota(nodeIDs.begin(), nodeIDs.end(), 0);
+        for (int j = 0; j < num_values; j++)
+            values.emplace_back(KeyType(i + 2 * j * num_nodes), KeyType(j));
+        nodes[i].set_values_and_nodeIDs(values, nodeIDs);
+    }
+
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> node_dist(0, num_nodes - 1);
+    std::uniform_int_distribution<int> key_dist(0, 2 * num_values * num_nodes);
+    std::vector<std::pair<int, KeyType>> finds(num_finds);
+    for (auto& find : finds)
+        find = std::pair<int, KeyType>(node_dist(gen), KeyType(key_dist(gen)));
+
+    // The next node is offset by the id of the child to go to.
+    int child_id = 0;
+    int checksum = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (const auto& find : finds) {
+        auto result = nodes[(find.first + child_id) % num_nodes].values_find(find.second);
+        child_id = result.first.second;
+        checksum += result.second;
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - begin;
+
+    for (auto* block : blocks)
+        delete block;
+    // Keep the finds from being optimized away.
+    if (checksum < 0)
+        std::cout << checksum;
+    return elapsed.count() / num_finds;
+}
+
+template <typename KeyType, unsigned RawBlockSize>
+void benchmark_layouts(const std::string& key_name) {
+    using node_type = stxxl::fractal_tree::node<KeyType, KeyType, RawBlockSize>;
+    std::cout << key_name << "," << RawBlockSize << "," << node_type::max_num_values_in_node << ","
+              << benchmark_layout<KeyType, RawBlockSize, pivot_layout::sorted>() << ","
+              << benchmark_layout<KeyType, RawBlockSize, pivot_layout::eytzinger>() << std::endl;
+}
+
+int main() {
+    std::cout << "KEY,BLOCK_SIZE,NUM_VALUES,SORTED_NS,EYTZINGER_NS" << std::endl;
+    benchmark_layouts<int, 4096>("int");
+    benchmark_layouts<int, 65536>("int");
+    benchmark_layouts<int, 1024 * 1024>("int");
+    benchmark_layouts<double, 4096>("double");
+    benchmark_layouts<double, 65536>("double");
+    benchmark_layouts<double, 1024 * 1024>("double");
+
+    return 0;
+}
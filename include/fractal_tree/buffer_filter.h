@@ -0,0 +1,133 @@
+/*
+ * buffer_filter.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_BUFFER_FILTER_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_BUFFER_FILTER_H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+// Whether the nodes of a fractal tree keep a filter of the keys
+// in their buffer (see buffer_filter), 0: no, 1: yes. The filter
+// takes space in the node blocks, so the buffers get smaller.
+#ifndef FRACTAL_TREE_BUFFER_FILTER
+#define FRACTAL_TREE_BUFFER_FILTER 0
+#endif
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+constexpr bool default_buffer_filter = FRACTAL_TREE_BUFFER_FILTER;
+
+namespace detail {
+
+// Hash of a key for the buffer filter (std::hash, whose
+// result for integers is the integer itself, mixed up with
+// the finalizer of MurmurHash3).
+template<typename KeyType>
+inline uint64_t buffer_filter_hash(const KeyType& key) {
+    uint64_t hash = std::hash<KeyType>()(key);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+}
+
+/*
+ * Filter of the keys in the buffer of a node, stored in the node's
+ * block next to the buffer. may_contain(key) is false only if key
+ * was not inserted since the last clear, so buffer_find can skip
+ * searching the buffer for most keys that are not in it.
+ *
+ * It is a split block Bloom filter (as in Apache Parquet): a key sets
+ * one bit in each of the 8 words of one block of 256 bits, so a
+ * lookup reads one cache line. At bits_per_item bits per buffer
+ * item, about 3% of the lookups of keys that are not in a full
+ * buffer are false positives.
+ *
+ * Only keys of arithmetic types (which std::hash covers) are
+ * filtered; for other keys, and if Enabled is false, the filter
+ * is empty and may_contain is always true.
+ */
+template<typename KeyType, int Capacity, bool Enabled>
+struct buffer_filter {
+    static constexpr int size_in_bytes(int) { return 0; }
+
+    void clear() { }
+    void insert(const KeyType&) { }
+    bool may_contain(const KeyType&) const { return true; }
+};
+
+template<typename KeyType, int Capacity>
+struct buffer_filter<KeyType, Capacity, true> {
+    static constexpr int bits_per_item = 8;
+    static constexpr int words_per_block = 8;
+    static constexpr int num_blocks_for(int capacity) {
+        return (capacity * bits_per_item + 32 * words_per_block - 1) / (32 * words_per_block);
+    }
+    // Size of the filter for a buffer with the given capacity.
+    static constexpr int size_in_bytes(int capacity) {
+        return num_blocks_for(capacity) * words_per_block * sizeof(uint32_t);
+    }
+
+    enum { num_blocks = num_blocks_for(Capacity) };
+
+    std::array<std::array<uint32_t, words_per_block>, num_blocks> blocks {};
+
+    void clear() {
+        for (auto& block : blocks)
+            block.fill(0);
+    }
+
+    void insert(const KeyType& key) {
+        uint64_t hash = detail::buffer_filter_hash(key);
+        std::array<uint32_t, words_per_block>& block = blocks[block_index(hash)];
+        for (int i = 0; i < words_per_block; i++)
+            block[i] |= mask(hash, i);
+    }
+
+    bool may_contain(const KeyType& key) const {
+        uint64_t hash = detail::buffer_filter_hash(key);
+        const std::array<uint32_t, words_per_block>& block = blocks[block_index(hash)];
+        uint32_t missing = 0;
+        for (int i = 0; i < words_per_block; i++)
+            missing |= ~block[i] & mask(hash, i);
+        return missing == 0;
+    }
+
+private:
+    // The upper half of the hash picks the block (without a
+    // division), the lower half the bits within the block.
+    static int block_index(uint64_t hash) {
+        return static_cast<int>(((hash >> 32) * num_blocks) >> 32);
+    }
+
+    static uint32_t mask(uint64_t hash, int word) {
+        static constexpr uint32_t salts[words_per_block] = {
+            0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+            0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+        };
+        return uint32_t(1) << ((static_cast<uint32_t>(hash) * salts[word]) >> 27);
+    }
+};
+
+// Whether nodes with the key type get a (non-empty) filter.
+template<typename KeyType, bool UseBufferFilter>
+using has_buffer_filter = std::integral_constant<bool,
+    UseBufferFilter && std::is_arithmetic<KeyType>::value>;
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_BUFFER_FILTER_H
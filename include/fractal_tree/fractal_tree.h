@@ -13,20 +13,59 @@
 #include <foxxll/common/utils.hpp>
 #include <foxxll/common/types.hpp>
 #include "node.h"
+#include "packed_leaf.h"
+#include "slotted_node.h"
 #include "fractal_tree_cache.h"
+#include "fractal_tree_root_log.h"
 #include <unordered_map>
 #include <unordered_set>
+#include <stdexcept>
 #include <foxxll/mng/block_manager.hpp>
 
 namespace stxxl {
 
 namespace fractal_tree {
 
+// Cache statistics of a fractal_tree.
+struct fractal_tree_stats {
+    fractal_tree_cache_stats node_cache;
+    fractal_tree_cache_stats leaf_cache;
+    // levels[depth] for the nodes / leaves at that depth (root:
+    // depth 1). Blocks count for the level they were loaded at. The
+    // root and pinned nodes are never loaded through a cache, so
+    // they do not show up here.
+    std::vector<fractal_tree_cache_stats> levels;
+    // Compression (see fractal_tree_block_io.h); all zero
+    // for the blocks that are not compressed.
+    fractal_tree_codec_stats node_codec;
+    fractal_tree_codec_stats leaf_codec;
+};
+
+/*
+ * Nodes and leaves can have blocks of different sizes (e.g. large
+ * leaves for the bandwidth of scans, and smaller nodes that are
+ * cheaper to flush and of which more fit into the cache); ftree
+ * gives both the same size.
+ *
+ * Epsilon (a std::ratio) trades the fanout of the nodes against the
+ * size of their buffers (see node_parameters): nodes have B^Epsilon
+ * values for blocks of B items.
+ *
+ * Combine is the function that upserts combine their deltas with
+ * (see upsert and no_upsert).
+ */
 template <typename KeyType,
           typename DataType,
-          size_t RawBlockSize,
+          size_t RawNodeBlockSize,
+          size_t RawLeafBlockSize,
           size_t RawMemoryPoolSize,
-          typename AllocStr
+          typename AllocStr,
+          template<typename, typename, unsigned> class CachePolicy = lru_policy,
+          bool PackedLeaves = default_packed_leaves,
+          block_compression Compression = default_block_compression,
+          typename BlockCodec = lz_block_codec,
+          typename Epsilon = default_epsilon,
+          typename Combine = no_upsert
          >
 class fractal_tree {
 
@@ -37,13 +76,26 @@ class fractal_tree {
     using data_type = DataType;
     using value_type = std::pair<key_type, data_type>;
 
-    using self_type = fractal_tree<KeyType, DataType, RawBlockSize, RawMemoryPoolSize, AllocStr>;
-    using bid_type = foxxll::BID<RawBlockSize>;
+    using self_type = fractal_tree<KeyType, DataType, RawNodeBlockSize, RawLeafBlockSize, RawMemoryPoolSize, AllocStr, CachePolicy, PackedLeaves, Compression, BlockCodec, Epsilon, Combine>;
+    using node_bid_type = foxxll::BID<RawNodeBlockSize>;
+    using leaf_bid_type = foxxll::BID<RawLeafBlockSize>;
     using alloc_strategy_type = AllocStr;
 
     // Nodes and Leaves declarations.
-    using node_type = node<KeyType, DataType, RawBlockSize>;
-    using leaf_type = leaf<KeyType, DataType, RawBlockSize>;
+    // Keys or data of variable length (e.g. strings) are stored
+    // in slotted pages (see slotted_node).
+    static constexpr bool slotted = has_slotted_layout<KeyType, DataType>::value;
+    using node_type = typename std::conditional<slotted,
+            slotted_node<KeyType, DataType, RawNodeBlockSize, Epsilon>,
+            node<KeyType, DataType, RawNodeBlockSize, default_pivot_layout, default_buffer_filter, Epsilon, Combine>>::type;
+    // Leaves with integer keys can be packed (see packed_leaf).
+    using leaf_type = typename std::conditional<slotted,
+            slotted_leaf<KeyType, DataType, RawLeafBlockSize, Epsilon>,
+            typename std::conditional<PackedLeaves && is_packable_key<KeyType>::value,
+                packed_leaf<KeyType, DataType, RawLeafBlockSize, Combine>,
+                leaf<KeyType, DataType, RawLeafBlockSize, Combine>>::type>::type;
+    // Size of an item in the buffer of a node (see node::item_size).
+    using item_size_type = typename node_type::item_size;
 
     using node_block_type = typename node_type::block_type;
     using leaf_block_type = typename leaf_type::block_type;
@@ -53,7 +105,12 @@ public:
         max_num_buffer_items_in_node = node_type::max_num_buffer_items_in_node,
         max_num_values_in_node = node_type::max_num_values_in_node,
         max_num_buffer_items_in_leaf = leaf_type::max_num_buffer_items_in_leaf,
-        node_buffer_mid = (max_num_buffer_items_in_node - 1) / 2,
+        // Largest item that can be inserted (in the unit of item_size:
+        // 1 if items have a fixed size, else bytes with the slot of 8
+        // bytes, e.g. 64 for nodes of 4096 bytes and Epsilon 1/2, which
+        // leaves 56 bytes for key and datum together). insert, erase
+        // and upsert throw std::length_error for larger items.
+        max_item_size = node_type::max_item_size,
         node_values_mid = (max_num_values_in_node - 1) / 2,
         leaf_buffer_mid = (max_num_buffer_items_in_leaf - 1) / 2,
     };
@@ -61,28 +118,76 @@ public:
     // a node with floor((max_num_values_in_node-1)/2) values. Thus,
     // as at least 3 values are needed to be able to split,
     // we require max_num_values_in_nodes >= 7
-    static_assert(max_num_values_in_node >= 7, "RawBlockSize too small -> too few values per node!");
+    static_assert(max_num_values_in_node >= 7, "RawNodeBlockSize or Epsilon too small -> too few values per node!");
+    // Flushing a full node buffer to a leaf splits it at most once.
+    static_assert(int(leaf_type::max_num_items_per_push) >= int(max_num_buffer_items_in_node),
+                  "RawLeafBlockSize too small -> a leaf cannot take the buffer of a node!");
+    static_assert(int(leaf_type::max_item_size) >= int(max_item_size),
+                  "RawLeafBlockSize too small -> a leaf cannot take the largest items!");
 
 private:
+    static constexpr size_t gcd(size_t a, size_t b) {
+        return b == 0 ? a : gcd(b, a % b);
+    }
+
     // Caches for nodes and leaves.
-    static_assert(RawMemoryPoolSize / 2 >= RawBlockSize, "RawMemoryPoolSize too small -> too few nodes fit in cache!");
+    // Both caches share one pool of memory. They start with half of
+    // it each, and memory then moves to the cache that misses more on
+    // blocks it evicted recently (see fractal_tree_frame_pool.h).
+    // The pool counts units that both block sizes are a multiple of.
+    static_assert(RawMemoryPoolSize / 2 >= RawNodeBlockSize, "RawMemoryPoolSize too small -> too few nodes fit in cache!");
+    static_assert(RawMemoryPoolSize / 2 >= RawLeafBlockSize, "RawMemoryPoolSize too small -> too few leaves fit in cache!");
     enum {
-        num_blocks_in_leaf_cache = (RawMemoryPoolSize / 2) / RawBlockSize,
-        // -1 as root is always kept in cache
-        num_blocks_in_node_cache = (RawMemoryPoolSize / 2) / RawBlockSize - 1
+        pool_unit_size = gcd(RawNodeBlockSize, RawLeafBlockSize),
+        node_frame_size = RawNodeBlockSize / pool_unit_size,
+        leaf_frame_size = RawLeafBlockSize / pool_unit_size,
+        // - node_frame_size as root is always kept in cache
+        num_units_in_pool = RawMemoryPoolSize / pool_unit_size - node_frame_size,
+        num_blocks_in_leaf_cache = (RawMemoryPoolSize / 2) / RawLeafBlockSize,
+        num_blocks_in_node_cache = (RawMemoryPoolSize / 2) / RawNodeBlockSize - 1,
+        // A split works on three nodes (or a node and two leaves).
+        min_num_blocks_in_leaf_cache = num_blocks_in_leaf_cache < 3 ? num_blocks_in_leaf_cache : 3,
+        min_num_blocks_in_node_cache = num_blocks_in_node_cache < 3 ? num_blocks_in_node_cache : 3,
+        max_num_blocks_in_leaf_cache = (num_units_in_pool - min_num_blocks_in_node_cache * node_frame_size) / leaf_frame_size,
+        max_num_blocks_in_node_cache = (num_units_in_pool - min_num_blocks_in_leaf_cache * leaf_frame_size) / node_frame_size,
+        // Evicted dirty blocks are written behind (asynchronously);
+        // up to a quarter of each cache's initial blocks can be in flight.
+        max_num_pending_leaf_writes = num_blocks_in_leaf_cache / 4,
+        max_num_pending_node_writes = num_blocks_in_node_cache / 4,
+        // When flushing a buffer, children that will receive items are
+        // prefetched. This leaves room for the blocks that are pinned
+        // meanwhile (the flushed node, and two nodes or leaves to split
+        // a child).
+        num_node_blocks_not_prefetched = 3,
+        num_leaf_blocks_not_prefetched = 2,
+        // During range_find, the leaf that is scanned and the leaves
+        // read ahead of it must all fit in the leaf cache.
+        max_range_read_ahead = max_num_blocks_in_leaf_cache - 1,
+        // Pinned nodes take their blocks out of the pool, but
+        // leave at least half of it to the caches.
+        max_num_pinned_nodes = num_units_in_pool / 2 / node_frame_size
     };
     static_assert(num_blocks_in_leaf_cache >= 2, "RawMemoryPoolSize too small -> less than 2 leaves fit in leaf cache!");
     static_assert(num_blocks_in_node_cache >= 2, "RawMemoryPoolSize too small -> less than 2 nodes fit in node cache!");
 
     struct bid_hash {
-        size_t operator () (const bid_type& bid) const {
+        template <typename BidType>
+        size_t operator () (const BidType& bid) const {
             size_t result = foxxll::longhash1(bid.offset + reinterpret_cast<uint64_t>(bid.storage));
             return result;
         }
     };
 
-    using node_cache_type = fractal_tree_cache<node_block_type, bid_type, bid_hash, num_blocks_in_node_cache>;
-    using leaf_cache_type = fractal_tree_cache<leaf_block_type, bid_type, bid_hash, num_blocks_in_leaf_cache>;
+    // Blocks that are compressed use BlockCodec.
+    using node_codec_type = typename std::conditional<Compression == block_compression::leaves_and_nodes,
+            BlockCodec, no_block_codec>::type;
+    using leaf_codec_type = typename std::conditional<Compression != block_compression::none,
+            BlockCodec, no_block_codec>::type;
+    using node_cache_type = fractal_tree_cache<node_block_type, node_bid_type, bid_hash, max_num_blocks_in_node_cache, max_num_pending_node_writes, CachePolicy, node_codec_type>;
+    using leaf_cache_type = fractal_tree_cache<leaf_block_type, leaf_bid_type, bid_hash, max_num_blocks_in_leaf_cache, max_num_pending_leaf_writes, CachePolicy, leaf_codec_type>;
+    using node_pin_type = typename node_cache_type::pinned_block;
+    using leaf_pin_type = typename leaf_cache_type::pinned_block;
+    using root_log_type = fractal_tree_root_log<key_type, data_type, max_num_buffer_items_in_node, item_size_type, Combine>;
 
     static constexpr data_type dummy_datum() { return data_type(); };
 
@@ -90,27 +195,46 @@ private:
     std::unordered_map<int, node_type*> m_node_id_to_node;
     std::unordered_map<int, leaf_type*> m_leaf_id_to_leaf;
 
-    std::unordered_set<bid_type, bid_hash> m_dirty_bids;
-
-    node_cache_type m_node_cache = node_cache_type(m_dirty_bids);
-    leaf_cache_type m_leaf_cache = leaf_cache_type(m_dirty_bids);
+    fractal_tree_frame_pool m_frame_pool { num_units_in_pool };
+    node_cache_type m_node_cache { m_frame_pool, num_blocks_in_node_cache, min_num_blocks_in_node_cache, node_frame_size };
+    leaf_cache_type m_leaf_cache { m_frame_pool, num_blocks_in_leaf_cache, min_num_blocks_in_leaf_cache, leaf_frame_size };
 
     int m_curr_node_id = 0;
     int m_curr_leaf_id = 0;
     int m_depth = 1;
+    // Number of leaves read ahead of the current one in range_find.
+    int m_range_read_ahead = max_range_read_ahead;
+
+    // Nodes at depth <= m_num_pinned_levels are pinned: their blocks
+    // are owned by the tree instead of the node cache (like the root,
+    // at depth 1), so they are never evicted. m_pinned_nodes[depth]
+    // holds the pinned nodes at that depth.
+    int m_num_pinned_levels = 1;
+    int m_num_pinned_nodes = 0;
+    std::vector<std::vector<node_type*>> m_pinned_nodes = std::vector<std::vector<node_type*>>(2);
 
     node_type m_root;
-    foxxll::block_manager* bm = foxxll::block_manager::get_instance();
+    // Inserted items that are not yet in the root buffer. Together,
+    // the two hold at most max_num_buffer_items_in_node items.
+    root_log_type m_root_log;
     alloc_strategy_type m_alloc_strategy;
 
 
 public:
     fractal_tree() :
-        m_root(m_curr_node_id++, bid_type()) {
+        m_root(m_curr_node_id++, node_bid_type()) {
         // Set up root.
         m_root.set_block(new node_block_type);
         m_node_id_to_node.insert(std::pair<int, node_type*>(m_root.get_id(), &m_root));
 
+        // New nodes and leaves only get disk blocks once they are written.
+        m_node_cache.set_block_allocator([this](const node_bid_type& bid) {
+            return allocate_block(*m_node_id_to_node.at(bid.offset), m_node_cache);
+        });
+        m_leaf_cache.set_block_allocator([this](const leaf_bid_type& bid) {
+            return allocate_block(*m_leaf_id_to_leaf.at(bid.offset), m_leaf_cache);
+        });
+
         TLX_LOG << "sizeof(KeyType):\t" << sizeof(KeyType) << "\tBytes";
         TLX_LOG << "sizeof(DataType):\t" << sizeof(DataType) << "\tBytes";
         TLX_LOG << "sizeof(node_block_type):\t" << sizeof(node_block_type) << "\tBytes";
@@ -121,15 +245,17 @@ public:
                     sizeof(node_block_type) + sizeof(leaf_block_type)
                     - sizeof(typename node_type::node_block) - sizeof(typename leaf_type::leaf_block)
                     << "\tBytes";
-        TLX_LOG << "RawBlockSize:\t" << RawBlockSize << "\tBytes";
+        TLX_LOG << "RawNodeBlockSize:\t" << RawNodeBlockSize << "\tBytes";
+        TLX_LOG << "RawLeafBlockSize:\t" << RawLeafBlockSize << "\tBytes";
         TLX_LOG << "RawMemoryPoolSize:\t" << RawMemoryPoolSize << "\tBytes";
         TLX_LOG << "Max number of buffer items per node:\t" << max_num_buffer_items_in_node;
         TLX_LOG << "Max number of values per node:\t" << max_num_values_in_node;
         TLX_LOG << "Max number of children per node:\t" << max_num_values_in_node+1;
         TLX_LOG << "Max number of items per leaf:\t" << max_num_buffer_items_in_leaf;
 
-        TLX_LOG1 << "Number of leaves that fit in leaf cache:\t" << num_blocks_in_leaf_cache;
-        TLX_LOG1 << "Number of nodes that fit in node cache:\t" << num_blocks_in_node_cache;
+        TLX_LOG1 << "Number of leaves that fit in leaf cache (initially):\t" << num_blocks_in_leaf_cache;
+        TLX_LOG1 << "Number of nodes that fit in node cache (initially):\t" << num_blocks_in_node_cache;
+        TLX_LOG1 << "Max number of pending leaf / node writes:\t" << max_num_pending_leaf_writes << " / " << max_num_pending_node_writes;
     }
 
     //! non-copyable: delete copy-constructor
@@ -138,9 +264,13 @@ public:
     fractal_tree& operator = (const fractal_tree&) = delete;
 
     ~fractal_tree() {
-        // Delete the root node's block
-        // (not in cache).
+        // Delete the root node's block and the blocks
+        // of the pinned nodes (not in cache).
         delete m_root.get_block();
+        for (auto& level : m_pinned_nodes) {
+            for (node_type* pinned_node : level)
+                delete pinned_node->get_block();
+        }
 
         // Delete the node objects (not the
         // actual data blocks, those are
@@ -153,45 +283,86 @@ public:
         }
     }
 
-    // Insert new key-datum pair into the tree
+    // Insert new key-datum pair into the tree.
+    // Throws std::length_error if item_size(val) > max_item_size
+    // (only possible for keys or data of variable length).
     void insert(const value_type& val) {
         /*
          * We want to insert a new value into the tree.
-         * Usually, this just means inserting it into
-         * the root buffer.
+         * Usually, this just means appending it to the
+         * root log, whose items are merged into the root
+         * buffer once the two together are full.
+         *
+         * (Full means that the new value does not fit
+         * anymore; see node::item_size for how the space
+         * in buffers is counted.)
          *
-         * If the root buffer is full, we either
+         * If the root buffer is then full, we either
          * want to (a) split the root up (if the root
          * keys are at least half full) or (b) flush
          * the root buffer down to the root's children.
          *
          * See flush_buffer for more explanations.
          */
-        if (m_root.buffer_full()) {
-            // If we currently only have the root ...
-            if (m_depth == 1)
-                split_singular_root();
-            else {
-                // Potentially split to keep "small-split invariant"
-                if (m_root.values_at_least_half_full())
-                    split_root();
-                // Flush buffer
-                else {
-                    if (m_depth == 2)
-                        flush_bottom_buffer(m_root);
-                    else
-                        flush_buffer(m_root, 1);
-                    assert(m_root.buffer_empty());
-                }
-            }
-        }
-        assert(!m_root.buffer_full());
-        m_root.add_to_buffer(val);
+        int space_needed = item_size_type()(val);
+        check_item_size(space_needed);
+        make_space_in_root(space_needed);
+        m_root_log.append(val);
+    }
+
+    // Erase the item with the key from the tree (if there is one).
+    // Throws std::length_error if the item_size of the key with a
+    // default datum is larger than max_item_size.
+    void erase(const key_type& key) {
+        /*
+         * Erasing inserts a tombstone for the key (see message_flags),
+         * which goes down the tree like an inserted item: it replaces
+         * the older items with its key in the buffers and values it
+         * passes, and removes the item in the leaf. Children that get
+         * too sparse are merged after the flushes that pushed to them
+         * (see merge_underflowing_children).
+         */
+        int space_needed = item_size_type()(value_type(key, dummy_datum()));
+        check_item_size(space_needed);
+        make_space_in_root(space_needed);
+        m_root_log.erase(key);
+    }
+
+    // Combine delta into the datum of the key: the datum becomes
+    // Combine()(datum, delta), or Combine()(data_type(), delta) if
+    // the tree has no item with the key.
+    // Throws std::length_error if item_size(value_type(key, delta))
+    // > max_item_size.
+    void upsert(const key_type& key, const data_type& delta) {
+        static_assert(!std::is_same<Combine, no_upsert>::value, "upsert needs a Combine function!");
+        static_assert(!slotted, "upsert needs keys and data of a fixed size!");
+        /*
+         * Upserting inserts an upsert message with the delta (see
+         * message_flags), which goes down the tree like an inserted
+         * item without reading the old datum. Where it meets older
+         * items with its key (in the root log, the buffers, the
+         * values or the leaf), it is combined with them. Lookups
+         * combine the upserts they pass (see recursive_find).
+         */
+        value_type val(key, delta);
+        int space_needed = item_size_type()(val);
+        check_item_size(space_needed);
+        make_space_in_root(space_needed);
+        m_root_log.upsert(val);
     }
 
     // First value of return is dummy if key is not found.
     std::pair<data_type, bool> find(key_type key) {
-        return recursive_find(m_root, key, 1);
+        // The root log has the most recent items.
+        std::pair<data_type, bool> delta(dummy_datum(), false);
+        message_type message;
+        std::pair<data_type, bool> maybe_datum_and_found_in_root_log = m_root_log.find_message(key, message);
+        if (maybe_datum_and_found_in_root_log.second && message != message_type::upsert)
+            return with_found_message(maybe_datum_and_found_in_root_log, message);
+        if (maybe_datum_and_found_in_root_log.second)
+            delta = maybe_datum_and_found_in_root_log;
+        clean_caches();
+        return recursive_find(m_root, key, 1, delta);
     }
 
     int depth() const {
@@ -199,20 +370,23 @@ public:
     }
     
     int num_nodes() const {
-        return m_curr_node_id;
+        return m_node_id_to_node.size();
     }
 
     int num_leaves() const {
-        return m_curr_leaf_id;
+        return m_leaf_id_to_leaf.size();
     }
 
     std::vector<value_type> range_find(key_type lower, key_type upper) {
         std::vector<value_type> result {};
         // Guess
         result.reserve(max_num_buffer_items_in_leaf * 10);
+        clean_caches();
+        merge_root_log();
 
-        // Flush root buffer first
-        if (m_depth > 1) {
+        // Flush root buffer first (merging the root's children
+        // can leave it with their buffer, see collapse_root)
+        while (m_depth > 1 && !m_root.buffer_empty()) {
             // Potentially split to keep "small-split invariant"
             if (m_root.values_at_least_half_full())
                 split_root();
@@ -222,7 +396,6 @@ public:
                     flush_bottom_buffer(m_root);
                 else
                     flush_buffer(m_root, 1);
-                assert(m_root.buffer_empty());
             }
         }
 
@@ -231,15 +404,113 @@ public:
         return result;
     }
 
+    // Set how many leaves range_find reads ahead of the leaf it
+    // currently scans (0 disables read-ahead). The window is capped
+    // so that all leaves that are read ahead fit in the leaf cache
+    // (at its largest; range_find caps it further if the leaf cache
+    // is currently smaller).
+    void set_range_read_ahead(int num_leaves) {
+        assert(num_leaves >= 0);
+        m_range_read_ahead = std::min(num_leaves, static_cast<int>(max_range_read_ahead));
+    }
+
+    int range_read_ahead() const {
+        return m_range_read_ahead;
+    }
+
+    // Pin the nodes at depth <= num_levels in memory (1 only pins
+    // the root). The pinned nodes take their blocks out of the
+    // memory pool of the caches; once max_num_pinned_nodes nodes are
+    // pinned, further nodes in the pinned levels go through the node
+    // cache as usual.
+    void set_num_pinned_levels(int num_levels) {
+        assert(num_levels >= 1);
+        m_num_pinned_levels = num_levels;
+        unpin_levels_below(num_levels);
+        m_pinned_nodes.resize(std::max(num_levels + 1, 2));
+
+        // Walk down the levels that should be pinned.
+        std::vector<int> level_ids { m_root.get_id() };
+        for (int depth = 2; depth <= std::min(num_levels, m_depth - 1); depth++) {
+            std::vector<int> next_level_ids {};
+            for (int id : level_ids) {
+                node_type& n = *m_node_id_to_node.at(id);
+                load(n, depth - 1);
+                for (int i=0; i<n.num_children(); i++)
+                    next_level_ids.push_back(n.get_child_id(i));
+            }
+            for (int id : next_level_ids) {
+                node_type& n = *m_node_id_to_node.at(id);
+                if (!n.is_pinned())
+                    pin(n, depth, false);
+            }
+            level_ids = next_level_ids;
+        }
+    }
+
+    int num_pinned_levels() const {
+        return m_num_pinned_levels;
+    }
+
+    int num_pinned_nodes() const {
+        return m_num_pinned_nodes;
+    }
+
+    // Write dirty blocks ahead of their eviction: before an operation,
+    // once more than high of a cache's blocks are dirty, the coldest
+    // dirty ones are written asynchronously until at most low are
+    // dirty (see fractal_tree_cache::clean). high = 1 disables this
+    // (default).
+    void set_dirty_watermarks(double high, double low) {
+        m_node_cache.set_dirty_watermarks(high, low);
+        m_leaf_cache.set_dirty_watermarks(high, low);
+    }
+
+    // Cache statistics since the tree was created
+    // or since the last snapshot_and_reset_stats().
+    fractal_tree_stats stats() const {
+        fractal_tree_stats result;
+        result.node_cache = m_node_cache.stats();
+        result.leaf_cache = m_leaf_cache.stats();
+        result.node_codec = m_node_cache.codec_stats();
+        result.leaf_codec = m_leaf_cache.codec_stats();
+        int num_levels = std::max(m_node_cache.num_stats_tags(), m_leaf_cache.num_stats_tags());
+        result.levels.resize(std::max(num_levels, m_depth + 1));
+        for (int depth = 1; depth < num_levels; depth++) {
+            result.levels[depth] += m_node_cache.stats(depth);
+            result.levels[depth] += m_leaf_cache.stats(depth);
+        }
+        return result;
+    }
+
+    // Return the statistics and start counting from zero again,
+    // e.g. to compare phases of a workload.
+    fractal_tree_stats snapshot_and_reset_stats() {
+        fractal_tree_stats result = stats();
+        m_node_cache.reset_stats();
+        m_leaf_cache.reset_stats();
+        return result;
+    }
+
+    // Number of blocks the node / leaf cache currently hold.
+    int node_cache_capacity() const {
+        return m_node_cache.capacity();
+    }
+
+    int leaf_cache_capacity() const {
+        return m_leaf_cache.capacity();
+    }
+
     void visualize() {
         if (num_nodes() > 30) {
             std::cout << "Tree is too large to visualize" << std::endl;
             return;
         }
+        merge_root_log();
         std::cout << "VISUALIZING TREE...\n" << std::endl;
         std::cout << "Depth: " << m_depth << std::endl;
-        std::cout << "Number of nodes: " << m_curr_node_id << std::endl;
-        std::cout << "Number of leaves: " << m_curr_leaf_id << std::endl;
+        std::cout << "Number of nodes: " << num_nodes() << std::endl;
+        std::cout << "Number of leaves: " << num_leaves() << std::endl;
 
         std::cout << "Level-order traversal of tree:\n" << std::endl;
 
@@ -253,7 +524,7 @@ public:
 
                 for (auto id : level_ids) {
                     node_type n = *m_node_id_to_node.at(id);
-                    load(n);
+                    load(n, curr_depth);
 
                     // Pretty-print keys, and first and last buffer item
                     std::cout << "[ ";
@@ -282,9 +553,11 @@ public:
 
                     // Pretty-print first and last buffer item
                     std::cout << "[ ";
-                    std::vector<value_type> buffer_items = n.get_buffer_items();
-                    std::cout << std::min_element(buffer_items.begin(), buffer_items.end())->first << " ... ";
-                    std::cout << std::max_element(buffer_items.begin(), buffer_items.end())->first;
+                    if (!n.buffer_empty()) {
+                        std::vector<value_type> buffer_items = n.get_buffer_items();
+                        std::cout << std::min_element(buffer_items.begin(), buffer_items.end())->first << " ... ";
+                        std::cout << std::max_element(buffer_items.begin(), buffer_items.end())->first;
+                    }
                     std::cout << " ]    ";
                 }
                 std::cout << std::endl;
@@ -297,34 +570,284 @@ public:
 
 private:
 
-    node_type& get_new_node() {
-        auto* new_node = new node_type(m_curr_node_id++, bid_type());
+    // Items larger than max_item_size would overflow the values of
+    // the nodes they are promoted to (see slotted_node_parameters).
+    static void check_item_size(int space_needed) {
+        if (space_needed > max_item_size)
+            throw std::length_error("fractal_tree: item is larger than max_item_size");
+    }
+
+    // Make sure that the root log and the root buffer have
+    // space_needed more space (see insert).
+    void make_space_in_root(int space_needed) {
+        if (m_root.buffer_space() < m_root_log.space() + space_needed)
+            merge_root_log();
+        // Merging children can leave the root with the buffer of
+        // one of them (see collapse_root), which is flushed again.
+        while (m_root.buffer_space() < space_needed) {
+            clean_caches();
+            // If we currently only have the root ...
+            if (m_depth == 1)
+                split_singular_root();
+            else {
+                // Potentially split to keep "small-split invariant"
+                if (m_root.values_at_least_half_full())
+                    split_root();
+                // Flush buffer
+                else {
+                    if (m_depth == 2)
+                        flush_bottom_buffer(m_root);
+                    else
+                        flush_buffer(m_root, 1);
+                }
+            }
+        }
+        assert(m_root.buffer_space() >= m_root_log.space() + space_needed);
+    }
+
+    // Move the items of the root log into the root buffer. Its
+    // tombstones and upserts go after its items (their keys differ).
+    void merge_root_log() {
+        if (m_root_log.empty())
+            return;
+        m_root.add_to_buffer(m_root_log.sorted_items());
+        std::vector<key_type>& erased_keys = m_root_log.sorted_erased_keys();
+        if (!erased_keys.empty())
+            m_root.add_to_buffer(tombstone_span<key_type, data_type>(erased_keys));
+        add_upserts_to_root(m_root_log.sorted_upserts());
+        m_root_log.clear();
+    }
+
+    // See merge_root_log. Trees with items of variable
+    // length have no upserts (see upsert).
+    template<typename Upserts>
+    void add_upserts_to_root(const Upserts& upserts) {
+        add_upserts_to_root(upserts, std::integral_constant<bool, slotted>());
+    }
+
+    template<typename Upserts>
+    void add_upserts_to_root(const Upserts& upserts, std::false_type /* slotted */) {
+        if (!upserts.empty())
+            m_root.add_to_buffer(upsert_span<key_type, data_type>(upserts));
+    }
+
+    template<typename Upserts>
+    void add_upserts_to_root(const Upserts& upserts, std::true_type /* slotted */) {
+        assert(upserts.empty());
+        (void)upserts;
+    }
+
+    // New nodes and leaves have a virtual bid (without storage) that
+    // holds their id. They get a disk block from allocate_block when
+    // they are first written, so a tree that fits into memory never
+    // allocates any.
+    template <typename BidType>
+    static BidType virtual_bid(int id) {
+        BidType bid;
+        bid.offset = id;
+        return bid;
+    }
+
+    template <typename NodeOrLeaf, typename Cache>
+    auto allocate_block(NodeOrLeaf& node_or_leaf, Cache& cache) {
+        auto& bid = node_or_leaf.get_bid();
+        assert(Cache::is_virtual(bid));
+        cache.new_block(m_alloc_strategy, bid);
+        return bid;
+    }
+
+    // depth is where the new node goes in the tree.
+    node_type& get_new_node(int depth) {
+        int id = m_curr_node_id++;
+        auto* new_node = new node_type(id, virtual_bid<node_bid_type>(id));
         m_node_id_to_node.insert(std::pair<int, node_type*>(new_node->get_id(), new_node));
-        bm->new_block(m_alloc_strategy, new_node->get_bid());
+        if (depth <= m_num_pinned_levels)
+            pin(*new_node, depth, true);
         return *new_node;
     }
 
     leaf_type& get_new_leaf() {
-        auto* new_leaf = new leaf_type(m_curr_leaf_id++, bid_type());
+        int id = m_curr_leaf_id++;
+        auto* new_leaf = new leaf_type(id, virtual_bid<leaf_bid_type>(id));
         m_leaf_id_to_leaf.insert(std::pair<int, leaf_type*>(new_leaf->get_id(), new_leaf));
-        bm->new_block(m_alloc_strategy, new_leaf->get_bid());
         return *new_leaf;
     }
 
-    void load(node_type& node) {
-        if (node != m_root) {
-            bid_type& node_bid = node.get_bid();
-            node_block_type* cached_node_block = m_node_cache.load(node_bid);
+    // Delete a node (at the given depth) that is no longer in the
+    // tree, and give its block and its disk block back.
+    // It must not be pinned by a pin_block.
+    void delete_node(node_type& node, int depth) {
+        if (node.is_pinned()) {
+            std::vector<node_type*>& level = m_pinned_nodes[depth];
+            level.erase(std::find(level.begin(), level.end(), &node));
+            delete node.get_block();
+            m_frame_pool.release_frame(node_frame_size);
+            m_num_pinned_nodes--;
+        }
+        m_node_cache.discard(node.get_bid());
+        m_node_id_to_node.erase(node.get_id());
+        delete &node;
+    }
+
+    void delete_leaf(leaf_type& leaf) {
+        m_leaf_cache.discard(leaf.get_bid());
+        m_leaf_id_to_leaf.erase(leaf.get_id());
+        delete &leaf;
+    }
+
+    // depth is the level of the node in the tree (for the statistics).
+    void load(node_type& node, int depth) {
+        if (node != m_root && !node.is_pinned()) {
+            node_bid_type& node_bid = node.get_bid();
+            node_block_type* cached_node_block = m_node_cache.load(node_bid, depth);
             node.set_block(cached_node_block);
         }
     }
 
     void load(leaf_type& leaf) {
-        bid_type& leaf_bid = leaf.get_bid();
-        leaf_block_type* cached_node_block = m_leaf_cache.load(leaf_bid);
+        leaf_bid_type& leaf_bid = leaf.get_bid();
+        leaf_block_type* cached_node_block = m_leaf_cache.load(leaf_bid, m_depth);
         leaf.set_block(cached_node_block);
     }
 
+    // Load a node / leaf and keep its block in memory while the
+    // returned pin exists. The root and the pinned nodes always
+    // are in memory (their pin is empty).
+    node_pin_type pin_block(node_type& node, int depth) {
+        if (node == m_root || node.is_pinned())
+            return node_pin_type();
+        node_pin_type node_pin = m_node_cache.pin(node.get_bid(), depth);
+        node.set_block(node_pin.block());
+        return node_pin;
+    }
+
+    leaf_pin_type pin_block(leaf_type& leaf) {
+        leaf_pin_type leaf_pin = m_leaf_cache.pin(leaf.get_bid(), m_depth);
+        leaf.set_block(leaf_pin.block());
+        return leaf_pin;
+    }
+
+    // As pin_block, for a node / leaf from get_new_node /
+    // get_new_leaf (nothing needs to be read).
+    node_pin_type pin_new_block(node_type& node, int depth) {
+        if (node.is_pinned())
+            return node_pin_type();
+        node_pin_type node_pin = m_node_cache.pin_new(node.get_bid(), depth);
+        node.set_block(node_pin.block());
+        return node_pin;
+    }
+
+    leaf_pin_type pin_new_block(leaf_type& leaf) {
+        leaf_pin_type leaf_pin = m_leaf_cache.pin_new(leaf.get_bid(), m_depth);
+        leaf.set_block(leaf_pin.block());
+        return leaf_pin;
+    }
+
+    // Only called between operations: no loaded
+    // block is being changed at that point.
+    void clean_caches() {
+        m_node_cache.clean();
+        m_leaf_cache.clean();
+    }
+
+    // The root and the pinned nodes are not in the node cache
+    // (and always stay in memory), so they are never marked dirty.
+    void mark_dirty(node_type& node) {
+        if (node != m_root && !node.is_pinned())
+            m_node_cache.mark_dirty(node.get_bid());
+    }
+
+    void mark_dirty(leaf_type& leaf) {
+        m_leaf_cache.mark_dirty(leaf.get_bid());
+    }
+
+    bool is_pinned(const node_type& node) const {
+        return node.is_pinned();
+    }
+
+    bool is_pinned(const leaf_type&) const {
+        return false;
+    }
+
+    // Give the node (at the given depth) a block of its own, if the
+    // pool can spare one. The data of an existing node is moved over
+    // from the node cache without writing it (unpin marks it dirty
+    // again), so that it keeps a virtual bid if it has one.
+    void pin(node_type& node, int depth, bool is_new) {
+        if (m_num_pinned_nodes == max_num_pinned_nodes || !m_frame_pool.reserve_frame(node_frame_size))
+            return;
+        // Value-initialized, so a new node starts out zeroed
+        // (see fractal_tree_cache).
+        auto* block = new node_block_type();
+        if (!is_new) {
+            memcpy(block, m_node_cache.load(node.get_bid(), depth), sizeof(node_block_type));
+            m_node_cache.drop(node.get_bid());
+        }
+        node.set_block(block);
+        node.set_pinned(true);
+        m_pinned_nodes[depth].push_back(&node);
+        m_num_pinned_nodes++;
+    }
+
+    // Move the node (at the given depth) into the node cache (as a
+    // dirty block, so that it is written once it is evicted) and
+    // free its block.
+    void unpin(node_type& node, int depth) {
+        node_block_type* block = node.get_block();
+        node.set_pinned(false);
+        m_frame_pool.release_frame(node_frame_size);
+        m_num_pinned_nodes--;
+        node_block_type* cached_block = m_node_cache.load_new(node.get_bid(), depth);
+        memcpy(cached_block, block, sizeof(node_block_type));
+        node.set_block(cached_block);
+        delete block;
+    }
+
+    // Unpin the nodes deeper than num_levels.
+    void unpin_levels_below(int num_levels) {
+        while (static_cast<int>(m_pinned_nodes.size()) > num_levels + 1) {
+            int depth = m_pinned_nodes.size() - 1;
+            for (node_type* pinned_node : m_pinned_nodes.back())
+                unpin(*pinned_node, depth);
+            m_pinned_nodes.pop_back();
+        }
+    }
+
+    // Issue reads for children of curr_node that will receive
+    // items from its buffer and are not cached, so that the
+    // reads overlap instead of happening one after another
+    // when the children are processed. The children are at
+    // depth child_depth (the tag of their loads, see load).
+    // The flushes of the children (see flush_buffer) prefetch into the
+    // same cache; while blocks prefetched by the parent are still to
+    // be loaded, they do not prefetch, as evicting for their reads
+    // would hit those blocks (the least recently used ones) and read
+    // them twice.
+    template <typename ChildType, typename CacheType>
+    void prefetch_children(node_type& curr_node, std::unordered_map<int, ChildType*>& child_id_to_child,
+                           CacheType& cache, int num_blocks_not_prefetched, int child_depth) {
+        if (cache.num_prefetched_blocks() > 0)
+            return;
+        int max_num_prefetched = std::max(cache.capacity() - num_blocks_not_prefetched, 0);
+        int num_prefetched = 0;
+        int low, high = 0;
+        for (int child_index = 0; child_index < curr_node.num_children(); child_index++) {
+            if (num_prefetched == max_num_prefetched)
+                break;
+            low = high;
+            high = curr_node.index_of_upper_bound_of_buffer(child_index);
+            if (high == low)
+                continue;
+
+            ChildType& child = *child_id_to_child.at(curr_node.get_child_id(child_index));
+            auto& child_bid = child.get_bid();
+            if (!is_pinned(child) && !cache.is_cached(child_bid)) {
+                cache.prefetch(child_bid, child_depth);
+                num_prefetched++;
+            }
+        }
+    }
+
     // Split up the root in cases where we do not only
     // have the root (in that case: see split_singular_root).
     void split_root() {
@@ -340,49 +863,66 @@ private:
          * 1+2+3 are done sequentially for each child to minimize
          * in-memory footprint.
          */
-        // Gather buffer items / values / nodeIDs to distribute to the children
+        // Spans of the buffer items / values / nodeIDs to distribute
+        // to the children (the root is always in memory).
         int values_mid = (m_root.num_values() - 1) / 2;
-
-        std::vector<value_type> values_for_left_child = m_root.get_values(
-                0, values_mid
-        );
-        std::vector<value_type> values_for_right_child = m_root.get_values(
-                values_mid + 1, m_root.num_values()
-        );
-        std::vector<int> nodeIDs_for_left_child = m_root.get_nodeIDs(
-                0, values_mid + 1
-        );
-        std::vector<int> nodeIDs_for_right_child = m_root.get_nodeIDs(
-                values_mid + 1, m_root.num_children()
-        );
-
         value_type mid_value = m_root.get_value(values_mid);
-        std::vector<value_type> buffer_items_for_left_child = m_root.get_buffer_items_less_than(mid_value);
-        std::vector<value_type> buffer_items_for_right_child = m_root.get_buffer_items_greater_equal_than(mid_value);
+        bool mid_value_erased = m_root.value_erased(values_mid);
+        int buffer_mid = m_root.buffer_span().lower_bound(mid_value.first);
+
+        // All nodes move one level down, below the two new children.
+        m_pinned_nodes.insert(m_pinned_nodes.begin() + 2, std::vector<node_type*>());
+        unpin_levels_below(m_num_pinned_levels);
 
         // Create new left child and populate it
-        node_type& left_child = get_new_node();
-        load(left_child);
-        m_dirty_bids.insert(left_child.get_bid());
+        node_type& left_child = get_new_node(2);
+        node_pin_type left_child_pin = pin_new_block(left_child, 2);
+        mark_dirty(left_child);
 
-        left_child.set_values_and_nodeIDs(values_for_left_child, nodeIDs_for_left_child);
-        left_child.set_buffer(buffer_items_for_left_child);
+        left_child.set_values_and_nodeIDs(m_root.values_span(0, values_mid),
+                                          m_root.nodeIDs_span(0, values_mid + 1));
+        left_child.set_buffer(m_root.buffer_span(0, buffer_mid));
+        left_child_pin.release();
 
         // Create new right child and populate it
-        node_type& right_child = get_new_node();
-        load(right_child);
-        m_dirty_bids.insert(right_child.get_bid());
+        node_type& right_child = get_new_node(2);
+        node_pin_type right_child_pin = pin_new_block(right_child, 2);
+        mark_dirty(right_child);
 
-        right_child.set_values_and_nodeIDs(values_for_right_child, nodeIDs_for_right_child);
-        right_child.set_buffer(buffer_items_for_right_child);
+        right_child.set_values_and_nodeIDs(m_root.values_span(values_mid + 1, m_root.num_values()),
+                                           m_root.nodeIDs_span(values_mid + 1, m_root.num_children()));
+        right_child.set_buffer(m_root.buffer_span(buffer_mid, m_root.num_items_in_buffer()));
 
         // Update root
         m_root.clear_buffer();
         m_root.clear_values();
-        m_root.add_to_values(mid_value, left_child.get_id(), right_child.get_id());
+        m_root.add_to_values(mid_value, left_child.get_id(), right_child.get_id(), mid_value_erased);
         m_depth++;
     }
 
+    // The root has a single child left (after its two children were
+    // merged, see merge_underflowing_children), which becomes the root:
+    // the tree gets one level shallower. Opposite of split_root.
+    void collapse_root() {
+        assert(m_root.num_values() == 0 && m_depth > 2);
+        node_type& child = *m_node_id_to_node.at(m_root.get_child_id(0));
+        node_pin_type child_pin = pin_block(child, 2);
+        m_root.set_values_and_nodeIDs(child.values_span(0, child.num_values()),
+                                      child.nodeIDs_span(0, child.num_children()));
+        m_root.set_buffer(child.buffer_span());
+        child_pin.release();
+        delete_node(child, 2);
+
+        // All nodes move one level up. The nodes that move up into
+        // the deepest pinned level stay in the node cache; nodes that
+        // are created there are pinned again (see get_new_node).
+        if (m_pinned_nodes.size() > 2) {
+            m_pinned_nodes.erase(m_pinned_nodes.begin() + 2);
+            m_pinned_nodes.emplace_back();
+        }
+        m_depth--;
+    }
+
     // Only have root and its buffer is full, so we split it up.
     void split_singular_root() {
         /* Pseudocode:
@@ -392,28 +932,28 @@ private:
          * 3. Promote mid item to key in root,
          *    set child ids, and clear the root's buffer.
         */
+        // (A full buffer of items of variable length need not
+        // have max_num_buffer_items_in_node items.)
+        int num_items = m_root.num_items_in_buffer();
+        int buffer_mid = (num_items - 1) / 2;
+
         // Left child
         leaf_type& left_child = get_new_leaf();
-        load(left_child);
-        m_dirty_bids.insert(left_child.get_bid());
+        leaf_pin_type left_child_pin = pin_new_block(left_child);
+        mark_dirty(left_child);
 
-        std::vector<value_type> values_for_left_child = m_root.get_buffer_items(
-                0, node_buffer_mid
-                );
-        left_child.set_buffer(values_for_left_child);
+        left_child.set_buffer(m_root.buffer_span(0, buffer_mid));
+        left_child_pin.release();
 
         // Right child
         leaf_type& right_child = get_new_leaf();
-        load(right_child);
-        m_dirty_bids.insert(right_child.get_bid());
+        leaf_pin_type right_child_pin = pin_new_block(right_child);
+        mark_dirty(right_child);
 
-        std::vector<value_type> values_for_right_child = m_root.get_buffer_items(
-                node_buffer_mid+1, max_num_buffer_items_in_node
-        );
-        right_child.set_buffer(values_for_right_child);
+        right_child.set_buffer(m_root.buffer_span(buffer_mid + 1, num_items));
 
         // Update root
-        value_type mid_value = m_root.get_buffer_item(node_buffer_mid);
+        value_type mid_value = m_root.get_buffer_item(buffer_mid);
         m_root.add_to_values(mid_value, left_child.get_id(), right_child.get_id());
         m_root.clear_buffer();
         m_depth++;
@@ -422,7 +962,8 @@ private:
     // Combine the buffer items in left_child and from
     // parent_node.buffer[low], ..., parent_node.buffer[high-1],
     // and distribute them to left_child and a new right_child.
-    // left_child must be the child of parent_node.
+    // left_child must be the child of parent_node, and
+    // both must be pinned.
     // low, high are indexes s.t. parent_node.buffer[low], ..., parent_node.buffer[high-1]
     // belong to the left_child.
     void split_and_flush(node_type& parent_node, leaf_type& left_child, int low, int high) {
@@ -440,46 +981,25 @@ private:
          * mid item is promoted to
          *
          */
-        load(parent_node);
-        load(left_child);
-        // Combine the sorted buffer items, and take from the parent
-        // in case of duplicates.
-        std::vector<value_type> combined_values = merge_into<value_type>(
-                parent_node.get_buffer_items(low, high), left_child.get_buffer_items());
-
-        if (combined_values.empty())
-            return;
-
-        int mid = (combined_values.size() - 1) / 2;
-        value_type mid_value = combined_values.at(mid);
-
-        // Add to left child buffer
-        left_child.clear_buffer();
-        std::vector<value_type> buffer_items_for_left_child =
-                std::vector<value_type>(
-                        combined_values.begin(), combined_values.begin() + mid
-                );
-        left_child.set_buffer(buffer_items_for_left_child);
-        m_dirty_bids.insert(left_child.get_bid());
-
-        // Create new right child, add to buffer,
+        // Create new right child
         leaf_type& right_child = get_new_leaf();
-        load(right_child);
-        m_dirty_bids.insert(right_child.get_bid());
+        leaf_pin_type right_child_pin = pin_new_block(right_child);
+        mark_dirty(right_child);
+        mark_dirty(left_child);
 
-        std::vector<value_type> buffer_items_for_right_child =
-                std::vector<value_type>(
-                        combined_values.begin() + mid + 1, combined_values.end()
-                );
-        right_child.set_buffer(buffer_items_for_right_child);
+        // Combine the sorted buffer items (in place), take from the
+        // parent in case of duplicates, and give the left half to
+        // left_child and the right half to right_child.
+        value_type mid_value = left_child.merge_and_split(parent_node.buffer_span(low, high), right_child);
 
         // Register children with parent
         parent_node.add_to_values(mid_value, left_child.get_id(), right_child.get_id());
-        m_dirty_bids.insert(parent_node.get_bid());
+        mark_dirty(parent_node);
     }
 
-    // Split left_child of parent_node into two nodes
-    void split(node_type& parent_node, node_type& left_child) {
+    // Split left_child (at depth child_depth) of parent_node into two nodes.
+    // Both must be pinned.
+    void split(node_type& parent_node, node_type& left_child, int child_depth) {
         /*
          * Pseudocode:
          * 1. Create new right child (the left child that should be split
@@ -489,44 +1009,119 @@ private:
          * 4. Promote mid item to value of parent nodes;
          *    set child ids
         */
-        load(parent_node);
-        load(left_child);
-        // Gather buffer items / values / nodeIDs to distribute to the children
         int values_mid = (left_child.num_values() - 1) / 2;
-
-        std::vector<value_type> values_for_left_child = left_child.get_values(
-                0, values_mid
-                );
-        std::vector<value_type> values_for_right_child = left_child.get_values(
-                values_mid + 1, left_child.num_values()
-                );
-        std::vector<int> nodeIDs_for_left_child = left_child.get_nodeIDs(
-                0, values_mid + 1
-                );
-        std::vector<int> nodeIDs_for_right_child = left_child.get_nodeIDs(
-                values_mid + 1, left_child.num_values() + 1
-        );
-
         value_type mid_value = left_child.get_value(values_mid);
-        std::vector<value_type> buffer_items_for_left_child = left_child.get_buffer_items_less_than(mid_value);
-        std::vector<value_type> buffer_items_for_right_child = left_child.get_buffer_items_greater_equal_than(mid_value);
+        bool mid_value_erased = left_child.value_erased(values_mid);
+        int buffer_mid = left_child.buffer_span().lower_bound(mid_value.first);
+
+        // Create new right child and populate it (from spans of the
+        // left child's block, which is pinned)
+        node_type& right_child = get_new_node(child_depth);
+        node_pin_type right_child_pin = pin_new_block(right_child, child_depth);
+        mark_dirty(right_child);
+
+        right_child.set_values_and_nodeIDs(left_child.values_span(values_mid + 1, left_child.num_values()),
+                                           left_child.nodeIDs_span(values_mid + 1, left_child.num_children()));
+        right_child.set_buffer(left_child.buffer_span(buffer_mid, left_child.num_items_in_buffer()));
+
+        // The left child keeps its first values and buffer items
+        mark_dirty(left_child);
+        left_child.truncate_values(values_mid);
+        left_child.truncate_buffer(buffer_mid);
+
+        // Update parent. Its buffer can still hold an item (or a
+        // tombstone or an upsert) with the key of mid_value (if
+        // left_child is split before the parent's items are pushed
+        // down to it). That item is more recent (an upsert is combined
+        // with mid_value), and the key must not be in both the buffer
+        // and the values.
+        message_type message_in_parent_buffer;
+        std::pair<data_type, bool> maybe_datum_and_found_in_parent_buffer =
+            parent_node.buffer_find_message(mid_value.first, message_in_parent_buffer);
+        if (maybe_datum_and_found_in_parent_buffer.second) {
+            mid_value_erased = detail::combine_messages<Combine>(
+                mid_value_erased ? message_type::erase : message_type::insert, mid_value.second,
+                message_in_parent_buffer, maybe_datum_and_found_in_parent_buffer.first) == message_type::erase;
+            mid_value.second = maybe_datum_and_found_in_parent_buffer.first;
+            parent_node.remove_from_buffer(mid_value.first);
+        }
+        parent_node.add_to_values(mid_value, left_child.get_id(), right_child.get_id(), mid_value_erased);
+        mark_dirty(parent_node);
+    }
 
-        // Create new right child and populate it
-        node_type& right_child = get_new_node();
-        load(right_child);
-        m_dirty_bids.insert(right_child.get_bid());
+    // Index of the child of node with the given id, or -1.
+    static int index_of_child(const node_type& node, int child_id) {
+        for (int i = 0; i < node.num_children(); i++) {
+            if (node.get_child_id(i) == child_id)
+                return i;
+        }
+        return -1;
+    }
 
-        right_child.set_values_and_nodeIDs(values_for_right_child, nodeIDs_for_right_child);
-        right_child.set_buffer(buffer_items_for_right_child);
+    // After the buffer of curr_node (at curr_depth, pinned) was
+    // flushed: merge the children with the given ids that became too
+    // sparse (see node::underflows and leaf::underflows) with their
+    // right or else their left neighbor. Inner nodes keep at least
+    // one value, and so does a root above leaves; the root above
+    // nodes gives its last value up (see collapse_root).
+    void merge_underflowing_children(node_type& curr_node, int curr_depth, const std::vector<int>& child_ids) {
+        bool children_are_leaves = curr_depth == m_depth - 1;
+        for (int child_id : child_ids) {
+            if (curr_node.num_values() < 2 && (curr_node != m_root || children_are_leaves))
+                return;
+            // The child may have been merged into its left neighbor.
+            int child_index = index_of_child(curr_node, child_id);
+            if (child_index < 0)
+                continue;
+            if (!(child_index < curr_node.num_values() && try_merge_children(curr_node, curr_depth, child_index))
+                && child_index > 0)
+                try_merge_children(curr_node, curr_depth, child_index - 1);
+            if (curr_node.num_values() == 0) {
+                collapse_root();
+                return;
+            }
+        }
+    }
 
-        // Set values for left child
-        m_dirty_bids.insert(left_child.get_bid());
-        left_child.set_values_and_nodeIDs(values_for_left_child, nodeIDs_for_left_child);
-        left_child.set_buffer(buffer_items_for_left_child);
+    // Merge the child of curr_node (at curr_depth, pinned) at
+    // left_index + 1 into the one at left_index, if the merge fits
+    // into one block. Return whether it did.
+    bool try_merge_children(node_type& curr_node, int curr_depth, int left_index) {
+        int left_id = curr_node.get_child_id(left_index);
+        int right_id = curr_node.get_child_id(left_index + 1);
+        value_type pivot = curr_node.get_value(left_index);
+        bool pivot_erased = curr_node.value_erased(left_index);
 
-        // Update parent
-        parent_node.add_to_values(mid_value, left_child.get_id(), right_child.get_id());
-        m_dirty_bids.insert(parent_node.get_bid());
+        if (curr_depth == m_depth - 1) {
+            leaf_type& left_child = *m_leaf_id_to_leaf.at(left_id);
+            leaf_type& right_child = *m_leaf_id_to_leaf.at(right_id);
+            leaf_pin_type left_child_pin = pin_block(left_child);
+            leaf_pin_type right_child_pin = pin_block(right_child);
+            // The pivot goes into the leaf, unless it was erased.
+            std::vector<value_type> pivot_items;
+            if (!pivot_erased)
+                pivot_items.push_back(pivot);
+            if (!left_child.try_merge(pivot_items, right_child))
+                return false;
+            mark_dirty(left_child);
+            right_child_pin.release();
+            delete_leaf(right_child);
+        } else {
+            node_type& left_child = *m_node_id_to_node.at(left_id);
+            node_type& right_child = *m_node_id_to_node.at(right_id);
+            node_pin_type left_child_pin = pin_block(left_child, curr_depth + 1);
+            node_pin_type right_child_pin = pin_block(right_child, curr_depth + 1);
+            // (A merged node that is at least half full is split
+            // before the next flush into it, see flush_buffer.)
+            if (!left_child.try_merge(pivot, pivot_erased, right_child))
+                return false;
+            mark_dirty(left_child);
+            right_child_pin.release();
+            delete_node(right_child, curr_depth + 1);
+        }
+        curr_node.remove_value(left_index);
+        mark_dirty(curr_node);
+        return true;
     }
 
     // Flush the items in a node's full buffer to the node's children
@@ -589,14 +1184,20 @@ private:
          *      // num children can change due to splitting
          *      num_children = curr_node.num_children();
          */
-        load(curr_node);
+        // curr_node and the child that is pushed to stay pinned, except
+        // during recursive calls (so that at most three blocks of the
+        // node cache are pinned at any time, however deep the tree is).
+        node_pin_type curr_node_pin = pin_block(curr_node, curr_depth);
+        prefetch_children(curr_node, m_node_id_to_node, m_node_cache, num_node_blocks_not_prefetched, curr_depth + 1);
         int num_children = curr_node.num_children();
         int low, high = 0;
         // Note that we cannot iterate through the children
-        // as the curr_node might be kicked to external memory
-        // during a recursive call to a child's flush_buffer,
+        // as they change when a child is split,
         // so we have to work with indexes.
         int child_index = 0;
+        // Children that got too sparse in the push (see
+        // merge_underflowing_children).
+        std::vector<int> underflowing_child_ids;
 
         while (child_index < num_children) {
             low = high;
@@ -612,21 +1213,19 @@ private:
             auto it = m_node_id_to_node.find(curr_node.get_child_id(child_index));
             assert(it != m_node_id_to_node.end());
             node_type& child = *(it->second);
-            load(child);
-            load(curr_node);
+            node_pin_type child_pin = pin_block(child, curr_depth + 1);
 
             if (child.values_at_least_half_full()) {
-                split(curr_node, child);
+                split(curr_node, child, curr_depth + 1);
                 // After splitting, the child is now responsible
                 // for a different range of values, so we have to
                 // re-calculate what should be pushed down.
-                load(curr_node);
-                load(child);
                 high = curr_node.index_of_upper_bound_of_buffer(child_index);
                 num_items_to_push = high - low;
             }
 
-            int space_in_child_buffer = child.max_buffer_size() - child.num_items_in_buffer();
+            int space_in_child_buffer = child.num_items_that_fit(curr_node.buffer_span(low, high));
+            int num_child_values = child.num_values();
 
             if (num_items_to_push > space_in_child_buffer) {
                 // Here we cannot keep the items to push down in-memory as
@@ -634,52 +1233,50 @@ private:
                 // flush_buffer -> use appropriate scoping.
 
                 // Push first part.
-                {
-                    std::vector<value_type> items_to_push = curr_node.get_buffer_items(
-                            low, low + space_in_child_buffer
-                            );
-                    child.add_to_buffer(items_to_push);
-                }
-                m_dirty_bids.insert(child.get_bid());
-                // Flush child buffer.
+                child.add_to_buffer(curr_node.buffer_span(low, low + space_in_child_buffer));
+                mark_dirty(child);
+                // Flush child buffer (which pins the blocks it needs).
+                child_pin.release();
+                curr_node_pin.release();
                 if (curr_depth == m_depth - 2)
                     flush_bottom_buffer(child);
                 else
                     flush_buffer(child, curr_depth+1);
 
-                // Reload (nodes might have been kicked out of memory
-                // in the recursive call to flush_buffer)
-                load(child);
-                load(curr_node);
+                // Pin again (the nodes might have been kicked out of
+                // memory in the recursive call to flush_buffer)
+                curr_node_pin = pin_block(curr_node, curr_depth);
+                child_pin = pin_block(child, curr_depth + 1);
                 // Push second part.
-                {
-                    std::vector<value_type> items_to_push = curr_node.get_buffer_items(
-                            low + space_in_child_buffer, high
-                    );
-                    child.add_to_buffer(items_to_push);
-                }
-                m_dirty_bids.insert(child.get_bid());
+                child.add_to_buffer(curr_node.buffer_span(low + space_in_child_buffer, high));
+                mark_dirty(child);
 
             } else {
-                std::vector<value_type> items_to_push = curr_node.get_buffer_items(low, high);
-                child.add_to_buffer(items_to_push);
-                m_dirty_bids.insert(child.get_bid());
+                child.add_to_buffer(curr_node.buffer_span(low, high));
+                mark_dirty(child);
             }
+            // Its children may have been merged (nodes that are
+            // sparse because they were just split are left alone).
+            if (child.num_values() < num_child_values && child.underflows())
+                underflowing_child_ids.push_back(child.get_id());
 
             child_index++;
             // num_children can change due to splitting
             num_children = curr_node.num_children();
         }
         curr_node.clear_buffer();
-        m_dirty_bids.insert(curr_node.get_bid());
+        mark_dirty(curr_node);
+        merge_underflowing_children(curr_node, curr_depth, underflowing_child_ids);
     }
 
     // See flush_buffer
     void flush_bottom_buffer(node_type& curr_node) {
-        load(curr_node);
+        node_pin_type curr_node_pin = pin_block(curr_node, m_depth - 1);
+        prefetch_children(curr_node, m_leaf_id_to_leaf, m_leaf_cache, num_leaf_blocks_not_prefetched, m_depth);
         int num_children = curr_node.num_children();
         int low, high = 0;
         int child_index = 0;
+        std::vector<int> underflowing_child_ids;
 
         while (child_index < num_children) {
             low = high;
@@ -695,26 +1292,26 @@ private:
             auto it = m_leaf_id_to_leaf.find(curr_node.get_child_id(child_index));
             assert(it != m_leaf_id_to_leaf.end());
             leaf_type& child = *(it->second);
-            load(child);
-            load(curr_node);
-
-            // If pushing the items to the child would lead to an overflow ...
-            if (child.num_items_in_buffer() + num_items_to_push > child.max_buffer_size())
+            leaf_pin_type child_pin = pin_block(child);
+
+            // Push down, or if that would lead to an overflow, split the child.
+            // (Tombstones can leave it with fewer items.)
+            int num_child_items = child.num_items_in_buffer();
+            if (child.try_add_to_buffer(curr_node.buffer_span(low, high))) {
+                mark_dirty(child);
+                if (child.num_items_in_buffer() < num_child_items && child.underflows())
+                    underflowing_child_ids.push_back(child.get_id());
+            } else {
                 split_and_flush(curr_node, child, low, high);
-            // Else: just push down
-            else {
-                std::vector<value_type> buffer_items_to_push_down = curr_node.get_buffer_items(low, high);
-                child.add_to_buffer(buffer_items_to_push_down);
-                m_dirty_bids.insert(child.get_bid());
             }
-            load(curr_node);
 
             child_index++;
             // num_children can change due to splitting
             num_children = curr_node.num_children();
         }
         curr_node.clear_buffer();
-        m_dirty_bids.insert(curr_node.get_bid());
+        mark_dirty(curr_node);
+        merge_underflowing_children(curr_node, m_depth - 1, underflowing_child_ids);
     }
 
     void recursive_range_find(node_type& curr_node, key_type& lower, key_type& upper, int curr_depth, std::vector<value_type>& result) {
@@ -724,31 +1321,54 @@ private:
         } else {
             flush_buffer(curr_node, curr_depth);
         }
-        load(curr_node);
+        load(curr_node, curr_depth);
 
+        // Copies instead of spans: the recursive calls
+        // below can evict curr_node's block.
         std::vector<value_type> values = curr_node.get_values();
         std::vector<int> nodeIDs = curr_node.get_nodeIDs(0, curr_node.num_children());
+        // Erased values only separate the children.
+        std::vector<bool> values_erased(values.size());
+        for (int i = 0; i < static_cast<int>(values.size()); i++)
+            values_erased[i] = curr_node.value_erased(i);
 
         bool next_level_is_leaf = curr_depth == m_depth - 1;
 
+        // Index of the last child whose keys can be in the range
+        // (so that we do not read ahead past it).
+        int last_child_index = values.size();
+        if (next_level_is_leaf && !values.empty()) {
+            auto it = std::upper_bound(values.begin(), values.end(), value_type(upper, dummy_datum()),
+                                       [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;});
+            if (it != values.end())
+                last_child_index = std::distance(values.begin(), it);
+            else if (!(values[values.size()-1].first < upper))
+                last_child_index = values.size() - 1;
+        }
+
         for (int i=0; i < values.size(); i++) {
             // Look at i-th value and descendants
-            if (values[i].first == lower) {
+            if (values[i].first == lower && !values_erased[i]) {
                 result.push_back(values[i]);
             }
 
             if ((values[i].first > lower) && (values[i].first <= upper)) {
-                if (next_level_is_leaf)
+                if (next_level_is_leaf) {
+                    read_ahead_leaves(nodeIDs, i, last_child_index);
                     recursive_range_find_leaf(*m_leaf_id_to_leaf.at(nodeIDs[i]), lower, upper, result);
+                }
                 else
                     recursive_range_find(*m_node_id_to_node.at(nodeIDs[i]), lower, upper, curr_depth+1, result);
 
-                result.push_back(values[i]);
+                if (!values_erased[i])
+                    result.push_back(values[i]);
             }
 
             if (values[i].first > upper) {
-                if (next_level_is_leaf)
+                if (next_level_is_leaf) {
+                    read_ahead_leaves(nodeIDs, i, last_child_index);
                     recursive_range_find_leaf(*m_leaf_id_to_leaf.at(nodeIDs[i]), lower, upper, result);
+                }
                 else
                     recursive_range_find(*m_node_id_to_node.at(nodeIDs[i]), lower, upper, curr_depth+1, result);
 
@@ -765,29 +1385,43 @@ private:
         }
     }
 
+    // Prefetch the (up to m_range_read_ahead many) leaves that
+    // range_find visits after the leaf at nodeIDs[child_index],
+    // but none after the leaf at nodeIDs[last_child_index].
+    void read_ahead_leaves(const std::vector<int>& nodeIDs, int child_index, int last_child_index) {
+        int read_ahead = std::min(m_range_read_ahead, m_leaf_cache.capacity() - 1);
+        int last_index_to_read = std::min(child_index + read_ahead, last_child_index);
+        for (int i = child_index + 1; i <= last_index_to_read; i++)
+            m_leaf_cache.prefetch(m_leaf_id_to_leaf.at(nodeIDs[i])->get_bid(), m_depth);
+    }
+
     void recursive_range_find_leaf(leaf_type& curr_leaf, key_type& lower, key_type& upper, std::vector<value_type>& result) {
         load(curr_leaf);
-        std::vector<value_type> buffer_items = curr_leaf.get_buffer_items();
+        // The leaf stays in memory until the next load.
+        typename leaf_type::item_span_type buffer_items = curr_leaf.buffer_span();
 
-        if (buffer_items[0].first > upper)
+        if (buffer_items.empty() || buffer_items.key(0) > upper)
             return;
 
-        auto lower_it = std::lower_bound(buffer_items.begin(), buffer_items.end(), value_type(lower, dummy_datum()),
-                                         [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;});
-        auto upper_it = std::lower_bound(buffer_items.begin(), buffer_items.end(), value_type(upper, dummy_datum()),
-                                         [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;});
-        if (upper_it != buffer_items.end())
-            upper_it++;
+        int lower_index = buffer_items.lower_bound(lower);
+        int upper_index = buffer_items.upper_bound(upper);
 
-        result.insert(result.end(), lower_it, upper_it);
+        for (int i = lower_index; i < upper_index; i++)
+            result.push_back(buffer_items[i]);
     }
 
 
-    std::pair<data_type, bool> recursive_find(node_type& curr_node, key_type& key, int curr_depth) {
+    // delta is the combined delta of the upserts for the key that
+    // are newer than the items of curr_node (if delta.second).
+    std::pair<data_type, bool> recursive_find(node_type& curr_node, key_type& key, int curr_depth,
+                                              std::pair<data_type, bool> delta) {
         /*
          * Pseudocode of function:
          *
-         * if current node's buffer contains key:
+         * if current node's buffer contains an upsert for the key:
+         *      combine its delta into delta
+         *
+         * else if current node's buffer contains key:
          *      return (datum associated with the key, true)
          *
          * if the root is the only node:
@@ -797,28 +1431,36 @@ private:
          *      return (datum associated with the key, true)
          *
          * continue searching in correct child of current node
+         *
+         * (All results are combined with delta, see with_delta.)
          */
-        load(curr_node);
+        load(curr_node, curr_depth);
 
-        // Search in buffer
-        std::pair<data_type, bool> maybe_datum_and_found_in_buffer = curr_node.buffer_find(key);
+        // Search in buffer (a tombstone means that the key was erased)
+        message_type message;
+        std::pair<data_type, bool> maybe_datum_and_found_in_buffer = curr_node.buffer_find_message(key, message);
         // If found
+        if (maybe_datum_and_found_in_buffer.second && message != message_type::upsert)
+            return with_delta(with_found_message(maybe_datum_and_found_in_buffer, message), delta);
         if (maybe_datum_and_found_in_buffer.second)
-            return maybe_datum_and_found_in_buffer;
+            delta = with_delta(maybe_datum_and_found_in_buffer, delta);
 
         // Case: currently only have root
         if (m_depth == 1) {
             assert(curr_node == m_root);
-            return std::pair<data_type, bool> (dummy_datum(), false);
+            return with_delta(std::pair<data_type, bool> (dummy_datum(), false), delta);
         }
 
         // Search in values
         // Return type <<datum of key if found else dummy_datum, id of child to go to>, bool whether key was found>
-        std::pair<std::pair<data_type, int>, bool> maybe_datum_and_child_and_found_in_values = curr_node.values_find(key);
+        bool erased;
+        std::pair<std::pair<data_type, int>, bool> maybe_datum_and_child_and_found_in_values = curr_node.values_find(key, erased);
+        if (erased)
+            return with_delta(std::pair<data_type, bool> (dummy_datum(), false), delta);
         // If found
         if (maybe_datum_and_child_and_found_in_values.second) {
             data_type datum = maybe_datum_and_child_and_found_in_values.first.first;
-            return std::pair<data_type, bool> (datum, true);
+            return with_delta(std::pair<data_type, bool> (datum, true), delta);
         }
 
         // Continue in child
@@ -829,23 +1471,44 @@ private:
             auto it = m_leaf_id_to_leaf.find(child_id);
             assert(it != m_leaf_id_to_leaf.end());
             leaf_type& child = *(it->second);
-            return leaf_find(child, key);
+            return leaf_find(child, key, delta);
         }
         // Child is inner node
         else
-            return recursive_find(*m_node_id_to_node.at(child_id), key, curr_depth+1);
+            return recursive_find(*m_node_id_to_node.at(child_id), key, curr_depth+1, delta);
     }
 
-    std::pair<data_type, bool> leaf_find(leaf_type& curr_leaf, key_type& key) {
+    std::pair<data_type, bool> leaf_find(leaf_type& curr_leaf, key_type& key, const std::pair<data_type, bool>& delta) {
         load(curr_leaf);
 
         // Search in buffer
         std::pair<data_type, bool> maybe_datum_and_found_in_buffer = curr_leaf.buffer_find(key);
         // If found
         if (maybe_datum_and_found_in_buffer.second)
-            return maybe_datum_and_found_in_buffer;
+            return with_delta(maybe_datum_and_found_in_buffer, delta);
         else
+            return with_delta(std::pair<data_type, bool> (dummy_datum(), false), delta);
+    }
+
+    // Result of a lookup that found an item (datum_and_found) of
+    // the given type other than an upsert.
+    static std::pair<data_type, bool> with_found_message(const std::pair<data_type, bool>& datum_and_found,
+                                                         message_type message) {
+        assert(message != message_type::upsert);
+        if (message == message_type::erase)
             return std::pair<data_type, bool> (dummy_datum(), false);
+        return datum_and_found;
+    }
+
+    // The datum of a key (or its absence, see find) after the newer
+    // upserts with the combined delta (if delta.second). This also
+    // combines the deltas of two upserts (the older one first).
+    static std::pair<data_type, bool> with_delta(const std::pair<data_type, bool>& datum_and_found,
+                                                 const std::pair<data_type, bool>& delta) {
+        if (!delta.second)
+            return datum_and_found;
+        data_type datum = datum_and_found.second ? datum_and_found.first : data_type();
+        return std::pair<data_type, bool> (Combine()(datum, delta.first), true);
     }
 
 };
@@ -856,9 +1519,32 @@ template <typename KeyType,
         typename DataType,
         size_t RawBlockSize,
         size_t RawMemoryPoolSize,
-        typename AllocStr = foxxll::default_alloc_strategy
+        typename AllocStr = foxxll::default_alloc_strategy,
+        template<typename, typename, unsigned> class CachePolicy = fractal_tree::lru_policy,
+        bool PackedLeaves = fractal_tree::default_packed_leaves,
+        fractal_tree::block_compression Compression = fractal_tree::default_block_compression,
+        typename BlockCodec = fractal_tree::lz_block_codec,
+        typename Epsilon = fractal_tree::default_epsilon,
+        typename Combine = fractal_tree::no_upsert
+>
+using ftree = fractal_tree::fractal_tree<KeyType, DataType, RawBlockSize, RawBlockSize, RawMemoryPoolSize, AllocStr, CachePolicy, PackedLeaves, Compression, BlockCodec, Epsilon, Combine>;
+
+// Fractal tree whose nodes and leaves have blocks of different sizes.
+template <typename KeyType,
+        typename DataType,
+        size_t RawNodeBlockSize,
+        size_t RawLeafBlockSize,
+        size_t RawMemoryPoolSize,
+        typename AllocStr = foxxll::default_alloc_strategy,
+        template<typename, typename, unsigned> class CachePolicy = fractal_tree::lru_policy,
+        bool PackedLeaves = fractal_tree::default_packed_leaves,
+        fractal_tree::block_compression Compression = fractal_tree::default_block_compression,
+        typename BlockCodec = fractal_tree::lz_block_codec,
+        typename Epsilon = fractal_tree::default_epsilon,
+        typename Combine = fractal_tree::no_upsert
 >
-using ftree = fractal_tree::fractal_tree<KeyType, DataType, RawBlockSize, RawMemoryPoolSize, AllocStr>;
+using ftree_with_block_sizes = fractal_tree::fractal_tree<KeyType, DataType, RawNodeBlockSize, RawLeafBlockSize, RawMemoryPoolSize,
+                                                          AllocStr, CachePolicy, PackedLeaves, Compression, BlockCodec, Epsilon, Combine>;
 
 }
 
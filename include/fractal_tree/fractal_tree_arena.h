@@ -0,0 +1,144 @@
+/*
+ * fractal_tree_arena.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_ARENA_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_ARENA_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <foxxll/common/aligned_alloc.hpp>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// Huge pages for the arenas of the caches:
+// 0: none, 1: transparent huge pages (if enabled in the kernel),
+// 2: explicit huge pages (MAP_HUGETLB; falls back to 1 if none
+// are reserved; memory of blocks smaller than a huge page is then
+// zeroed instead of given back). Only has an effect on Linux.
+#ifndef FRACTAL_TREE_HUGE_PAGES
+#define FRACTAL_TREE_HUGE_PAGES 0
+#endif
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+/*
+ * One contiguous, aligned piece of memory that holds all blocks of
+ * a cache (instead of one allocation per block).
+ *
+ * On Linux, the arena is an anonymous mapping: its pages are only
+ * faulted in when they are first touched, and then read as zeros.
+ * Memory that is released is given back to the operating system
+ * (and reads as zeros again). Elsewhere, the arena is allocated
+ * with foxxll::aligned_alloc, and its memory is not zero-filled.
+ */
+class fractal_tree_arena {
+public:
+    // Blocks are read and written with direct I/O,
+    // so they must be aligned like foxxll's blocks.
+    static constexpr size_t block_alignment = 4096;
+    static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+private:
+    char* m_memory = nullptr;
+    // What was allocated / mapped (m_memory is aligned within it).
+    void* m_allocation = nullptr;
+    size_t m_allocation_size = 0;
+    bool m_is_mapped = false;
+
+public:
+    explicit fractal_tree_arena(size_t size) {
+        if (size == 0)
+            return;
+#if defined(__linux__)
+        // Huge pages need an aligned arena.
+        size_t alignment = FRACTAL_TREE_HUGE_PAGES > 0 ? huge_page_size : block_alignment;
+        m_allocation_size = round_up(size, alignment);
+#if FRACTAL_TREE_HUGE_PAGES == 2 && defined(MAP_HUGETLB)
+        // Without MAP_NORESERVE, this fails (instead of faulting
+        // later on) if not enough huge pages are reserved.
+        void* huge_memory = mmap(nullptr, m_allocation_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (huge_memory != MAP_FAILED) {
+            m_allocation = huge_memory;
+            m_memory = static_cast<char*>(huge_memory);
+            m_is_mapped = true;
+            return;
+        }
+#endif
+        // Map enough to align the arena.
+        m_allocation_size += alignment - block_alignment;
+        void* memory = mmap(nullptr, m_allocation_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED)
+            throw std::bad_alloc();
+        m_allocation = memory;
+        m_memory = reinterpret_cast<char*>(round_up(reinterpret_cast<size_t>(memory), alignment));
+        m_is_mapped = true;
+#if FRACTAL_TREE_HUGE_PAGES > 0 && defined(MADV_HUGEPAGE)
+        madvise(m_memory, round_up(size, alignment), MADV_HUGEPAGE);
+#endif
+#else
+        m_allocation_size = size;
+        m_allocation = foxxll::aligned_alloc<block_alignment>(size);
+        m_memory = static_cast<char*>(m_allocation);
+#endif
+    }
+
+    //! non-copyable: the arena owns its memory
+    fractal_tree_arena(const fractal_tree_arena&) = delete;
+    fractal_tree_arena& operator = (const fractal_tree_arena&) = delete;
+
+    ~fractal_tree_arena() {
+        if (m_allocation == nullptr)
+            return;
+#if defined(__linux__)
+        munmap(m_allocation, m_allocation_size);
+#else
+        foxxll::aligned_dealloc<block_alignment>(m_allocation);
+#endif
+    }
+
+    char* data() const {
+        return m_memory;
+    }
+
+    // Whether memory that was never touched (or was
+    // released) reads as zeros.
+    bool is_zero_filled() const {
+        return m_is_mapped;
+    }
+
+    // The memory [begin, begin + size) is not needed for now;
+    // give its pages back (if the arena is mapped).
+    void release(char* begin, size_t size) {
+        assert(m_memory <= begin);
+#if defined(__linux__)
+        // This fails for memory that is not aligned to the pages of
+        // the mapping (e.g. part of an explicit huge page); it is then
+        // kept, but zeroed, as released memory reads as zeros.
+        if (m_is_mapped && madvise(begin, size, MADV_DONTNEED) != 0)
+            memset(begin, 0, size);
+#else
+        (void)begin;
+        (void)size;
+#endif
+    }
+
+    static constexpr size_t round_up(size_t size, size_t alignment) {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+};
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_ARENA_H
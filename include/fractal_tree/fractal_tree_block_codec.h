@@ -0,0 +1,314 @@
+/*
+ * fractal_tree_block_codec.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_BLOCK_CODEC_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_BLOCK_CODEC_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+
+// Which blocks of a fractal tree are compressed on disk (see
+// block_compression), 0: none, 1: leaves, 2: leaves and nodes.
+#ifndef FRACTAL_TREE_BLOCK_COMPRESSION
+#define FRACTAL_TREE_BLOCK_COMPRESSION 0
+#endif
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+// Which blocks of a fractal tree are compressed (with the tree's
+// block codec) when they are written, see fractal_tree_block_io.h.
+enum class block_compression {
+    none,
+    leaves,
+    leaves_and_nodes
+};
+
+constexpr block_compression default_block_compression =
+    FRACTAL_TREE_BLOCK_COMPRESSION == 2 ? block_compression::leaves_and_nodes
+    : FRACTAL_TREE_BLOCK_COMPRESSION == 1 ? block_compression::leaves
+    : block_compression::none;
+
+// Counters of the compressed blocks of a cache (see
+// fractal_tree_block_io). All bytes are counted on disk, i.e.
+// rounded up to whole extent granules, except for compressed_bytes.
+struct fractal_tree_codec_stats {
+    uint64_t num_compressed = 0;
+    uint64_t num_decompressed = 0;
+    // Size of the blocks written, before and after compression.
+    uint64_t raw_bytes = 0;
+    uint64_t compressed_bytes = 0;
+    uint64_t bytes_written = 0;
+    uint64_t bytes_read = 0;
+    // CPU time spent in the codec.
+    uint64_t compress_ns = 0;
+    uint64_t decompress_ns = 0;
+    // Disk space taken from the block manager, and the
+    // part of it in use by the current extents of blocks.
+    uint64_t disk_bytes_allocated = 0;
+    uint64_t disk_bytes_used = 0;
+
+    fractal_tree_codec_stats& operator += (const fractal_tree_codec_stats& other) {
+        num_compressed += other.num_compressed;
+        num_decompressed += other.num_decompressed;
+        raw_bytes += other.raw_bytes;
+        compressed_bytes += other.compressed_bytes;
+        bytes_written += other.bytes_written;
+        bytes_read += other.bytes_read;
+        compress_ns += other.compress_ns;
+        decompress_ns += other.decompress_ns;
+        disk_bytes_allocated += other.disk_bytes_allocated;
+        disk_bytes_used += other.disk_bytes_used;
+        return *this;
+    }
+
+    double compression_ratio() const {
+        return compressed_bytes == 0 ? 1.0 : static_cast<double>(raw_bytes) / compressed_bytes;
+    }
+};
+
+inline std::ostream& operator << (std::ostream& os, const fractal_tree_codec_stats& stats) {
+    return os << "compressed: " << stats.num_compressed << " (ratio " << stats.compression_ratio()
+              << ", " << stats.compress_ns / 1000 << " us)"
+              << " decompressed: " << stats.num_decompressed << " (" << stats.decompress_ns / 1000 << " us)"
+              << " bytes written: " << stats.bytes_written << " read: " << stats.bytes_read
+              << " disk bytes used: " << stats.disk_bytes_used << " of " << stats.disk_bytes_allocated;
+}
+
+/*
+ * Block codecs. A codec has
+ *
+ *   // Compress the n bytes at src into at most capacity bytes at
+ *   // dst; return the compressed size, or 0 if it does not fit.
+ *   size_t compress(const char* src, size_t n, char* dst, size_t capacity);
+ *
+ *   // Decompress the n bytes at src, which have to give exactly
+ *   // size bytes, to dst; return whether they did. Must be safe
+ *   // to call from several threads at once.
+ *   bool decompress(const char* src, size_t n, char* dst, size_t size) const;
+ *
+ * no_block_codec turns compression off: the caches read and write
+ * their blocks as they are.
+ */
+struct no_block_codec { };
+
+/*
+ * Byte-oriented LZ77 codec (vendored, no dependencies): the output
+ * is in the LZ4 block format, and compress is a greedy single pass
+ * that finds matches through a hash table of 4 byte sequences, as
+ * LZ4's fast mode does. Blocks of sorted keys with small data
+ * (common prefixes, repeated data, zero padding) compress well;
+ * random bytes do not compress at all (compress returns 0).
+ */
+class lz_block_codec {
+    enum {
+        hash_bits = 12,
+        min_match = 4,
+        // The last 5 bytes are literals, and the last match starts
+        // at least 12 bytes before the end (as in LZ4).
+        last_literals = 5,
+        match_start_limit = 12,
+        max_offset = 65535
+    };
+
+    // Positions (+1, 0: empty) of 4 byte sequences by their hash.
+    std::array<uint32_t, 1 << hash_bits> m_table;
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint64_t read64(const unsigned char* p) {
+        uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint32_t hash(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - hash_bits);
+    }
+
+    // Write the length of a literal run or match beyond the 15 that
+    // fit into the token; return the new output position (or nullptr
+    // if it does not fit).
+    static unsigned char* write_length(unsigned char* op, const unsigned char* op_end, size_t length) {
+        for (; length >= 255; length -= 255) {
+            if (op == op_end)
+                return nullptr;
+            *op++ = 255;
+        }
+        if (op == op_end)
+            return nullptr;
+        *op++ = static_cast<unsigned char>(length);
+        return op;
+    }
+
+    // Append the literals [anchor, anchor + num_literals) and, if
+    // match_length > 0, a match. Return nullptr if it does not fit.
+    static unsigned char* write_sequence(unsigned char* op, const unsigned char* op_end,
+                                         const unsigned char* anchor, size_t num_literals,
+                                         size_t offset, size_t match_length) {
+        if (op == op_end)
+            return nullptr;
+        unsigned char* token = op++;
+        *token = static_cast<unsigned char>((num_literals < 15 ? num_literals : 15) << 4);
+        if (num_literals >= 15 && (op = write_length(op, op_end, num_literals - 15)) == nullptr)
+            return nullptr;
+        if (static_cast<size_t>(op_end - op) < num_literals)
+            return nullptr;
+        std::memcpy(op, anchor, num_literals);
+        op += num_literals;
+        if (match_length == 0)
+            return op;
+
+        if (op_end - op < 2)
+            return nullptr;
+        *op++ = static_cast<unsigned char>(offset);
+        *op++ = static_cast<unsigned char>(offset >> 8);
+        size_t length = match_length - min_match;
+        *token |= static_cast<unsigned char>(length < 15 ? length : 15);
+        if (length >= 15)
+            op = write_length(op, op_end, length - 15);
+        return op;
+    }
+
+public:
+    size_t compress(const char* source, size_t n, char* destination, size_t capacity) {
+        const unsigned char* src = reinterpret_cast<const unsigned char*>(source);
+        unsigned char* op = reinterpret_cast<unsigned char*>(destination);
+        unsigned char* const op_end = op + capacity;
+        const unsigned char* anchor = src;
+
+        if (n > match_start_limit) {
+            m_table.fill(0);
+            const unsigned char* ip = src;
+            const unsigned char* const ip_limit = src + n - match_start_limit;
+            const unsigned char* const match_limit = src + n - last_literals;
+            while (ip < ip_limit) {
+                uint32_t sequence = read32(ip);
+                uint32_t& entry = m_table[hash(sequence)];
+                const unsigned char* ref = entry != 0 ? src + (entry - 1) : nullptr;
+                bool found = ref != nullptr && ip - ref <= max_offset && read32(ref) == sequence;
+                entry = static_cast<uint32_t>(ip - src) + 1;
+                if (!found) {
+                    // Skip faster through data without matches.
+                    ip += 1 + ((ip - anchor) >> 6);
+                    continue;
+                }
+                // Extend the match backwards and forwards.
+                while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                    ip--;
+                    ref--;
+                }
+                const unsigned char* match_end = ip + min_match;
+                const size_t distance = ip - ref;
+                while (match_end + sizeof(uint64_t) <= match_limit
+                       && read64(match_end) == read64(match_end - distance))
+                    match_end += sizeof(uint64_t);
+                while (match_end < match_limit && *match_end == match_end[-static_cast<ptrdiff_t>(distance)])
+                    match_end++;
+
+                op = write_sequence(op, op_end, anchor, ip - anchor, ip - ref, match_end - ip);
+                if (op == nullptr)
+                    return 0;
+                ip = match_end;
+                anchor = ip;
+                if (ip < ip_limit)
+                    m_table[hash(read32(ip - 2))] = static_cast<uint32_t>(ip - 2 - src) + 1;
+            }
+        }
+        op = write_sequence(op, op_end, anchor, src + n - anchor, 0, 0);
+        if (op == nullptr)
+            return 0;
+        return op - reinterpret_cast<unsigned char*>(destination);
+    }
+
+    bool decompress(const char* source, size_t n, char* destination, size_t size) const {
+        const unsigned char* ip = reinterpret_cast<const unsigned char*>(source);
+        const unsigned char* const ip_end = ip + n;
+        unsigned char* op = reinterpret_cast<unsigned char*>(destination);
+        unsigned char* const op_begin = op;
+        unsigned char* const op_end = op + size;
+
+        // Read a length beyond the 15 of the token.
+        auto read_length = [&ip, ip_end](size_t& length)->bool {
+            unsigned char byte;
+            do {
+                if (ip == ip_end)
+                    return false;
+                byte = *ip++;
+                length += byte;
+            } while (byte == 255);
+            return true;
+        };
+
+        while (true) {
+            if (ip == ip_end)
+                return false;
+            unsigned char token = *ip++;
+            size_t num_literals = token >> 4;
+            if (num_literals == 15 && !read_length(num_literals))
+                return false;
+            if (static_cast<size_t>(ip_end - ip) < num_literals || static_cast<size_t>(op_end - op) < num_literals)
+                return false;
+            // Short runs and matches are copied as 16 bytes (of which
+            // the rest is overwritten later) if there is room.
+            if (num_literals <= 16 && ip_end - ip >= 16 && op_end - op >= 16)
+                std::memcpy(op, ip, 16);
+            else
+                std::memcpy(op, ip, num_literals);
+            ip += num_literals;
+            op += num_literals;
+            // The last sequence has no match.
+            if (ip == ip_end)
+                break;
+
+            if (ip_end - ip < 2)
+                return false;
+            size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+            ip += 2;
+            size_t match_length = token & 15;
+            if (match_length == 15 && !read_length(match_length))
+                return false;
+            match_length += min_match;
+            if (offset == 0 || offset > static_cast<size_t>(op - op_begin)
+                || static_cast<size_t>(op_end - op) < match_length)
+                return false;
+            // The match can overlap the bytes it produces.
+            const unsigned char* ref = op - offset;
+            if (offset >= 16 && match_length <= 16 && op_end - op >= 16) {
+                std::memcpy(op, ref, 16);
+                op += match_length;
+            } else if (offset >= match_length) {
+                std::memcpy(op, ref, match_length);
+                op += match_length;
+            } else if (offset >= sizeof(uint64_t)) {
+                // Each word is complete before it is read again.
+                unsigned char* const match_end = op + match_length;
+                for (; op + sizeof(uint64_t) <= match_end; op += sizeof(uint64_t), ref += sizeof(uint64_t))
+                    std::memcpy(op, ref, sizeof(uint64_t));
+                while (op < match_end)
+                    *op++ = *ref++;
+            } else {
+                for (size_t i = 0; i < match_length; i++)
+                    *op++ = *ref++;
+            }
+        }
+        return op == op_end;
+    }
+};
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_BLOCK_CODEC_H
@@ -0,0 +1,353 @@
+/*
+ * fractal_tree_block_io.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_BLOCK_IO_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_BLOCK_IO_H
+
+#include <foxxll/common/aligned_alloc.hpp>
+#include <foxxll/io/file.hpp>
+#include <foxxll/io/request.hpp>
+#include <foxxll/mng/block_manager.hpp>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include "fractal_tree_block_codec.h"
+
+// Compressed blocks are stored in extents of a multiple of this
+// many bytes (direct I/O needs 4 KiB aligned offsets and sizes).
+#ifndef FRACTAL_TREE_EXTENT_GRANULE
+#define FRACTAL_TREE_EXTENT_GRANULE 4096
+#endif
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+/*
+ * How a fractal_tree_cache reads and writes its blocks, and where
+ * their disk blocks come from (new_block).
+ *
+ * With a codec (see fractal_tree_block_codec.h), a block is
+ * compressed when it is written, and stored in an extent: a run of
+ * granules (FRACTAL_TREE_EXTENT_GRANULE bytes, or the block size if
+ * that is smaller) in a segment, a large disk block from the block
+ * manager. Blocks that do not save a granule are stored as they are.
+ * The bids of the blocks are logical (from new_block): a table maps
+ * them to their current extent, which changes when the size of the
+ * compressed block does. Extents that become free are merged with
+ * their free neighbors, and a block gets the smallest free extent
+ * that is large enough (and split off the rest), so the disk space
+ * of the segments is reused even though the sizes of the blocks
+ * keep changing. Segments are never given back.
+ *
+ * Reads go to a staging buffer, and are decompressed into the block
+ * (by the thread that completes the read) before anyone waiting for
+ * the read continues, so the cache only ever sees uncompressed
+ * blocks. Each read or write in flight has its own staging buffer;
+ * they are kept for reuse.
+ */
+template<typename BlockType, typename BidType, typename BlockCodec>
+class fractal_tree_block_io {
+    using block_type = BlockType;
+    using bid_type = BidType;
+
+public:
+    enum {
+        block_size = sizeof(block_type),
+        granule = block_size < FRACTAL_TREE_EXTENT_GRANULE ? block_size : FRACTAL_TREE_EXTENT_GRANULE,
+        max_num_granules = (block_size + granule - 1) / granule,
+        num_granules_in_segment = 64 * max_num_granules
+    };
+
+private:
+    using segment_bid_type = foxxll::BID<static_cast<size_t>(num_granules_in_segment) * granule>;
+
+    struct extent {
+        foxxll::file* storage = nullptr;
+        uint64_t offset = 0;
+        int num_granules = 0;
+        // Size of the compressed block (block_size: not compressed).
+        int num_bytes = 0;
+    };
+    using extent_position = std::pair<foxxll::file*, uint64_t>;
+
+    BlockCodec m_codec;
+    // Extents by logical index (see index()).
+    std::vector<extent> m_extents;
+    // Logical indexes of deleted blocks.
+    std::vector<size_t> m_free_indexes;
+    // Free extents (including the unused parts of the segments), by
+    // position (to merge neighbors) and by size (to find the smallest
+    // one that is large enough). The size is in granules.
+    std::map<extent_position, int> m_free_extents_by_position;
+    std::set<std::pair<int, extent_position>> m_free_extents_by_size;
+    std::function<void(segment_bid_type&)> m_allocate_segment;
+    // Storage of the logical bids.
+    foxxll::file* m_storage = nullptr;
+
+    std::mutex m_staging_buffers_mutex;
+    std::vector<char*> m_staging_buffers;
+    std::atomic<int> m_num_requests_in_flight { 0 };
+
+    fractal_tree_codec_stats m_stats;
+    // Counted by the threads that complete reads.
+    std::atomic<uint64_t> m_num_decompressed { 0 };
+    std::atomic<uint64_t> m_decompress_ns { 0 };
+
+public:
+    fractal_tree_block_io() = default;
+
+    //! non-copyable: requests in flight refer to it
+    fractal_tree_block_io(const fractal_tree_block_io&) = delete;
+    fractal_tree_block_io& operator = (const fractal_tree_block_io&) = delete;
+
+    ~fractal_tree_block_io() {
+        // The cache has waited for all its requests, but a request
+        // that was polled as completed can still be in its handler.
+        while (m_num_requests_in_flight > 0)
+            std::this_thread::yield();
+        for (char* buffer : m_staging_buffers)
+            foxxll::aligned_dealloc<4096>(buffer);
+    }
+
+    // Give bid a logical bid. Segments are allocated with the
+    // allocation strategy of the first call.
+    template<typename AllocStr>
+    void new_block(const AllocStr& alloc_strategy, bid_type& bid) {
+        if (!m_allocate_segment) {
+            m_allocate_segment = [alloc_strategy](segment_bid_type& segment) {
+                foxxll::block_manager::get_instance()->new_block(alloc_strategy, segment);
+            };
+        }
+        if (m_storage == nullptr)
+            m_storage = new_segment();
+        bid.storage = m_storage;
+        if (!m_free_indexes.empty()) {
+            bid.offset = m_free_indexes.back() * static_cast<uint64_t>(block_size);
+            m_free_indexes.pop_back();
+            return;
+        }
+        bid.offset = m_extents.size() * static_cast<uint64_t>(block_size);
+        m_extents.emplace_back();
+    }
+
+    // Give the disk space of the bid back; new_block can reuse the bid.
+    // No request may use it anymore.
+    void delete_block(const bid_type& bid) {
+        free_extent(m_extents[index(bid)]);
+        m_free_indexes.push_back(index(bid));
+    }
+
+    foxxll::request_ptr read(block_type* block, const bid_type& bid) {
+        const extent e = m_extents[index(bid)];
+        assert(e.num_granules > 0);
+        char* buffer = take_staging_buffer();
+        m_stats.bytes_read += static_cast<uint64_t>(e.num_granules) * granule;
+        m_num_requests_in_flight++;
+        return e.storage->aread(buffer, e.offset, static_cast<size_t>(e.num_granules) * granule,
+                                [this, block, buffer, e](foxxll::request*, bool success) {
+                                    if (success)
+                                        decode(buffer, e.num_bytes, block);
+                                    give_back_staging_buffer(buffer);
+                                    m_num_requests_in_flight--;
+                                });
+    }
+
+    foxxll::request_ptr write(block_type* block, const bid_type& bid) {
+        extent& e = m_extents[index(bid)];
+        char* buffer = take_staging_buffer();
+        const char* data = reinterpret_cast<const char*>(block);
+
+        auto start = std::chrono::steady_clock::now();
+        // A compressed block has to save at least a granule.
+        int num_bytes = max_num_granules == 1 ? 0
+                        : static_cast<int>(m_codec.compress(data, block_size, buffer, (max_num_granules - 1) * granule));
+        m_stats.compress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        if (num_bytes == 0) {
+            std::memcpy(buffer, data, block_size);
+            num_bytes = block_size;
+        }
+        int num_granules = (num_bytes + granule - 1) / granule;
+        std::memset(buffer + num_bytes, 0, static_cast<size_t>(num_granules) * granule - num_bytes);
+
+        if (num_granules != e.num_granules) {
+            free_extent(e);
+            allocate_extent(e, num_granules);
+        }
+        e.num_bytes = num_bytes;
+
+        m_stats.num_compressed++;
+        m_stats.raw_bytes += block_size;
+        m_stats.compressed_bytes += num_bytes;
+        m_stats.bytes_written += static_cast<uint64_t>(num_granules) * granule;
+        m_num_requests_in_flight++;
+        return e.storage->awrite(buffer, e.offset, static_cast<size_t>(num_granules) * granule,
+                                 [this, buffer](foxxll::request*, bool) {
+                                     give_back_staging_buffer(buffer);
+                                     m_num_requests_in_flight--;
+                                 });
+    }
+
+    fractal_tree_codec_stats stats() const {
+        fractal_tree_codec_stats result = m_stats;
+        result.num_decompressed = m_num_decompressed;
+        result.decompress_ns = m_decompress_ns;
+        return result;
+    }
+
+    // Reset the counters (but not the disk space).
+    void reset_stats() {
+        fractal_tree_codec_stats reset;
+        reset.disk_bytes_allocated = m_stats.disk_bytes_allocated;
+        reset.disk_bytes_used = m_stats.disk_bytes_used;
+        m_stats = reset;
+        m_num_decompressed = 0;
+        m_decompress_ns = 0;
+    }
+
+private:
+    static size_t index(const bid_type& bid) {
+        return bid.offset / block_size;
+    }
+
+    void decode(const char* buffer, int num_bytes, block_type* block) {
+        char* data = reinterpret_cast<char*>(block);
+        if (num_bytes == static_cast<int>(block_size)) {
+            std::memcpy(data, buffer, block_size);
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool decompressed = m_codec.decompress(buffer, num_bytes, data, block_size);
+        assert(decompressed);
+        (void)decompressed;
+        m_decompress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        m_num_decompressed++;
+    }
+
+    // Allocate a segment (a free extent) and return its storage.
+    foxxll::file* new_segment() {
+        segment_bid_type segment;
+        m_allocate_segment(segment);
+        m_stats.disk_bytes_allocated += segment_bid_type::size;
+        add_free_extent(extent_position(segment.storage, segment.offset), num_granules_in_segment);
+        return segment.storage;
+    }
+
+    void allocate_extent(extent& e, int num_granules) {
+        auto it = m_free_extents_by_size.lower_bound(std::make_pair(num_granules, extent_position()));
+        if (it == m_free_extents_by_size.end()) {
+            new_segment();
+            it = m_free_extents_by_size.lower_bound(std::make_pair(num_granules, extent_position()));
+        }
+        int num_free_granules = it->first;
+        extent_position position = it->second;
+        remove_free_extent(position, num_free_granules);
+        if (num_free_granules > num_granules)
+            add_free_extent(extent_position(position.first, position.second + static_cast<uint64_t>(num_granules) * granule),
+                            num_free_granules - num_granules);
+        e.storage = position.first;
+        e.offset = position.second;
+        e.num_granules = num_granules;
+        m_stats.disk_bytes_used += static_cast<uint64_t>(num_granules) * granule;
+    }
+
+    void free_extent(extent& e) {
+        if (e.num_granules == 0)
+            return;
+        m_stats.disk_bytes_used -= static_cast<uint64_t>(e.num_granules) * granule;
+        extent_position position(e.storage, e.offset);
+        int num_granules = e.num_granules;
+        e = extent();
+
+        // Merge with the free extents right after and right before it.
+        auto next = m_free_extents_by_position.lower_bound(position);
+        if (next != m_free_extents_by_position.end()
+            && next->first == extent_position(position.first, position.second + static_cast<uint64_t>(num_granules) * granule)) {
+            num_granules += next->second;
+            remove_free_extent(next->first, next->second);
+        }
+        auto prev = m_free_extents_by_position.lower_bound(position);
+        if (prev != m_free_extents_by_position.begin()) {
+            --prev;
+            if (prev->first.first == position.first
+                && prev->first.second + static_cast<uint64_t>(prev->second) * granule == position.second) {
+                position = prev->first;
+                num_granules += prev->second;
+                remove_free_extent(prev->first, prev->second);
+            }
+        }
+        add_free_extent(position, num_granules);
+    }
+
+    void add_free_extent(const extent_position& position, int num_granules) {
+        m_free_extents_by_position.emplace(position, num_granules);
+        m_free_extents_by_size.emplace(num_granules, position);
+    }
+
+    // (By value: position can be a key of the maps.)
+    void remove_free_extent(extent_position position, int num_granules) {
+        m_free_extents_by_position.erase(position);
+        m_free_extents_by_size.erase(std::make_pair(num_granules, position));
+    }
+
+    char* take_staging_buffer() {
+        {
+            std::lock_guard<std::mutex> lock(m_staging_buffers_mutex);
+            if (!m_staging_buffers.empty()) {
+                char* buffer = m_staging_buffers.back();
+                m_staging_buffers.pop_back();
+                return buffer;
+            }
+        }
+        return static_cast<char*>(foxxll::aligned_alloc<4096>(static_cast<size_t>(max_num_granules) * granule));
+    }
+
+    void give_back_staging_buffer(char* buffer) {
+        std::lock_guard<std::mutex> lock(m_staging_buffers_mutex);
+        m_staging_buffers.push_back(buffer);
+    }
+};
+
+// Without a codec, blocks are read and written as they are.
+template<typename BlockType, typename BidType>
+class fractal_tree_block_io<BlockType, BidType, no_block_codec> {
+public:
+    template<typename AllocStr>
+    void new_block(const AllocStr& alloc_strategy, BidType& bid) {
+        foxxll::block_manager::get_instance()->new_block(alloc_strategy, bid);
+    }
+
+    void delete_block(const BidType& bid) {
+        foxxll::block_manager::get_instance()->delete_block(bid);
+    }
+
+    foxxll::request_ptr read(BlockType* block, const BidType& bid) {
+        return block->read(bid);
+    }
+
+    foxxll::request_ptr write(BlockType* block, const BidType& bid) {
+        return block->write(bid);
+    }
+
+    fractal_tree_codec_stats stats() const {
+        return fractal_tree_codec_stats();
+    }
+
+    void reset_stats() { }
+};
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_BLOCK_IO_H
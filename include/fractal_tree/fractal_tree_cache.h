@@ -6,137 +6,833 @@
 #define EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_CACHE_H
 
 #include <tlx/logger.hpp>
-#include <list>
-#include <unordered_map>
-#include <unordered_set>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include <algorithm>
+#include <functional>
 #include <foxxll/io/request_operations.hpp>
+#include "fractal_tree_arena.h"
+#include "fractal_tree_block_io.h"
+#include "fractal_tree_cache_policies.h"
+#include "fractal_tree_frame_pool.h"
 
 namespace stxxl {
 
 namespace fractal_tree {
 
+// Counters of a fractal_tree_cache (or of a part of it).
+// Each eviction is either a dirty write-back or a clean drop.
+struct fractal_tree_cache_stats {
+    // Loads of cached blocks.
+    uint64_t hits = 0;
+    // Loads that had to read (including loads of prefetched blocks).
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t dirty_writebacks = 0;
+    uint64_t clean_drops = 0;
+    // Dirty blocks written ahead of their eviction by clean().
+    uint64_t cleaned = 0;
 
-template<typename BlockType, typename BidType, typename BidHash, unsigned NumBlocksInCache>
+    fractal_tree_cache_stats& operator += (const fractal_tree_cache_stats& other) {
+        hits += other.hits;
+        misses += other.misses;
+        evictions += other.evictions;
+        dirty_writebacks += other.dirty_writebacks;
+        clean_drops += other.clean_drops;
+        cleaned += other.cleaned;
+        return *this;
+    }
+
+    double hit_ratio() const {
+        return hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses);
+    }
+};
+
+inline std::ostream& operator << (std::ostream& os, const fractal_tree_cache_stats& stats) {
+    return os << "hits: " << stats.hits << " misses: " << stats.misses
+              << " (hit ratio " << stats.hit_ratio() << ")"
+              << " evictions: " << stats.evictions
+              << " (dirty write-backs " << stats.dirty_writebacks << ", clean drops " << stats.clean_drops << ")"
+              << " cleaned: " << stats.cleaned;
+}
+
+
+// MaxNumPendingWrites > 0 enables write-behind: dirty blocks that are
+// evicted are written asynchronously, and their in-memory blocks only
+// become available again once the write has completed. At most
+// MaxNumPendingWrites such writes are in flight at any time.
+// With MaxNumPendingWrites == 0, evictions write synchronously.
+// ReplacementPolicy decides which block is evicted when a new one
+// needs to be loaded (see fractal_tree_cache_policies.h).
+// A cache can share its memory with another cache through a
+// fractal_tree_frame_pool; NumBlocksInCache is then the most
+// blocks it can ever hold, and the number of blocks it actually
+// holds (its capacity) follows its target in the pool.
+// With dirty watermarks set (see set_dirty_watermarks), clean()
+// writes dirty blocks ahead of their eviction, so that evictions
+// mostly find clean victims.
+// Loads can be tagged (e.g. with the level of the block in the tree);
+// the cache keeps its statistics per tag, and attributes evictions
+// to the tag of the last load (or prefetch) of the evicted block.
+// A block can be pinned (see pin()) while it is being worked on;
+// pinned blocks are never evicted.
+// New blocks can be loaded with a virtual bid (without storage, see
+// set_block_allocator); they only get a disk block when they are
+// first written.
+// All bookkeeping lives in a table of NumBlocksInCache frames that is
+// set up in the constructor, and the blocks of all frames live in one
+// arena (see fractal_tree_arena.h); a block is only set up (and its
+// memory touched) when its frame is first used. So loading, evicting,
+// marking blocks dirty and moving frames to or from a shared pool do
+// not allocate memory, apart from foxxll's requests and the statistics
+// of a tag that is used for the first time.
+// With a BlockCodec other than no_block_codec, blocks are compressed
+// on disk (see fractal_tree_block_io.h); the frames always hold
+// uncompressed blocks. Disk blocks for such a cache have to come from
+// its new_block.
+template<typename BlockType, typename BidType, typename BidHash, unsigned NumBlocksInCache, unsigned MaxNumPendingWrites = 0,
+         template<typename, typename, unsigned> class ReplacementPolicy = lru_policy,
+         typename BlockCodec = no_block_codec>
 class fractal_tree_cache {
 
     using block_type = BlockType;
     using bid_type = BidType;
     using bid_hash = BidHash;
+    using policy_type = ReplacementPolicy<BidType, BidHash, NumBlocksInCache>;
+    using cache_index_type = bid_index<BidType, BidHash>;
+    using block_io_type = fractal_tree_block_io<BlockType, BidType, BlockCodec>;
+    // Returns the disk block for the block with the given virtual bid.
+    using block_allocator_type = std::function<bid_type(const bid_type&)>;
 
     enum {
-        max_num_blocks_in_cache = NumBlocksInCache
+        max_num_blocks_in_cache = NumBlocksInCache,
+        max_num_pending_writes = MaxNumPendingWrites,
+        // Distance of the blocks of neighboring frames in the arena.
+        frame_size = fractal_tree_arena::round_up(sizeof(block_type), fractal_tree_arena::block_alignment)
     };
+    static_assert(max_num_pending_writes <= max_num_blocks_in_cache, "More pending writes than blocks in cache!");
 
-    using bid_block_pair_type = std::pair<bid_type, block_type*>;
-    using cache_list_iterator_type = typename std::list<bid_block_pair_type>::iterator;
+    // Each in-memory block belongs to one frame. A frame is
+    // either unallocated (does not count towards the capacity),
+    // unused, holds a cached bid, or holds an evicted bid whose
+    // write is pending.
+    struct frame_type {
+        bid_type bid;
+        // Block of the frame in the arena.
+        block_type* block = nullptr;
+        // The block was constructed (and zeroed).
+        bool is_block_set_up = false;
+        // The read that has not been waited for yet
+        // (for prefetched blocks).
+        foxxll::request_ptr read_request;
+        // The write that has not been waited for yet (of an
+        // evicted dirty block, or of a cached block by clean()).
+        foxxll::request_ptr write_request;
+        // Prefetched, but not loaded yet.
+        bool prefetched = false;
+        // Changed since it was read.
+        bool dirty = false;
+        // Tag of the last load.
+        int tag = 0;
+        // Number of pins; a pinned frame is not evicted.
+        int pin_count = 0;
+    };
 
 private:
-    std::list<block_type*> m_unused_blocks;
-    std::list<bid_block_pair_type> m_cache_list;
+    // Before the frames, so that it outlives their requests.
+    block_io_type m_io;
+    fractal_tree_arena m_arena { max_num_blocks_in_cache * static_cast<size_t>(frame_size) };
+    std::vector<frame_type> m_frames = std::vector<frame_type>(max_num_blocks_in_cache);
+    std::vector<int> m_unused_frames;
+    std::vector<int> m_unallocated_frames;
+    int m_capacity = 0;
+    // Frames with pending writes; oldest write at the back.
+    frame_links m_pending_write_links = frame_links(max_num_blocks_in_cache);
+    frame_list m_pending_writes;
+
+    // Frames of the cached bids.
+    cache_index_type m_cache_index = cache_index_type(max_num_blocks_in_cache);
+    int m_num_dirty = 0;
 
-    std::unordered_map<bid_type, cache_list_iterator_type, bid_hash> m_cache_map;
-    std::unordered_set<bid_type, bid_hash>& m_dirty_bids;
+    // clean() starts once more than m_high_dirty_ratio of the blocks
+    // are dirty, and writes until at most m_low_dirty_ratio are.
+    double m_high_dirty_ratio = 1.0;
+    double m_low_dirty_ratio = 1.0;
+    std::vector<int> m_frames_to_clean;
+
+    block_allocator_type m_allocate_block;
+
+    // Statistics per tag.
+    std::vector<fractal_tree_cache_stats> m_stats = std::vector<fractal_tree_cache_stats>(1);
+
+    policy_type m_policy;
+    int m_num_pinned_frames = 0;
+    // Frames that were prefetched, but not loaded yet.
+    int m_num_prefetched = 0;
+
+    // Shared memory budget (if any) and recently evicted bids,
+    // whose misses tell the pool that this cache is too small.
+    fractal_tree_frame_pool* m_pool = nullptr;
+    int m_pool_id = -1;
+    ghost_list<bid_type, bid_hash> m_evicted_bids = ghost_list<bid_type, bid_hash>(max_num_blocks_in_cache + 1);
 
 public:
-    explicit fractal_tree_cache(std::unordered_set<bid_type, bid_hash>& dirty_bids) : m_dirty_bids(dirty_bids) {
-        for (size_t i = 0; i < max_num_blocks_in_cache; i++) {
-            auto* block = new block_type;
-            // Valgrind warns that we're writing to uninitialized bytes
-            // when the struct we use inside the block_type does not
-            // fill a full block, so we explicitly set the whole region to
-            // 0 here to prevent this
-            // (this is the same as setting the FOXXLL_WITH_VALGRIND
-            // flag to true in typed_block.hpp)
-            memset(block, 0, sizeof(block_type));
-            m_unused_blocks.push_back(block);
+    // Keeps a cached block in memory as long as it exists (see pin()).
+    // Pins can be moved, but not copied.
+    class pinned_block {
+        fractal_tree_cache* m_cache = nullptr;
+        int m_frame = -1;
+
+    public:
+        pinned_block() = default;
+
+        pinned_block(fractal_tree_cache* cache, int frame) : m_cache(cache), m_frame(frame) { }
+
+        pinned_block(const pinned_block&) = delete;
+        pinned_block& operator = (const pinned_block&) = delete;
+
+        pinned_block(pinned_block&& other) noexcept : m_cache(other.m_cache), m_frame(other.m_frame) {
+            other.m_cache = nullptr;
         }
+
+        pinned_block& operator = (pinned_block&& other) noexcept {
+            if (this != &other) {
+                release();
+                m_cache = other.m_cache;
+                m_frame = other.m_frame;
+                other.m_cache = nullptr;
+            }
+            return *this;
+        }
+
+        ~pinned_block() {
+            release();
+        }
+
+        bool valid() const {
+            return m_cache != nullptr;
+        }
+
+        block_type* block() const {
+            assert(valid());
+            return m_cache->m_frames[m_frame].block;
+        }
+
+        // Unpin the block early (e.g. before working on other blocks).
+        void release() {
+            if (m_cache != nullptr) {
+                m_cache->unpin(m_frame);
+                m_cache = nullptr;
+            }
+        }
+    };
+
+    fractal_tree_cache() {
+        init_frames(max_num_blocks_in_cache);
     }
 
+    // Cache that starts with num_blocks blocks out of the pool,
+    // and never holds less than min_num_blocks blocks. Each block
+    // takes frame_size units of the pool (see fractal_tree_frame_pool).
+    fractal_tree_cache(fractal_tree_frame_pool& pool, int num_blocks, int min_num_blocks, int frame_size = 1) : m_pool(&pool) {
+        assert(0 < min_num_blocks && num_blocks <= max_num_blocks_in_cache);
+        m_pool_id = pool.add_cache(num_blocks, min_num_blocks, frame_size);
+        init_frames(num_blocks);
+    }
+
+    //! non-copyable: the frames own their blocks
+    fractal_tree_cache(const fractal_tree_cache&) = delete;
+    fractal_tree_cache& operator = (const fractal_tree_cache&) = delete;
+
     ~fractal_tree_cache() {
-        for (block_type* block : m_unused_blocks)
-            delete block;
+        // Blocks with pending reads or writes must not
+        // be deleted before the request has completed.
+        wait_for_pending_writes();
 
-        // Delete blocks in cache.
-        for (bid_block_pair_type pair : m_cache_list) {
-            block_type* block = pair.second;
-            delete block;
+        for (frame_type& frame : m_frames) {
+            if (frame.read_request.valid())
+                frame.read_request->wait();
+            if (frame.write_request.valid())
+                frame.write_request->wait();
+            if (frame.is_block_set_up)
+                frame.block->~block_type();
+        }
+        if (m_pool != nullptr) {
+            for (int i = 0; i < m_capacity; i++)
+                m_pool->return_frame(m_pool_id);
         }
     }
 
-    // Evict least recently used item.
+    // Evict the item chosen by the replacement policy.
     void evict() {
-        // Get least recently used bid and block.
-        bid_block_pair_type lru_item = m_cache_list.back();
-        bid_type lru_bid = lru_item.first;
-        kick(lru_bid);
+        int victim = m_policy.victim([this](int frame)->bool { return m_frames[frame].pin_count == 0; });
+        assert(victim >= 0);
+        // Only evictions count (kicks by the user of the cache do not).
+        fractal_tree_cache_stats& stats = m_stats[m_frames[victim].tag];
+        stats.evictions++;
+        if (m_frames[victim].dirty)
+            stats.dirty_writebacks++;
+        else
+            stats.clean_drops++;
+        kick(m_frames[victim].bid);
+
+        if (m_pool != nullptr) {
+            // Remember as many evicted bids as this cache could
+            // additionally hold if it got all the blocks it can
+            // (the bid of the frame is the one written to).
+            m_evicted_bids.push_front(m_frames[victim].bid);
+            while (m_evicted_bids.size() > max_num_blocks_in_cache - m_capacity)
+                m_evicted_bids.pop_back();
+        }
     }
 
     // Load data from a bid into memory.
-    // Return the in-memory block with the data.
-    block_type* load(const bid_type& bid) {
-        auto it = m_cache_map.find(bid);
-
-        // If not in cache ...
-        if (it == m_cache_map.end()) {
-            // If there are no free blocks, evict an item.
-            if (m_unused_blocks.empty())
-                evict();
-            assert(!m_unused_blocks.empty());
-
-            // Take unused block and load data into it.
-            block_type* new_block = m_unused_blocks.back();
-            m_unused_blocks.pop_back();
-            foxxll::request_ptr req = new_block->read(bid);
-
-            // Insert pair (bid, new_block) into cache list and map
-            m_cache_list.push_front(bid_block_pair_type(bid, new_block));
-            m_cache_map[bid] = m_cache_list.begin();
-
-            req->wait();
-            return new_block;
-
-        // If in cache ...
-        } else {
-            // Move to front as item was most recently used
-            m_cache_list.splice(m_cache_list.begin(), m_cache_list, it->second);
-            // Return the block that's in the cache list
-            return it->second->second;
+    // Return the in-memory block with the data. The block may
+    // be evicted by the next load (unless it is pinned).
+    block_type* load(const bid_type& bid, int tag = 0) {
+        int frame = load_frame(bid, tag);
+        unpin(frame);
+        return m_frames[frame].block;
+    }
+
+    // Load data from a bid into memory and keep it there
+    // until the returned pin is released or destroyed.
+    // At most capacity() - 1 blocks can be pinned at a time
+    // (loading needs a frame that can be evicted).
+    pinned_block pin(const bid_type& bid, int tag = 0) {
+        return pinned_block(this, load_frame(bid, tag));
+    }
+
+    // Load a block that was just allocated (and never written) into
+    // memory without reading it; its contents are undefined. The block
+    // is dirty, so that it is written when it is evicted. This does
+    // not count as a hit or miss.
+    block_type* load_new(const bid_type& bid, int tag = 0) {
+        int frame = load_new_frame(bid, tag);
+        unpin(frame);
+        return m_frames[frame].block;
+    }
+
+    // As load_new, but keep the block pinned (see pin()).
+    pinned_block pin_new(const bid_type& bid, int tag = 0) {
+        return pinned_block(this, load_new_frame(bid, tag));
+    }
+
+    // Start loading data from a bid into memory without
+    // waiting for it; the next load of the bid waits for
+    // the read instead. This can evict other items.
+    // As the bid is about to be used, prefetching a cached bid
+    // counts as a use for the replacement policy (and does not
+    // read). Prefetching when all blocks are pinned does nothing.
+    // A prefetched block that is evicted before it is loaded counts
+    // for the given tag (like the tag of a load).
+    void prefetch(const bid_type& bid, int tag = 0) {
+        int frame = m_cache_index.find(bid);
+        if (frame != cache_index_type::none) {
+            m_policy.access(frame);
+        } else if (can_get_unused_frame()) {
+            assert(tag >= 0);
+            if (tag >= static_cast<int>(m_stats.size()))
+                m_stats.resize(tag + 1);
+            frame = fetch(bid);
+            m_frames[frame].prefetched = true;
+            m_num_prefetched++;
+            m_frames[frame].tag = tag;
         }
     }
 
     void kick(const bid_type& bid) {
-        if (is_cached(bid)) {
-            cache_list_iterator_type list_it = m_cache_map.find(bid)->second;
-            assert(list_it != m_cache_list.end());
-            block_type* block = list_it->second;
+        int frame = m_cache_index.find(bid);
+        if (frame != cache_index_type::none) {
+            frame_type& f = m_frames[frame];
+            assert(f.pin_count == 0);
 
-            // If necessary, write to external memory.
-            if (m_dirty_bids.find(bid) != m_dirty_bids.end()) {
-                block->write(bid)->wait();
-                m_dirty_bids.erase(bid);
+            // A prefetched block can only be reused once it was read.
+            if (f.read_request.valid()) {
+                f.read_request->wait();
+                f.read_request = foxxll::request_ptr();
             }
+            end_prefetch(frame);
+
+            // A block with a virtual bid was never written (so it is
+            // dirty); it gets its disk block now. Note that this can
+            // change bid, so f.bid is used from here on.
+            if (is_virtual(f.bid))
+                allocate_block(frame);
+
             // Delete entry from cache.
-            m_cache_map.erase(bid);
-            // Add block back to unused blocks.
-            m_unused_blocks.push_back(block);
-            m_cache_list.erase(list_it);
+            m_policy.remove(frame, f.bid);
+            m_cache_index.erase(f.bid);
+
+            // If necessary, write to external memory.
+            if (f.dirty) {
+                // An older write by clean() must not overtake this one.
+                if (f.write_request.valid())
+                    f.write_request->wait();
+                f.write_request = m_io.write(f.block, f.bid);
+                f.dirty = false;
+                m_num_dirty--;
+            }
+            // Wait for the write (or the write by clean()).
+            if (f.write_request.valid()) {
+                if (max_num_pending_writes > 0) {
+                    // Write-behind: frame becomes unused once the write is done.
+                    m_pending_writes.push_front(m_pending_write_links, frame);
+                    if (m_pending_writes.size() > max_num_pending_writes)
+                        wait_for_oldest_pending_write();
+                    return;
+                }
+                f.write_request->wait();
+                f.write_request = foxxll::request_ptr();
+            }
+            // Add frame back to unused frames.
+            m_unused_frames.push_back(frame);
+        }
+    }
+
+    // Drop the block of bid (e.g. of a deleted node) without writing
+    // it and give its disk block back (a virtual bid has none). The
+    // block must not be pinned, and the bid must not be used again.
+    void discard(const bid_type& bid) {
+        int frame = m_cache_index.find(bid);
+        if (frame != cache_index_type::none) {
+            drop_frame(frame);
+        } else {
+            // The block may have been evicted but still be written.
+            frame = find_pending_write(bid);
+            if (frame != frame_list::none) {
+                m_frames[frame].write_request->wait();
+                finish_pending_write(frame);
+            }
         }
+        if (!is_virtual(bid))
+            m_io.delete_block(bid);
+    }
+
+    // Drop the block of bid without writing it, but keep the bid
+    // and its disk block (if any), e.g. while the block is kept
+    // outside of the cache; load_new puts it back. The block must
+    // not be pinned.
+    void drop(const bid_type& bid) {
+        int frame = m_cache_index.find(bid);
+        if (frame != cache_index_type::none)
+            drop_frame(frame);
+    }
+
+    // Statistics of the loads with the given tag.
+    fractal_tree_cache_stats stats(int tag) const {
+        return tag < static_cast<int>(m_stats.size()) ? m_stats[tag] : fractal_tree_cache_stats();
+    }
+
+    // Statistics of all loads.
+    fractal_tree_cache_stats stats() const {
+        fractal_tree_cache_stats total;
+        for (const fractal_tree_cache_stats& stats : m_stats)
+            total += stats;
+        return total;
+    }
+
+    // Number of tags used so far (all tags are below it).
+    int num_stats_tags() const {
+        return m_stats.size();
+    }
+
+    void reset_stats() {
+        for (fractal_tree_cache_stats& stats : m_stats)
+            stats = fractal_tree_cache_stats();
+        m_io.reset_stats();
+    }
+
+    // Compression statistics (all zero without a codec).
+    fractal_tree_codec_stats codec_stats() const {
+        return m_io.stats();
+    }
+
+    // Get a disk block for a new block (e.g. in the
+    // allocator of set_block_allocator).
+    template<typename AllocStr>
+    void new_block(const AllocStr& alloc_strategy, bid_type& bid) {
+        m_io.new_block(alloc_strategy, bid);
+    }
+
+    // Wait for all pending writes, making their frames unused.
+    void wait_for_pending_writes() {
+        while (!m_pending_writes.empty())
+            wait_for_oldest_pending_write();
     }
 
     int num_unused_blocks() const {
-        return m_unused_blocks.size();
+        return m_unused_frames.size();
+    }
+
+    int num_pending_writes() const {
+        return m_pending_writes.size();
+    }
+
+    // Number of blocks this cache currently holds.
+    int capacity() const {
+        return m_capacity;
     }
 
     int num_cached_blocks() const {
-        return m_cache_list.size();
+        return m_cache_index.size();
+    }
+
+    // Number of prefetched blocks that were not loaded yet.
+    int num_prefetched_blocks() const {
+        return m_num_prefetched;
     }
 
     bool is_cached(const bid_type& bid) const {
-        return m_cache_map.find(bid) != m_cache_map.end();
+        return m_cache_index.find(bid) != cache_index_type::none;
+    }
+
+    // The cached block of bid was changed and has to be
+    // written to external memory when it is evicted.
+    void mark_dirty(const bid_type& bid) {
+        int frame = m_cache_index.find(bid);
+        assert(frame != cache_index_type::none);
+        if (!m_frames[frame].dirty) {
+            m_frames[frame].dirty = true;
+            m_num_dirty++;
+        }
+    }
+
+    int num_dirty_blocks() const {
+        return m_num_dirty;
+    }
+
+    // Blocks can be loaded with load_new / pin_new under a virtual bid
+    // (one without storage, e.g. a default constructed one with a
+    // unique offset). When such a block is first written (as it is
+    // evicted or cleaned), allocate is called with the virtual bid
+    // and returns the bid of the block's new disk block, which
+    // replaces the virtual one in the cache.
+    void set_block_allocator(block_allocator_type allocate) {
+        m_allocate_block = std::move(allocate);
+    }
+
+    static bool is_virtual(const bid_type& bid) {
+        return bid.storage == nullptr;
+    }
+
+    // Enable clean() with the given ratios of dirty blocks
+    // (0 <= low <= high <= 1); high = 1 disables it (default).
+    void set_dirty_watermarks(double high, double low) {
+        assert(0 <= low && low <= high && high <= 1);
+        m_high_dirty_ratio = high;
+        m_low_dirty_ratio = low;
+    }
+
+    // If more than the high watermark of the blocks are dirty,
+    // start writing the coldest dirty blocks (in the order of their
+    // bids) until at most the low watermark are dirty. The blocks
+    // stay cached and are clean afterwards. This does not wait for
+    // the writes; they are waited for when a block is loaded or
+    // evicted again.
+    // Pinned blocks are not cleaned, as they may still be changed.
+    // Must not be called while an unpinned loaded block is being changed.
+    void clean() {
+        if (m_num_dirty <= m_high_dirty_ratio * m_capacity)
+            return;
+        int num_to_clean = m_num_dirty - static_cast<int>(m_low_dirty_ratio * m_capacity);
+        m_policy.find_coldest([this, num_to_clean](int frame)->bool {
+            const frame_type& f = m_frames[frame];
+            if (f.dirty && f.pin_count == 0 && !f.write_request.valid())
+                m_frames_to_clean.push_back(frame);
+            return static_cast<int>(m_frames_to_clean.size()) == num_to_clean;
+        });
+        for (int frame : m_frames_to_clean) {
+            if (is_virtual(m_frames[frame].bid))
+                allocate_block(frame);
+        }
+        std::sort(m_frames_to_clean.begin(), m_frames_to_clean.end(), [this](int frame1, int frame2)->bool {
+            const bid_type& bid1 = m_frames[frame1].bid;
+            const bid_type& bid2 = m_frames[frame2].bid;
+            return bid1.storage < bid2.storage || (bid1.storage == bid2.storage && bid1.offset < bid2.offset);
+        });
+        for (int frame : m_frames_to_clean) {
+            frame_type& f = m_frames[frame];
+            f.write_request = m_io.write(f.block, f.bid);
+            f.dirty = false;
+            m_num_dirty--;
+            m_stats[f.tag].cleaned++;
+        }
+        m_frames_to_clean.clear();
     }
 
     bool is_dirty(const bid_type& bid) const {
-        return m_dirty_bids.find(bid) != m_dirty_bids.end();
+        int frame = m_cache_index.find(bid);
+        return frame != cache_index_type::none && m_frames[frame].dirty;
+    }
+
+private:
+    void init_frames(int num_blocks) {
+        m_frames_to_clean.reserve(max_num_blocks_in_cache);
+        m_unused_frames.reserve(max_num_blocks_in_cache);
+        m_unallocated_frames.reserve(max_num_blocks_in_cache);
+        for (int frame = 0; frame < max_num_blocks_in_cache; frame++)
+            m_frames[frame].block = reinterpret_cast<block_type*>(m_arena.data() + frame * static_cast<size_t>(frame_size));
+        for (int frame = max_num_blocks_in_cache - 1; frame >= num_blocks; frame--)
+            m_unallocated_frames.push_back(frame);
+        for (int frame = num_blocks - 1; frame >= 0; frame--)
+            allocate_frame(frame);
+    }
+
+    // Make the frame unused (its block is set up on first use).
+    void allocate_frame(int frame) {
+        m_unused_frames.push_back(frame);
+        m_capacity++;
+    }
+
+    // Construct the block of the frame when it is first used.
+    void set_up_block(int frame) {
+        frame_type& f = m_frames[frame];
+        if (f.is_block_set_up)
+            return;
+        ::new (static_cast<void*>(f.block)) block_type;
+        // Valgrind warns that we're writing to uninitialized bytes
+        // when the struct we use inside the block_type does not
+        // fill a full block, so we explicitly set the whole region to
+        // 0 here to prevent this
+        // (this is the same as setting the FOXXLL_WITH_VALGRIND
+        // flag to true in typed_block.hpp).
+        // A mapped arena already reads as zeros.
+        if (!m_arena.is_zero_filled())
+            memset(f.block, 0, sizeof(block_type));
+        f.is_block_set_up = true;
+    }
+
+    // Give the memory of the block of the frame back.
+    void release_block(int frame) {
+        frame_type& f = m_frames[frame];
+        if (f.is_block_set_up) {
+            f.block->~block_type();
+            f.is_block_set_up = false;
+        }
+        m_arena.release(reinterpret_cast<char*>(f.block), frame_size);
+    }
+
+    // Move the capacity one block towards the target in the pool.
+    // Shrinking frees the block of an unused frame (evicting to get
+    // one if necessary) and gives the frame back to the pool.
+    void adjust_capacity() {
+        if (m_pool == nullptr)
+            return;
+        int target = m_pool->target(m_pool_id);
+        if (m_capacity < target && m_pool->take_frame(m_pool_id)) {
+            int frame = m_unallocated_frames.back();
+            m_unallocated_frames.pop_back();
+            allocate_frame(frame);
+        } else if (m_capacity > target && can_get_unused_frame()) {
+            int frame = get_unused_frame();
+            release_block(frame);
+            m_unallocated_frames.push_back(frame);
+            m_capacity--;
+            m_pool->return_frame(m_pool_id);
+        }
+    }
+
+    // Load the bid and return its frame, pinned.
+    int load_frame(const bid_type& bid, int tag) {
+        assert(tag >= 0);
+        if (tag >= static_cast<int>(m_stats.size()))
+            m_stats.resize(tag + 1);
+
+        int frame = m_cache_index.find(bid);
+        if (frame == cache_index_type::none) {
+            frame = fetch(bid);
+            m_stats[tag].misses++;
+        } else {
+            // The first load of a prefetched block is
+            // not a repeated use of the block.
+            if (!m_frames[frame].prefetched) {
+                m_policy.access(frame);
+                m_stats[tag].hits++;
+            } else {
+                m_stats[tag].misses++;
+            }
+        }
+        frame_type& f = m_frames[frame];
+        end_prefetch(frame);
+        f.tag = tag;
+        pin_frame(frame);
+        // Also adjust on hits: a cache that gives blocks to the
+        // other one might not miss at all.
+        adjust_capacity();
+
+        // Wait for the read (if the block was just
+        // fetched or was prefetched before).
+        if (f.read_request.valid()) {
+            f.read_request->wait();
+            f.read_request = foxxll::request_ptr();
+        }
+        // The block may be changed once it is loaded,
+        // so a write by clean() has to be done first.
+        if (f.write_request.valid()) {
+            f.write_request->wait();
+            f.write_request = foxxll::request_ptr();
+        }
+        return frame;
+    }
+
+    // Put the new bid into a frame without reading it
+    // and return the frame, pinned.
+    int load_new_frame(const bid_type& bid, int tag) {
+        assert(!is_cached(bid));
+        if (tag >= static_cast<int>(m_stats.size()))
+            m_stats.resize(tag + 1);
+
+        int frame = fetch(bid, false);
+        frame_type& f = m_frames[frame];
+        f.tag = tag;
+        f.dirty = true;
+        m_num_dirty++;
+        pin_frame(frame);
+        adjust_capacity();
+        return frame;
+    }
+
+    // Give the (dirty) block of the frame, which has a
+    // virtual bid, a disk block.
+    void allocate_block(int frame) {
+        frame_type& f = m_frames[frame];
+        assert(f.dirty && m_allocate_block);
+        m_cache_index.erase(f.bid);
+        f.bid = m_allocate_block(f.bid);
+        assert(!is_virtual(f.bid));
+        m_cache_index.insert(f.bid, frame);
+    }
+
+    // The prefetched block of the frame (if any) was loaded,
+    // evicted or dropped.
+    void end_prefetch(int frame) {
+        if (m_frames[frame].prefetched) {
+            m_frames[frame].prefetched = false;
+            m_num_prefetched--;
+        }
+    }
+
+    void pin_frame(int frame) {
+        if (m_frames[frame].pin_count++ == 0)
+            m_num_pinned_frames++;
+    }
+
+    void unpin(int frame) {
+        assert(m_frames[frame].pin_count > 0);
+        if (--m_frames[frame].pin_count == 0)
+            m_num_pinned_frames--;
+    }
+
+    // Whether get_unused_frame() can succeed.
+    bool can_get_unused_frame() const {
+        return !m_unused_frames.empty() || !m_pending_writes.empty()
+               || m_num_pinned_frames < m_cache_index.size();
+    }
+
+    // Put the bid (which is not cached) into a frame.
+    // If necessary (and read is set), issue a read,
+    // but do not wait for it.
+    int fetch(const bid_type& bid, bool read = true) {
+        m_policy.miss(bid);
+        if (m_pool != nullptr && m_evicted_bids.erase(bid))
+            m_pool->ghost_hit(m_pool_id);
+
+        // If the block was evicted but its write is still in
+        // flight, the in-memory block holds the latest data ->
+        // take it back instead of reading from external memory.
+        int frame = find_pending_write(bid);
+        if (frame != frame_list::none) {
+            frame_type& f = m_frames[frame];
+            f.write_request->wait();
+            f.write_request = foxxll::request_ptr();
+            m_pending_writes.erase(m_pending_write_links, frame);
+        } else {
+            // Take unused frame and load data into it.
+            adjust_capacity();
+            frame = get_unused_frame();
+            set_up_block(frame);
+            m_frames[frame].bid = bid;
+            assert(!read || !is_virtual(bid));
+            if (read)
+                m_frames[frame].read_request = m_io.read(m_frames[frame].block, bid);
+        }
+        m_cache_index.insert(bid, frame);
+        m_policy.insert(frame, bid);
+        return frame;
+    }
+
+    // Return a frame that can be used to load new data into.
+    // Prefers frames whose pending writes have already completed
+    // over evicting, and only waits for a write if evicting did
+    // not free a frame (i.e. the evicted block was dirty).
+    int get_unused_frame() {
+        reclaim_completed_writes();
+        if (m_unused_frames.empty() && m_num_pinned_frames < m_cache_index.size())
+            evict();
+        if (m_unused_frames.empty())
+            wait_for_oldest_pending_write();
+        assert(!m_unused_frames.empty());
+
+        int frame = m_unused_frames.back();
+        m_unused_frames.pop_back();
+        return frame;
+    }
+
+    // Make the frames of all completed pending writes unused.
+    void reclaim_completed_writes() {
+        int frame = m_pending_writes.back();
+        while (frame != frame_list::none) {
+            int newer_frame = m_pending_write_links.prev[frame];
+            if (m_frames[frame].write_request->poll())
+                finish_pending_write(frame);
+            frame = newer_frame;
+        }
+    }
+
+    void wait_for_oldest_pending_write() {
+        assert(!m_pending_writes.empty());
+        int oldest = m_pending_writes.back();
+        m_frames[oldest].write_request->wait();
+        finish_pending_write(oldest);
+    }
+
+    // Make the frame of a cached block unused without writing it.
+    void drop_frame(int frame) {
+        frame_type& f = m_frames[frame];
+        assert(f.pin_count == 0);
+        // The frame (and the disk block) can only
+        // be reused once no request uses it.
+        if (f.read_request.valid()) {
+            f.read_request->wait();
+            f.read_request = foxxll::request_ptr();
+        }
+        if (f.write_request.valid()) {
+            f.write_request->wait();
+            f.write_request = foxxll::request_ptr();
+        }
+        end_prefetch(frame);
+        m_policy.remove(frame, f.bid);
+        m_cache_index.erase(f.bid);
+        if (f.dirty) {
+            f.dirty = false;
+            m_num_dirty--;
+        }
+        m_unused_frames.push_back(frame);
+    }
+
+    void finish_pending_write(int frame) {
+        m_frames[frame].write_request = foxxll::request_ptr();
+        m_pending_writes.erase(m_pending_write_links, frame);
+        m_unused_frames.push_back(frame);
+    }
+
+    // There are at most max_num_pending_writes pending writes,
+    // so a linear search is fine here.
+    int find_pending_write(const bid_type& bid) const {
+        return m_pending_writes.find_from_back(m_pending_write_links,
+                                               [this, &bid](int frame)->bool { return m_frames[frame].bid == bid; });
     }
 
 };
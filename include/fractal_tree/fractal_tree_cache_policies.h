@@ -0,0 +1,535 @@
+/*
+ * fractal_tree_cache_policies.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_CACHE_POLICIES_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_CACHE_POLICIES_H
+
+#include <vector>
+#include <cassert>
+#include <algorithm>
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+/*
+ * Replacement policies for the fractal_tree_cache.
+ *
+ * The cache stores blocks in frames 0, ..., NumFrames-1, and tells
+ * the policy about every change:
+ *  - miss(bid):          bid is requested but not cached. Called
+ *                        before a victim is chosen for it.
+ *  - insert(frame, bid): bid is now cached in frame.
+ *  - access(frame):      the bid cached in frame was used again.
+ *  - remove(frame, bid): bid is no longer cached in frame.
+ *  - victim(is_evictable):
+ *                        return the frame to evict next, among
+ *                        the frames for which is_evictable(frame)
+ *                        is true (or -1 if there is none).
+ *  - find_coldest(predicate):
+ *                        walk the cached frames from the one that
+ *                        would be evicted next towards the most
+ *                        valuable one, and return the first frame for
+ *                        which predicate(frame) is true (or -1).
+ *
+ * Policies that keep a history of evicted bids ("ghosts") use it to
+ * tell blocks that are used repeatedly from blocks that are only
+ * used once (e.g. by a range_find), so that a scan does not evict the
+ * frequently used blocks.
+ *
+ * All bookkeeping is sized when a policy is constructed; the calls
+ * above do not allocate memory.
+ */
+
+// Links between frames for the frame_lists of a policy.
+struct frame_links {
+    std::vector<int> prev;
+    std::vector<int> next;
+
+    explicit frame_links(unsigned num_frames) : prev(num_frames), next(num_frames) { }
+};
+
+// Intrusive doubly-linked list of frames, using the links of its policy.
+// A frame can be in at most one list of a policy; front is the most
+// recently inserted frame.
+class frame_list {
+public:
+    static constexpr int none = -1;
+
+private:
+    int m_front = none;
+    int m_back = none;
+    int m_size = 0;
+
+public:
+    void push_front(frame_links& links, int frame) {
+        links.prev[frame] = none;
+        links.next[frame] = m_front;
+        if (m_front != none)
+            links.prev[m_front] = frame;
+        else
+            m_back = frame;
+        m_front = frame;
+        m_size++;
+    }
+
+    void erase(frame_links& links, int frame) {
+        if (links.prev[frame] != none)
+            links.next[links.prev[frame]] = links.next[frame];
+        else
+            m_front = links.next[frame];
+        if (links.next[frame] != none)
+            links.prev[links.next[frame]] = links.prev[frame];
+        else
+            m_back = links.prev[frame];
+        m_size--;
+    }
+
+    void move_to_front(frame_links& links, int frame) {
+        erase(links, frame);
+        push_front(links, frame);
+    }
+
+    int front() const {
+        return m_front;
+    }
+
+    int back() const {
+        return m_back;
+    }
+
+    // Return the frame closest to the back for which
+    // predicate(frame) is true, or none.
+    template <typename Predicate>
+    int find_from_back(const frame_links& links, const Predicate& predicate) const {
+        for (int frame = m_back; frame != none; frame = links.prev[frame]) {
+            if (predicate(frame))
+                return frame;
+        }
+        return none;
+    }
+
+    int size() const {
+        return m_size;
+    }
+
+    bool empty() const {
+        return m_size == 0;
+    }
+};
+
+// Map from bids to non-negative ints (e.g. frames) with room for up
+// to max_num_entries entries, using open addressing with linear
+// probing in a table of at least twice that size.
+template <typename BidType, typename BidHash>
+class bid_index {
+    using bid_type = BidType;
+
+public:
+    enum { none = -1 };
+
+private:
+    std::vector<bid_type> m_bids;
+    // none for empty slots.
+    std::vector<int> m_values;
+    size_t m_mask;
+    int m_size = 0;
+    BidHash m_hash;
+
+    static size_t table_size(unsigned max_num_entries) {
+        size_t size = 2;
+        while (size < 2 * static_cast<size_t>(max_num_entries))
+            size *= 2;
+        return size;
+    }
+
+    size_t home_slot(const bid_type& bid) const {
+        return m_hash(bid) & m_mask;
+    }
+
+    size_t find_slot(const bid_type& bid) const {
+        size_t slot = home_slot(bid);
+        while (m_values[slot] != none && !(m_bids[slot] == bid))
+            slot = (slot + 1) & m_mask;
+        return slot;
+    }
+
+public:
+    explicit bid_index(unsigned max_num_entries) :
+        m_bids(table_size(max_num_entries)),
+        m_values(table_size(max_num_entries), none),
+        m_mask(table_size(max_num_entries) - 1) { }
+
+    // Return the value of bid, or none.
+    int find(const bid_type& bid) const {
+        return m_values[find_slot(bid)];
+    }
+
+    // bid must not be in the index yet.
+    void insert(const bid_type& bid, int value) {
+        assert(value != none && 2 * (m_size + 1) <= static_cast<int>(m_values.size()));
+        size_t slot = find_slot(bid);
+        assert(m_values[slot] == none);
+        m_bids[slot] = bid;
+        m_values[slot] = value;
+        m_size++;
+    }
+
+    bool erase(const bid_type& bid) {
+        size_t hole = find_slot(bid);
+        if (m_values[hole] == none)
+            return false;
+        // Move entries after the hole back into it, as long as
+        // that keeps them reachable from their home slot (so no
+        // tombstones are needed).
+        for (size_t slot = (hole + 1) & m_mask; m_values[slot] != none; slot = (slot + 1) & m_mask) {
+            size_t distance_from_home = (slot - home_slot(m_bids[slot])) & m_mask;
+            size_t distance_from_hole = (slot - hole) & m_mask;
+            if (distance_from_home >= distance_from_hole) {
+                m_bids[hole] = m_bids[slot];
+                m_values[hole] = m_values[slot];
+                hole = slot;
+            }
+        }
+        m_values[hole] = none;
+        m_size--;
+        return true;
+    }
+
+    int size() const {
+        return m_size;
+    }
+};
+
+// List of up to capacity bids of evicted blocks; front is the most
+// recently evicted bid.
+template <typename BidType, typename BidHash>
+class ghost_list {
+    using bid_type = BidType;
+
+    // Each bid is stored in a slot; slots are linked like frames.
+    std::vector<bid_type> m_bids;
+    frame_links m_links;
+    frame_list m_list;
+    std::vector<int> m_unused_slots;
+    bid_index<bid_type, BidHash> m_bid_to_slot;
+
+public:
+    explicit ghost_list(unsigned capacity) :
+        m_bids(capacity), m_links(capacity), m_bid_to_slot(capacity) {
+        m_unused_slots.reserve(capacity);
+        for (int slot = capacity - 1; slot >= 0; slot--)
+            m_unused_slots.push_back(slot);
+    }
+
+    void push_front(const bid_type& bid) {
+        assert(!m_unused_slots.empty());
+        int slot = m_unused_slots.back();
+        m_unused_slots.pop_back();
+        m_bids[slot] = bid;
+        m_list.push_front(m_links, slot);
+        m_bid_to_slot.insert(bid, slot);
+    }
+
+    bool erase(const bid_type& bid) {
+        int slot = m_bid_to_slot.find(bid);
+        if (slot == bid_index<bid_type, BidHash>::none)
+            return false;
+        m_bid_to_slot.erase(bid);
+        m_list.erase(m_links, slot);
+        m_unused_slots.push_back(slot);
+        return true;
+    }
+
+    void pop_back() {
+        assert(!m_list.empty());
+        erase(m_bids[m_list.back()]);
+    }
+
+    bool contains(const bid_type& bid) const {
+        return m_bid_to_slot.find(bid) != bid_index<bid_type, BidHash>::none;
+    }
+
+    int size() const {
+        return m_list.size();
+    }
+};
+
+// Least recently used.
+template <typename BidType, typename BidHash, unsigned NumFrames>
+class lru_policy {
+    using bid_type = BidType;
+
+    frame_links m_links = frame_links(NumFrames);
+    frame_list m_lru_list;
+
+public:
+    void miss(const bid_type&) { }
+
+    void insert(int frame, const bid_type&) {
+        m_lru_list.push_front(m_links, frame);
+    }
+
+    void access(int frame) {
+        m_lru_list.move_to_front(m_links, frame);
+    }
+
+    void remove(int frame, const bid_type&) {
+        m_lru_list.erase(m_links, frame);
+    }
+
+    template <typename IsEvictable>
+    int victim(const IsEvictable& is_evictable) {
+        return m_lru_list.find_from_back(m_links, is_evictable);
+    }
+
+    template <typename Predicate>
+    int find_coldest(const Predicate& predicate) const {
+        return m_lru_list.find_from_back(m_links, predicate);
+    }
+};
+
+// CLOCK (second chance): frames are arranged in a circle. A used frame
+// gets its reference bit set; the clock hand evicts the first frame
+// without reference bit, clearing the bits of the frames it passes.
+template <typename BidType, typename BidHash, unsigned NumFrames>
+class clock_policy {
+    using bid_type = BidType;
+
+    std::vector<bool> m_cached = std::vector<bool>(NumFrames, false);
+    std::vector<bool> m_referenced = std::vector<bool>(NumFrames, false);
+    int m_hand = 0;
+
+public:
+    void miss(const bid_type&) { }
+
+    void insert(int frame, const bid_type&) {
+        m_cached[frame] = true;
+        m_referenced[frame] = true;
+    }
+
+    void access(int frame) {
+        m_referenced[frame] = true;
+    }
+
+    void remove(int frame, const bid_type&) {
+        m_cached[frame] = false;
+        m_referenced[frame] = false;
+    }
+
+    template <typename IsEvictable>
+    int victim(const IsEvictable& is_evictable) {
+        // If there is an evictable frame, it is found after
+        // at most two rounds, as the first round clears all
+        // reference bits.
+        for (unsigned i = 0; i < 2 * NumFrames; i++) {
+            int frame = m_hand;
+            m_hand = (m_hand + 1) % NumFrames;
+            if (!m_cached[frame] || !is_evictable(frame))
+                continue;
+            if (!m_referenced[frame])
+                return frame;
+            m_referenced[frame] = false;
+        }
+        return frame_list::none;
+    }
+
+    template <typename Predicate>
+    int find_coldest(const Predicate& predicate) const {
+        // Unreferenced frames first, in the order of the hand.
+        for (bool referenced : { false, true }) {
+            for (unsigned i = 0; i < NumFrames; i++) {
+                int frame = (m_hand + i) % NumFrames;
+                if (m_cached[frame] && m_referenced[frame] == referenced && predicate(frame))
+                    return frame;
+            }
+        }
+        return frame_list::none;
+    }
+};
+
+// 2Q (Johnson & Shasha, VLDB '94). Blocks used for the first time
+// go to the FIFO queue a1_in. When they are evicted from there, their
+// bids are remembered in the ghost queue a1_out. Only blocks that are
+// used again while in a1_out go to the LRU list am; blocks that are
+// only used once (scans) never displace blocks in am.
+template <typename BidType, typename BidHash, unsigned NumFrames>
+class two_queue_policy {
+    using bid_type = BidType;
+
+    enum {
+        // Tuning recommended in the paper.
+        max_size_a1_in = NumFrames / 4 > 0 ? NumFrames / 4 : 1,
+        max_size_a1_out = NumFrames / 2 > 0 ? NumFrames / 2 : 1
+    };
+
+    frame_links m_links = frame_links(NumFrames);
+    std::vector<bool> m_in_am = std::vector<bool>(NumFrames, false);
+    frame_list m_a1_in;
+    frame_list m_am;
+    ghost_list<bid_type, BidHash> m_a1_out = ghost_list<bid_type, BidHash>(max_size_a1_out + 1);
+
+    // Whether the bid of the current miss was in a1_out.
+    bool m_miss_in_a1_out = false;
+
+public:
+    void miss(const bid_type& bid) {
+        m_miss_in_a1_out = m_a1_out.erase(bid);
+    }
+
+    void insert(int frame, const bid_type&) {
+        m_in_am[frame] = m_miss_in_a1_out;
+        if (m_miss_in_a1_out)
+            m_am.push_front(m_links, frame);
+        else
+            m_a1_in.push_front(m_links, frame);
+        m_miss_in_a1_out = false;
+    }
+
+    void access(int frame) {
+        // Blocks in a1_in stay where they are (a "correlated"
+        // reference shortly after the first one does not count).
+        if (m_in_am[frame])
+            m_am.move_to_front(m_links, frame);
+    }
+
+    void remove(int frame, const bid_type& bid) {
+        if (m_in_am[frame]) {
+            m_am.erase(m_links, frame);
+            m_in_am[frame] = false;
+        } else {
+            m_a1_in.erase(m_links, frame);
+            m_a1_out.push_front(bid);
+            if (m_a1_out.size() > max_size_a1_out)
+                m_a1_out.pop_back();
+        }
+    }
+
+    template <typename IsEvictable>
+    int victim(const IsEvictable& is_evictable) {
+        bool evict_from_a1_in = m_a1_in.size() > max_size_a1_in || m_am.empty();
+        frame_list& first = evict_from_a1_in ? m_a1_in : m_am;
+        frame_list& second = evict_from_a1_in ? m_am : m_a1_in;
+        int frame = first.find_from_back(m_links, is_evictable);
+        return frame != frame_list::none ? frame : second.find_from_back(m_links, is_evictable);
+    }
+
+    template <typename Predicate>
+    int find_coldest(const Predicate& predicate) const {
+        int frame = m_a1_in.find_from_back(m_links, predicate);
+        return frame != frame_list::none ? frame : m_am.find_from_back(m_links, predicate);
+    }
+};
+
+// ARC (Megiddo & Modha, FAST '03). t1 holds blocks used once recently,
+// t2 blocks used again; the ghost lists b1 and b2 remember the bids
+// recently evicted from t1 and t2. A miss on a ghost moves the target
+// size p of t1 towards the list that would have had a hit, so the
+// split between recency and frequency adapts to the workload.
+// Unlike in the paper, a hit in t1 does not move a block to t2: the
+// tree uses the blocks of a scan several times in a row (a range_find
+// flushes into a leaf and then reads it), which would make every
+// scanned block frequent. As in 2Q, blocks only go to t2 when they
+// are used again after their eviction (a miss on a ghost), so that
+// scans do not displace the blocks in t2.
+template <typename BidType, typename BidHash, unsigned NumFrames>
+class arc_policy {
+    using bid_type = BidType;
+
+    frame_links m_links = frame_links(NumFrames);
+    std::vector<bool> m_in_t2 = std::vector<bool>(NumFrames, false);
+    frame_list m_t1;
+    frame_list m_t2;
+    // |b1| <= c and |t1| + |t2| + |b1| + |b2| <= 2c.
+    ghost_list<bid_type, BidHash> m_b1 = ghost_list<bid_type, BidHash>(NumFrames);
+    ghost_list<bid_type, BidHash> m_b2 = ghost_list<bid_type, BidHash>(2 * NumFrames);
+
+    // Target size of t1.
+    int m_p = 0;
+    // Where the bid of the current miss was found.
+    bool m_miss_in_b1 = false;
+    bool m_miss_in_b2 = false;
+
+public:
+    void miss(const bid_type& bid) {
+        m_miss_in_b1 = m_b1.contains(bid);
+        m_miss_in_b2 = m_b2.contains(bid);
+        if (m_miss_in_b1) {
+            int delta = std::max(m_b2.size() / std::max(m_b1.size(), 1), 1);
+            m_p = std::min(m_p + delta, static_cast<int>(NumFrames));
+            m_b1.erase(bid);
+        } else if (m_miss_in_b2) {
+            int delta = std::max(m_b1.size() / std::max(m_b2.size(), 1), 1);
+            m_p = std::max(m_p - delta, 0);
+            m_b2.erase(bid);
+        }
+    }
+
+    void insert(int frame, const bid_type&) {
+        bool seen_before = m_miss_in_b1 || m_miss_in_b2;
+        m_in_t2[frame] = seen_before;
+        if (seen_before)
+            m_t2.push_front(m_links, frame);
+        else
+            m_t1.push_front(m_links, frame);
+        m_miss_in_b1 = m_miss_in_b2 = false;
+
+        // Bound the history: |t1| + |t2| + |b1| + |b2| <= 2c (|b1| <= c
+        // is kept by remove). The paper bounds |t1| + |b1| by c, which
+        // leaves no ghosts while scanned blocks fill t1; here, b1 is the
+        // only way into t2.
+        while (m_t1.size() + m_t2.size() + m_b1.size() + m_b2.size() > 2 * static_cast<int>(NumFrames)) {
+            if (m_b2.size() > 0)
+                m_b2.pop_back();
+            else
+                m_b1.pop_back();
+        }
+    }
+
+    void access(int frame) {
+        if (m_in_t2[frame])
+            m_t2.move_to_front(m_links, frame);
+        else
+            m_t1.move_to_front(m_links, frame);
+    }
+
+    void remove(int frame, const bid_type& bid) {
+        if (m_in_t2[frame]) {
+            m_t2.erase(m_links, frame);
+            if (m_b2.size() == 2 * static_cast<int>(NumFrames))
+                m_b2.pop_back();
+            m_b2.push_front(bid);
+            m_in_t2[frame] = false;
+        } else {
+            m_t1.erase(m_links, frame);
+            if (m_b1.size() == static_cast<int>(NumFrames))
+                m_b1.pop_back();
+            m_b1.push_front(bid);
+        }
+    }
+
+    template <typename IsEvictable>
+    int victim(const IsEvictable& is_evictable) {
+        bool evict_from_t1 = !m_t1.empty() &&
+                             (m_t1.size() > m_p || (m_miss_in_b2 && m_t1.size() == m_p) || m_t2.empty());
+        frame_list& first = evict_from_t1 ? m_t1 : m_t2;
+        frame_list& second = evict_from_t1 ? m_t2 : m_t1;
+        int frame = first.find_from_back(m_links, is_evictable);
+        return frame != frame_list::none ? frame : second.find_from_back(m_links, is_evictable);
+    }
+
+    template <typename Predicate>
+    int find_coldest(const Predicate& predicate) const {
+        int frame = m_t1.find_from_back(m_links, predicate);
+        return frame != frame_list::none ? frame : m_t2.find_from_back(m_links, predicate);
+    }
+};
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_CACHE_POLICIES_H
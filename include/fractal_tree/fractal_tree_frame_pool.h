@@ -0,0 +1,138 @@
+/*
+ * fractal_tree_frame_pool.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_FRAME_POOL_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_FRAME_POOL_H
+
+#include <cassert>
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+/*
+ * Memory budget (in frames, i.e. blocks) shared by two caches,
+ * e.g. the node cache and the leaf cache of a fractal tree.
+ *
+ * The budget is counted in units; a frame of a cache takes
+ * frame_size units (1 if both caches have blocks of the same size,
+ * else e.g. the size of its blocks divided by that of the smaller
+ * ones). The targets below are kept in units, too.
+ *
+ * Each cache has a target number of frames. A cache that misses
+ * on a bid it evicted recently (a "ghost hit") would have kept the
+ * bid with more frames, so it takes one frame of the target of the
+ * other cache (as long as that one stays above its minimum).
+ *
+ * The pool only keeps the books; the caches themselves allocate or
+ * free their blocks and move towards their target when they need a
+ * frame (see fractal_tree_cache).
+ *
+ * Frames can also be reserved for blocks outside the caches (e.g.
+ * pinned nodes). A reserved frame comes out of the target of the
+ * cache with more frames to spare; until that cache has shrunk, the
+ * pool is overdrawn (num_free_frames() < 0).
+ */
+class fractal_tree_frame_pool {
+public:
+    enum { max_num_caches = 2 };
+
+private:
+    // All in units.
+    int m_num_free_units;
+    int m_num_caches = 0;
+    int m_frame_sizes[max_num_caches] = { 1, 1 };
+    int m_targets[max_num_caches] = { 0, 0 };
+    int m_min_num_units[max_num_caches] = { 0, 0 };
+
+public:
+    explicit fractal_tree_frame_pool(int num_units) : m_num_free_units(num_units) { }
+
+    //! non-copyable: caches keep a reference to their pool
+    fractal_tree_frame_pool(const fractal_tree_frame_pool&) = delete;
+    fractal_tree_frame_pool& operator = (const fractal_tree_frame_pool&) = delete;
+
+    // Register a cache that starts out with num_frames frames
+    // (taken from the pool) of frame_size units each, and never
+    // goes below min_num_frames. Return the id of the cache.
+    int add_cache(int num_frames, int min_num_frames, int frame_size = 1) {
+        assert(m_num_caches < max_num_caches);
+        assert(min_num_frames <= num_frames && num_frames * frame_size <= m_num_free_units);
+        m_num_free_units -= num_frames * frame_size;
+        m_frame_sizes[m_num_caches] = frame_size;
+        m_targets[m_num_caches] = num_frames * frame_size;
+        m_min_num_units[m_num_caches] = min_num_frames * frame_size;
+        return m_num_caches++;
+    }
+
+    void ghost_hit(int cache_id) {
+        if (m_num_caches < max_num_caches)
+            return;
+        int other_id = 1 - cache_id;
+        int frame_size = m_frame_sizes[cache_id];
+        if (m_targets[other_id] - frame_size >= m_min_num_units[other_id]) {
+            m_targets[other_id] -= frame_size;
+            m_targets[cache_id] += frame_size;
+        }
+    }
+
+    // Target of the cache in frames (the units of its target
+    // that do not make up a whole frame are not used).
+    int target(int cache_id) const {
+        return m_targets[cache_id] / m_frame_sizes[cache_id];
+    }
+
+    // Take a free frame for the cache (freed by the other
+    // cache) if there is one.
+    bool take_frame(int cache_id) {
+        if (m_num_free_units < m_frame_sizes[cache_id])
+            return false;
+        m_num_free_units -= m_frame_sizes[cache_id];
+        return true;
+    }
+
+    void return_frame(int cache_id) {
+        m_num_free_units += m_frame_sizes[cache_id];
+    }
+
+    // Reserve frame_size units out of the target of the cache with
+    // the most units to spare; return whether that was possible.
+    bool reserve_frame(int frame_size = 1) {
+        int cache_id = -1;
+        int max_num_spare_units = frame_size - 1;
+        for (int id = 0; id < m_num_caches; id++) {
+            int num_spare_units = m_targets[id] - m_min_num_units[id];
+            if (num_spare_units > max_num_spare_units) {
+                cache_id = id;
+                max_num_spare_units = num_spare_units;
+            }
+        }
+        if (cache_id < 0)
+            return false;
+        m_targets[cache_id] -= frame_size;
+        m_num_free_units -= frame_size;
+        return true;
+    }
+
+    // Give reserved units to the cache with the smaller target.
+    void release_frame(int frame_size = 1) {
+        assert(m_num_caches > 0);
+        int cache_id = (m_num_caches == max_num_caches && m_targets[1] < m_targets[0]) ? 1 : 0;
+        m_targets[cache_id] += frame_size;
+        m_num_free_units += frame_size;
+    }
+
+    // In units (which are frames if all frames have size 1).
+    int num_free_frames() const {
+        return m_num_free_units;
+    }
+};
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_FRAME_POOL_H
@@ -0,0 +1,327 @@
+/*
+ * fractal_tree_root_log.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_ROOT_LOG_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_ROOT_LOG_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "key_search.h"
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+namespace detail {
+
+// Keys that the index of the root log hashes with std::hash.
+template<typename KeyType>
+using is_hashed_key = std::integral_constant<bool,
+    std::is_arithmetic<KeyType>::value || std::is_same<KeyType, std::string>::value>;
+
+// Hash of a key for the index of the root log. Keys other than
+// integers, floating point numbers and strings all hash to 0, so the
+// index degrades to a linear scan for them (which is still correct).
+template<typename KeyType>
+inline size_t root_log_hash(const KeyType& key, std::true_type /* is_hashed_key */) {
+    return std::hash<KeyType>()(key);
+}
+
+template<typename KeyType>
+inline size_t root_log_hash(const KeyType&, std::false_type /* is_hashed_key */) {
+    return 0;
+}
+
+// Integer keys (but bool) are radix sorted.
+template<typename KeyType>
+using is_radix_sortable = std::integral_constant<bool,
+    std::is_integral<KeyType>::value && !std::is_same<KeyType, bool>::value>;
+
+// Sort items by key with an LSD radix sort over the bytes of the
+// keys (with the sign bit flipped, so that negative keys come
+// first). Passes where all keys have the same byte are skipped.
+template<typename ValueType>
+void radix_sort_by_key(std::vector<ValueType>& items, std::vector<ValueType>& buffer) {
+    using key_type = typename ValueType::first_type;
+    using unsigned_key_type = typename std::make_unsigned<key_type>::type;
+    constexpr int num_passes = sizeof(key_type);
+    constexpr unsigned_key_type sign_bit = std::is_signed<key_type>::value
+        ? unsigned_key_type(1) << (8 * sizeof(key_type) - 1) : 0;
+    auto digit = [](const ValueType& item, int pass) -> size_t {
+        unsigned_key_type key = static_cast<unsigned_key_type>(item.first) ^ sign_bit;
+        return (key >> (8 * pass)) & 0xff;
+    };
+
+    std::array<std::array<size_t, 256>, num_passes> counts {};
+    for (const ValueType& item : items) {
+        for (int pass = 0; pass < num_passes; pass++)
+            counts[pass][digit(item, pass)]++;
+    }
+
+    buffer.resize(items.size());
+    for (int pass = 0; pass < num_passes; pass++) {
+        std::array<size_t, 256>& pass_counts = counts[pass];
+        if (pass_counts[digit(items[0], pass)] == items.size())
+            continue;
+        // Counts -> first index of each digit.
+        size_t index = 0;
+        for (size_t& count : pass_counts) {
+            size_t num_items_with_digit = count;
+            count = index;
+            index += num_items_with_digit;
+        }
+        for (const ValueType& item : items)
+            buffer[pass_counts[digit(item, pass)]++] = item;
+        items.swap(buffer);
+    }
+}
+
+template<typename ValueType>
+void sort_by_key(std::vector<ValueType>& items, std::vector<ValueType>& buffer, std::true_type /* is_radix_sortable */) {
+    radix_sort_by_key(items, buffer);
+}
+
+template<typename ValueType>
+void sort_by_key(std::vector<ValueType>& items, std::vector<ValueType>&, std::false_type /* is_radix_sortable */) {
+    std::sort(items.begin(), items.end(),
+              [](const ValueType& val1, const ValueType& val2)->bool { return val1.first < val2.first; });
+}
+
+// Every item takes one unit of space (as in the buffers of node).
+struct unit_item_size {
+    template<typename ValueType>
+    int operator () (const ValueType&) const { return 1; }
+};
+
+}
+
+/*
+ * Staging area for the items inserted into the root buffer of a
+ * fractal tree. Inserting into the (sorted) root buffer directly
+ * takes O(B) work per item; the log instead appends the items
+ * unsorted, and the tree merges them into the root buffer in one
+ * go (sorted by sorted_items) when it needs the buffer.
+ *
+ * The log holds at most one item per key: appending an item with a
+ * key that is already in the log replaces that item's datum. A hash
+ * index (open addressing, at most half full) finds the item of a
+ * key, both for that and for point lookups. Erasing a key replaces
+ * its item by a tombstone, and an upsert is combined with the item of
+ * its key (see message_flags); the tree adds the tombstones and then
+ * the upserts to the root buffer after the items (see
+ * sorted_erased_keys and sorted_upserts).
+ *
+ * space() is the space that the items take in the root buffer, in
+ * the unit of ItemSize (the node's item_size: items, or bytes for
+ * slotted nodes).
+ */
+template<typename KeyType, typename DataType, int Capacity, typename ItemSize = detail::unit_item_size,
+         typename Combine = no_upsert>
+class fractal_tree_root_log {
+public:
+    using key_type = KeyType;
+    using data_type = DataType;
+    using value_type = std::pair<key_type, data_type>;
+
+private:
+    static constexpr int index_size_for(int capacity, int size = 1) {
+        return size >= 2 * capacity ? size : index_size_for(capacity, 2 * size);
+    }
+    static constexpr int log2(int size) {
+        return size <= 1 ? 0 : 1 + log2(size / 2);
+    }
+
+    enum {
+        index_size = index_size_for(Capacity),
+        index_bits = log2(index_size)
+    };
+
+    std::vector<value_type> m_items;
+    // Type of the item with the same index (tombstones
+    // have data_type() as their datum).
+    std::vector<message_type> m_messages;
+    int m_num_erased = 0;
+    int m_num_upserts = 0;
+    // Keys of the tombstones and the upserts (see sorted_items).
+    std::vector<key_type> m_erased_keys;
+    std::vector<value_type> m_upserts;
+    int m_space = 0;
+    // Slot -> index of item + 1 (0: empty).
+    std::vector<int> m_index = std::vector<int>(index_size, 0);
+    // Scratch space for sorting.
+    std::vector<value_type> m_sort_buffer;
+
+public:
+    fractal_tree_root_log() {
+        m_items.reserve(Capacity);
+        m_messages.reserve(Capacity);
+    }
+
+    int size() const {
+        return m_items.size();
+    }
+
+    bool empty() const {
+        return m_items.empty();
+    }
+
+    bool full() const {
+        return m_items.size() == Capacity;
+    }
+
+    int space() const {
+        return m_space;
+    }
+
+    // Add the item, or replace the datum of the item (or
+    // the tombstone) with the same key if there is one.
+    void append(const value_type& value) {
+        set(value, message_type::insert);
+    }
+
+    // Add a tombstone for the key, replacing the
+    // item with the key if there is one.
+    void erase(const key_type& key) {
+        set(value_type(key, data_type()), message_type::erase);
+    }
+
+    // Add an upsert with the delta value.second, or combine
+    // it with the item with the key if there is one.
+    void upsert(const value_type& value) {
+        set(value, message_type::upsert);
+    }
+
+    // Same as node::buffer_find.
+    std::pair<data_type, bool> find(const key_type& key) const {
+        bool erased;
+        return find(key, erased);
+    }
+
+    // Same as node::buffer_find with erased.
+    std::pair<data_type, bool> find(const key_type& key, bool& erased) const {
+        message_type message;
+        std::pair<data_type, bool> datum_and_found = find_message(key, message);
+        erased = datum_and_found.second && message == message_type::erase;
+        if (datum_and_found.second && message != message_type::insert)
+            return std::pair<data_type, bool>(data_type(), false);
+        return datum_and_found;
+    }
+
+    // Same as node::buffer_find_message.
+    std::pair<data_type, bool> find_message(const key_type& key, message_type& message) const {
+        message = message_type::insert;
+        if (empty())
+            return std::pair<data_type, bool>(data_type(), false);
+        int slot = find_slot(key);
+        if (m_index[slot] == 0)
+            return std::pair<data_type, bool>(data_type(), false);
+        message = m_messages[m_index[slot] - 1];
+        return std::pair<data_type, bool>(m_items[m_index[slot] - 1].second, true);
+    }
+
+    // Sort the inserted items (without the tombstones and upserts) by
+    // key and return them (e.g. to add them to the root buffer). The
+    // index is invalid until clear().
+    std::vector<value_type>& sorted_items() {
+        if (m_num_erased + m_num_upserts > 0 && m_erased_keys.empty() && m_upserts.empty()) {
+            // Move the tombstones and upserts out of the items.
+            int num_kept = 0;
+            for (int i = 0; i < static_cast<int>(m_items.size()); i++) {
+                if (m_messages[i] == message_type::erase)
+                    m_erased_keys.push_back(m_items[i].first);
+                else if (m_messages[i] == message_type::upsert)
+                    m_upserts.push_back(m_items[i]);
+                else
+                    m_items[num_kept++] = m_items[i];
+            }
+            m_items.resize(num_kept);
+        }
+        if (m_items.size() > 1)
+            detail::sort_by_key(m_items, m_sort_buffer, detail::is_radix_sortable<key_type>());
+        return m_items;
+    }
+
+    // The sorted keys of the tombstones. Call after sorted_items.
+    std::vector<key_type>& sorted_erased_keys() {
+        assert(static_cast<int>(m_erased_keys.size()) == m_num_erased);
+        std::sort(m_erased_keys.begin(), m_erased_keys.end());
+        return m_erased_keys;
+    }
+
+    // The upserts, sorted by key. Call after sorted_items.
+    std::vector<value_type>& sorted_upserts() {
+        assert(static_cast<int>(m_upserts.size()) == m_num_upserts);
+        if (m_upserts.size() > 1)
+            detail::sort_by_key(m_upserts, m_sort_buffer, detail::is_radix_sortable<key_type>());
+        return m_upserts;
+    }
+
+    void clear() {
+        m_items.clear();
+        m_messages.clear();
+        m_num_erased = 0;
+        m_num_upserts = 0;
+        m_erased_keys.clear();
+        m_upserts.clear();
+        m_space = 0;
+        std::fill(m_index.begin(), m_index.end(), 0);
+    }
+
+private:
+    // See append, erase and upsert.
+    void set(value_type value, message_type message) {
+        int slot = find_slot(value.first);
+        if (m_index[slot] != 0) {
+            int index = m_index[slot] - 1;
+            value_type& item = m_items[index];
+            m_space -= ItemSize()(item);
+            count(m_messages[index], -1);
+            message = detail::combine_messages<Combine>(m_messages[index], item.second, message, value.second);
+            item.second = value.second;
+            m_messages[index] = message;
+        } else {
+            assert(!full());
+            m_items.push_back(value);
+            m_messages.push_back(message);
+            m_index[slot] = m_items.size();
+        }
+        count(message, 1);
+        m_space += ItemSize()(value);
+    }
+
+    // Add change to the number of items of the message's type.
+    void count(message_type message, int change) {
+        if (message == message_type::erase)
+            m_num_erased += change;
+        else if (message == message_type::upsert)
+            m_num_upserts += change;
+    }
+
+    // Slot of the item with the key, or the
+    // empty slot where it would be added.
+    int find_slot(const key_type& key) const {
+        // Fibonacci hashing: take the top bits of the
+        // product, which depend on all bits of the hash.
+        uint64_t hash = detail::root_log_hash(key, detail::is_hashed_key<key_type>());
+        int slot = static_cast<int>((hash * 0x9E3779B97F4A7C15ull) >> (64 - index_bits));
+        while (m_index[slot] != 0 && !(m_items[m_index[slot] - 1].first == key))
+            slot = (slot + 1) & (index_size - 1);
+        return slot;
+    }
+};
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_FRACTAL_TREE_ROOT_LOG_H
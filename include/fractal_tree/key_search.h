@@ -0,0 +1,863 @@
+/*
+ * key_search.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_KEY_SEARCH_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_KEY_SEARCH_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+// ----------------------- Search kernels. ---------------------------
+
+namespace detail {
+
+// Number of the n keys that are less than key.
+template<typename KeyType>
+inline int count_less(const KeyType* keys, int n, const KeyType& key) {
+    int count = 0;
+    for (int i = 0; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+/*
+ * Vectorized versions of count_less for the common key types
+ * (chosen at compile time; other types use the scalar loop).
+ * Each compares a vector of keys at a time and counts the set
+ * bits of the comparison mask; the remaining keys are compared
+ * one by one.
+ */
+#if defined(__AVX2__)
+
+inline int count_less(const int32_t* keys, int n, const int32_t& key) {
+    const __m256i key_vector = _mm256_set1_epi32(key);
+    int count = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i less = _mm256_cmpgt_epi32(key_vector, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)));
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+    }
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+inline int count_less(const int64_t* keys, int n, const int64_t& key) {
+    const __m256i key_vector = _mm256_set1_epi64x(key);
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i less = _mm256_cmpgt_epi64(key_vector, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)));
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+    }
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+inline int count_less(const float* keys, int n, const float& key) {
+    const __m256 key_vector = _mm256_set1_ps(key);
+    int count = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 less = _mm256_cmp_ps(_mm256_loadu_ps(keys + i), key_vector, _CMP_LT_OQ);
+        count += __builtin_popcount(_mm256_movemask_ps(less));
+    }
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+inline int count_less(const double* keys, int n, const double& key) {
+    const __m256d key_vector = _mm256_set1_pd(key);
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d less = _mm256_cmp_pd(_mm256_loadu_pd(keys + i), key_vector, _CMP_LT_OQ);
+        count += __builtin_popcount(_mm256_movemask_pd(less));
+    }
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+#elif defined(__SSE2__)
+
+// SSE2 has no popcnt, so the (all-ones, i.e. -1) lanes of the
+// comparison masks are subtracted from a vector of counts instead.
+inline int sum_of_counts_epi32(__m128i counts) {
+    counts = _mm_add_epi32(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(1, 0, 3, 2)));
+    counts = _mm_add_epi32(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(counts);
+}
+
+inline int sum_of_counts_epi64(__m128i counts) {
+    counts = _mm_add_epi64(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtsi128_si32(counts);
+}
+
+inline int count_less(const int32_t* keys, int n, const int32_t& key) {
+    const __m128i key_vector = _mm_set1_epi32(key);
+    __m128i counts = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        counts = _mm_sub_epi32(counts, _mm_cmpgt_epi32(key_vector, _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i))));
+    int count = sum_of_counts_epi32(counts);
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+#if defined(__SSE4_2__)
+inline int count_less(const int64_t* keys, int n, const int64_t& key) {
+    const __m128i key_vector = _mm_set1_epi64x(key);
+    __m128i counts = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 2 <= n; i += 2)
+        counts = _mm_sub_epi64(counts, _mm_cmpgt_epi64(key_vector, _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i))));
+    int count = sum_of_counts_epi64(counts);
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+#endif
+
+inline int count_less(const float* keys, int n, const float& key) {
+    const __m128 key_vector = _mm_set1_ps(key);
+    __m128i counts = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        counts = _mm_sub_epi32(counts, _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(keys + i), key_vector)));
+    int count = sum_of_counts_epi32(counts);
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+inline int count_less(const double* keys, int n, const double& key) {
+    const __m128d key_vector = _mm_set1_pd(key);
+    __m128i counts = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 2 <= n; i += 2)
+        counts = _mm_sub_epi64(counts, _mm_castpd_si128(_mm_cmplt_pd(_mm_loadu_pd(keys + i), key_vector)));
+    int count = sum_of_counts_epi64(counts);
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+#endif
+
+// Binary search narrows the range down to this many keys,
+// which are then counted (see count_less).
+constexpr int linear_search_window = 32;
+
+template<typename KeyType>
+inline int lower_bound_index(const KeyType* keys, int n, const KeyType& key, std::true_type /* is_arithmetic */) {
+    int first = 0;
+    int count = n;
+    while (count > linear_search_window) {
+        int step = count / 2;
+        if (keys[first + step] < key) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+    return first + count_less(keys + first, count, key);
+}
+
+template<typename KeyType>
+inline int lower_bound_index(const KeyType* keys, int n, const KeyType& key, std::false_type /* is_arithmetic */) {
+    return std::lower_bound(keys, keys + n, key) - keys;
+}
+
+}
+
+// Index of the first of the n (sorted) keys that is not less
+// than key, or n if there is none (like std::lower_bound).
+template<typename KeyType>
+inline int lower_bound_index(const KeyType* keys, int n, const KeyType& key) {
+    return detail::lower_bound_index(keys, n, key, std::is_arithmetic<KeyType>());
+}
+
+// ----------------------- Spans. ---------------------------
+
+// Read-only view of consecutive elements (pointer and length), e.g.
+// of the nodeIDs of a node, or of items in a std::vector.
+template<typename T>
+class array_span {
+    const T* m_begin = nullptr;
+    int m_size = 0;
+
+public:
+    array_span() = default;
+    array_span(const T* begin, int size) : m_begin(begin), m_size(size) {}
+    array_span(const std::vector<T>& elements) : m_begin(elements.data()), m_size(elements.size()) {}
+
+    int size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const T* begin() const { return m_begin; }
+    const T* end() const { return m_begin + m_size; }
+
+    const T& operator [] (int index) const {
+        assert(0 <= index && index < m_size);
+        return m_begin[index];
+    }
+
+    // Elements with indexes in [low, high).
+    array_span subspan(int low, int high) const {
+        assert(0 <= low && low <= high && high <= m_size);
+        return array_span(m_begin + low, high - low);
+    }
+};
+
+// Types of the items in the buffers of the nodes (see message_flags).
+enum class message_type : uint8_t {
+    insert,
+    erase,
+    upsert
+};
+
+// Read-only view of items whose keys and data are stored in
+// separate arrays (see item_array). Spans taken from a node or
+// leaf point into its block, so they are only valid while the
+// block is in memory (i.e. pinned). Spans of the buffer and the
+// values of a node also point to the bits that store the types
+// of their items (see message_flags).
+template<typename KeyType, typename DataType>
+class item_span {
+public:
+    using value_type = std::pair<KeyType, DataType>;
+
+private:
+    const KeyType* m_keys = nullptr;
+    const DataType* m_data = nullptr;
+    int m_size = 0;
+    // Words of message_flags (nullptr: only inserted items)
+    // and the index of the first item in them.
+    const uint64_t* m_message_words = nullptr;
+    int m_message_offset = 0;
+
+public:
+    item_span() = default;
+    item_span(const KeyType* keys, const DataType* data, int size,
+              const uint64_t* message_words = nullptr, int message_offset = 0)
+        : m_keys(keys), m_data(data), m_size(size), m_message_words(message_words), m_message_offset(message_offset) {}
+
+    int size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    const KeyType& key(int index) const {
+        assert(0 <= index && index < m_size);
+        return m_keys[index];
+    }
+
+    const DataType& datum(int index) const {
+        assert(0 <= index && index < m_size);
+        return m_data[index];
+    }
+
+    message_type message(int index) const {
+        assert(0 <= index && index < m_size);
+        if (m_message_words == nullptr)
+            return message_type::insert;
+        int bit = 2 * (m_message_offset + index);
+        return static_cast<message_type>((m_message_words[bit / 64] >> (bit % 64)) & 3);
+    }
+
+    // Whether the item is a tombstone.
+    bool erased(int index) const {
+        return message(index) == message_type::erase;
+    }
+
+    value_type operator [] (int index) const {
+        return value_type(key(index), datum(index));
+    }
+
+    // Items with indexes in [low, high).
+    item_span subspan(int low, int high) const {
+        assert(0 <= low && low <= high && high <= m_size);
+        return item_span(m_keys + low, m_data + low, high - low, m_message_words, m_message_offset + low);
+    }
+
+    // Index of the first item whose key is not less than key, or size().
+    int lower_bound(const KeyType& key) const {
+        return lower_bound_index(m_keys, m_size, key);
+    }
+
+    // Index of the first item whose key is greater than key, or size().
+    int upper_bound(const KeyType& key) const {
+        return std::upper_bound(m_keys, m_keys + m_size, key) - m_keys;
+    }
+};
+
+// Tombstones for the sorted keys (e.g. of the root log)
+// as a span of items; their data are default constructed.
+template<typename KeyType, typename DataType>
+class tombstone_span {
+public:
+    using value_type = std::pair<KeyType, DataType>;
+
+private:
+    array_span<KeyType> m_keys;
+
+public:
+    tombstone_span(array_span<KeyType> keys) : m_keys(keys) {}
+
+    int size() const { return m_keys.size(); }
+    bool empty() const { return m_keys.empty(); }
+
+    value_type operator [] (int index) const {
+        return value_type(m_keys[index], DataType());
+    }
+};
+
+// Upserts (of the root log) with the sorted keys as a span of
+// items; their data are the deltas.
+template<typename KeyType, typename DataType>
+class upsert_span {
+public:
+    using value_type = std::pair<KeyType, DataType>;
+
+private:
+    array_span<value_type> m_items;
+
+public:
+    upsert_span(array_span<value_type> items) : m_items(items) {}
+
+    int size() const { return m_items.size(); }
+    bool empty() const { return m_items.empty(); }
+
+    const value_type& operator [] (int index) const {
+        return m_items[index];
+    }
+};
+
+namespace detail {
+
+// Type of the item at index of items (any span or vector of
+// items). Only spans can have items that are not inserted.
+template<typename Items>
+inline message_type message_of(const Items&, int) {
+    return message_type::insert;
+}
+
+template<typename KeyType, typename DataType>
+inline message_type message_of(const item_span<KeyType, DataType>& items, int index) {
+    return items.message(index);
+}
+
+template<typename KeyType, typename DataType>
+inline message_type message_of(const tombstone_span<KeyType, DataType>&, int) {
+    return message_type::erase;
+}
+
+template<typename KeyType, typename DataType>
+inline message_type message_of(const upsert_span<KeyType, DataType>&, int) {
+    return message_type::upsert;
+}
+
+// Whether the item at index of items is a tombstone.
+template<typename Items>
+inline bool is_erased(const Items& items, int index) {
+    return message_of(items, index) == message_type::erase;
+}
+
+// Whether any of the items is not an inserted item.
+template<typename Items>
+inline bool has_messages(const Items& items) {
+    for (int i = 0; i < static_cast<int>(items.size()); i++) {
+        if (message_of(items, i) != message_type::insert)
+            return true;
+    }
+    return false;
+}
+
+}
+
+// Whether the items (any span or vector of items) are sorted by key.
+template<typename Items>
+bool is_sorted_by_key(const Items& items) {
+    for (int i = 1; i < static_cast<int>(items.size()); i++) {
+        if (items[i].first < items[i - 1].first)
+            return false;
+    }
+    return true;
+}
+
+// ----------------------- Item arrays. ---------------------------
+
+// Skip function for item_array::merge that leaves out no item.
+struct skip_none {
+    bool operator () (int) const { return false; }
+};
+
+/*
+ * Combine function of a tree without upserts (see fractal_tree::upsert).
+ *
+ * A Combine function object returns the datum of a key after an
+ * upsert with a delta, given the datum before (data_type() if the key
+ * had none): Combine()(datum, delta). It has to be associative, so
+ * that the deltas of two upserts can be combined before they reach
+ * the datum: Combine()(Combine()(datum, a), b) ==
+ * Combine()(datum, Combine()(a, b)). E.g. std::plus<DataType>
+ * for counters.
+ */
+struct no_upsert {
+    template<typename DataType>
+    DataType operator () (const DataType& datum, const DataType&) const {
+        assert(false);
+        return datum;
+    }
+};
+
+/*
+ * The items in the buffers are messages for their keys:
+ * - an inserted item replaces the older items with its key,
+ * - a tombstone (see fractal_tree::erase) erases its key (its datum
+ *   has no meaning),
+ * - an upsert (see fractal_tree::upsert) combines its datum (a delta)
+ *   into the datum of its key.
+ * On their way down the tree, messages replace the older messages
+ * with their key in the buffers and values they meet, or are combined
+ * with them (see combine_messages). At a leaf they are applied, so
+ * that leaves only hold inserted items (see item_array::apply_in_place).
+ *
+ * The buffer and the values of a node store the types of their items
+ * with two bits per item (values are never upserts); the items of
+ * leaves are always inserted items (HasMessages is false), so they do
+ * not store the bits.
+ */
+template<int Capacity, bool HasMessages>
+struct message_flags {
+    std::array<uint64_t, (2 * Capacity + 63) / 64> message_words {};
+
+    // Bytes that the flags of num_items items take.
+    static constexpr int size_in_bytes(int num_items) {
+        return static_cast<int>(sizeof(uint64_t)) * ((2 * num_items + 63) / 64);
+    }
+
+    message_type message(int index) const {
+        return static_cast<message_type>((message_words[2 * index / 64] >> (2 * index % 64)) & 3);
+    }
+
+    bool erased(int index) const {
+        return message(index) == message_type::erase;
+    }
+
+    void set_message(int index, message_type message) {
+        uint64_t& word = message_words[2 * index / 64];
+        word = (word & ~(uint64_t(3) << (2 * index % 64)))
+               | (static_cast<uint64_t>(message) << (2 * index % 64));
+    }
+
+    const uint64_t* message_data() const {
+        return message_words.data();
+    }
+};
+
+template<int Capacity>
+struct message_flags<Capacity, false> {
+    message_type message(int) const {
+        return message_type::insert;
+    }
+
+    bool erased(int) const {
+        return false;
+    }
+
+    void set_message(int, message_type message) {
+        assert(message == message_type::insert);
+        (void)message;
+    }
+
+    const uint64_t* message_data() const {
+        return nullptr;
+    }
+};
+
+namespace detail {
+
+// Type of the message for a key after a newer message (with
+// newer_datum) meets an older one (with older_datum); newer_datum
+// becomes the datum of the result. Only upserts are combined
+// with the older message, the others replace it.
+template<typename Combine, typename DataType>
+message_type combine_messages(message_type older, const DataType& older_datum,
+                              message_type newer, DataType& newer_datum) {
+    if (newer != message_type::upsert)
+        return newer;
+    if (older == message_type::erase)
+        newer_datum = Combine()(DataType(), newer_datum);
+    else
+        newer_datum = Combine()(older_datum, newer_datum);
+    return older == message_type::upsert ? message_type::upsert : message_type::insert;
+}
+
+// The inserted item that a message (other than a tombstone)
+// gives at a leaf that has no older item with its key.
+template<typename Combine, typename ValueType>
+ValueType applied_item(ValueType item, message_type message) {
+    assert(message != message_type::erase);
+    if (message == message_type::upsert)
+        item.second = Combine()(typename ValueType::second_type(), item.second);
+    return item;
+}
+
+}
+
+// Up to Capacity items (pairs of key and datum) of a node or leaf
+// block, stored as a structure of arrays: searching the keys does
+// not stride over the data (and can use the kernels above).
+// Items of an array with HasMessages can also be tombstones and
+// upserts (see message_flags).
+template<typename KeyType, typename DataType, int Capacity, bool HasMessages = false>
+struct item_array : message_flags<Capacity, HasMessages> {
+    using value_type = std::pair<KeyType, DataType>;
+
+    std::array<KeyType, Capacity>  keys {};
+    std::array<DataType, Capacity> data {};
+
+    value_type get(int index) const {
+        return value_type(keys[index], data[index]);
+    }
+
+    void set(int index, const value_type& value, message_type message = message_type::insert) {
+        keys[index] = value.first;
+        data[index] = value.second;
+        this->set_message(index, message);
+    }
+
+    // Return vector of the items with indexes in [low, high).
+    std::vector<value_type> get(int low, int high) const {
+        assert(0 <= low && low <= high && high <= Capacity);
+        std::vector<value_type> result;
+        result.reserve(high - low);
+        for (int i = low; i < high; i++)
+            result.emplace_back(keys[i], data[i]);
+        return result;
+    }
+
+    // Set the items from index first on to [begin, end).
+    template<typename InputIterator>
+    void set(int first, InputIterator begin, InputIterator end) {
+        for (int i = first; begin != end; i++, ++begin)
+            set(i, *begin);
+    }
+
+    // Set the items from index first on to the items of the span.
+    void set(int first, const item_span<KeyType, DataType>& items) {
+        assert(0 <= first && first + items.size() <= Capacity);
+        for (int i = 0; i < items.size(); i++) {
+            keys[first + i] = items.key(i);
+            data[first + i] = items.datum(i);
+            this->set_message(first + i, items.message(i));
+        }
+    }
+
+    // Shift the items with indexes in [index, size) one to the right.
+    void shift_right(int index, int size) {
+        assert(size < Capacity);
+        std::move_backward(keys.begin() + index, keys.begin() + size, keys.begin() + size + 1);
+        std::move_backward(data.begin() + index, data.begin() + size, data.begin() + size + 1);
+        if (HasMessages) {
+            for (int i = size; i > index; i--)
+                this->set_message(i, this->message(i - 1));
+        }
+    }
+
+    // Shift the items with indexes in [index + 1, size) one to the left.
+    void shift_left(int index, int size) {
+        assert(index < size && size <= Capacity);
+        std::move(keys.begin() + index + 1, keys.begin() + size, keys.begin() + index);
+        std::move(data.begin() + index + 1, data.begin() + size, data.begin() + index);
+        if (HasMessages) {
+            for (int i = index; i + 1 < size; i++)
+                this->set_message(i, this->message(i + 1));
+        }
+    }
+
+    // Index of the first of the first size items whose key is not less than key.
+    int lower_bound(int size, const KeyType& key) const {
+        return lower_bound_index(keys.data(), size, key);
+    }
+
+    // Span of the items with indexes in [low, high).
+    item_span<KeyType, DataType> span(int low, int high) const {
+        assert(0 <= low && low <= high && high <= Capacity);
+        return item_span<KeyType, DataType>(keys.data() + low, data.data() + low, high - low, this->message_data(), low);
+    }
+
+    // Number of items that merging new_items into the first
+    // size items gives (see merge).
+    template<typename Items, typename Skip>
+    int merged_size(int size, const Items& new_items, Skip skip) const {
+        int num_new_items = new_items.size();
+        int num_merged = size;
+        int i = 0;
+        for (int j = 0; j < num_new_items; j++) {
+            if (skip(j))
+                continue;
+            KeyType key = new_items[j].first;
+            while (i < size && keys[i] < key)
+                i++;
+            // Duplicates replace an item.
+            if (i < size && !(key < keys[i]))
+                i++;
+            else
+                num_merged++;
+        }
+        return num_merged;
+    }
+
+    /*
+     * Merge the sorted new_items (any span or vector of items) into
+     * the first size items, leaving out the new items for which
+     * skip(index) holds, and taking the new item in case of duplicate
+     * keys (combined with the older one if it is an upsert, see
+     * combine_messages). num_merged is merged_size(...).
+     *
+     * The merge goes from its last item to its first, and calls
+     * output(index, item, message) with each item, its index in the
+     * merge and its type until the new items are used up. The items
+     * before are the first items of this array, already in place;
+     * return their number. When output is called with index, the
+     * items of this array at index and above have been read, so
+     * output can write the item to this array (see merge_in_place)
+     * without a scratch buffer.
+     */
+    template<typename Items, typename Skip, typename Output, typename Combine = no_upsert>
+    int merge(int size, const Items& new_items, int num_merged, Skip skip, Output output,
+              Combine = Combine()) const {
+        int i = size - 1;
+        int index = num_merged - 1;
+        for (int j = new_items.size() - 1; j >= 0; j--) {
+            if (skip(j))
+                continue;
+            value_type new_item = new_items[j];
+            message_type new_message = detail::message_of(new_items, j);
+            while (i >= 0 && new_item.first < keys[i]) {
+                output(index, get(i), this->message(i));
+                index--;
+                i--;
+            }
+            if (i >= 0 && !(keys[i] < new_item.first)) {
+                new_message = detail::combine_messages<Combine>(this->message(i), data[i], new_message, new_item.second);
+                i--;
+            }
+            output(index, new_item, new_message);
+            index--;
+        }
+        assert(index == i);
+        return i + 1;
+    }
+
+    // Merge (see merge) the new items into the first size items
+    // of this array, in place. Return the new number of items.
+    template<typename Items, typename Skip, typename Combine = no_upsert>
+    int merge_in_place(int size, const Items& new_items, Skip skip, Combine combine = Combine()) {
+        int num_merged = merged_size(size, new_items, skip);
+        assert(num_merged <= Capacity);
+        merge(size, new_items, num_merged, skip,
+              [this](int index, const value_type& item, message_type message) { set(index, item, message); },
+              combine);
+        return num_merged;
+    }
+
+    // Remove those of the first size items that the tombstones
+    // among the sorted new_items erase. Return the new number of items.
+    template<typename Items>
+    int remove_erased(int size, const Items& new_items) {
+        int num_new_items = new_items.size();
+        int num_kept = 0;
+        int j = 0;
+        for (int i = 0; i < size; i++) {
+            while (j < num_new_items && new_items[j].first < keys[i])
+                j++;
+            if (j < num_new_items && !(keys[i] < new_items[j].first) && detail::is_erased(new_items, j))
+                continue;
+            if (num_kept != i)
+                set(num_kept, get(i), this->message(i));
+            num_kept++;
+        }
+        return num_kept;
+    }
+
+    // Number of items that applying new_items to the
+    // first size items gives (see apply_in_place).
+    template<typename Items>
+    int applied_size(int size, const Items& new_items) const {
+        int num_new_items = new_items.size();
+        int num_applied = size;
+        int i = 0;
+        for (int j = 0; j < num_new_items; j++) {
+            KeyType key = new_items[j].first;
+            while (i < size && keys[i] < key)
+                i++;
+            bool duplicate = i < size && !(key < keys[i]);
+            if (duplicate)
+                i++;
+            if (detail::is_erased(new_items, j))
+                num_applied -= duplicate;
+            else
+                num_applied += !duplicate;
+        }
+        return num_applied;
+    }
+
+    // As merge_in_place, but apply the messages among the new items
+    // (as at a leaf, whose items are all inserted items): tombstones
+    // remove the items with their keys instead of being merged, and
+    // upserts become inserted items. Return the new number of items.
+    template<typename Items, typename Combine = no_upsert>
+    int apply_in_place(int size, const Items& new_items, Combine combine = Combine()) {
+        if (!detail::has_messages(new_items))
+            return merge_in_place(size, new_items, skip_none());
+        // merge only moves items to the right, so the removals
+        // are done first (moving items to the left).
+        size = remove_erased(size, new_items);
+        auto skip_erased = [&new_items](int index) { return detail::is_erased(new_items, index); };
+        int num_merged = merged_size(size, new_items, skip_erased);
+        assert(num_merged <= Capacity);
+        merge(size, new_items, num_merged, skip_erased,
+              [this](int index, const value_type& item, message_type message) {
+                  set(index, detail::applied_item<Combine>(item, message));
+              },
+              combine);
+        return num_merged;
+    }
+};
+
+// ----------------------- Pivot indexes. ---------------------------
+
+// Layout of the pivots (values) of inner nodes
+// that is searched on the way down the tree.
+enum class pivot_layout {
+    // Search the sorted values (see item_array::lower_bound).
+    sorted,
+    // Additionally keep the keys of the values in Eytzinger
+    // (breadth-first) order, see eytzinger_pivot_index.
+    eytzinger
+};
+
+// Pivot layout of the nodes of a fractal tree,
+// 0: pivot_layout::sorted, 1: pivot_layout::eytzinger.
+#ifndef FRACTAL_TREE_EYTZINGER_PIVOTS
+#define FRACTAL_TREE_EYTZINGER_PIVOTS 0
+#endif
+
+constexpr pivot_layout default_pivot_layout =
+    FRACTAL_TREE_EYTZINGER_PIVOTS ? pivot_layout::eytzinger : pivot_layout::sorted;
+
+// Index over the sorted values of a node (an item_array) that is
+// stored in the node's block next to them. It has to be rebuilt
+// whenever the keys of the values change.
+// find(values, size, key) returns the index of the first of the
+// first size values whose key is not less than key (like
+// item_array::lower_bound), and whether that key equals key.
+template<typename KeyType, int Capacity, pivot_layout Layout>
+struct pivot_index;
+
+// The sorted values are searched directly; the index is empty.
+template<typename KeyType, int Capacity>
+struct pivot_index<KeyType, Capacity, pivot_layout::sorted> {
+    template<typename Values>
+    void build(const Values&, int) { }
+
+    template<typename Values>
+    std::pair<int, bool> find(const Values& values, int size, const KeyType& key) const {
+        int index = values.lower_bound(size, key);
+        return std::pair<int, bool>(index, index != size && values.keys[index] == key);
+    }
+};
+
+/*
+ * The keys of the values in Eytzinger order: slots[1] is the root of
+ * an implicit binary search tree, and the children of slots[k] are
+ * slots[2k] and slots[2k + 1]. The first levels of the tree share a
+ * few cache lines, and the search is branch-free: it only depends on
+ * the comparisons, and the cache lines of the levels further down
+ * can be prefetched. Each key is stored with its rank, i.e. its index
+ * in the sorted values (and thus in the node's child ids), so the
+ * rank is in the cache line that was searched last.
+ */
+template<typename KeyType, int Capacity>
+struct pivot_index<KeyType, Capacity, pivot_layout::eytzinger> {
+    struct slot {
+        KeyType key {};
+        int rank = 0;
+    };
+    // slots[0] is unused.
+    std::array<slot, Capacity + 1> slots {};
+
+    template<typename Values>
+    void build(const Values& values, int size) {
+        assert(size <= Capacity);
+        build(values.keys.data(), size, 0, 1);
+    }
+
+    template<typename Values>
+    std::pair<int, bool> find(const Values&, int size, const KeyType& key) const {
+        // The descendants of slots[k] that are log2(slots_per_cache_line)
+        // levels further down are next to each other: prefetch them
+        // while searching the levels in between.
+        constexpr int slots_per_cache_line = sizeof(slot) < 64 ? 64 / sizeof(slot) : 1;
+        if (size == 0)
+            return std::pair<int, bool>(0, false);
+        // Descend through the full levels of the tree (the same number
+        // of steps for every key, so the loop is well predicted) ...
+        const int num_full_levels = 31 - __builtin_clz(size + 1);
+        int k = 1;
+        for (int level = 0; level < num_full_levels; level++) {
+            if (slots_per_cache_line * k <= size)
+                __builtin_prefetch(slots.data() + slots_per_cache_line * k);
+            k = 2 * k + (slots[k].key < key);
+        }
+        // ... and then through the last, partial one if k is in it
+        // (without a branch; slots[0] stands in for the slots past it).
+        const bool in_last_level = k <= size;
+        const int next_k = 2 * k + (slots[in_last_level ? k : 0].key < key);
+        k = in_last_level ? next_k : k;
+        // The path went right (1 bits) after the lower bound and
+        // then always left; strip those to find the lower bound.
+        k >>= __builtin_ffs(~k);
+        if (k == 0)
+            return std::pair<int, bool>(size, false);
+        return std::pair<int, bool>(slots[k].rank, slots[k].key == key);
+    }
+
+private:
+    // Fill the subtree rooted at k with the sorted keys from
+    // index rank on (in order). Return the next unused rank.
+    int build(const KeyType* sorted_keys, int size, int rank, int k) {
+        if (k > size)
+            return rank;
+        rank = build(sorted_keys, size, rank, 2 * k);
+        slots[k].key = sorted_keys[rank];
+        slots[k].rank = rank;
+        return build(sorted_keys, size, rank + 1, 2 * k + 1);
+    }
+};
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_KEY_SEARCH_H
@@ -11,7 +11,17 @@
 #include <tlx/logger.hpp>
 #include <foxxll/mng/typed_block.hpp>
 #include <limits>
-
+#include <ratio>
+#include "buffer_filter.h"
+#include "key_search.h"
+
+// Epsilon of the nodes of fractal trees by default (see
+// node_parameters), in percent: 50 gives nodes sqrt(B) values,
+// smaller values give larger buffers (towards a buffered repository
+// tree), larger ones more values (towards a B-tree).
+#ifndef FRACTAL_TREE_EPSILON_PERCENT
+#define FRACTAL_TREE_EPSILON_PERCENT 50
+#endif
 
 namespace stxxl {
 
@@ -87,12 +97,72 @@ double constexpr SQRT(double x)
            : std::numeric_limits<double>::quiet_NaN();
 }
 
+// Constexpr natural logarithm of a positive, finite x: with x = m * 2^k
+// (1 <= m < 2), ln(x) = k ln(2) + 2 atanh((m - 1) / (m + 1)).
+double constexpr LOG(double x)
+{
+    int k = 0;
+    for (; x >= 2; x /= 2)
+        k++;
+    for (; x < 1; x *= 2)
+        k--;
+    double y = (x - 1) / (x + 1);
+    double term = y;
+    double sum = 0;
+    for (int i = 1; i < 64; i += 2) {
+        sum += term / i;
+        term *= y * y;
+    }
+    return 2 * sum + k * 0.69314718055994530942;
+}
+
+// Constexpr exponential function: exp(x) = exp(x / 2^k)^(2^k),
+// with a Taylor series for |x / 2^k| <= 1/2.
+double constexpr EXP(double x)
+{
+    int k = 0;
+    for (; x > 0.5 || x < -0.5; x /= 2)
+        k++;
+    double term = 1;
+    double sum = 1;
+    for (int i = 1; i < 24; i++) {
+        term *= x / i;
+        sum += term;
+    }
+    for (; k > 0; k--)
+        sum *= sum;
+    return sum;
+}
+
+// Constexpr x^y for a positive, finite x.
+double constexpr POW(double x, double y)
+{
+    return EXP(y * LOG(x));
+}
+
+using default_epsilon = std::ratio<FRACTAL_TREE_EPSILON_PERCENT, 100>;
+
+// Number of values of a node whose block has room for num_items
+// items: num_items^Epsilon (a std::ratio, 0 < Epsilon <= 1), rounded
+// down. (Exact for Epsilon = 1/2; otherwise, a result that is an
+// integer up to rounding errors is rounded to that integer.)
+template<typename Epsilon>
+int constexpr NUM_NODE_VALUES(double num_items) {
+    return 2 * Epsilon::num == Epsilon::den
+           ? static_cast<int>(SQRT(num_items))
+           : static_cast<int>(POW(num_items, static_cast<double>(Epsilon::num) / Epsilon::den) + 1e-9);
+}
+
 // Given the raw_block_size and the size that a struct with the
 // values and the nodeIDs (without buffer) would take (both in bytes),
 // calculate how many items of type value_type fit into the buffer.
 template<typename ValueType, unsigned RawBlockSize, unsigned SizeWithoutBuffer>
 unsigned constexpr NUM_NODE_BUFFER_ITEMS() {
-    unsigned remaining_bytes_for_buffer = RawBlockSize - SizeWithoutBuffer;
+    static_assert(SizeWithoutBuffer < RawBlockSize,
+                  "RawBlockSize too small -> no room for a buffer next to the values and nodeIDs "
+                  "of a node (use a smaller Epsilon or bigger blocks)!");
+    // (Guarded so that the subtraction cannot wrap around after a failed assertion.)
+    unsigned remaining_bytes_for_buffer = SizeWithoutBuffer < RawBlockSize ? RawBlockSize - SizeWithoutBuffer : 0;
     // The struct without the buffer contains an array of ints (the nodeIDs)
     // and an array of value_type (the values) -> it's already aligned to the
     // bigger of the two.
@@ -105,61 +175,112 @@ unsigned constexpr NUM_NODE_BUFFER_ITEMS() {
     return max_num_items;
 }
 
+// Given the number of items that fit into the space for the buffer,
+// calculate how many fit if the buffer filter (see buffer_filter)
+// and the bits that store the types of the items (see message_flags) have to fit
+// into that space, too.
+template<typename ValueType, typename BufferFilterType>
+int constexpr NUM_NODE_BUFFER_ITEMS_WITH_FILTER(int max_num_items) {
+    int num_items = max_num_items;
+    while (num_items > 0 && static_cast<int>(num_items * sizeof(ValueType)) + BufferFilterType::size_in_bytes(num_items)
+                            + message_flags<1, true>::size_in_bytes(num_items)
+                            > static_cast<int>(max_num_items * sizeof(ValueType)))
+        num_items--;
+    return num_items;
+}
+
 // Set up sizes and types for the blocks used to store inner nodes' data in external memory.
-template<typename ValueType, unsigned RawBlockSize>
+// With B = RawBlockSize / sizeof(ValueType) items per block, a node has B^Epsilon values
+// (so B^Epsilon + 1 children), and the rest of the block is its buffer (see
+// NUM_NODE_BUFFER_ITEMS). Epsilon = 1/2 gives sqrt(B) values, Epsilon -> 1 a B-tree,
+// Epsilon -> 0 a buffered repository tree.
+template<typename ValueType, unsigned RawBlockSize, pivot_layout PivotLayout = pivot_layout::sorted,
+         bool UseBufferFilter = false, typename Epsilon = std::ratio<1, 2>>
 class node_parameters final {
+    static_assert(0 < Epsilon::num && Epsilon::num <= Epsilon::den, "Epsilon must be in (0, 1]!");
+
 public:
     enum {
-        max_num_values_in_node =
-        static_cast<int>(
-                SQRT(static_cast<double>(RawBlockSize / sizeof(ValueType)))
-        )
+        max_num_values_in_node = NUM_NODE_VALUES<Epsilon>(static_cast<double>(RawBlockSize / sizeof(ValueType)))
     };
-    struct _node_block_without_buffer {
+    using pivot_index_type = pivot_index<typename ValueType::first_type, max_num_values_in_node, PivotLayout>;
+
+    struct _node_block_without_buffer : pivot_index_type {
         std::array<ValueType, max_num_values_in_node>       value {};
+        message_flags<max_num_values_in_node, true>          value_messages {};
         std::array<int,        max_num_values_in_node+1>     nodeIDs {};
     };
 
+    // The filter's size only depends on the capacity of the buffer.
+    using buffer_filter_sizes_type = buffer_filter<typename ValueType::first_type, 1,
+        has_buffer_filter<typename ValueType::first_type, UseBufferFilter>::value>;
+
     enum {
-        max_num_buffer_items_in_node = NUM_NODE_BUFFER_ITEMS<ValueType, RawBlockSize, sizeof(_node_block_without_buffer)>(),
+        max_num_buffer_items_in_node = NUM_NODE_BUFFER_ITEMS_WITH_FILTER<ValueType, buffer_filter_sizes_type>(
+                NUM_NODE_BUFFER_ITEMS<ValueType, RawBlockSize, sizeof(_node_block_without_buffer)>()),
     };
 };
 
 // ----------------------- Node and Leaf classes. ---------------------------
 
+// Combine is the combine function of upserts (see no_upsert).
 template<typename KeyType,
      typename DataType,
-     unsigned RawBlockSize>
+     unsigned RawBlockSize,
+     pivot_layout PivotLayout = default_pivot_layout,
+     bool UseBufferFilter = default_buffer_filter,
+     typename Epsilon = default_epsilon,
+     typename Combine = no_upsert>
 class node final {
 public:
     // Basic type declarations
     using key_type = KeyType;
     using data_type = DataType;
     using value_type = std::pair<key_type, data_type>;
-    using self_type = node<KeyType, DataType, RawBlockSize>;
+    using self_type = node<KeyType, DataType, RawBlockSize, PivotLayout, UseBufferFilter, Epsilon, Combine>;
     using bid_type = foxxll::BID<RawBlockSize>;
-    using node_parameter_type = node_parameters<value_type, RawBlockSize>;
+    using node_parameter_type = node_parameters<value_type, RawBlockSize, PivotLayout, UseBufferFilter, Epsilon>;
 
 public:
     enum {
         max_num_values_in_node = node_parameter_type::max_num_values_in_node,
         max_num_buffer_items_in_node = node_parameter_type::max_num_buffer_items_in_node,
+        // Largest item_size of an item.
+        max_item_size = 1,
     };
     static_assert(max_num_values_in_node >= 3, "RawBlockSize too small -> too few values per node!");
     static_assert(max_num_buffer_items_in_node >= 2, "RawBlockSize too small -> too few buffer items per node!");
 
+    // Buffer items can be tombstones and upserts, values can be
+    // tombstones (see message_flags).
+    using buffer_type = item_array<key_type, data_type, max_num_buffer_items_in_node, true>;
+    using values_type = item_array<key_type, data_type, max_num_values_in_node, true>;
+    using pivot_index_type = pivot_index<key_type, max_num_values_in_node, PivotLayout>;
+    using buffer_filter_type = buffer_filter<key_type, max_num_buffer_items_in_node,
+        has_buffer_filter<key_type, UseBufferFilter>::value>;
+    // Views into the node's block (only valid while it is pinned).
+    using item_span_type = item_span<key_type, data_type>;
+    using nodeID_span_type = array_span<int>;
+
+    // Size of an item in the buffer, in the unit of buffer_space
+    // (items; see slotted_node for buffers that count bytes).
+    struct item_size {
+        int operator () (const value_type&) const { return 1; }
+    };
+
     // This is how the data of the inner nodes will be stored in a block.
-    struct node_block {
-        std::array<value_type, max_num_buffer_items_in_node> buffer {};
-        std::array<value_type, max_num_values_in_node>       values {};
-        std::array<int,        max_num_values_in_node+1>     nodeIDs {};
+    // Keys and data are stored in separate arrays (see item_array).
+    // The pivot index (empty for the sorted layout) is searched
+    // instead of the values in values_find. The buffer filter (empty
+    // unless enabled) is checked before the buffer in buffer_find.
+    struct node_block : buffer_filter_type, pivot_index_type {
+        buffer_type                                      buffer {};
+        values_type                                      values {};
+        std::array<int,        max_num_values_in_node+1> nodeIDs {};
     };
     using block_type = foxxll::typed_block<RawBlockSize, node_block>;
     static_assert(sizeof(node_block) <= sizeof(block_type), "RawBlockSize too small!");
 
-    using buffer_iterator_type = typename std::array<value_type, max_num_buffer_items_in_node>::iterator;
-    using values_iterator_type = typename std::array<value_type, max_num_values_in_node>::iterator;
-
     static constexpr data_type dummy_datum() { return data_type(); };
 
 private:
@@ -169,10 +290,14 @@ private:
     int m_num_buffer_items = 0;
     int m_num_values = 0;
     block_type* m_block = nullptr;
+    // Block is owned by the tree instead of the cache.
+    bool m_pinned = false;
 
-    std::array<value_type, max_num_values_in_node>*       m_values  = nullptr;
-    std::array<int,        max_num_values_in_node+1>*     m_nodeIDs = nullptr;
-    std::array<value_type, max_num_buffer_items_in_node>* m_buffer  = nullptr;
+    values_type*                                      m_values  = nullptr;
+    std::array<int,        max_num_values_in_node+1>* m_nodeIDs = nullptr;
+    buffer_type*                                      m_buffer  = nullptr;
+    pivot_index_type*                                 m_pivot_index = nullptr;
+    buffer_filter_type*                               m_buffer_filter = nullptr;
 
 public:
     explicit node(int ID, bid_type BID) : m_id(ID), m_bid(BID) {};
@@ -218,20 +343,48 @@ public:
         return m_num_buffer_items == 0;
     }
 
+    // Free space in the buffer (see item_size).
+    int buffer_space() const {
+        return max_num_buffer_items_in_node - m_num_buffer_items;
+    }
+
+    // Number of the first of new_items (any span or vector of items)
+    // that fit into the buffer, even if none of them is a duplicate.
+    template<typename Items>
+    int num_items_that_fit(const Items& new_items) const {
+        return std::min(static_cast<int>(new_items.size()), buffer_space());
+    }
+
     // Check if number of keys in node is >= floor(b/2)
     bool values_at_least_half_full() const {
         return m_num_values >= (max_num_values_in_node-1) / 2;
     }
 
+    // Whether the node has so few values that it should be
+    // merged with a neighbor (see try_merge).
+    bool underflows() const {
+        return m_num_values < max_num_values_in_node / 4;
+    }
+
     block_type* get_block() {
         return m_block;
     }
 
+    bool is_pinned() const {
+        return m_pinned;
+    }
+
+    void set_pinned(bool pinned) {
+        m_pinned = pinned;
+    }
+
     void set_block(block_type* block) {
         m_block = block;
         m_values = &(m_block->begin()->values);
         m_nodeIDs = &(m_block->begin()->nodeIDs);
         m_buffer = &(m_block->begin()->buffer);
+        m_pivot_index = m_block->begin();
+        m_buffer_filter = m_block->begin();
     }
 
     void clear() {
@@ -253,22 +406,15 @@ public:
             // at last child -> return max index of buffer + 1
             return m_num_buffer_items;
         else {
-            value_type upper_bound_value_of_child = m_values->at(child_index);
-            // binary search for first buffer item that does not
+            const key_type& upper_bound_key_of_child = m_values->keys[child_index];
+            // search for first buffer item that does not
             // belong to the child anymore.
-            auto it = std::lower_bound(
-                    m_buffer->begin(),
-                    m_buffer->begin() + m_num_buffer_items,
-                    upper_bound_value_of_child,
-                    [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;}
-            );
-            int index_of_upper_bound = std::distance(m_buffer->begin(), it);
-            return index_of_upper_bound;
+            return m_buffer->lower_bound(m_num_buffer_items, upper_bound_key_of_child);
         }
     }
 
     std::vector<value_type> get_buffer_items() const {
-        return std::vector<value_type>(m_buffer->begin(), m_buffer->begin()+m_num_buffer_items);
+        return m_buffer->get(0, m_num_buffer_items);
     }
 
     // Return vector of items in buffer with indexes in [low, high).
@@ -276,94 +422,98 @@ public:
     std::vector<value_type> get_buffer_items(int low, int high) const {
         assert(low <= high);
         assert(m_num_buffer_items >= high);
-        return std::vector<value_type>(m_buffer->begin() + low, m_buffer->begin() + high);
+        return m_buffer->get(low, high);
+    }
+
+    // Span versions of get_buffer_items (no copies).
+    item_span_type buffer_span() const {
+        return m_buffer->span(0, m_num_buffer_items);
+    }
+
+    item_span_type buffer_span(int low, int high) const {
+        assert(low <= high);
+        assert(m_num_buffer_items >= high);
+        return m_buffer->span(low, high);
     }
 
     value_type get_buffer_item(int index) const {
         assert(index < m_num_buffer_items);
-        return m_buffer->at(index);
+        return m_buffer->get(index);
     }
 
     // Given a value_type bound, return a vector of all
     // buffer items whose key is smaller than bound.first
     std::vector<value_type> get_buffer_items_less_than(value_type bound) const {
-        auto it = std::lower_bound(
-                m_buffer->begin(),
-                m_buffer->begin() + m_num_buffer_items,
-                bound,
-                [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;}
-        );
-        // std::lower_bound finds first key that's >= bound, or the end
-        return std::vector<value_type>(m_buffer->begin(), it);
+        // lower_bound finds first key that's >= bound, or the end
+        int index = m_buffer->lower_bound(m_num_buffer_items, bound.first);
+        return m_buffer->get(0, index);
     }
 
     std::vector<value_type> get_buffer_items_greater_equal_than(value_type bound) const {
-        auto it = std::lower_bound(
-                m_buffer->begin(),
-                m_buffer->begin() + m_num_buffer_items,
-                bound,
-                [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;}
-        );
-        // std::lower_bound finds first key that's >= bound, or the end
-        return std::vector<value_type>(it, m_buffer->begin()+m_num_buffer_items);
+        // lower_bound finds first key that's >= bound, or the end
+        int index = m_buffer->lower_bound(m_num_buffer_items, bound.first);
+        return m_buffer->get(index, m_num_buffer_items);
     }
 
     void clear_buffer() {
         m_num_buffer_items = 0;
+        m_buffer_filter->clear();
+    }
+
+    // Keep only the first num_items buffer items.
+    void truncate_buffer(int num_items) {
+        assert(0 <= num_items && num_items <= m_num_buffer_items);
+        m_num_buffer_items = num_items;
+        // Rebuild the filter (it cannot forget keys)
+        m_buffer_filter->clear();
+        for (int i = 0; i < m_num_buffer_items; i++)
+            m_buffer_filter->insert(m_buffer->keys[i]);
     }
 
     // First clear buffer, then add values to buffer.
-    void set_buffer(std::vector<value_type>& values) {
+    void set_buffer(const std::vector<value_type>& values) {
         assert(values.size() <= max_num_buffer_items_in_node);
         clear_buffer();
         add_to_buffer(values);
     }
 
+    void set_buffer(const item_span_type& items) {
+        assert(items.size() <= max_num_buffer_items_in_node);
+        clear_buffer();
+        add_to_buffer(items);
+    }
+
     // Add the new value to the buffer. In case of a duplicate
     // key, take the datum from the new value.
     void add_to_buffer(value_type new_value) {
         if (buffer_empty()) {
-            *(m_buffer->begin()) = new_value;
+            m_buffer->set(0, new_value);
+            m_buffer_filter->insert(new_value.first);
             m_num_buffer_items++;
         } else {
-            std::vector<value_type> v { new_value };
-            add_to_buffer(v);
+            add_items_to_buffer(array_span<value_type>(&new_value, 1));
         }
     }
 
     // Add the new values to the buffer. In case of duplicate keys,
     // take the data from new_values.
-    void add_to_buffer(std::vector<value_type>& new_values) {
-        /*
-         * When adding new values to the node's buffer, we might
-         * have duplicate keys in the new values and the current values,
-         * and duplicate keys in the new values and the current buffer items.
-         *
-         * Pseudocode:
-         * 1. Check for duplicate keys in new_values and current values.
-         *    Use the new data for all duplicates.
-         * 2. For the remaining new_values, merge them with the current
-         *    buffer items, and again use the new value for all duplicates.
-         */
-
-        bool is_sorted = std::is_sorted(new_values.begin(), new_values.end(),
-                                        [] (value_type val1, value_type val2)->bool { return val1.first < val2.first; });
-        assert(is_sorted);
-
-        // 1.
-        // Check for and replace duplicate keys in new_values and current values.
-        new_values = update_duplicate_values(new_values);
+    void add_to_buffer(const std::vector<value_type>& new_values) {
+        add_items_to_buffer(array_span<value_type>(new_values));
+    }
 
-        // 2.
-        std::vector<value_type> buffer_values = std::vector<value_type>(m_buffer->begin(), m_buffer->begin()+m_num_buffer_items);
+    // Same, from a span (e.g. of the buffer of the parent node).
+    void add_to_buffer(const item_span_type& new_items) {
+        add_items_to_buffer(new_items);
+    }
 
-        // Merge, and take from new_values in case of duplicates
-        std::vector<value_type> new_buffer_values = merge_into<value_type>(new_values, buffer_values);
-        assert(new_buffer_values.size() <= max_num_buffer_items_in_node);
+    // Same, for tombstones (e.g. of the root log).
+    void add_to_buffer(const tombstone_span<key_type, data_type>& tombstones) {
+        add_items_to_buffer(tombstones);
+    }
 
-        // Replace buffer with new buffer values
-        m_num_buffer_items = new_buffer_values.size();
-        std::move(new_buffer_values.begin(), new_buffer_values.end(), m_buffer->begin());
+    // Same, for upserts (e.g. of the root log).
+    void add_to_buffer(const upsert_span<key_type, data_type>& upserts) {
+        add_items_to_buffer(upserts);
     }
 
     // Given a key, search for an item that has that key in the
@@ -371,21 +521,52 @@ public:
     // <datum of the item, true>. Else, return a pair
     // <some datum, false>.
     std::pair<data_type, bool> buffer_find(const key_type& key) const {
-        // Binary search for key
-        auto it = std::lower_bound(
-                m_buffer->begin(),
-                m_buffer->begin() + m_num_buffer_items,
-                value_type (key, dummy_datum()),
-                [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;}
-                );
+        bool erased;
+        return buffer_find(key, erased);
+    }
+
+    // Same, but a tombstone for the key is not found either, and
+    // sets erased (which is false otherwise).
+    std::pair<data_type, bool> buffer_find(const key_type& key, bool& erased) const {
+        message_type message;
+        std::pair<data_type, bool> datum_and_found = buffer_find_message(key, message);
+        erased = datum_and_found.second && message == message_type::erase;
+        if (datum_and_found.second && message != message_type::insert)
+            return std::pair<data_type, bool>(dummy_datum(), false);
+        return datum_and_found;
+    }
 
-        // std::lower_bound finds first key that's >= what we look for, or the end
-        bool found = (it != m_buffer->begin() + m_num_buffer_items) && (it->first == key);
+    // Same, but find items of all types (see message_type): if the
+    // buffer has an item with the key, return <its datum (the delta
+    // of an upsert), true> and set message to its type.
+    std::pair<data_type, bool> buffer_find_message(const key_type& key, message_type& message) const {
+        message = message_type::insert;
+        // Most keys that are not in the buffer do not pass the filter
+        if (!m_buffer_filter->may_contain(key))
+            return std::pair<data_type, bool>(dummy_datum(), false);
 
-        if (found)
-            return std::pair<data_type, bool>(it->second, true);
-        else
+        // Search for key
+        int index = m_buffer->lower_bound(m_num_buffer_items, key);
+
+        // lower_bound finds first key that's >= what we look for, or the end
+        bool found = (index != m_num_buffer_items) && (m_buffer->keys[index] == key);
+
+        if (!found)
             return std::pair<data_type, bool>(dummy_datum(), false);
+        message = m_buffer->message(index);
+        return std::pair<data_type, bool>(m_buffer->data[index], true);
+    }
+
+    // Remove the item with the given key from the buffer
+    // (if there is one). Return whether an item was removed.
+    // The key stays in the filter until the buffer is cleared.
+    bool remove_from_buffer(const key_type& key) {
+        int index = m_buffer->lower_bound(m_num_buffer_items, key);
+        if (index == m_num_buffer_items || !(m_buffer->keys[index] == key))
+            return false;
+        m_buffer->shift_left(index, m_num_buffer_items);
+        m_num_buffer_items--;
+        return true;
     }
 
 
@@ -396,7 +577,7 @@ public:
     }
 
     std::vector<value_type> get_values() const {
-        return std::vector<value_type>(m_values->begin(), m_values->begin()+m_num_values);
+        return m_values->get(0, m_num_values);
     }
 
     // Return vector of values with indexes in [low, high).
@@ -404,12 +585,19 @@ public:
     std::vector<value_type> get_values(int low, int high) const {
         assert(low <= high);
         assert(m_num_values >= high);
-        return std::vector<value_type>(m_values->begin() + low, m_values->begin() + high);
+        return m_values->get(low, high);
     }
 
     value_type get_value(int index) const {
         assert(m_num_values > index);
-        return m_values->at(index);
+        return m_values->get(index);
+    }
+
+    // Whether the value is a tombstone: its key was erased, but it
+    // still separates the children.
+    bool value_erased(int index) const {
+        assert(m_num_values > index);
+        return m_values->erased(index);
     }
 
     // Return vector of nodeIDs with indexes in [low, high).
@@ -420,6 +608,19 @@ public:
         return std::vector<int>(m_nodeIDs->begin() + low, m_nodeIDs->begin() + high);
     }
 
+    // Span versions of get_values and get_nodeIDs (no copies).
+    item_span_type values_span(int low, int high) const {
+        assert(low <= high);
+        assert(m_num_values >= high);
+        return m_values->span(low, high);
+    }
+
+    nodeID_span_type nodeIDs_span(int low, int high) const {
+        assert(low <= high);
+        assert(num_children() >= high);
+        return nodeID_span_type(m_nodeIDs->data() + low, high - low);
+    }
+
     // Set values and nodeIDs to given vectors.
     // This clears the whole buffer, values, and nodeIDs before
     // setting the new values and nodeIDs, and should thus
@@ -432,8 +633,28 @@ public:
         clear();
         assert(buffer_empty()); // Not checking for duplicates -> precondition: buffer needs to be empty.
         m_num_values = values.size();
-        std::move(values.begin(), values.end(), m_values->begin());
+        m_values->set(0, values.begin(), values.end());
         std::move(nodeIDs.begin(), nodeIDs.end(), m_nodeIDs->begin());
+        m_pivot_index->build(*m_values, m_num_values);
+    }
+
+    // Same, from spans (e.g. of another node's values and nodeIDs).
+    void set_values_and_nodeIDs(const item_span_type& values, const nodeID_span_type& nodeIDs) {
+        assert(nodeIDs.size() == values.size() + 1);
+        assert(values.size() <= max_num_values_in_node);
+        clear();
+        m_num_values = values.size();
+        m_values->set(0, values);
+        std::copy(nodeIDs.begin(), nodeIDs.end(), m_nodeIDs->begin());
+        m_pivot_index->build(*m_values, m_num_values);
+    }
+
+    // Keep only the first num_values values and the first
+    // num_values + 1 nodeIDs (e.g. when splitting the node).
+    void truncate_values(int num_values) {
+        assert(0 <= num_values && num_values <= m_num_values);
+        m_num_values = num_values;
+        m_pivot_index->build(*m_values, m_num_values);
     }
 
     // Given new_values that should be inserted to the buffer, replace duplicate keys
@@ -444,26 +665,27 @@ public:
         remaining_new_values.reserve(new_values.size());
 
         auto it_new_values = new_values.begin();
-        auto it_current_values = m_values->begin();
+        int current_index = 0;
 
         // Walk through the two sorted lists, and for all duplicate keys,
         // replace the datum in m_values with the new datum from
         // new_values.
-        while ((it_new_values != new_values.end()) && (it_current_values != m_values->begin() + m_num_values)) {
+        while ((it_new_values != new_values.end()) && (current_index != m_num_values)) {
+            const key_type& current_key = m_values->keys[current_index];
             // Compare by key
-            if (it_new_values->first < it_current_values->first) {
+            if (it_new_values->first < current_key) {
                 // No duplicate -> still want to insert the new value into the buffer
                 remaining_new_values.push_back(*it_new_values);
                 it_new_values++;
                 continue;
             }
-            if (it_new_values->first > it_current_values->first) {
-                it_current_values++;
+            if (it_new_values->first > current_key) {
+                current_index++;
                 continue;
             }
             // Keys equal -> duplicate found -> take data from new_values.
-            it_current_values->second = it_new_values->second;
-            it_current_values++;
+            m_values->data[current_index] = it_new_values->second;
+            current_index++;
             it_new_values++;
         }
         // Insert remaining elements
@@ -474,12 +696,12 @@ public:
         return remaining_new_values;
     }
 
-    // Add value to the node's values, and add the corresponding children to
-    // the node's nodeIDs.
+    // Add value (a tombstone if erased is set) to the node's values, and
+    // add the corresponding children to the node's nodeIDs.
     // Precondition: the key of value is neither in the buffer nor in
     // the values before insertion.
     // Precondition: there is still space in the values, i.e. num_values() < max_num_values_in_node
-    void add_to_values(value_type value, const int left_child_id, const int right_child_id) {
+    void add_to_values(value_type value, const int left_child_id, const int right_child_id, bool erased = false) {
         assert(num_values() < max_num_values_in_node);
         /*
          * Pseudocode:
@@ -489,24 +711,15 @@ public:
          * 4. insert left child id in free space at index i
          * 5. overwrite id at i+1 with right child id
          */
-        // 1.
-        // Binary search for position to insert
-        auto insert_position_it = std::lower_bound(
-                m_values->begin(),
-                m_values->begin() + m_num_values,
-                value,
-                [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;}
-        );
+        // 1. + 2.
+        // Search for position to insert
+        int insert_position_index = m_values->lower_bound(m_num_values, value.first);
         // Shift all values [position to insert, last position] one to the right
         // to make space for the new value.
-        for (auto it = m_values->begin() + m_num_values; it != insert_position_it; it--) {
-            *it = *(it-1);
-        }
+        m_values->shift_right(insert_position_index, m_num_values);
         // Insert new value
-        *insert_position_it = value;
+        m_values->set(insert_position_index, value, erased ? message_type::erase : message_type::insert);
 
-        // 2.
-        int insert_position_index = std::distance(m_values->begin(), insert_position_it);
         auto nodeID_insert_position_it = m_nodeIDs->begin() + insert_position_index;
 
         // 3.
@@ -519,33 +732,71 @@ public:
         *(nodeID_insert_position_it+1) = right_child_id;
 
         m_num_values++;
+        m_pivot_index->build(*m_values, m_num_values);
+    }
+
+    // Remove the value with the given index and the child to its
+    // right (e.g. after that child was merged into the one to its left).
+    void remove_value(int index) {
+        assert(0 <= index && index < m_num_values);
+        m_values->shift_left(index, m_num_values);
+        std::move(m_nodeIDs->begin() + index + 2, m_nodeIDs->begin() + m_num_values + 1,
+                  m_nodeIDs->begin() + index + 1);
+        m_num_values--;
+        m_pivot_index->build(*m_values, m_num_values);
+    }
+
+    // Append the value pivot (a tombstone if pivot_erased is set) and
+    // the values, children and buffer items of right_node (whose keys
+    // are all greater than pivot's, which are greater than this node's)
+    // to this node, if they fit. Return whether they did; otherwise
+    // this node is unchanged.
+    bool try_merge(const value_type& pivot, bool pivot_erased, const self_type& right_node) {
+        if (m_num_values + 1 + right_node.m_num_values > max_num_values_in_node
+            || m_num_buffer_items + right_node.m_num_buffer_items > max_num_buffer_items_in_node)
+            return false;
+        m_values->set(m_num_values, pivot, pivot_erased ? message_type::erase : message_type::insert);
+        m_values->set(m_num_values + 1, right_node.values_span(0, right_node.m_num_values));
+        std::copy(right_node.m_nodeIDs->begin(), right_node.m_nodeIDs->begin() + right_node.num_children(),
+                  m_nodeIDs->begin() + m_num_values + 1);
+        m_num_values += 1 + right_node.m_num_values;
+        m_pivot_index->build(*m_values, m_num_values);
+
+        m_buffer->set(m_num_buffer_items, right_node.buffer_span());
+        for (int i = 0; i < right_node.m_num_buffer_items; i++)
+            m_buffer_filter->insert(right_node.m_buffer->keys[i]);
+        m_num_buffer_items += right_node.m_num_buffer_items;
+        return true;
     }
 
     // Find key in values array. Return type:
     // < <datum of key if found else dummy_datum, id of child to go to>, bool whether key was found >
     // Precondition: num_values() > 0
     std::pair<std::pair<data_type, int>, bool> values_find(const key_type& key) const {
-        assert(num_values() > 0);
-        // Binary search for key
-        auto it = std::lower_bound(
-                m_values->begin(),
-                m_values->begin() + m_num_values,
-                value_type (key, dummy_datum()),
-                [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;}
-        );
-
-        // std::lower_bound finds first key that's >= what we look for, or the end
-        bool found = (it != m_values->begin() + m_num_values) && (it->first == key);
+        bool erased;
+        return values_find(key, erased);
+    }
 
-        if (found)
+    // Same, but a value that is a tombstone is not found either,
+    // and sets erased (which is false otherwise).
+    std::pair<std::pair<data_type, int>, bool> values_find(const key_type& key, bool& erased) const {
+        assert(num_values() > 0);
+        // Search for key
+        // (index of the first key that's >= what we look for, or the end)
+        std::pair<int, bool> index_and_found = m_pivot_index->find(*m_values, m_num_values, key);
+        int index = index_and_found.first;
+        bool found = index_and_found.second;
+        erased = found && m_values->erased(index);
+
+        if (found && !erased)
             return std::pair< std::pair<data_type, int>, bool >(
-                    std::pair<data_type, int>(it->second,0),
+                    std::pair<data_type, int>(m_values->data[index],0),
                     true
                     );
         else {
             // First key that's >= what we're looking for is
             // at index i -> want to go to i'th child next.
-            int index_of_upper_bound_key = it - m_values->begin();
+            int index_of_upper_bound_key = index;
             assert(index_of_upper_bound_key < num_children());
             int id_of_child_to_go_to = (*m_nodeIDs)[index_of_upper_bound_key];
 
@@ -558,43 +809,128 @@ public:
     }
 
     int get_id() { return m_id; }
+
+private:
+    // See add_to_buffer. new_items is a span or vector of items.
+    template<typename Items>
+    void add_items_to_buffer(const Items& new_items) {
+        /*
+         * When adding new items to the node's buffer, we might
+         * have duplicate keys in the new items and the current values,
+         * and duplicate keys in the new items and the current buffer items.
+         *
+         * Pseudocode:
+         * 1. Check for duplicate keys in new items and current values.
+         *    Use the new data for all duplicates.
+         * 2. Merge the remaining new items into the buffer in place,
+         *    and again use the new item for all duplicates.
+         *
+         * New tombstones replace items like the other new items (a
+         * value becomes a tombstone), and new items replace tombstones.
+         * New upserts are combined with the items they replace (so a
+         * value stays an inserted item, see combine_messages).
+         * Without values (the root of a tree of depth 1), the buffer
+         * holds all items, so the messages are applied instead.
+         */
+        assert(is_sorted_by_key(new_items));
+
+        // The new items that go to the values can be in the
+        // filter, too (it only needs to have no false negatives).
+        for (int i = 0; i < new_items.size(); i++)
+            m_buffer_filter->insert(new_items[i].first);
+
+        if (m_num_values == 0) {
+            m_num_buffer_items = m_buffer->apply_in_place(m_num_buffer_items, new_items, Combine());
+            return;
+        }
+
+        // Whether the key of a new item is in the values. The merge
+        // asks in key order (forwards, then backwards), so walking
+        // through the values is cheaper than searching them.
+        int value_index = 0;
+        auto is_in_values = [this, &new_items, &value_index](int index) -> bool {
+            key_type key = new_items[index].first;
+            while (value_index < m_num_values && m_values->keys[value_index] < key)
+                value_index++;
+            while (value_index > 0 && !(m_values->keys[value_index - 1] < key))
+                value_index--;
+            return value_index < m_num_values && !(key < m_values->keys[value_index]);
+        };
+
+        // 1.
+        // For all duplicate keys, replace the datum in the values.
+        for (int i = 0; i < new_items.size(); i++) {
+            if (is_in_values(i)) {
+                data_type datum = new_items[i].second;
+                message_type message = detail::combine_messages<Combine>(
+                    m_values->message(value_index), m_values->data[value_index],
+                    detail::message_of(new_items, i), datum);
+                m_values->set(value_index, value_type(new_items[i].first, datum), message);
+            }
+        }
+
+        // 2.
+        m_num_buffer_items = m_buffer->merge_in_place(m_num_buffer_items, new_items, is_in_values, Combine());
+    }
 };
 
 template<typename KeyType,
         typename DataType,
-        unsigned RawBlockSize>
-bool operator == (const node<KeyType, DataType, RawBlockSize>& node1, const node<KeyType, DataType, RawBlockSize>& node2) {
+        unsigned RawBlockSize,
+        pivot_layout PivotLayout,
+        bool UseBufferFilter,
+        typename Epsilon,
+        typename Combine>
+bool operator == (const node<KeyType, DataType, RawBlockSize, PivotLayout, UseBufferFilter, Epsilon, Combine>& node1,
+                  const node<KeyType, DataType, RawBlockSize, PivotLayout, UseBufferFilter, Epsilon, Combine>& node2) {
     return node1.get_id() == node2.get_id();
 }
 
 template<typename KeyType,
         typename DataType,
-        unsigned RawBlockSize>
-bool operator != (const node<KeyType, DataType, RawBlockSize>& node1, const node<KeyType, DataType, RawBlockSize>& node2) {
+        unsigned RawBlockSize,
+        pivot_layout PivotLayout,
+        bool UseBufferFilter,
+        typename Epsilon,
+        typename Combine>
+bool operator != (const node<KeyType, DataType, RawBlockSize, PivotLayout, UseBufferFilter, Epsilon, Combine>& node1,
+                  const node<KeyType, DataType, RawBlockSize, PivotLayout, UseBufferFilter, Epsilon, Combine>& node2) {
     return !(node1.get_id() == node2.get_id());
 }
 
 
+// Combine is the combine function of upserts (see no_upsert).
 template<typename KeyType,
         typename DataType,
-        unsigned RawBlockSize>
+        unsigned RawBlockSize,
+        typename Combine = no_upsert>
 class leaf final {
     // Type declarations
     using key_type = KeyType;
     using data_type = DataType;
     using value_type = std::pair<key_type, data_type>;
-    using self_type = leaf<KeyType, DataType, RawBlockSize>;
+    using self_type = leaf<KeyType, DataType, RawBlockSize, Combine>;
     using bid_type = foxxll::BID<RawBlockSize>;
 
 public:
     // Set up sizes and types for the blocks used to store inner nodes' data in external memory.
     enum {
         max_num_buffer_items_in_leaf = (int) (RawBlockSize / sizeof(value_type)),
+        // New items that a leaf can take if it is split (once) when
+        // they do not fit (see merge_and_split).
+        max_num_items_per_push = max_num_buffer_items_in_leaf,
+        // Largest item_size of an item (see node::item_size).
+        max_item_size = 1,
     };
     static_assert(max_num_buffer_items_in_leaf >= 2, "RawBlockSize too small -> too few buffer items per leaf!");
 
+    using buffer_type = item_array<key_type, data_type, max_num_buffer_items_in_leaf>;
+    // View into the leaf's block (only valid while it is pinned).
+    using item_span_type = item_span<key_type, data_type>;
+
+    // Keys and data are stored in separate arrays (see item_array).
     struct leaf_block {
-        std::array<value_type, max_num_buffer_items_in_leaf> buffer {};
+        buffer_type buffer {};
     };
     using block_type = foxxll::typed_block<RawBlockSize, leaf_block>;
     static_assert(sizeof(leaf_block) <= sizeof(block_type), "RawBlockSize too small!");
@@ -607,7 +943,7 @@ private:
     int m_num_buffer_items = 0;
     block_type* m_block = NULL;
 
-    std::array<value_type, max_num_buffer_items_in_leaf>* m_buffer  = nullptr;
+    buffer_type* m_buffer  = nullptr;
 
 public:
     explicit leaf(int ID, bid_type BID) : m_id(ID), m_bid(BID) {};
@@ -646,37 +982,119 @@ public:
     }
 
     std::vector<value_type> get_buffer_items() const {
-        return std::vector<value_type>(m_buffer->begin(), m_buffer->begin()+m_num_buffer_items);
+        return m_buffer->get(0, m_num_buffer_items);
+    }
+
+    // Span version of get_buffer_items (no copies).
+    item_span_type buffer_span() const {
+        return m_buffer->span(0, m_num_buffer_items);
     }
 
     // Set the buffer to new_values.
     // The buffer will be cleared before the
     // new values are inserted.
-    void set_buffer(std::vector<value_type>& new_values) {
+    void set_buffer(const std::vector<value_type>& new_values) {
         assert(new_values.size() <= max_num_buffer_items_in_leaf);
 
         clear_buffer();
         m_num_buffer_items = new_values.size();
-        std::move(new_values.begin(), new_values.end(), m_buffer->begin());
+        m_buffer->set(0, new_values.begin(), new_values.end());
+    }
+
+    void set_buffer(const item_span_type& new_items) {
+        assert(new_items.size() <= max_num_buffer_items_in_leaf);
+
+        m_num_buffer_items = new_items.size();
+        m_buffer->set(0, new_items);
     }
 
     // Add the new values to the buffer. In case of duplicate keys,
     // take the data from new_values.
-    void add_to_buffer(std::vector<value_type>& new_values) {
+    void add_to_buffer(const std::vector<value_type>& new_values) {
+        add_items_to_buffer(array_span<value_type>(new_values));
+    }
+
+    // Same, from a span (e.g. of the buffer of the parent node).
+    void add_to_buffer(const item_span_type& new_items) {
+        add_items_to_buffer(new_items);
+    }
 
-        bool is_sorted = std::is_sorted(new_values.begin(), new_values.end(),
-                                        [] (value_type val1, value_type val2)->bool { return val1.first < val2.first; });
-        assert(is_sorted);
+    // Add the new items (a span or vector of items) to the buffer if
+    // it has space for all of them; return whether it had (else the
+    // leaf is unchanged). Tombstones among the new items remove the
+    // items with their keys (and are not added), upserts are combined
+    // with them (see no_upsert).
+    template<typename Items>
+    bool try_add_to_buffer(const Items& new_items) {
+        // Only count the duplicates and tombstones if necessary.
+        if (m_num_buffer_items + static_cast<int>(new_items.size()) > max_num_buffer_items_in_leaf
+            && m_buffer->applied_size(m_num_buffer_items, new_items) > max_num_buffer_items_in_leaf)
+            return false;
+        add_items_to_buffer(new_items);
+        return true;
+    }
 
-        std::vector<value_type> buffer_values = std::vector<value_type>(m_buffer->begin(), m_buffer->begin()+m_num_buffer_items);
+    // Whether the leaf has so few items that it should be
+    // merged with a neighbor (see try_merge).
+    bool underflows() const {
+        return m_num_buffer_items < max_num_buffer_items_in_leaf / 4;
+    }
 
-        // Merge, and take from values in case of duplicates
-        std::vector<value_type> new_buffer_values = merge_into<value_type>(new_values, buffer_values);
-        assert(new_buffer_values.size() <= max_num_buffer_items_in_leaf);
+    // Append the pivot items (at most the one value of the parent
+    // between the leaves) and the items of right_leaf (whose keys are
+    // all greater, like the pivot's are greater than this leaf's) to
+    // this leaf, if they fit. Return whether they did; otherwise this
+    // leaf is unchanged.
+    bool try_merge(const std::vector<value_type>& pivot, const self_type& right_leaf) {
+        int num_merged = m_num_buffer_items + static_cast<int>(pivot.size()) + right_leaf.m_num_buffer_items;
+        if (num_merged > max_num_buffer_items_in_leaf)
+            return false;
+        m_buffer->set(m_num_buffer_items, pivot.begin(), pivot.end());
+        m_buffer->set(m_num_buffer_items + static_cast<int>(pivot.size()), right_leaf.buffer_span());
+        m_num_buffer_items = num_merged;
+        return true;
+    }
 
-        // Replace buffer with new buffer values
-        m_num_buffer_items = new_buffer_values.size();
-        std::move(new_buffer_values.begin(), new_buffer_values.end(), m_buffer->begin());
+    /*
+     * Merge the new items into the buffer (like add_to_buffer, but
+     * the merged items need not fit into one leaf), and split them
+     * up: the items before the mid item stay in this leaf, the items
+     * after it go to right_leaf (whose buffer is replaced). Return
+     * the mid item. Tombstones and upserts are applied as in
+     * try_add_to_buffer.
+     * Precondition: the merge has at least one item.
+     */
+    value_type merge_and_split(const item_span_type& new_items, self_type& right_leaf) {
+        assert(is_sorted_by_key(new_items));
+        assert(&right_leaf != this);
+
+        auto skip_erased = [&new_items](int index) { return new_items.erased(index); };
+        m_num_buffer_items = m_buffer->remove_erased(m_num_buffer_items, new_items);
+        int num_merged = m_buffer->merged_size(m_num_buffer_items, new_items, skip_erased);
+        assert(num_merged > 0);
+        int mid = (num_merged - 1) / 2;
+        value_type mid_value;
+        auto distribute = [this, &right_leaf, &mid_value, mid](int index, const value_type& message_item,
+                                                               message_type message) {
+            value_type item = detail::applied_item<Combine>(message_item, message);
+            if (index < mid)
+                m_buffer->set(index, item);
+            else if (index == mid)
+                mid_value = item;
+            else
+                right_leaf.m_buffer->set(index - mid - 1, item);
+        };
+        // The items that stay in place can include the mid
+        // item and items that go to the right leaf.
+        int num_in_place = m_buffer->merge(m_num_buffer_items, new_items, num_merged, skip_erased, distribute,
+                                           Combine());
+        for (int index = mid; index < num_in_place; index++)
+            distribute(index, m_buffer->get(index), message_type::insert);
+
+        m_num_buffer_items = mid;
+        right_leaf.m_num_buffer_items = num_merged - mid - 1;
+        assert(right_leaf.m_num_buffer_items <= max_num_buffer_items_in_leaf);
+        return mid_value;
     }
 
     // Given a key, search for an item that has that key in the
@@ -684,23 +1102,27 @@ public:
     // <datum of the item, true>. Else, return a pair
     // <some datum, false>.
     std::pair<data_type, bool> buffer_find(const key_type& key) const {
-        // Binary search for key
-        auto it = std::lower_bound(
-                m_buffer->begin(),
-                m_buffer->begin() + m_num_buffer_items,
-                value_type (key, dummy_datum()),
-                [](const value_type& val1, const value_type& val2)->bool {return val1.first < val2.first;}
-        );
+        // Search for key
+        int index = m_buffer->lower_bound(m_num_buffer_items, key);
 
-        // std::lower_bound finds first key that's >= what we look for, or the end
-        bool found = (it != m_buffer->begin() + m_num_buffer_items) && (it->first == key);
+        // lower_bound finds first key that's >= what we look for, or the end
+        bool found = (index != m_num_buffer_items) && (m_buffer->keys[index] == key);
 
         if (found)
-            return std::pair<data_type, bool>(it->second, true);
+            return std::pair<data_type, bool>(m_buffer->data[index], true);
         else
             return std::pair<data_type, bool>(dummy_datum(), false);
     }
 
+private:
+    // See add_to_buffer. new_items is a span or vector of items.
+    template<typename Items>
+    void add_items_to_buffer(const Items& new_items) {
+        assert(is_sorted_by_key(new_items));
+        // Merge in place, take from the new items in case of
+        // duplicates, and apply the tombstones and upserts
+        m_num_buffer_items = m_buffer->apply_in_place(m_num_buffer_items, new_items, Combine());
+    }
 };
 
 
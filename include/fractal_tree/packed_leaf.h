@@ -0,0 +1,492 @@
+/*
+ * packed_leaf.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_PACKED_LEAF_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_PACKED_LEAF_H
+
+#include <foxxll/mng/typed_block.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "key_search.h"
+
+// Whether fractal trees with integer keys use packed leaves (see
+// packed_leaf) by default, 0: no, 1: yes. Packed leaves hold more
+// items per block if the keys of a leaf are close to each other.
+#ifndef FRACTAL_TREE_PACKED_LEAVES
+#define FRACTAL_TREE_PACKED_LEAVES 0
+#endif
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+constexpr bool default_packed_leaves = FRACTAL_TREE_PACKED_LEAVES;
+
+// Keys that packed leaves can store (integers other than bool).
+template<typename KeyType>
+using is_packable_key = std::integral_constant<bool,
+    std::is_integral<KeyType>::value && !std::is_same<KeyType, bool>::value>;
+
+/*
+ * Leaf that stores its keys with frame-of-reference encoding: the
+ * keys in [base, base + 2^bit_width) are stored as bit-packed
+ * offsets from base, the keys below and above that window as they
+ * are (e.g. a few outliers). Each leaf picks base and bit_width for
+ * its keys, so the number of items that fit into a leaf depends on
+ * how close its keys are: a leaf is full once its items do not fit
+ * into the block anymore, not at a fixed number of items.
+ *
+ * buffer_find searches the packed keys directly. The other methods
+ * decode the items into a scratch buffer (shared by all packed
+ * leaves of a thread), work on that, and encode them again. Spans
+ * from buffer_span point into the scratch buffer, so they are only
+ * valid until the next call on a packed leaf.
+ *
+ * Besides that, packed_leaf has the interface of leaf.
+ */
+template<typename KeyType,
+        typename DataType,
+        unsigned RawBlockSize,
+        typename Combine = no_upsert>
+class packed_leaf final {
+    // Type declarations
+    using key_type = KeyType;
+    using data_type = DataType;
+    using value_type = std::pair<key_type, data_type>;
+    using self_type = packed_leaf<KeyType, DataType, RawBlockSize, Combine>;
+    using bid_type = foxxll::BID<RawBlockSize>;
+    using unsigned_key_type = typename std::make_unsigned<key_type>::type;
+
+    static_assert(is_packable_key<KeyType>::value, "packed leaves need integer keys!");
+
+    static constexpr int num_key_bits = 8 * sizeof(key_type);
+    static constexpr size_t max_alignment(size_t a, size_t b) { return a > b ? a : b; }
+    static constexpr size_t round_up(size_t size, size_t alignment) {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+public:
+    // Where the items of a leaf are: the first num_low keys are less
+    // than base, the next num_packed keys are packed, the remaining
+    // num_high keys are greater.
+    struct packing {
+        key_type base {};
+        int bit_width = 0;
+        int num_low = 0;
+        int num_packed = 0;
+        int num_high = 0;
+
+        int size() const { return num_low + num_packed + num_high; }
+    };
+
+    static constexpr size_t area_alignment =
+        max_alignment(max_alignment(alignof(uint64_t), alignof(key_type)), alignof(data_type));
+
+    enum {
+        area_size = RawBlockSize - round_up(sizeof(packing), area_alignment),
+    };
+
+    // The data of the items, then the keys that are not packed, then
+    // the packed keys (64 bit words), one after another in area.
+    struct leaf_block : packing {
+        alignas(area_alignment) unsigned char area[area_size];
+    };
+    using block_type = foxxll::typed_block<RawBlockSize, leaf_block>;
+    static_assert(sizeof(leaf_block) <= sizeof(block_type), "RawBlockSize too small!");
+
+    enum {
+        // Upper bound (every item takes at least the size of its datum).
+        max_num_buffer_items_in_leaf = area_size / sizeof(data_type),
+        // Padding in area (see area_bytes).
+        max_padding = alignof(key_type) + 2 * sizeof(uint64_t),
+        raw_item_size = sizeof(key_type) + sizeof(data_type),
+        // New items that a leaf can take if it is split (once) when
+        // they do not fit: a key that does not fit in a leaf's packing
+        // takes raw_item_size bytes, so merging them and splitting by
+        // size gives two halves that fit (see merge_and_split).
+        max_num_items_per_push = (area_size - 2 * raw_item_size - 2 * max_padding) / raw_item_size,
+        // Largest item_size of an item (see node::item_size).
+        max_item_size = 1,
+    };
+    static_assert(max_num_items_per_push >= 2, "RawBlockSize too small -> too few buffer items per leaf!");
+
+    using item_span_type = item_span<key_type, data_type>;
+    using scratch_type = item_array<key_type, data_type, 2 * max_num_buffer_items_in_leaf>;
+
+    static constexpr data_type dummy_datum() { return data_type(); };
+
+private:
+    const int m_id;
+    bid_type m_bid;
+    leaf_block* m_block = nullptr;
+
+public:
+    explicit packed_leaf(int ID, bid_type BID) : m_id(ID), m_bid(BID) {};
+
+    bid_type& get_bid() {
+        return m_bid;
+    }
+
+    int get_id() const {
+        return m_id;
+    }
+
+    void set_block(block_type* block) {
+        m_block = block->begin();
+    }
+
+    bool buffer_empty() const {
+        return num_items_in_buffer() == 0;
+    }
+
+    int num_items_in_buffer() const {
+        return m_block->size();
+    }
+
+    const packing& get_packing() const {
+        return *m_block;
+    }
+
+    void clear_buffer() {
+        static_cast<packing&>(*m_block) = packing();
+    }
+
+    std::vector<value_type> get_buffer_items() const {
+        int size = decode();
+        return scratch().get(0, size);
+    }
+
+    // The items, decoded into the scratch buffer (see above).
+    item_span_type buffer_span() const {
+        int size = decode();
+        return scratch().span(0, size);
+    }
+
+    // Set the buffer to new_values.
+    void set_buffer(const std::vector<value_type>& new_values) {
+        set_items(array_span<value_type>(new_values));
+    }
+
+    void set_buffer(const item_span_type& new_items) {
+        set_items(new_items);
+    }
+
+    // Add the new values to the buffer. In case of duplicate keys,
+    // take the data from new_values.
+    void add_to_buffer(const std::vector<value_type>& new_values) {
+        bool fits = try_add_to_buffer(array_span<value_type>(new_values));
+        assert(fits);
+        (void)fits;
+    }
+
+    void add_to_buffer(const item_span_type& new_items) {
+        bool fits = try_add_to_buffer(new_items);
+        assert(fits);
+        (void)fits;
+    }
+
+    // Add the new items (a span or vector of items) to the buffer if
+    // they fit; return whether they did (else the leaf is unchanged).
+    // Tombstones among the new items remove the items with their keys
+    // (and are not added), upserts are combined with them.
+    template<typename Items>
+    bool try_add_to_buffer(const Items& new_items) {
+        assert(is_sorted_by_key(new_items));
+        scratch_type& items = scratch();
+        int size = items.apply_in_place(decode(), new_items, Combine());
+        packing new_packing = best_packing(items.keys.data(), size, &get_packing());
+        if (area_bytes(new_packing) > area_size)
+            return false;
+        encode(items.keys.data(), items.data.data(), new_packing);
+        return true;
+    }
+
+    /*
+     * Merge the new items into the buffer (like add_to_buffer, but
+     * the merged items need not fit into one leaf), and split them
+     * up: the items before the mid item stay in this leaf, the items
+     * after it go to right_leaf (whose buffer is replaced). Return
+     * the mid item. Tombstones and upserts are applied as in
+     * try_add_to_buffer.
+     * Precondition: the merge has at least one item, and there are at
+     * most max_num_items_per_push new items.
+     *
+     * The mid item is the one at which the merged items, in the
+     * packing of this leaf, take half of their size. New items take
+     * at most raw_item_size bytes each in this packing, so both
+     * halves fit (in this packing, or a better one).
+     */
+    template<typename Items>
+    value_type merge_and_split(const Items& new_items, self_type& right_leaf) {
+        assert(is_sorted_by_key(new_items));
+        assert(new_items.size() <= max_num_items_per_push);
+        assert(&right_leaf != this);
+
+        scratch_type& items = scratch();
+        int size = items.apply_in_place(decode(), new_items, Combine());
+        assert(size > 0);
+        const key_type* keys = items.keys.data();
+        const data_type* data = items.data.data();
+
+        packing split_packing = buffer_empty()
+            ? best_packing(keys, size, nullptr)
+            : packing_with(keys, size, get_packing().base, get_packing().bit_width);
+        // Size of each item in bits in split_packing.
+        auto item_bits = [&split_packing](int index) -> size_t {
+            bool is_packed = split_packing.num_low <= index
+                             && index < split_packing.num_low + split_packing.num_packed;
+            return 8 * sizeof(data_type) + (is_packed ? split_packing.bit_width : num_key_bits);
+        };
+        size_t total_bits = 0;
+        for (int i = 0; i < size; i++)
+            total_bits += item_bits(i);
+        int mid = 0;
+        for (size_t bits = item_bits(0); 2 * bits < total_bits; bits += item_bits(mid))
+            mid++;
+        value_type mid_value(keys[mid], data[mid]);
+
+        packing right_packing = best_packing(keys + mid + 1, size - mid - 1, &split_packing);
+        assert(area_bytes(right_packing) <= area_size);
+        right_leaf.encode(keys + mid + 1, data + mid + 1, right_packing);
+
+        packing left_packing = best_packing(keys, mid, &split_packing);
+        assert(area_bytes(left_packing) <= area_size);
+        encode(keys, data, left_packing);
+
+        return mid_value;
+    }
+
+    // Whether the leaf's items take so little of its area that it
+    // should be merged with a neighbor (see try_merge).
+    bool underflows() const {
+        return area_bytes(get_packing()) < area_size / 4;
+    }
+
+    // Append the pivot items (at most the one value of the parent
+    // between the leaves) and the items of right_leaf (whose keys are
+    // all greater, like the pivot's are greater than this leaf's) to
+    // this leaf, if they fit. Return whether they did; otherwise this
+    // leaf is unchanged.
+    bool try_merge(const std::vector<value_type>& pivot, const self_type& right_leaf) {
+        // More items than max_num_buffer_items_in_leaf never fit.
+        if (num_items_in_buffer() + static_cast<int>(pivot.size()) + right_leaf.num_items_in_buffer()
+            > max_num_buffer_items_in_leaf)
+            return false;
+        // Both leaves decode into the scratch buffer.
+        std::vector<value_type> right_items = right_leaf.get_buffer_items();
+        scratch_type& items = scratch();
+        int size = decode();
+        items.set(size, pivot.begin(), pivot.end());
+        size += pivot.size();
+        items.set(size, right_items.begin(), right_items.end());
+        size += right_items.size();
+        packing new_packing = best_packing(items.keys.data(), size, &get_packing());
+        if (area_bytes(new_packing) > area_size)
+            return false;
+        encode(items.keys.data(), items.data.data(), new_packing);
+        return true;
+    }
+
+    // Given a key, search for an item that has that key in the
+    // buffer. If such an item is found, return a pair
+    // <datum of the item, true>. Else, return a pair
+    // <some datum, false>.
+    std::pair<data_type, bool> buffer_find(const key_type& key) const {
+        const packing& p = get_packing();
+        const key_type* raw = raw_keys(p);
+        int index;
+        bool found;
+        if (key < p.base) {
+            index = lower_bound_index(raw, p.num_low, key);
+            found = index != p.num_low && raw[index] == key;
+        } else if (fits_packing(key, p.base, p.bit_width)) {
+            const uint64_t* words = packed_words(p);
+            unsigned_key_type offset = unsigned_key_type(key) - unsigned_key_type(p.base);
+            // Binary search on the packed offsets
+            int first = 0;
+            int count = p.num_packed;
+            while (count > 0) {
+                int step = count / 2;
+                if (read_field(words, first + step, p.bit_width) < offset) {
+                    first += step + 1;
+                    count -= step + 1;
+                } else {
+                    count = step;
+                }
+            }
+            found = first != p.num_packed && read_field(words, first, p.bit_width) == offset;
+            index = p.num_low + first;
+        } else {
+            int high_index = lower_bound_index(raw + p.num_low, p.num_high, key);
+            found = high_index != p.num_high && raw[p.num_low + high_index] == key;
+            index = p.num_low + p.num_packed + high_index;
+        }
+
+        if (found)
+            return std::pair<data_type, bool>(data_array()[index], true);
+        else
+            return std::pair<data_type, bool>(dummy_datum(), false);
+    }
+
+    // Size in bytes of the items of a leaf with the packing in area.
+    static size_t area_bytes(const packing& p) {
+        size_t raw_keys_offset = round_up(p.size() * sizeof(data_type), alignof(key_type));
+        size_t packed_offset = round_up(raw_keys_offset + (p.num_low + p.num_high) * sizeof(key_type), sizeof(uint64_t));
+        return packed_offset + num_words(p.num_packed, p.bit_width) * sizeof(uint64_t);
+    }
+
+private:
+    static scratch_type& scratch() {
+        static thread_local std::unique_ptr<scratch_type> items(new scratch_type);
+        return *items;
+    }
+
+    // ---------------- Packing ----------------
+
+    // Whether a key that is not less than base fits into the window.
+    static bool fits_packing(const key_type& key, const key_type& base, int bit_width) {
+        return bit_width >= num_key_bits
+               || unsigned_key_type(unsigned_key_type(key) - unsigned_key_type(base)) < (unsigned_key_type(1) << bit_width);
+    }
+
+    static int num_words(int num_packed, int bit_width) {
+        return static_cast<int>((static_cast<uint64_t>(num_packed) * bit_width + 63) / 64);
+    }
+
+    // Packing of the size sorted keys with the given base and bit width.
+    static packing packing_with(const key_type* keys, int size, const key_type& base, int bit_width) {
+        packing p;
+        p.base = base;
+        p.bit_width = bit_width;
+        p.num_low = lower_bound_index(keys, size, base);
+        const key_type* first = keys + p.num_low;
+        p.num_packed = std::partition_point(first, keys + size, [&](const key_type& key) {
+            return fits_packing(key, base, bit_width);
+        }) - first;
+        p.num_high = size - p.num_low - p.num_packed;
+        return p;
+    }
+
+    // Smallest packing of the size sorted keys with the smallest key
+    // as base (or other_packing's base and width, if it is smaller).
+    static packing best_packing(const key_type* keys, int size, const packing* other_packing) {
+        packing best;
+        if (size == 0)
+            return best;
+        size_t best_bytes = SIZE_MAX;
+        for (int bit_width = 0; bit_width <= num_key_bits; bit_width++) {
+            packing p = packing_with(keys, size, keys[0], bit_width);
+            size_t bytes = area_bytes(p);
+            if (bytes < best_bytes) {
+                best = p;
+                best_bytes = bytes;
+            }
+            // Wider windows cannot hold more keys.
+            if (p.num_high == 0)
+                break;
+        }
+        if (other_packing != nullptr && other_packing->size() > 0) {
+            packing p = packing_with(keys, size, other_packing->base, other_packing->bit_width);
+            if (area_bytes(p) < best_bytes)
+                best = p;
+        }
+        return best;
+    }
+
+    // ---------------- Area ----------------
+
+    data_type* data_array() const {
+        return reinterpret_cast<data_type*>(m_block->area);
+    }
+
+    key_type* raw_keys(const packing& p) const {
+        size_t offset = round_up(p.size() * sizeof(data_type), alignof(key_type));
+        return reinterpret_cast<key_type*>(m_block->area + offset);
+    }
+
+    uint64_t* packed_words(const packing& p) const {
+        size_t offset = round_up(round_up(p.size() * sizeof(data_type), alignof(key_type))
+                                 + (p.num_low + p.num_high) * sizeof(key_type), sizeof(uint64_t));
+        return reinterpret_cast<uint64_t*>(m_block->area + offset);
+    }
+
+    // The index-th field of bit_width bits.
+    static uint64_t read_field(const uint64_t* words, int index, int bit_width) {
+        if (bit_width == 0)
+            return 0;
+        uint64_t bit = static_cast<uint64_t>(index) * bit_width;
+        int word = static_cast<int>(bit / 64);
+        int shift = static_cast<int>(bit % 64);
+        uint64_t field = words[word] >> shift;
+        if (shift + bit_width > 64)
+            field |= words[word + 1] << (64 - shift);
+        return bit_width == 64 ? field : field & ((uint64_t(1) << bit_width) - 1);
+    }
+
+    static void write_field(uint64_t* words, int index, int bit_width, uint64_t field) {
+        if (bit_width == 0)
+            return;
+        uint64_t bit = static_cast<uint64_t>(index) * bit_width;
+        int word = static_cast<int>(bit / 64);
+        int shift = static_cast<int>(bit % 64);
+        words[word] |= field << shift;
+        if (shift + bit_width > 64)
+            words[word + 1] |= field >> (64 - shift);
+    }
+
+    // Decode the items into the scratch buffer; return their number.
+    int decode() const {
+        const packing& p = get_packing();
+        scratch_type& items = scratch();
+        const key_type* raw = raw_keys(p);
+        const uint64_t* words = packed_words(p);
+        int size = p.size();
+        std::copy(data_array(), data_array() + size, items.data.begin());
+        std::copy(raw, raw + p.num_low, items.keys.begin());
+        for (int i = 0; i < p.num_packed; i++)
+            items.keys[p.num_low + i] = key_type(unsigned_key_type(p.base) + unsigned_key_type(read_field(words, i, p.bit_width)));
+        std::copy(raw + p.num_low, raw + p.num_low + p.num_high, items.keys.begin() + p.num_low + p.num_packed);
+        return size;
+    }
+
+    // Store the sorted items (not in the scratch buffer, or at its
+    // beginning) with the packing.
+    void encode(const key_type* keys, const data_type* data, const packing& p) {
+        assert(area_bytes(p) <= area_size);
+        static_cast<packing&>(*m_block) = p;
+        int size = p.size();
+        std::copy(data, data + size, data_array());
+        key_type* raw = raw_keys(p);
+        std::copy(keys, keys + p.num_low, raw);
+        std::copy(keys + p.num_low + p.num_packed, keys + size, raw + p.num_low);
+        uint64_t* words = packed_words(p);
+        std::fill(words, words + num_words(p.num_packed, p.bit_width), 0);
+        for (int i = 0; i < p.num_packed; i++)
+            write_field(words, i, p.bit_width, unsigned_key_type(keys[p.num_low + i]) - unsigned_key_type(p.base));
+    }
+
+    template<typename Items>
+    void set_items(const Items& new_items) {
+        assert(is_sorted_by_key(new_items));
+        scratch_type& items = scratch();
+        for (int i = 0; i < static_cast<int>(new_items.size()); i++)
+            items.set(i, new_items[i]);
+        packing p = best_packing(items.keys.data(), new_items.size(), nullptr);
+        assert(area_bytes(p) <= area_size);
+        encode(items.keys.data(), items.data.data(), p);
+    }
+};
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_PACKED_LEAF_H
@@ -0,0 +1,805 @@
+/*
+ * slotted_node.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_SLOTTED_NODE_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_SLOTTED_NODE_H
+
+#include <foxxll/mng/typed_block.hpp>
+#include <array>
+#include <cassert>
+#include <memory>
+#include <vector>
+#include "node.h"
+#include "slotted_page.h"
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+/*
+ * Sizes of the blocks of slotted nodes and leaves (see slotted_node).
+ *
+ * The buffers and leaves hold as many items as fit into their bytes.
+ * The values of a node are a slotted page, too, but with room for
+ * max_num_values_in_node items of max_item_size bytes: while a node's
+ * buffer is flushed, each of its children can add a value to it (see
+ * fractal_tree::flush_buffer), and that must not overflow the node.
+ * Items (with their slot) must thus not be larger than max_item_size,
+ * which is chosen such that the values take a quarter of the block.
+ * The number of values depends on Epsilon as for node_parameters
+ * (with items of 16 bytes).
+ */
+template<typename KeyType, typename DataType, unsigned RawBlockSize, typename Epsilon = default_epsilon>
+class slotted_node_parameters final {
+    static constexpr int round_down(int size) {
+        return size / alignof(slot) * alignof(slot);
+    }
+    static constexpr int round_up(int size) {
+        return (size + alignof(slot) - 1) / alignof(slot) * alignof(slot);
+    }
+
+public:
+    enum {
+        max_num_values_in_node = NUM_NODE_VALUES<Epsilon>(static_cast<double>(RawBlockSize / 16)),
+        max_item_size = RawBlockSize / (4 * max_num_values_in_node),
+        values_area_size = round_up(max_num_values_in_node * max_item_size),
+    };
+    static_assert(max_item_size <= UINT16_MAX, "RawBlockSize too large -> items can be too large for their slots!");
+
+    using values_page_type = slotted_page<KeyType, DataType, values_area_size>;
+
+    struct _node_block_without_buffer {
+        values_page_type                             values;
+        std::array<int, max_num_values_in_node + 1>  nodeIDs {};
+    };
+
+    enum {
+        min_item_size = values_page_type::min_item_size,
+        // Size of a page without its area.
+        page_header_size = sizeof(values_page_type) - values_area_size,
+        buffer_area_size = round_down(RawBlockSize - sizeof(_node_block_without_buffer) - page_header_size),
+        leaf_area_size = round_down(RawBlockSize - page_header_size),
+        // Upper bounds (every item takes at least min_item_size bytes).
+        max_num_buffer_items_in_node = buffer_area_size / min_item_size,
+        max_num_buffer_items_in_leaf = leaf_area_size / min_item_size,
+    };
+    // A leaf that is split when a node buffer is pushed
+    // to it must give two halves that fit into leaves.
+    static_assert(buffer_area_size + 2 * max_item_size <= leaf_area_size,
+                  "RawBlockSize too small -> a leaf cannot take the buffer of a node!");
+};
+
+/*
+ * Inner node for keys and / or data of variable length (see
+ * slot_traits): its values and its buffer are slotted pages
+ * (see slotted_page), so the buffer holds as many items as fit
+ * into it instead of a fixed number of items of the largest size.
+ *
+ * The space in the buffer is counted in bytes (see buffer_space
+ * and item_size). Spans point into the node's block, as with node.
+ * Changes in the middle of the buffer or the values merge them
+ * into a scratch page (shared by the slotted nodes of a thread)
+ * and copy that back.
+ *
+ * Besides that, slotted_node has the interface of node.
+ */
+template<typename KeyType,
+        typename DataType,
+        unsigned RawBlockSize,
+        typename Epsilon = default_epsilon>
+class slotted_node final {
+public:
+    // Basic type declarations
+    using key_type = KeyType;
+    using data_type = DataType;
+    using value_type = std::pair<key_type, data_type>;
+    using self_type = slotted_node<KeyType, DataType, RawBlockSize, Epsilon>;
+    using bid_type = foxxll::BID<RawBlockSize>;
+    using node_parameter_type = slotted_node_parameters<KeyType, DataType, RawBlockSize, Epsilon>;
+
+    enum {
+        max_num_values_in_node = node_parameter_type::max_num_values_in_node,
+        max_num_buffer_items_in_node = node_parameter_type::max_num_buffer_items_in_node,
+        max_item_size = node_parameter_type::max_item_size,
+        buffer_area_size = node_parameter_type::buffer_area_size,
+    };
+    static_assert(max_num_values_in_node >= 3, "RawBlockSize too small -> too few values per node!");
+
+    using values_type = typename node_parameter_type::values_page_type;
+    using buffer_type = slotted_page<key_type, data_type, buffer_area_size>;
+    using scratch_type = slotted_page<key_type, data_type, 2 * buffer_area_size>;
+    // Views into the node's block (only valid while it is pinned).
+    using item_span_type = slotted_span<key_type, data_type>;
+    using nodeID_span_type = array_span<int>;
+    // Size of an item in the buffer, in the unit of buffer_space (bytes).
+    using item_size = slotted_item_size<key_type, data_type>;
+
+    struct node_block {
+        values_type                                  values;
+        std::array<int, max_num_values_in_node + 1>  nodeIDs {};
+        buffer_type                                  buffer;
+    };
+    using block_type = foxxll::typed_block<RawBlockSize, node_block>;
+    static_assert(sizeof(node_block) <= sizeof(block_type), "RawBlockSize too small!");
+
+    static constexpr data_type dummy_datum() { return data_type(); };
+
+private:
+    const int m_id;
+    bid_type m_bid;
+
+    block_type* m_block = nullptr;
+    // Block is owned by the tree instead of the cache.
+    bool m_pinned = false;
+
+    values_type*                                 m_values  = nullptr;
+    std::array<int, max_num_values_in_node + 1>* m_nodeIDs = nullptr;
+    buffer_type*                                 m_buffer  = nullptr;
+
+public:
+    explicit slotted_node(int ID, bid_type BID) : m_id(ID), m_bid(BID) {};
+
+
+    // ---------------- Basic methods ----------------
+
+
+    bid_type& get_bid() {
+        return m_bid;
+    }
+
+    int get_id() const {
+        return m_id;
+    }
+
+    int max_buffer_size() const {
+        return max_num_buffer_items_in_node;
+    }
+
+    int num_children() const {
+        return num_values() == 0 ? 0 : num_values() + 1;
+    }
+
+    int num_values() const {
+        return m_values->size();
+    }
+
+    int get_child_id(int child_index) const {
+        assert(child_index <= num_values() + 1);
+        return m_nodeIDs->at(child_index);
+    }
+
+    int num_items_in_buffer() const {
+        return m_buffer->size();
+    }
+
+    // Whether the buffer might not take another item.
+    bool buffer_full() const {
+        return buffer_space() < max_item_size;
+    }
+
+    bool buffer_empty() const {
+        return num_items_in_buffer() == 0;
+    }
+
+    // Free bytes in the buffer.
+    int buffer_space() const {
+        return m_buffer->free_bytes();
+    }
+
+    // Number of the first of new_items (any span or vector of items)
+    // that fit into the buffer, even if none of them is a duplicate.
+    template<typename Items>
+    int num_items_that_fit(const Items& new_items) const {
+        int space = buffer_space();
+        int num_items = 0;
+        while (num_items < static_cast<int>(new_items.size())
+               && (space -= item_size()(new_items, num_items)) >= 0)
+            num_items++;
+        return num_items;
+    }
+
+    // Check if number of keys in node is >= floor(b/2)
+    bool values_at_least_half_full() const {
+        return num_values() >= (max_num_values_in_node-1) / 2;
+    }
+
+    // Whether the node has so few values that it should be
+    // merged with a neighbor (see try_merge).
+    bool underflows() const {
+        return num_values() < max_num_values_in_node / 4;
+    }
+
+    block_type* get_block() {
+        return m_block;
+    }
+
+    bool is_pinned() const {
+        return m_pinned;
+    }
+
+    void set_pinned(bool pinned) {
+        m_pinned = pinned;
+    }
+
+    void set_block(block_type* block) {
+        m_block = block;
+        m_values = &(m_block->begin()->values);
+        m_nodeIDs = &(m_block->begin()->nodeIDs);
+        m_buffer = &(m_block->begin()->buffer);
+    }
+
+    void clear() {
+        clear_buffer();
+        clear_values();
+    }
+
+
+    // ---------------- Methods for the buffer ----------------
+
+
+    // Given the index of a child, return the index of the first
+    // buffer item that does not belong to that child anymore.
+    // Precondition: number of children > 0.
+    int index_of_upper_bound_of_buffer(int child_index) const {
+        assert(num_values() > 0);
+        assert(child_index < num_values() + 1);
+        if (child_index == num_values())
+            return num_items_in_buffer();
+        return buffer_span().lower_bound(m_values->span().key(child_index));
+    }
+
+    std::vector<value_type> get_buffer_items() const {
+        return get_items(buffer_span());
+    }
+
+    // Return vector of items in buffer with indexes in [low, high).
+    std::vector<value_type> get_buffer_items(int low, int high) const {
+        return get_items(buffer_span(low, high));
+    }
+
+    item_span_type buffer_span() const {
+        return m_buffer->span();
+    }
+
+    item_span_type buffer_span(int low, int high) const {
+        assert(low <= high);
+        assert(num_items_in_buffer() >= high);
+        return m_buffer->span(low, high);
+    }
+
+    value_type get_buffer_item(int index) const {
+        assert(index < num_items_in_buffer());
+        return buffer_span()[index];
+    }
+
+    void clear_buffer() {
+        m_buffer->clear();
+    }
+
+    // Keep only the first num_items buffer items.
+    void truncate_buffer(int num_items) {
+        m_buffer->truncate(num_items);
+    }
+
+    // First clear buffer, then add the items (any span or vector of
+    // sorted items, which must fit) to the buffer.
+    template<typename Items>
+    void set_buffer(const Items& items) {
+        assert(is_sorted_by_key(items));
+        clear_buffer();
+        for (int i = 0; i < static_cast<int>(items.size()); i++)
+            detail::append_item(*m_buffer, items, i);
+    }
+
+    // Add the new value to the buffer. In case of a duplicate
+    // key, take the datum from the new value.
+    void add_to_buffer(value_type new_value) {
+        add_items_to_buffer(array_span<value_type>(&new_value, 1));
+    }
+
+    // Add the new items (any span or vector of sorted items) to the
+    // buffer. In case of duplicate keys, take the data from new_items.
+    // Precondition: they fit (see num_items_that_fit).
+    template<typename Items>
+    void add_to_buffer(const Items& new_items) {
+        add_items_to_buffer(new_items);
+    }
+
+    // Given a key, search for an item that has that key in the
+    // buffer. If such an item is found, return a pair
+    // <datum of the item, true>. Else, return a pair
+    // <some datum, false>.
+    std::pair<data_type, bool> buffer_find(const key_type& key) const {
+        bool erased;
+        return buffer_find(key, erased);
+    }
+
+    // Same, but a tombstone for the key is not found either, and
+    // sets erased (which is false otherwise).
+    std::pair<data_type, bool> buffer_find(const key_type& key, bool& erased) const {
+        message_type message;
+        std::pair<data_type, bool> datum_and_found = buffer_find_message(key, message);
+        erased = datum_and_found.second && message == message_type::erase;
+        if (erased)
+            return std::pair<data_type, bool>(dummy_datum(), false);
+        return datum_and_found;
+    }
+
+    // Same, but a tombstone for the key is found as well (see
+    // node::buffer_find_message); slotted buffers have no upserts.
+    std::pair<data_type, bool> buffer_find_message(const key_type& key, message_type& message) const {
+        item_span_type items = buffer_span();
+        int index = items.lower_bound(key);
+        bool found = index != items.size() && items.compare_key(index, key) == 0;
+        message = found && items.erased(index) ? message_type::erase : message_type::insert;
+        if (found && message == message_type::erase)
+            return std::pair<data_type, bool>(dummy_datum(), true);
+        else if (found)
+            return std::pair<data_type, bool>(items.datum(index), true);
+        else
+            return std::pair<data_type, bool>(dummy_datum(), false);
+    }
+
+    // Remove the item with the given key from the buffer
+    // (if there is one). Return whether an item was removed.
+    bool remove_from_buffer(const key_type& key) {
+        item_span_type items = buffer_span();
+        int index = items.lower_bound(key);
+        if (index == items.size() || items.compare_key(index, key) != 0)
+            return false;
+        scratch_type& rebuilt = scratch();
+        rebuilt.clear();
+        rebuilt.append(items.subspan(0, index));
+        rebuilt.append(items.subspan(index + 1, items.size()));
+        m_buffer->assign(rebuilt);
+        return true;
+    }
+
+
+    // ---------------- Methods for the values & nodeIDs ----------------
+
+    void clear_values() {
+        m_values->clear();
+    }
+
+    std::vector<value_type> get_values() const {
+        return get_items(m_values->span());
+    }
+
+    // Return vector of values with indexes in [low, high).
+    std::vector<value_type> get_values(int low, int high) const {
+        return get_items(values_span(low, high));
+    }
+
+    value_type get_value(int index) const {
+        assert(num_values() > index);
+        return m_values->span()[index];
+    }
+
+    // Whether the value is a tombstone (see node::value_erased).
+    bool value_erased(int index) const {
+        assert(num_values() > index);
+        return m_values->span().erased(index);
+    }
+
+    // Return vector of nodeIDs with indexes in [low, high).
+    std::vector<int> get_nodeIDs(int low, int high) const {
+        assert(low <= high);
+        assert(num_children() >= high);
+        return std::vector<int>(m_nodeIDs->begin() + low, m_nodeIDs->begin() + high);
+    }
+
+    item_span_type values_span(int low, int high) const {
+        assert(low <= high);
+        assert(num_values() >= high);
+        return m_values->span(low, high);
+    }
+
+    nodeID_span_type nodeIDs_span(int low, int high) const {
+        assert(low <= high);
+        assert(num_children() >= high);
+        return nodeID_span_type(m_nodeIDs->data() + low, high - low);
+    }
+
+    // Set values (any span or vector of sorted items) and nodeIDs.
+    // This clears the buffer, too, and should thus only be used on
+    // a new node (see node::set_values_and_nodeIDs).
+    template<typename Items>
+    void set_values_and_nodeIDs(const Items& values, const nodeID_span_type& nodeIDs) {
+        assert(nodeIDs.size() == static_cast<int>(values.size()) + 1);
+        assert(values.size() <= max_num_values_in_node);
+        clear();
+        for (int i = 0; i < static_cast<int>(values.size()); i++)
+            detail::append_item(*m_values, values, i);
+        std::copy(nodeIDs.begin(), nodeIDs.end(), m_nodeIDs->begin());
+    }
+
+    // Keep only the first num_values values and the first
+    // num_values + 1 nodeIDs (e.g. when splitting the node).
+    void truncate_values(int num_values) {
+        m_values->truncate(num_values);
+    }
+
+    // Add value (a tombstone if erased is set) to the node's values, and
+    // add the corresponding children to the node's nodeIDs.
+    // Precondition: the key of value is neither in the buffer nor in
+    // the values before insertion.
+    // Precondition: there is still space in the values, i.e. num_values() < max_num_values_in_node
+    void add_to_values(value_type value, const int left_child_id, const int right_child_id, bool erased = false) {
+        assert(num_values() < max_num_values_in_node);
+        assert(item_size()(value) <= max_item_size);
+        item_span_type values = m_values->span();
+        int insert_position_index = values.lower_bound(value.first);
+
+        scratch_type& rebuilt = scratch();
+        rebuilt.clear();
+        rebuilt.append(values.subspan(0, insert_position_index));
+        if (erased)
+            rebuilt.append_erased(value.first);
+        else
+            rebuilt.append(value);
+        rebuilt.append(values.subspan(insert_position_index, values.size()));
+        m_values->assign(rebuilt);
+
+        auto nodeID_insert_position_it = m_nodeIDs->begin() + insert_position_index;
+        std::move_backward(nodeID_insert_position_it, m_nodeIDs->begin() + num_values(), m_nodeIDs->begin() + num_values() + 1);
+        *nodeID_insert_position_it = left_child_id;
+        *(nodeID_insert_position_it+1) = right_child_id;
+    }
+
+    // Remove the value with the given index and the child to its
+    // right (see node::remove_value).
+    void remove_value(int index) {
+        assert(0 <= index && index < num_values());
+        item_span_type values = m_values->span();
+        std::move(m_nodeIDs->begin() + index + 2, m_nodeIDs->begin() + num_values() + 1,
+                  m_nodeIDs->begin() + index + 1);
+        scratch_type& rebuilt = scratch();
+        rebuilt.clear();
+        rebuilt.append(values.subspan(0, index));
+        rebuilt.append(values.subspan(index + 1, values.size()));
+        m_values->assign(rebuilt);
+    }
+
+    // Append the value pivot and the values, children and buffer
+    // items of right_node to this node if they fit (see node::try_merge).
+    bool try_merge(const value_type& pivot, bool pivot_erased, const self_type& right_node) {
+        int pivot_size = pivot_erased ? item_size()(value_type(pivot.first, dummy_datum())) : item_size()(pivot);
+        if (num_values() + 1 + right_node.num_values() > max_num_values_in_node
+            || m_values->num_bytes() + pivot_size + right_node.m_values->num_bytes() > values_type::area_size
+            || m_buffer->num_bytes() + right_node.m_buffer->num_bytes() > buffer_type::area_size)
+            return false;
+        std::copy(right_node.m_nodeIDs->begin(), right_node.m_nodeIDs->begin() + right_node.num_children(),
+                  m_nodeIDs->begin() + num_values() + 1);
+        if (pivot_erased)
+            m_values->append_erased(pivot.first);
+        else
+            m_values->append(pivot);
+        m_values->append(right_node.m_values->span());
+        m_buffer->append(right_node.buffer_span());
+        return true;
+    }
+
+    // Find key in values array. Return type:
+    // < <datum of key if found else dummy_datum, id of child to go to>, bool whether key was found >
+    // Precondition: num_values() > 0
+    std::pair<std::pair<data_type, int>, bool> values_find(const key_type& key) const {
+        bool erased;
+        return values_find(key, erased);
+    }
+
+    // Same, but a value that is a tombstone is not found either,
+    // and sets erased (which is false otherwise).
+    std::pair<std::pair<data_type, int>, bool> values_find(const key_type& key, bool& erased) const {
+        assert(num_values() > 0);
+        item_span_type values = m_values->span();
+        int index = values.lower_bound(key);
+        bool found = index != values.size() && values.compare_key(index, key) == 0;
+        erased = found && values.erased(index);
+        if (found && !erased)
+            return std::pair<std::pair<data_type, int>, bool>(
+                    std::pair<data_type, int>(values.datum(index), 0), true);
+        assert(index < num_children());
+        return std::pair<std::pair<data_type, int>, bool>(
+                std::pair<data_type, int>(dummy_datum(), (*m_nodeIDs)[index]), false);
+    }
+
+private:
+    static scratch_type& scratch() {
+        static thread_local std::unique_ptr<scratch_type> page(new scratch_type);
+        return *page;
+    }
+
+    static std::vector<value_type> get_items(const item_span_type& items) {
+        std::vector<value_type> result;
+        result.reserve(items.size());
+        for (int i = 0; i < items.size(); i++)
+            result.push_back(items[i]);
+        return result;
+    }
+
+    // See add_to_buffer. new_items is a span or vector of items.
+    template<typename Items>
+    void add_items_to_buffer(const Items& new_items) {
+        /*
+         * As node::add_items_to_buffer: new items whose key is in
+         * the values replace the datum there, the others are merged
+         * into the buffer. Without values, tombstones are applied.
+         */
+        assert(is_sorted_by_key(new_items));
+        scratch_type& merged = scratch();
+        item_span_type values = m_values->span();
+
+        if (values.empty()) {
+            merged.clear();
+            apply_into_page(buffer_span(), new_items, merged);
+            m_buffer->assign(merged);
+            return;
+        }
+
+        // Whether the key of a new item is in the values (asked in
+        // key order, so the values are walked through once).
+        int value_index = 0;
+        auto is_in_values = [&new_items, &values, &value_index](int index) -> bool {
+            key_type key = detail::item_key(new_items, index);
+            while (value_index < values.size() && values.compare_key(value_index, key) < 0)
+                value_index++;
+            return value_index < values.size() && values.compare_key(value_index, key) == 0;
+        };
+
+        // For all duplicate keys, replace the datum in the values.
+        bool has_duplicate_values = false;
+        for (int i = 0; i < static_cast<int>(new_items.size()) && !has_duplicate_values; i++)
+            has_duplicate_values = is_in_values(i);
+        if (has_duplicate_values) {
+            merged.clear();
+            value_index = 0;
+            merge_into_page(values, new_items, [&is_in_values](int index) { return !is_in_values(index); }, merged);
+            m_values->assign(merged);
+            values = m_values->span();
+        }
+
+        merged.clear();
+        value_index = 0;
+        merge_into_page(buffer_span(), new_items, is_in_values, merged);
+        m_buffer->assign(merged);
+    }
+};
+
+template<typename KeyType,
+        typename DataType,
+        unsigned RawBlockSize,
+        typename Epsilon>
+bool operator == (const slotted_node<KeyType, DataType, RawBlockSize, Epsilon>& node1,
+                  const slotted_node<KeyType, DataType, RawBlockSize, Epsilon>& node2) {
+    return node1.get_id() == node2.get_id();
+}
+
+template<typename KeyType,
+        typename DataType,
+        unsigned RawBlockSize,
+        typename Epsilon>
+bool operator != (const slotted_node<KeyType, DataType, RawBlockSize, Epsilon>& node1,
+                  const slotted_node<KeyType, DataType, RawBlockSize, Epsilon>& node2) {
+    return !(node1.get_id() == node2.get_id());
+}
+
+
+/*
+ * Leaf for keys and / or data of variable length: its buffer is a
+ * slotted page (see slotted_page) that holds as many items as fit,
+ * so a leaf is full once the bytes of its items do not fit anymore
+ * (as with packed_leaf, which it mirrors). merge_and_split splits
+ * the merged items at half of their bytes.
+ *
+ * Besides that, slotted_leaf has the interface of leaf.
+ */
+template<typename KeyType,
+        typename DataType,
+        unsigned RawBlockSize,
+        typename Epsilon = default_epsilon>
+class slotted_leaf final {
+    // Type declarations
+    using key_type = KeyType;
+    using data_type = DataType;
+    using value_type = std::pair<key_type, data_type>;
+    using self_type = slotted_leaf<KeyType, DataType, RawBlockSize, Epsilon>;
+    using bid_type = foxxll::BID<RawBlockSize>;
+    using node_parameter_type = slotted_node_parameters<KeyType, DataType, RawBlockSize, Epsilon>;
+
+public:
+    enum {
+        leaf_area_size = node_parameter_type::leaf_area_size,
+        max_item_size = node_parameter_type::max_item_size,
+        // Upper bound (every item takes at least min_item_size bytes).
+        max_num_buffer_items_in_leaf = node_parameter_type::max_num_buffer_items_in_leaf,
+        // Bytes of new items that a leaf can take if it is split (once)
+        // when they do not fit: merging them and splitting by size
+        // gives two halves that fit (see merge_and_split).
+        max_bytes_per_push = leaf_area_size - 2 * max_item_size,
+        max_num_items_per_push = max_bytes_per_push / node_parameter_type::min_item_size,
+    };
+
+    using buffer_type = slotted_page<key_type, data_type, leaf_area_size>;
+    using scratch_type = slotted_page<key_type, data_type, 2 * leaf_area_size>;
+    // View into the leaf's block (only valid while it is pinned).
+    using item_span_type = slotted_span<key_type, data_type>;
+
+    struct leaf_block {
+        buffer_type buffer;
+    };
+    using block_type = foxxll::typed_block<RawBlockSize, leaf_block>;
+    static_assert(sizeof(leaf_block) <= sizeof(block_type), "RawBlockSize too small!");
+
+    static constexpr data_type dummy_datum() { return data_type(); };
+
+private:
+    const int m_id;
+    bid_type m_bid;
+    buffer_type* m_buffer = nullptr;
+
+public:
+    explicit slotted_leaf(int ID, bid_type BID) : m_id(ID), m_bid(BID) {};
+
+    bid_type& get_bid() {
+        return m_bid;
+    }
+
+    int get_id() const {
+        return m_id;
+    }
+
+    void set_block(block_type* block) {
+        m_buffer = &(block->begin()->buffer);
+    }
+
+    bool buffer_empty() const {
+        return num_items_in_buffer() == 0;
+    }
+
+    int num_items_in_buffer() const {
+        return m_buffer->size();
+    }
+
+    // Bytes that the items take in the block.
+    int num_bytes_in_buffer() const {
+        return m_buffer->num_bytes();
+    }
+
+    void clear_buffer() {
+        m_buffer->clear();
+    }
+
+    std::vector<value_type> get_buffer_items() const {
+        item_span_type items = buffer_span();
+        std::vector<value_type> result;
+        result.reserve(items.size());
+        for (int i = 0; i < items.size(); i++)
+            result.push_back(items[i]);
+        return result;
+    }
+
+    item_span_type buffer_span() const {
+        return m_buffer->span();
+    }
+
+    // Set the buffer to the new items (any span or vector of
+    // sorted items, which must fit).
+    template<typename Items>
+    void set_buffer(const Items& new_items) {
+        assert(is_sorted_by_key(new_items));
+        clear_buffer();
+        for (int i = 0; i < static_cast<int>(new_items.size()); i++)
+            detail::append_item(*m_buffer, new_items, i);
+    }
+
+    // Add the new items to the buffer. In case of duplicate keys,
+    // take the data from new_items. Precondition: they fit.
+    template<typename Items>
+    void add_to_buffer(const Items& new_items) {
+        bool fits = try_add_to_buffer(new_items);
+        assert(fits);
+        (void)fits;
+    }
+
+    // Add the new items (a span or vector of items) to the buffer if
+    // they fit; return whether they did (else the leaf is unchanged).
+    // Tombstones among the new items remove the items with their keys
+    // (and are not added).
+    template<typename Items>
+    bool try_add_to_buffer(const Items& new_items) {
+        assert(is_sorted_by_key(new_items));
+        scratch_type& merged = scratch();
+        merged.clear();
+        apply_into_page(buffer_span(), new_items, merged);
+        if (merged.num_bytes() > leaf_area_size)
+            return false;
+        m_buffer->assign(merged);
+        return true;
+    }
+
+    // Whether the leaf's items take so few of its bytes that it
+    // should be merged with a neighbor (see try_merge).
+    bool underflows() const {
+        return num_bytes_in_buffer() < leaf_area_size / 4;
+    }
+
+    // Append the pivot items (at most the one value of the parent
+    // between the leaves) and the items of right_leaf to this leaf if
+    // they fit (see leaf::try_merge).
+    bool try_merge(const std::vector<value_type>& pivot, const self_type& right_leaf) {
+        int num_bytes = num_bytes_in_buffer() + right_leaf.num_bytes_in_buffer();
+        for (const value_type& value : pivot)
+            num_bytes += buffer_type::item_size(value);
+        if (num_bytes > leaf_area_size)
+            return false;
+        for (const value_type& value : pivot)
+            m_buffer->append(value);
+        m_buffer->append(right_leaf.buffer_span());
+        return true;
+    }
+
+    /*
+     * Merge the new items into the buffer (like add_to_buffer, but
+     * the merged items need not fit into one leaf), and split them
+     * up: the items before the mid item stay in this leaf, the items
+     * after it go to right_leaf (whose buffer is replaced). Return
+     * the mid item. Tombstones are applied as in try_add_to_buffer.
+     * Precondition: the merge has at least one item, and the new
+     * items take at most max_bytes_per_push bytes.
+     *
+     * The mid item is the one at which the merged items take half of
+     * their bytes, so both halves fit.
+     */
+    template<typename Items>
+    value_type merge_and_split(const Items& new_items, self_type& right_leaf) {
+        assert(is_sorted_by_key(new_items));
+        assert(&right_leaf != this);
+
+        scratch_type& merged = scratch();
+        merged.clear();
+        apply_into_page(buffer_span(), new_items, merged);
+        item_span_type items = merged.span();
+        assert(items.size() > 0);
+        assert(merged.num_bytes() <= leaf_area_size + max_bytes_per_push);
+
+        int mid = 0;
+        for (int bytes = items.item_size(0); 2 * bytes < merged.num_bytes(); bytes += items.item_size(mid))
+            mid++;
+        value_type mid_value = items[mid];
+
+        right_leaf.m_buffer->clear();
+        right_leaf.m_buffer->append(items.subspan(mid + 1, items.size()));
+        m_buffer->clear();
+        m_buffer->append(items.subspan(0, mid));
+        return mid_value;
+    }
+
+    // Given a key, search for an item that has that key in the
+    // buffer. If such an item is found, return a pair
+    // <datum of the item, true>. Else, return a pair
+    // <some datum, false>.
+    std::pair<data_type, bool> buffer_find(const key_type& key) const {
+        item_span_type items = buffer_span();
+        int index = items.lower_bound(key);
+        if (index != items.size() && items.compare_key(index, key) == 0)
+            return std::pair<data_type, bool>(items.datum(index), true);
+        else
+            return std::pair<data_type, bool>(dummy_datum(), false);
+    }
+
+private:
+    static scratch_type& scratch() {
+        static thread_local std::unique_ptr<scratch_type> page(new scratch_type);
+        return *page;
+    }
+};
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_SLOTTED_NODE_H
@@ -0,0 +1,469 @@
+/*
+ * slotted_page.h
+ *
+ * Copyright (C) 2021 Henri Froese
+ */
+
+#ifndef EXTERNAL_MEMORY_FRACTAL_TREE_SLOTTED_PAGE_H
+#define EXTERNAL_MEMORY_FRACTAL_TREE_SLOTTED_PAGE_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "key_search.h"
+
+namespace stxxl {
+
+namespace fractal_tree {
+
+// ----------------------- Slot traits. ---------------------------
+
+/*
+ * How keys and data are stored in slotted pages: a value takes
+ * size(value) bytes, which store writes and load reads back.
+ * compare(bytes, size, value) compares a stored value with value
+ * (< 0, 0, > 0 if it is less than, equal to, greater than value).
+ *
+ * Types with variable_length (e.g. std::string; specialize
+ * slot_traits for others) make a fractal tree use slotted pages
+ * (see has_slotted_layout). Other types are copied bytewise.
+ */
+template<typename T>
+struct slot_traits {
+    static constexpr bool variable_length = false;
+    static constexpr int min_size = sizeof(T);
+
+    static int size(const T&) {
+        return sizeof(T);
+    }
+
+    static void store(const T& value, unsigned char* bytes) {
+        std::memcpy(bytes, &value, sizeof(T));
+    }
+
+    static T load(const unsigned char* bytes, int) {
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+    static int compare(const unsigned char* bytes, int size, const T& value) {
+        T stored = load(bytes, size);
+        return stored < value ? -1 : (value < stored ? 1 : 0);
+    }
+};
+
+// Strings are stored without a terminator, and compared
+// bytewise (as std::string compares them).
+template<>
+struct slot_traits<std::string> {
+    static constexpr bool variable_length = true;
+    static constexpr int min_size = 0;
+
+    static int size(const std::string& value) {
+        return value.size();
+    }
+
+    static void store(const std::string& value, unsigned char* bytes) {
+        std::memcpy(bytes, value.data(), value.size());
+    }
+
+    static std::string load(const unsigned char* bytes, int size) {
+        return std::string(reinterpret_cast<const char*>(bytes), size);
+    }
+
+    static int compare(const unsigned char* bytes, int size, const std::string& value) {
+        int value_size = value.size();
+        int result = std::memcmp(bytes, value.data(), std::min(size, value_size));
+        if (result != 0)
+            return result;
+        return size < value_size ? -1 : (value_size < size ? 1 : 0);
+    }
+};
+
+// Whether nodes and leaves with these keys and data are slotted
+// pages (see slotted_node) instead of arrays of items.
+template<typename KeyType, typename DataType>
+using has_slotted_layout = std::integral_constant<bool,
+    slot_traits<KeyType>::variable_length || slot_traits<DataType>::variable_length>;
+
+// ----------------------- Slotted spans. ---------------------------
+
+// An item in a slotted page: its key and datum are stored one after
+// the other, offset bytes before the end of the page's area.
+// A tombstone (see message_flags) has only its key; its datum_size
+// is erased_datum_size.
+struct slot {
+    static constexpr uint16_t erased_datum_size = UINT16_MAX;
+
+    uint32_t offset;
+    uint16_t key_size;
+    uint16_t datum_size;
+
+    bool erased() const {
+        return datum_size == erased_datum_size;
+    }
+
+    // Bytes of the key and the datum.
+    int num_bytes() const {
+        return key_size + (erased() ? 0 : datum_size);
+    }
+};
+
+// Read-only view of consecutive items of a slotted page (as
+// item_span for arrays of items). Keys and data are loaded when
+// they are accessed; searches compare the stored keys directly.
+template<typename KeyType, typename DataType>
+class slotted_span {
+public:
+    using value_type = std::pair<KeyType, DataType>;
+
+private:
+    using key_traits = slot_traits<KeyType>;
+    using data_traits = slot_traits<DataType>;
+
+    const slot* m_slots = nullptr;
+    const unsigned char* m_area_end = nullptr;
+    int m_size = 0;
+
+public:
+    slotted_span() = default;
+    slotted_span(const slot* slots, const unsigned char* area_end, int size)
+        : m_slots(slots), m_area_end(area_end), m_size(size) {}
+
+    int size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    const slot& get_slot(int index) const {
+        assert(0 <= index && index < m_size);
+        return m_slots[index];
+    }
+
+    // The key, followed by the datum.
+    const unsigned char* bytes(int index) const {
+        return m_area_end - get_slot(index).offset;
+    }
+
+    // Bytes that the item takes in a page (with its slot).
+    int item_size(int index) const {
+        return sizeof(slot) + get_slot(index).num_bytes();
+    }
+
+    KeyType key(int index) const {
+        return key_traits::load(bytes(index), get_slot(index).key_size);
+    }
+
+    DataType datum(int index) const {
+        if (erased(index))
+            return DataType();
+        return data_traits::load(bytes(index) + get_slot(index).key_size, get_slot(index).datum_size);
+    }
+
+    // Whether the item is a tombstone.
+    bool erased(int index) const {
+        return get_slot(index).erased();
+    }
+
+    value_type operator [] (int index) const {
+        return value_type(key(index), datum(index));
+    }
+
+    // Items with indexes in [low, high).
+    slotted_span subspan(int low, int high) const {
+        assert(0 <= low && low <= high && high <= m_size);
+        return slotted_span(m_slots + low, m_area_end, high - low);
+    }
+
+    // Compare the key of the item with key (see slot_traits::compare).
+    int compare_key(int index, const KeyType& key) const {
+        return key_traits::compare(bytes(index), get_slot(index).key_size, key);
+    }
+
+    // Index of the first item whose key is not less than key, or size().
+    int lower_bound(const KeyType& key) const {
+        int first = 0;
+        int count = m_size;
+        while (count > 0) {
+            int step = count / 2;
+            if (compare_key(first + step, key) < 0) {
+                first += step + 1;
+                count -= step + 1;
+            } else {
+                count = step;
+            }
+        }
+        return first;
+    }
+
+    // Index of the first item whose key is greater than key, or size().
+    int upper_bound(const KeyType& key) const {
+        int first = 0;
+        int count = m_size;
+        while (count > 0) {
+            int step = count / 2;
+            if (compare_key(first + step, key) <= 0) {
+                first += step + 1;
+                count -= step + 1;
+            } else {
+                count = step;
+            }
+        }
+        return first;
+    }
+};
+
+// ----------------------- Slotted pages. ---------------------------
+
+/*
+ * Items with variable-length keys and data in AreaSize bytes: an
+ * array of slots (sorted by key) grows from the front of the area,
+ * the keys and data from its end. A page takes as many items as fit
+ * into its area, however long their keys and data are.
+ *
+ * The bytes of the items are stored in the order of their slots
+ * (each appended item goes in front of the previous one), which
+ * keeps the page compact: truncating it frees the bytes of the
+ * items that are cut off. Changes in the middle rebuild the page
+ * (see assign). Offsets count from the end of the area, so pages
+ * of different sizes can be copied into each other.
+ *
+ * A page of zeros is empty.
+ */
+template<typename KeyType, typename DataType, int AreaSize>
+struct slotted_page {
+    using key_type = KeyType;
+    using data_type = DataType;
+    using value_type = std::pair<key_type, data_type>;
+    using span_type = slotted_span<key_type, data_type>;
+    using key_traits = slot_traits<key_type>;
+    using data_traits = slot_traits<data_type>;
+
+    static_assert(AreaSize % alignof(slot) == 0, "AreaSize must be a multiple of the alignment of a slot!");
+
+    enum {
+        area_size = AreaSize,
+        // An item takes at least this many bytes.
+        min_item_size = sizeof(slot) + key_traits::min_size + data_traits::min_size
+    };
+
+    uint32_t num_items = 0;
+    uint32_t heap_size = 0;
+    alignas(slot) unsigned char area[AreaSize];
+
+    // Bytes that the item takes in a page (with its slot).
+    static int item_size(const value_type& value) {
+        return sizeof(slot) + key_traits::size(value.first) + data_traits::size(value.second);
+    }
+
+    int size() const {
+        return num_items;
+    }
+
+    int num_bytes() const {
+        return num_items * sizeof(slot) + heap_size;
+    }
+
+    int free_bytes() const {
+        return AreaSize - num_bytes();
+    }
+
+    span_type span() const {
+        return span_type(slots(), area + AreaSize, num_items);
+    }
+
+    span_type span(int low, int high) const {
+        return span().subspan(low, high);
+    }
+
+    void clear() {
+        num_items = 0;
+        heap_size = 0;
+    }
+
+    // Append the item (whose key must not be less than the last key).
+    void append(const value_type& value) {
+        int key_size = key_traits::size(value.first);
+        int datum_size = data_traits::size(value.second);
+        unsigned char* bytes = add_slot(key_size, datum_size);
+        key_traits::store(value.first, bytes);
+        data_traits::store(value.second, bytes + key_size);
+    }
+
+    // Append a tombstone for the key (see append).
+    void append_erased(const key_type& key) {
+        int key_size = key_traits::size(key);
+        key_traits::store(key, add_slot(key_size, slot::erased_datum_size));
+    }
+
+    // Same, for the index-th item of items (e.g. of another page),
+    // whose bytes are copied as they are.
+    void append(const span_type& items, int index) {
+        const slot& item_slot = items.get_slot(index);
+        unsigned char* bytes = add_slot(item_slot.key_size, item_slot.datum_size);
+        std::memcpy(bytes, items.bytes(index), item_slot.num_bytes());
+    }
+
+    // Append the items of the span.
+    void append(const span_type& items) {
+        for (int i = 0; i < items.size(); i++)
+            append(items, i);
+    }
+
+    // Keep only the first num_items_to_keep items.
+    void truncate(int num_items_to_keep) {
+        assert(0 <= num_items_to_keep && num_items_to_keep <= size());
+        num_items = num_items_to_keep;
+        heap_size = num_items == 0 ? 0 : slots()[num_items - 1].offset;
+    }
+
+    // Replace the items with the items of other (which must fit).
+    template<int OtherAreaSize>
+    void assign(const slotted_page<key_type, data_type, OtherAreaSize>& other) {
+        assert(other.num_bytes() <= AreaSize);
+        num_items = other.num_items;
+        heap_size = other.heap_size;
+        std::memcpy(slots(), other.slots(), num_items * sizeof(slot));
+        std::memcpy(area + AreaSize - heap_size, other.area + OtherAreaSize - heap_size, heap_size);
+    }
+
+    slot* slots() {
+        return reinterpret_cast<slot*>(area);
+    }
+
+    const slot* slots() const {
+        return reinterpret_cast<const slot*>(area);
+    }
+
+private:
+    // Add a slot for an item with the given sizes (datum_size is
+    // slot::erased_datum_size for a tombstone); return where the
+    // item's key and datum go.
+    unsigned char* add_slot(int key_size, int datum_size) {
+        assert(key_size <= UINT16_MAX && datum_size <= UINT16_MAX);
+        slot& new_slot = slots()[num_items];
+        new_slot.key_size = static_cast<uint16_t>(key_size);
+        new_slot.datum_size = static_cast<uint16_t>(datum_size);
+        assert(static_cast<int>(sizeof(slot)) + new_slot.num_bytes() <= free_bytes());
+        heap_size += new_slot.num_bytes();
+        new_slot.offset = heap_size;
+        num_items++;
+        return area + AreaSize - heap_size;
+    }
+};
+
+// ----------------------- Merging into slotted pages. ---------------------------
+
+namespace detail {
+
+// Key of the index-th of items (any span or vector of items);
+// for slotted spans, only the key is loaded.
+template<typename Items>
+auto item_key(const Items& items, int index) -> typename std::decay<decltype(items[index].first)>::type {
+    return items[index].first;
+}
+
+template<typename KeyType, typename DataType>
+KeyType item_key(const slotted_span<KeyType, DataType>& items, int index) {
+    return items.key(index);
+}
+
+template<typename KeyType, typename DataType>
+inline bool is_erased(const slotted_span<KeyType, DataType>& items, int index) {
+    return items.erased(index);
+}
+
+// Append the index-th of items to the page; items of
+// slotted spans are copied without loading them.
+template<typename Page, typename Items>
+void append_item(Page& page, const Items& items, int index) {
+    if (is_erased(items, index))
+        page.append_erased(item_key(items, index));
+    else
+        page.append(items[index]);
+}
+
+template<typename Page, typename KeyType, typename DataType>
+void append_item(Page& page, const slotted_span<KeyType, DataType>& items, int index) {
+    page.append(items, index);
+}
+
+}
+
+// Size of an item in a slotted page (see slotted_page::item_size),
+// the unit in which slotted nodes count the space in their buffer.
+template<typename KeyType, typename DataType>
+struct slotted_item_size {
+    int operator () (const std::pair<KeyType, DataType>& value) const {
+        return sizeof(slot) + slot_traits<KeyType>::size(value.first) + slot_traits<DataType>::size(value.second);
+    }
+
+    template<typename Items>
+    int operator () (const Items& items, int index) const {
+        return (*this)(items[index]);
+    }
+
+    int operator () (const slotted_span<KeyType, DataType>& items, int index) const {
+        return items.item_size(index);
+    }
+};
+
+/*
+ * Append the merge of the items (a slotted span) and the sorted
+ * new_items (any span or vector of items) to merged (e.g. an empty
+ * scratch page), leaving out the new items for which skip(index)
+ * holds, and taking the new item in case of duplicate keys (as
+ * item_array::merge_in_place does).
+ */
+template<typename KeyType, typename DataType, typename Items, typename Skip, typename Page>
+void merge_into_page(const slotted_span<KeyType, DataType>& items, const Items& new_items, Skip skip, Page& merged) {
+    int i = 0;
+    for (int j = 0; j < static_cast<int>(new_items.size()); j++) {
+        if (skip(j))
+            continue;
+        KeyType key = detail::item_key(new_items, j);
+        int comparison = 1;
+        while (i < items.size() && (comparison = items.compare_key(i, key)) < 0) {
+            merged.append(items, i);
+            i++;
+        }
+        // Duplicates replace an item.
+        if (i < items.size() && comparison == 0)
+            i++;
+        detail::append_item(merged, new_items, j);
+    }
+    for (; i < items.size(); i++)
+        merged.append(items, i);
+}
+
+// As merge_into_page (without skip), but apply the tombstones among
+// the new items: they remove the items with their keys instead of
+// being merged (as item_array::apply_in_place does).
+template<typename KeyType, typename DataType, typename Items, typename Page>
+void apply_into_page(const slotted_span<KeyType, DataType>& items, const Items& new_items, Page& merged) {
+    int i = 0;
+    for (int j = 0; j < static_cast<int>(new_items.size()); j++) {
+        KeyType key = detail::item_key(new_items, j);
+        int comparison = 1;
+        while (i < items.size() && (comparison = items.compare_key(i, key)) < 0) {
+            merged.append(items, i);
+            i++;
+        }
+        if (i < items.size() && comparison == 0)
+            i++;
+        if (!detail::is_erased(new_items, j))
+            detail::append_item(merged, new_items, j);
+    }
+    for (; i < items.size(); i++)
+        merged.append(items, i);
+}
+
+}
+
+}
+
+#endif //EXTERNAL_MEMORY_FRACTAL_TREE_SLOTTED_PAGE_H
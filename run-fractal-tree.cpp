@@ -37,6 +37,23 @@ int main()
     }
     assert(range_values == correct_range_values);
 
+    // erase key
+    f.erase(1);
+    assert(!f.find(1).second);
+
+    // count keys with upserts, which add to the datum
+    // (or to 0) without reading it first
+    using counter_ftree_type = stxxl::ftree<key_type, data_type, block_size, cache_size,
+                                            foxxll::default_alloc_strategy, stxxl::fractal_tree::lru_policy,
+                                            stxxl::fractal_tree::default_packed_leaves,
+                                            stxxl::fractal_tree::default_block_compression,
+                                            stxxl::fractal_tree::lz_block_codec,
+                                            stxxl::fractal_tree::default_epsilon, std::plus<data_type>>;
+    counter_ftree_type counts;
+    for (key_type k = 0; k < 1000; k++) {
+        counts.upsert(k % 10, 1);
+    }
+    assert(counts.find(3).first == 100);
 
     return 0;
 }
@@ -5,6 +5,7 @@
  */
 
 #include <gtest/gtest.h>
+#include <random>
 #include "../include/fractal_tree/fractal_tree.h"
 
 using key_type = int;
@@ -32,8 +33,10 @@ struct bid_hash {
     }
 };
 
-template<typename BlockType, typename BidType, typename BidHash, unsigned NumBlocksInCache>
-using fractal_tree_cache = stxxl::fractal_tree::fractal_tree_cache<BlockType, BidType, BidHash, NumBlocksInCache>;
+template<typename BlockType, typename BidType, typename BidHash, unsigned NumBlocksInCache, unsigned MaxNumPendingWrites = 0,
+         template<typename, typename, unsigned> class ReplacementPolicy = stxxl::fractal_tree::lru_policy,
+         typename BlockCodec = stxxl::fractal_tree::no_block_codec>
+using fractal_tree_cache = stxxl::fractal_tree::fractal_tree_cache<BlockType, BidType, BidHash, NumBlocksInCache, MaxNumPendingWrites, ReplacementPolicy, BlockCodec>;
 
 class TestCache : public ::testing::Test { };
 
@@ -52,8 +55,7 @@ foxxll_timer custom_timer("test_cache_basic");
 constexpr unsigned num_blocks_in_cache = 2;
 using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
 
-std::unordered_set<bid_type, bid_hash> dirty_bids;
-cache_type cache = cache_type(dirty_bids);
+cache_type cache;
 
 ASSERT_EQ(num_blocks_in_cache, cache.num_cached_blocks() + cache.num_unused_blocks());
 ASSERT_EQ(cache.num_cached_blocks(), 0);
@@ -67,8 +69,7 @@ bm = foxxll::block_manager::get_instance();
 constexpr unsigned num_blocks_in_cache = 1;
 using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
 
-std::unordered_set<bid_type, bid_hash> dirty_bids;
-cache_type cache = cache_type(dirty_bids);
+cache_type cache;
 
 std::array<value_type, num_items>* data = nullptr;
 bid_type bid = bid_type();
@@ -81,7 +82,7 @@ ASSERT_FALSE(cache.is_dirty(bid));
 block_type* block_for_data = cache.load(bid);
 data = &(block_for_data->begin()->A);
 *data = data1;
-dirty_bids.insert(bid);
+cache.mark_dirty(bid);
 
 ASSERT_TRUE(cache.is_cached(bid));
 ASSERT_TRUE(cache.is_dirty(bid));
@@ -97,8 +98,7 @@ bm = foxxll::block_manager::get_instance();
 constexpr unsigned num_blocks_in_cache = 1;
 using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
 
-std::unordered_set<bid_type, bid_hash> dirty_bids;
-cache_type cache = cache_type(dirty_bids);
+cache_type cache;
 
 std::array<value_type, num_items>* data = nullptr;
 bid_type bid = bid_type();
@@ -111,7 +111,7 @@ ASSERT_FALSE(cache.is_dirty(bid));
 block_type* block_for_data = cache.load(bid);
 data = &(block_for_data->begin()->A);
 *data = data1;
-dirty_bids.insert(bid);
+cache.mark_dirty(bid);
 
 ASSERT_TRUE(cache.is_cached(bid));
 ASSERT_TRUE(cache.is_dirty(bid));
@@ -142,8 +142,7 @@ bm = foxxll::block_manager::get_instance();
 constexpr unsigned num_blocks_in_cache = 1;
 using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
 
-std::unordered_set<bid_type, bid_hash> dirty_bids;
-cache_type cache = cache_type(dirty_bids);
+cache_type cache;
 
 std::array<value_type, num_items>* data = nullptr;
 bid_type bid1 = bid_type();
@@ -166,7 +165,7 @@ ASSERT_FALSE(cache.is_dirty(bid1));
 block_type* block_for_data2 = cache.load(bid2);
 data = &(block_for_data2->begin()->A);
 *data = data2;
-dirty_bids.insert(bid2);
+cache.mark_dirty(bid2);
 
 ASSERT_FALSE(cache.is_cached(bid1));
 ASSERT_TRUE(cache.is_cached(bid2));
@@ -205,8 +204,7 @@ bm = foxxll::block_manager::get_instance();
 constexpr unsigned num_blocks_in_cache = 2;
 using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
 
-std::unordered_set<bid_type, bid_hash> dirty_bids;
-cache_type cache = cache_type(dirty_bids);
+cache_type cache;
 
 std::array<value_type, num_items>* data = nullptr;
 bid_type bid1 = bid_type();
@@ -220,7 +218,7 @@ bm->new_block(foxxll::default_alloc_strategy(), bid3);
 block_type* block_for_data1 = cache.load(bid1);
 data = &(block_for_data1->begin()->A);
 *data = data1;
-dirty_bids.insert(bid1);
+cache.mark_dirty(bid1);
 
 ASSERT_TRUE(cache.is_cached(bid1));
 ASSERT_FALSE(cache.is_cached(bid2));
@@ -233,7 +231,7 @@ ASSERT_EQ(*data, data1);
 block_type* block_for_data2 = cache.load(bid2);
 data = &(block_for_data2->begin()->A);
 *data = data2;
-dirty_bids.insert(bid2);
+cache.mark_dirty(bid2);
 
 ASSERT_TRUE(cache.is_cached(bid1));
 ASSERT_TRUE(cache.is_cached(bid2));
@@ -247,7 +245,7 @@ ASSERT_EQ(*data, data2);
 block_type* block_for_data3 = cache.load(bid3);
 data = &(block_for_data3->begin()->A);
 *data = data3;
-dirty_bids.insert(bid3);
+cache.mark_dirty(bid3);
 
 ASSERT_FALSE(cache.is_cached(bid1));
 ASSERT_TRUE(cache.is_cached(bid2));
@@ -273,3 +271,747 @@ ASSERT_EQ(cache.num_cached_blocks(), 2);
 ASSERT_EQ(cache.num_unused_blocks(), 0);
 }
 
+
+TEST_F(TestCache, test_cache_write_behind) {
+std::array<value_type, num_items> data1;
+data1.fill(value_type(1, 1));
+
+std::array<value_type, num_items> data2;
+data2.fill(value_type(2, 2));
+
+bm = foxxll::block_manager::get_instance();
+constexpr unsigned num_blocks_in_cache = 2;
+constexpr unsigned max_num_pending_writes = 1;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache, max_num_pending_writes>;
+
+cache_type cache;
+
+std::array<value_type, num_items>* data = nullptr;
+bid_type bid1 = bid_type();
+bm->new_block(foxxll::default_alloc_strategy(), bid1);
+bid_type bid2 = bid_type();
+bm->new_block(foxxll::default_alloc_strategy(), bid2);
+
+// Load bid1 and make it dirty.
+block_type* block_for_data1 = cache.load(bid1);
+data = &(block_for_data1->begin()->A);
+*data = data1;
+cache.mark_dirty(bid1);
+
+// Kick dirty bid1 -> its block is not unused
+// until the write was waited for.
+cache.kick(bid1);
+ASSERT_FALSE(cache.is_cached(bid1));
+ASSERT_FALSE(cache.is_dirty(bid1));
+ASSERT_EQ(cache.num_pending_writes(), 1);
+ASSERT_EQ(cache.num_cached_blocks(), 0);
+ASSERT_EQ(cache.num_unused_blocks(), 1);
+
+// Loading bid1 again takes back the block with the pending write.
+block_type* block_for_data1_again = cache.load(bid1);
+ASSERT_EQ(block_for_data1, block_for_data1_again);
+ASSERT_EQ(block_for_data1_again->begin()->A, data1);
+ASSERT_EQ(cache.num_pending_writes(), 0);
+ASSERT_EQ(cache.num_cached_blocks(), 1);
+ASSERT_EQ(cache.num_unused_blocks(), 1);
+
+// bid1 is clean now -> kicking it does not write.
+cache.kick(bid1);
+ASSERT_EQ(cache.num_pending_writes(), 0);
+ASSERT_EQ(cache.num_unused_blocks(), 2);
+
+// Load bid2, make it dirty, and kick it.
+block_type* block_for_data2 = cache.load(bid2);
+data = &(block_for_data2->begin()->A);
+*data = data2;
+cache.mark_dirty(bid2);
+cache.kick(bid2);
+ASSERT_EQ(cache.num_pending_writes(), 1);
+
+cache.wait_for_pending_writes();
+ASSERT_EQ(cache.num_pending_writes(), 0);
+ASSERT_EQ(cache.num_unused_blocks(), 2);
+
+// Both blocks were written to external memory.
+ASSERT_EQ(cache.load(bid1)->begin()->A, data1);
+ASSERT_EQ(cache.load(bid2)->begin()->A, data2);
+ASSERT_EQ(cache.num_cached_blocks(), 2);
+ASSERT_EQ(cache.num_unused_blocks(), 0);
+}
+
+TEST_F(TestCache, test_cache_prefetch) {
+std::array<value_type, num_items> data1;
+data1.fill(value_type(1, 1));
+
+bm = foxxll::block_manager::get_instance();
+constexpr unsigned num_blocks_in_cache = 2;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
+
+cache_type cache;
+
+bid_type bid1 = bid_type();
+bm->new_block(foxxll::default_alloc_strategy(), bid1);
+bid_type bid2 = bid_type();
+bm->new_block(foxxll::default_alloc_strategy(), bid2);
+
+// Write data 1 to external memory.
+block_type* block_for_data1 = cache.load(bid1);
+block_for_data1->begin()->A = data1;
+cache.mark_dirty(bid1);
+cache.kick(bid1);
+
+foxxll::stats* stats = foxxll::stats::get_instance();
+const foxxll::stats_data stats_begin(*stats);
+
+// Prefetching puts the bids in the cache ...
+cache.prefetch(bid1);
+cache.prefetch(bid2);
+ASSERT_TRUE(cache.is_cached(bid1));
+ASSERT_TRUE(cache.is_cached(bid2));
+ASSERT_EQ(cache.num_cached_blocks(), 2);
+ASSERT_EQ(cache.num_unused_blocks(), 0);
+ASSERT_EQ(cache.num_prefetched_blocks(), 2);
+ASSERT_EQ((foxxll::stats_data(*stats) - stats_begin).get_read_count(), 2);
+
+// ... and loading them afterwards does not read again.
+block_for_data1 = cache.load(bid1);
+ASSERT_EQ(block_for_data1->begin()->A, data1);
+ASSERT_EQ(cache.num_prefetched_blocks(), 1);
+cache.load(bid2);
+ASSERT_EQ(cache.num_prefetched_blocks(), 0);
+ASSERT_EQ((foxxll::stats_data(*stats) - stats_begin).get_read_count(), 2);
+
+// Prefetching a cached bid does not read it again, but makes it
+// the most recently used one: loading a third bid evicts bid2.
+cache.prefetch(bid1);
+ASSERT_EQ((foxxll::stats_data(*stats) - stats_begin).get_read_count(), 2);
+ASSERT_EQ(cache.num_cached_blocks(), 2);
+bid_type bid3 = bid_type();
+bm->new_block(foxxll::default_alloc_strategy(), bid3);
+cache.load(bid3);
+ASSERT_TRUE(cache.is_cached(bid1));
+ASSERT_FALSE(cache.is_cached(bid2));
+ASSERT_EQ(cache.num_prefetched_blocks(), 0);
+
+// A prefetched block that is evicted before it is loaded
+// is no longer counted.
+cache.prefetch(bid2);
+ASSERT_EQ(cache.num_prefetched_blocks(), 1);
+cache.kick(bid2);
+ASSERT_EQ(cache.num_prefetched_blocks(), 0);
+}
+
+TEST_F(TestCache, test_cache_policy_scan) {
+// Two hot blocks are used, pushed out by a scan and used
+// again, then a second scan loads many blocks once each.
+// LRU and CLOCK evict the hot blocks again, ARC keeps them.
+bm = foxxll::block_manager::get_instance();
+constexpr unsigned num_blocks_in_cache = 6;
+constexpr unsigned num_scanned_blocks = 12;
+using lru_cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache, 0, stxxl::fractal_tree::lru_policy>;
+using clock_cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache, 0, stxxl::fractal_tree::clock_policy>;
+using arc_cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache, 0, stxxl::fractal_tree::arc_policy>;
+
+lru_cache_type lru_cache;
+clock_cache_type clock_cache;
+arc_cache_type arc_cache;
+
+std::vector<bid_type> hot_bids(2);
+for (bid_type& bid : hot_bids)
+    bm->new_block(foxxll::default_alloc_strategy(), bid);
+std::vector<bid_type> scanned_bids(num_blocks_in_cache + num_scanned_blocks);
+for (bid_type& bid : scanned_bids)
+    bm->new_block(foxxll::default_alloc_strategy(), bid);
+auto load_all = [&](const bid_type& bid) {
+    lru_cache.load(bid);
+    clock_cache.load(bid);
+    arc_cache.load(bid);
+};
+
+// Blocks that are used repeatedly only while they are cached
+// (e.g. by a scan that reads each block twice) are not hot yet.
+for (int i=0; i<2; i++) {
+    for (bid_type& bid : hot_bids)
+        load_all(bid);
+}
+for (unsigned i=0; i<num_blocks_in_cache; i++)
+    load_all(scanned_bids[i]);
+for (bid_type& bid : hot_bids) {
+    ASSERT_FALSE(lru_cache.is_cached(bid));
+    ASSERT_FALSE(clock_cache.is_cached(bid));
+    ASSERT_FALSE(arc_cache.is_cached(bid));
+}
+
+// Using them again after their eviction makes them hot.
+for (bid_type& bid : hot_bids)
+    load_all(bid);
+for (unsigned i=num_blocks_in_cache; i<scanned_bids.size(); i++)
+    load_all(scanned_bids[i]);
+for (bid_type& bid : hot_bids) {
+    ASSERT_FALSE(lru_cache.is_cached(bid));
+    ASSERT_FALSE(clock_cache.is_cached(bid));
+    ASSERT_TRUE(arc_cache.is_cached(bid));
+}
+ASSERT_EQ(lru_cache.num_cached_blocks(), num_blocks_in_cache);
+ASSERT_EQ(clock_cache.num_cached_blocks(), num_blocks_in_cache);
+ASSERT_EQ(arc_cache.num_cached_blocks(), num_blocks_in_cache);
+}
+
+TEST_F(TestCache, test_cache_policy_two_queue) {
+// With 2Q, a block only counts as hot once it is used
+// again after it was evicted from the first-use queue.
+bm = foxxll::block_manager::get_instance();
+constexpr unsigned num_blocks_in_cache = 4;
+constexpr unsigned num_scanned_blocks = 10;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache, 0, stxxl::fractal_tree::two_queue_policy>;
+
+cache_type cache;
+
+bid_type hot_bid = bid_type();
+bm->new_block(foxxll::default_alloc_strategy(), hot_bid);
+std::vector<bid_type> other_bids(num_blocks_in_cache);
+for (bid_type& bid : other_bids)
+    bm->new_block(foxxll::default_alloc_strategy(), bid);
+std::vector<bid_type> scanned_bids(num_scanned_blocks);
+for (bid_type& bid : scanned_bids)
+    bm->new_block(foxxll::default_alloc_strategy(), bid);
+
+// Use hot block, push it out of the cache with
+// other blocks and use it again.
+cache.load(hot_bid);
+for (bid_type& bid : other_bids)
+    cache.load(bid);
+ASSERT_FALSE(cache.is_cached(hot_bid));
+cache.load(hot_bid);
+
+// Now the hot block survives a scan.
+for (bid_type& bid : scanned_bids)
+    cache.load(bid);
+ASSERT_TRUE(cache.is_cached(hot_bid));
+ASSERT_EQ(cache.num_cached_blocks(), num_blocks_in_cache);
+}
+
+TEST_F(TestCache, test_cache_shared_frame_pool) {
+// Two caches share a pool of 8 blocks. The one that misses on
+// blocks it evicted recently takes blocks from the other one.
+bm = foxxll::block_manager::get_instance();
+constexpr int max_num_blocks_in_cache = 6;
+constexpr int num_blocks_in_pool = 8;
+constexpr int min_num_blocks_in_cache = 2;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, max_num_blocks_in_cache>;
+
+stxxl::fractal_tree::fractal_tree_frame_pool pool(num_blocks_in_pool);
+cache_type cache1(pool, num_blocks_in_pool / 2, min_num_blocks_in_cache);
+cache_type cache2(pool, num_blocks_in_pool / 2, min_num_blocks_in_cache);
+ASSERT_EQ(cache1.capacity(), 4);
+ASSERT_EQ(cache2.capacity(), 4);
+ASSERT_EQ(pool.num_free_frames(), 0);
+
+std::vector<bid_type> bids(max_num_blocks_in_cache);
+for (bid_type& bid : bids)
+    bm->new_block(foxxll::default_alloc_strategy(), bid);
+bid_type other_bid;
+bm->new_block(foxxll::default_alloc_strategy(), other_bid);
+
+// cache1 cycles through more blocks than it holds and
+// writes to them, cache2 only uses a single block.
+for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < max_num_blocks_in_cache; i++) {
+        block_type* block = cache1.load(bids[i]);
+        block->begin()->A.fill(value_type(round, i));
+        cache1.mark_dirty(bids[i]);
+        cache2.load(other_bid);
+    }
+}
+ASSERT_EQ(cache1.capacity(), max_num_blocks_in_cache);
+ASSERT_EQ(cache2.capacity(), min_num_blocks_in_cache);
+ASSERT_EQ(pool.num_free_frames(), 0);
+
+// Now the whole working set of cache1 is cached.
+for (int i = 0; i < max_num_blocks_in_cache; i++) {
+    ASSERT_TRUE(cache1.is_cached(bids[i]));
+    ASSERT_EQ(cache1.load(bids[i])->begin()->A[0], value_type(3, i));
+}
+
+// The other way round: cache2 takes its blocks back.
+for (bid_type& bid : bids)
+    cache1.kick(bid);
+for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < max_num_blocks_in_cache; i++) {
+        cache2.load(bids[i]);
+        cache1.load(other_bid);
+    }
+}
+ASSERT_EQ(cache1.capacity(), min_num_blocks_in_cache);
+ASSERT_EQ(cache2.capacity(), max_num_blocks_in_cache);
+for (int i = 0; i < max_num_blocks_in_cache; i++)
+    ASSERT_EQ(cache2.load(bids[i])->begin()->A[0], value_type(3, i));
+}
+
+TEST_F(TestCache, test_cache_frame_pool_frame_sizes) {
+// A pool of 24 units shared by a cache with frames of 1 unit
+// (8 frames, at least 2) and one with frames of 4 units (4
+// frames, at least 1). Ghost hits move a frame of the cache
+// that hit, taken out of the target of the other one.
+stxxl::fractal_tree::fractal_tree_frame_pool pool(24);
+int small_id = pool.add_cache(8, 2, 1);
+int large_id = pool.add_cache(4, 1, 4);
+ASSERT_EQ(pool.num_free_frames(), 0);
+
+pool.ghost_hit(large_id);
+ASSERT_EQ(pool.target(small_id), 4);
+ASSERT_EQ(pool.target(large_id), 5);
+// The small cache would go below its minimum.
+pool.ghost_hit(large_id);
+ASSERT_EQ(pool.target(small_id), 4);
+ASSERT_EQ(pool.target(large_id), 5);
+// Units that do not make up a whole frame are not used.
+pool.ghost_hit(small_id);
+ASSERT_EQ(pool.target(small_id), 5);
+ASSERT_EQ(pool.target(large_id), 4);
+
+// Frames freed by one cache can be taken by the other one.
+pool.return_frame(large_id);
+ASSERT_EQ(pool.num_free_frames(), 4);
+ASSERT_TRUE(pool.take_frame(small_id));
+ASSERT_FALSE(pool.take_frame(large_id));
+ASSERT_EQ(pool.num_free_frames(), 3);
+
+// Reserved units come out of the cache with the most to spare.
+ASSERT_TRUE(pool.reserve_frame(4));
+ASSERT_EQ(pool.target(large_id), 3);
+ASSERT_EQ(pool.num_free_frames(), -1);
+pool.release_frame(4);
+ASSERT_EQ(pool.target(small_id), 9);
+ASSERT_EQ(pool.num_free_frames(), 3);
+}
+
+TEST_F(TestCache, test_cache_bid_index) {
+using bid_index_type = stxxl::fractal_tree::bid_index<bid_type, bid_hash>;
+constexpr int num_bids = 64;
+bid_index_type index = bid_index_type(num_bids);
+
+std::vector<bid_type> bids(num_bids);
+for (int i = 0; i < num_bids; i++) {
+    bids[i].offset = i * RawBlockSize;
+    ASSERT_EQ(index.find(bids[i]), bid_index_type::none);
+    index.insert(bids[i], i);
+}
+ASSERT_EQ(index.size(), num_bids);
+
+// Erasing moves other entries around; all of
+// the remaining ones must still be found.
+for (int i = 0; i < num_bids; i += 3)
+    ASSERT_TRUE(index.erase(bids[i]));
+ASSERT_FALSE(index.erase(bids[0]));
+for (int i = 0; i < num_bids; i++)
+    ASSERT_EQ(index.find(bids[i]), i % 3 == 0 ? bid_index_type::none : i);
+
+for (int i = 0; i < num_bids; i += 3)
+    index.insert(bids[i], num_bids + i);
+for (int i = 0; i < num_bids; i++)
+    ASSERT_EQ(index.find(bids[i]), i % 3 == 0 ? num_bids + i : i);
+ASSERT_EQ(index.size(), num_bids);
+}
+
+TEST_F(TestCache, test_cache_clean) {
+bm = foxxll::block_manager::get_instance();
+constexpr int num_blocks_in_cache = 8;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
+cache_type cache;
+
+std::vector<bid_type> bids(num_blocks_in_cache);
+for (bid_type& bid : bids)
+    bm->new_block(foxxll::default_alloc_strategy(), bid);
+for (int i = 0; i < num_blocks_in_cache; i++) {
+    cache.load(bids[i])->begin()->A.fill(value_type(i, i));
+    cache.mark_dirty(bids[i]);
+}
+ASSERT_EQ(cache.num_dirty_blocks(), num_blocks_in_cache);
+
+// Disabled by default.
+cache.clean();
+ASSERT_EQ(cache.num_dirty_blocks(), num_blocks_in_cache);
+
+// Writes the 6 least recently used blocks.
+cache.set_dirty_watermarks(0.5, 0.25);
+cache.clean();
+ASSERT_EQ(cache.num_dirty_blocks(), 2);
+for (int i = 0; i < num_blocks_in_cache; i++) {
+    ASSERT_TRUE(cache.is_cached(bids[i]));
+    ASSERT_EQ(cache.is_dirty(bids[i]), i >= 6);
+}
+
+// Below the high watermark -> nothing to do.
+cache.mark_dirty(bids[0]);
+cache.clean();
+ASSERT_EQ(cache.num_dirty_blocks(), 3);
+
+// Evicting a cleaned block does not write it again.
+foxxll::stats* stats = foxxll::stats::get_instance();
+foxxll::stats_data stats_begin(*stats);
+cache.kick(bids[1]);
+ASSERT_EQ((foxxll::stats_data(*stats) - stats_begin).get_write_count(), 0);
+
+// All data made it to external memory.
+for (bid_type& bid : bids)
+    cache.kick(bid);
+for (int i = 0; i < num_blocks_in_cache; i++)
+    ASSERT_EQ(cache.load(bids[i])->begin()->A[0], value_type(i, i));
+}
+
+TEST_F(TestCache, test_cache_stats) {
+bm = foxxll::block_manager::get_instance();
+constexpr unsigned num_blocks_in_cache = 2;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
+cache_type cache;
+
+std::vector<bid_type> bids(3);
+for (bid_type& bid : bids)
+    bm->new_block(foxxll::default_alloc_strategy(), bid);
+
+// Two misses with tag 1, one hit with tag 2.
+cache.load(bids[0], 1);
+cache.mark_dirty(bids[0]);
+cache.load(bids[1], 1);
+cache.load(bids[1], 2);
+// Evicts the dirty bids[0] (last loaded with tag 1).
+cache.load(bids[2], 2);
+// Evicts the clean bids[1] (last loaded with tag 2).
+cache.load(bids[0], 1);
+
+stxxl::fractal_tree::fractal_tree_cache_stats stats1 = cache.stats(1);
+ASSERT_EQ(stats1.hits, 0);
+ASSERT_EQ(stats1.misses, 3);
+ASSERT_EQ(stats1.evictions, 1);
+ASSERT_EQ(stats1.dirty_writebacks, 1);
+ASSERT_EQ(stats1.clean_drops, 0);
+
+stxxl::fractal_tree::fractal_tree_cache_stats stats2 = cache.stats(2);
+ASSERT_EQ(stats2.hits, 1);
+ASSERT_EQ(stats2.misses, 1);
+ASSERT_EQ(stats2.evictions, 1);
+ASSERT_EQ(stats2.dirty_writebacks, 0);
+ASSERT_EQ(stats2.clean_drops, 1);
+
+stxxl::fractal_tree::fractal_tree_cache_stats total = cache.stats();
+ASSERT_EQ(total.hits, 1);
+ASSERT_EQ(total.misses, 4);
+ASSERT_EQ(total.evictions, 2);
+ASSERT_DOUBLE_EQ(total.hit_ratio(), 0.2);
+ASSERT_EQ(cache.stats(3).misses, 0);
+
+cache.reset_stats();
+ASSERT_EQ(cache.stats().misses, 0);
+ASSERT_EQ(cache.stats().evictions, 0);
+
+// A prefetched block that is evicted before it is loaded counts
+// for the tag of the prefetch (not of the frame's previous block).
+cache.prefetch(bids[1], 3);
+cache.load(bids[0], 1);
+// Evicts the prefetched bids[1].
+cache.load(bids[2], 1);
+ASSERT_EQ(cache.stats(2).evictions, 1);
+ASSERT_EQ(cache.stats(3).evictions, 1);
+ASSERT_EQ(cache.stats(3).misses, 0);
+
+// Kicking a block is no eviction.
+cache.kick(bids[0]);
+ASSERT_EQ(cache.stats().evictions, 2);
+}
+
+TEST_F(TestCache, test_cache_load_new) {
+std::array<value_type, num_items> data1;
+data1.fill(value_type(1, 1));
+
+bm = foxxll::block_manager::get_instance();
+constexpr unsigned num_blocks_in_cache = 2;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
+cache_type cache;
+
+bid_type bid1;
+bm->new_block(foxxll::default_alloc_strategy(), bid1);
+
+// A new block is not read, and is dirty.
+foxxll::stats* stats = foxxll::stats::get_instance();
+foxxll::stats_data stats_begin(*stats);
+cache.load_new(bid1)->begin()->A = data1;
+ASSERT_EQ((foxxll::stats_data(*stats) - stats_begin).get_read_count(), 0);
+ASSERT_TRUE(cache.is_cached(bid1));
+ASSERT_TRUE(cache.is_dirty(bid1));
+ASSERT_EQ(cache.num_dirty_blocks(), 1);
+
+// It is written when it is evicted.
+cache.kick(bid1);
+ASSERT_EQ((foxxll::stats_data(*stats) - stats_begin).get_write_count(), 1);
+ASSERT_EQ(cache.load(bid1)->begin()->A, data1);
+}
+
+TEST_F(TestCache, test_cache_pin) {
+bm = foxxll::block_manager::get_instance();
+constexpr unsigned num_blocks_in_cache = 3;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
+cache_type cache;
+
+std::array<bid_type, 6> bids;
+for (bid_type& bid : bids)
+    bm->new_block(foxxll::default_alloc_strategy(), bid);
+
+// A pinned block stays cached, although it is
+// the least recently used one.
+cache_type::pinned_block pin0 = cache.pin(bids[0]);
+ASSERT_TRUE(pin0.valid());
+ASSERT_EQ(pin0.block(), cache.load(bids[0]));
+for (int i = 1; i < 6; i++)
+    cache.load(bids[i]);
+ASSERT_TRUE(cache.is_cached(bids[0]));
+
+// Pins can be moved.
+cache_type::pinned_block moved_pin0 = std::move(pin0);
+ASSERT_FALSE(pin0.valid());
+for (int i = 1; i < 6; i++)
+    cache.load(bids[i]);
+ASSERT_TRUE(cache.is_cached(bids[0]));
+
+// Once released, the block can be evicted again.
+moved_pin0.release();
+ASSERT_FALSE(moved_pin0.valid());
+for (int i = 1; i < 6; i++)
+    cache.load(bids[i]);
+ASSERT_FALSE(cache.is_cached(bids[0]));
+
+// With all blocks pinned, prefetching does nothing.
+{
+    cache_type::pinned_block pin1 = cache.pin(bids[1]);
+    cache_type::pinned_block pin2 = cache.pin(bids[2]);
+    cache_type::pinned_block pin3 = cache.pin_new(bids[0]);
+    ASSERT_TRUE(cache.is_dirty(bids[0]));
+    cache.prefetch(bids[3]);
+    ASSERT_FALSE(cache.is_cached(bids[3]));
+    ASSERT_TRUE(cache.is_cached(bids[1]));
+    ASSERT_TRUE(cache.is_cached(bids[2]));
+}
+cache.prefetch(bids[3]);
+ASSERT_TRUE(cache.is_cached(bids[3]));
+}
+
+TEST_F(TestCache, test_cache_discard) {
+std::array<value_type, num_items> data1;
+data1.fill(value_type(1, 1));
+
+bm = foxxll::block_manager::get_instance();
+constexpr unsigned num_blocks_in_cache = 2;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
+cache_type cache;
+
+bid_type bid1, bid2;
+bm->new_block(foxxll::default_alloc_strategy(), bid1);
+bm->new_block(foxxll::default_alloc_strategy(), bid2);
+
+// A discarded dirty block is dropped without being written.
+foxxll::stats* stats = foxxll::stats::get_instance();
+foxxll::stats_data stats_begin(*stats);
+cache.load_new(bid1)->begin()->A = data1;
+cache.load_new(bid2)->begin()->A = data1;
+cache.discard(bid1);
+ASSERT_FALSE(cache.is_cached(bid1));
+ASSERT_FALSE(cache.is_dirty(bid1));
+ASSERT_EQ(cache.num_dirty_blocks(), 1);
+ASSERT_EQ(cache.num_cached_blocks(), 1);
+ASSERT_EQ(cache.num_unused_blocks(), 1);
+
+// An evicted block is discarded as well.
+cache.kick(bid2);
+cache.discard(bid2);
+ASSERT_EQ(cache.num_cached_blocks(), 0);
+ASSERT_EQ(cache.num_unused_blocks(), 2);
+ASSERT_EQ((foxxll::stats_data(*stats) - stats_begin).get_write_count(), 1);
+
+// A dropped block is not written either, but its bid can be loaded again.
+bid_type bid3;
+bm->new_block(foxxll::default_alloc_strategy(), bid3);
+cache.load_new(bid3)->begin()->A = data1;
+cache.drop(bid3);
+ASSERT_FALSE(cache.is_cached(bid3));
+ASSERT_EQ(cache.num_dirty_blocks(), 0);
+ASSERT_EQ(cache.num_unused_blocks(), 2);
+cache.load_new(bid3)->begin()->A = data1;
+cache.kick(bid3);
+ASSERT_EQ((foxxll::stats_data(*stats) - stats_begin).get_write_count(), 2);
+ASSERT_EQ(cache.load(bid3)->begin()->A, data1);
+}
+
+TEST_F(TestCache, test_cache_virtual_bids) {
+std::array<value_type, num_items> data1;
+data1.fill(value_type(1, 1));
+std::array<value_type, num_items> data2;
+data2.fill(value_type(2, 2));
+
+bm = foxxll::block_manager::get_instance();
+constexpr unsigned num_blocks_in_cache = 2;
+using cache_type = fractal_tree_cache<block_type, bid_type, bid_hash, num_blocks_in_cache>;
+cache_type cache;
+
+// Blocks with virtual bids get their disk block when they are written.
+std::array<bid_type, 2> disk_bids;
+int num_allocated = 0;
+cache.set_block_allocator([&](const bid_type& bid) {
+    bid_type& disk_bid = disk_bids[bid.offset];
+    bm->new_block(foxxll::default_alloc_strategy(), disk_bid);
+    num_allocated++;
+    return disk_bid;
+});
+
+bid_type virtual_bid1;
+virtual_bid1.offset = 0;
+bid_type virtual_bid2;
+virtual_bid2.offset = 1;
+ASSERT_TRUE(cache_type::is_virtual(virtual_bid1));
+cache.load_new(virtual_bid1)->begin()->A = data1;
+cache.load_new(virtual_bid2)->begin()->A = data2;
+ASSERT_EQ(num_allocated, 0);
+
+// Evicting allocates.
+cache.kick(virtual_bid1);
+ASSERT_EQ(num_allocated, 1);
+ASSERT_FALSE(cache.is_cached(virtual_bid1));
+ASSERT_EQ(cache.load(disk_bids[0])->begin()->A, data1);
+
+// So does cleaning; the block stays cached under its disk bid.
+cache.set_dirty_watermarks(0, 0);
+cache.clean();
+ASSERT_EQ(num_allocated, 2);
+ASSERT_FALSE(cache.is_cached(virtual_bid2));
+ASSERT_TRUE(cache.is_cached(disk_bids[1]));
+ASSERT_FALSE(cache.is_dirty(disk_bids[1]));
+cache.kick(disk_bids[1]);
+ASSERT_EQ(cache.load(disk_bids[1])->begin()->A, data2);
+}
+
+TEST_F(TestCache, test_cache_block_codec) {
+stxxl::fractal_tree::lz_block_codec codec;
+std::mt19937 gen(0);
+
+std::vector<std::vector<char>> inputs;
+inputs.emplace_back();
+inputs.emplace_back(std::vector<char>{ 'a' });
+inputs.emplace_back(std::vector<char>(13, 'b'));
+inputs.emplace_back(std::vector<char>(100000, 0));
+// Sorted items with small data, as in a leaf.
+std::vector<char> items;
+for (int i = 0; i < 5000; i++) {
+    value_type item(3 * i, i % 7);
+    items.insert(items.end(), reinterpret_cast<char*>(&item), reinterpret_cast<char*>(&item) + sizeof(item));
+}
+inputs.push_back(items);
+// Random bytes, and random bytes with repeats.
+std::vector<char> random(70000);
+for (char& c : random)
+    c = static_cast<char>(gen());
+inputs.push_back(random);
+std::vector<char> repeats;
+for (int i = 0; i < 300; i++)
+    repeats.insert(repeats.end(), random.begin() + gen() % 1000, random.begin() + 1000 + gen() % 300);
+inputs.push_back(repeats);
+
+for (const std::vector<char>& input : inputs) {
+    std::vector<char> compressed(input.size() + input.size() / 255 + 16);
+    size_t num_bytes = codec.compress(input.data(), input.size(), compressed.data(), compressed.size());
+    ASSERT_GT(num_bytes, 0u);
+    std::vector<char> output(input.size());
+    ASSERT_TRUE(codec.decompress(compressed.data(), num_bytes, output.data(), output.size()));
+    ASSERT_EQ(output, input);
+    // Wrong sizes and truncated input are detected.
+    if (!input.empty()) {
+        ASSERT_FALSE(codec.decompress(compressed.data(), num_bytes, output.data(), output.size() - 1));
+        ASSERT_FALSE(codec.decompress(compressed.data(), num_bytes - 1, output.data(), output.size()));
+    }
+    // Without enough space, compress gives up.
+    if (input == random) {
+        ASSERT_EQ(codec.compress(input.data(), input.size(), compressed.data(), input.size() - 1), 0u);
+    }
+}
+ASSERT_LT(codec.compress(items.data(), items.size(), std::vector<char>(items.size()).data(), items.size()), items.size() * 2 / 3);
+}
+
+TEST_F(TestCache, test_cache_compression) {
+constexpr unsigned CompressedBlockSize = 64 * 1024;
+using compressed_bid_type = foxxll::BID<CompressedBlockSize>;
+using compressed_block_type = foxxll::typed_block<CompressedBlockSize, std::array<int, CompressedBlockSize / sizeof(int)>>;
+struct compressed_bid_hash {
+    size_t operator () (const compressed_bid_type& bid) const {
+        return foxxll::longhash1(bid.offset + reinterpret_cast<uint64_t>(bid.storage));
+    }
+};
+constexpr unsigned num_blocks_in_cache = 2;
+using cache_type = fractal_tree_cache<compressed_block_type, compressed_bid_type, compressed_bid_hash, num_blocks_in_cache, 0,
+                                      stxxl::fractal_tree::lru_policy, stxxl::fractal_tree::lz_block_codec>;
+cache_type cache;
+
+// A block that compresses well, and one that does not.
+std::array<int, CompressedBlockSize / sizeof(int)> sorted;
+for (int i = 0; i < (int) sorted.size(); i++)
+    sorted[i] = i / 4;
+std::array<int, CompressedBlockSize / sizeof(int)> random;
+std::mt19937 gen(0);
+for (int& value : random)
+    value = gen();
+
+compressed_bid_type bid1;
+compressed_bid_type bid2;
+cache.new_block(foxxll::default_alloc_strategy(), bid1);
+cache.new_block(foxxll::default_alloc_strategy(), bid2);
+ASSERT_NE(bid1, bid2);
+*cache.load_new(bid1)->begin() = sorted;
+*cache.load_new(bid2)->begin() = random;
+cache.kick(bid1);
+cache.kick(bid2);
+
+stxxl::fractal_tree::fractal_tree_codec_stats stats = cache.codec_stats();
+ASSERT_EQ(stats.num_compressed, 2u);
+ASSERT_EQ(stats.raw_bytes, 2u * CompressedBlockSize);
+ASSERT_GT(stats.compression_ratio(), 1.5);
+ASSERT_LT(stats.bytes_written, 1.5 * CompressedBlockSize);
+ASSERT_EQ(stats.disk_bytes_used, stats.bytes_written);
+ASSERT_GE(stats.disk_bytes_allocated, stats.disk_bytes_used);
+
+// The cache holds the blocks uncompressed.
+ASSERT_EQ(*cache.load(bid1)->begin(), sorted);
+ASSERT_EQ(*cache.load(bid2)->begin(), random);
+ASSERT_EQ(cache.codec_stats().num_decompressed, 1u);
+ASSERT_EQ(cache.codec_stats().bytes_read, stats.bytes_written);
+
+// Swapping the contents moves both blocks to other extents.
+*cache.load(bid1)->begin() = random;
+cache.mark_dirty(bid1);
+*cache.load(bid2)->begin() = sorted;
+cache.mark_dirty(bid2);
+cache.kick(bid1);
+cache.kick(bid2);
+ASSERT_EQ(*cache.load(bid1)->begin(), random);
+ASSERT_EQ(*cache.load(bid2)->begin(), sorted);
+ASSERT_EQ(cache.codec_stats().disk_bytes_used, stats.disk_bytes_used);
+
+cache.reset_stats();
+ASSERT_EQ(cache.codec_stats().num_compressed, 0u);
+ASSERT_EQ(cache.codec_stats().disk_bytes_used, stats.disk_bytes_used);
+
+// Blocks whose compressed size keeps changing reuse the disk space
+// that becomes free (all of them fit into the first segment).
+std::vector<compressed_bid_type> bids(48);
+for (compressed_bid_type& bid : bids) {
+    cache.new_block(foxxll::default_alloc_strategy(), bid);
+    *cache.load_new(bid)->begin() = sorted;
+    cache.kick(bid);
+}
+for (int i = 0; i < 2000; i++) {
+    compressed_bid_type& bid = bids[gen() % bids.size()];
+    std::array<int, CompressedBlockSize / sizeof(int)>& data = *cache.load(bid)->begin();
+    int num_random = gen() % data.size();
+    std::copy(random.begin(), random.begin() + num_random, data.begin());
+    std::fill(data.begin() + num_random, data.end(), 0);
+    cache.mark_dirty(bid);
+    cache.kick(bid);
+}
+ASSERT_EQ(cache.codec_stats().disk_bytes_allocated, 64u * CompressedBlockSize);
+}
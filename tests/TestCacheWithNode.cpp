@@ -37,10 +37,9 @@ TEST_F(TestCacheWithNode, test_cache_with_node_load) {
     foxxll::block_manager* bm = foxxll::block_manager::get_instance();
     constexpr unsigned num_blocks_in_cache = 1;
     using cache_type = fractal_tree_cache<node_type::block_type, bid_type, bid_hash, num_blocks_in_cache>;
-    std::unordered_set<bid_type, bid_hash> dirty_bids;
 
     node_type n(0, bid_type());
-    cache_type cache = cache_type(dirty_bids);
+    cache_type cache;
 
     bm->new_block(foxxll::default_alloc_strategy(), n.get_bid());
 
@@ -52,7 +51,7 @@ TEST_F(TestCacheWithNode, test_cache_with_node_load) {
     n.set_block(cached_block);
     std::vector<value_type> buffer_items { {0,0} };
     n.set_buffer(buffer_items);
-    dirty_bids.insert(n.get_bid());
+    cache.mark_dirty(n.get_bid());
 
     ASSERT_EQ(n.num_items_in_buffer(), 1);
     ASSERT_EQ(n.num_values(), 0);
@@ -89,12 +88,11 @@ TEST_F(TestCacheWithNode, test_cache_with_node_evict) {
     foxxll::block_manager* bm = foxxll::block_manager::get_instance();
     constexpr unsigned num_blocks_in_cache = 2;
     using cache_type = fractal_tree_cache<node_type::block_type, bid_type, bid_hash, num_blocks_in_cache>;
-    std::unordered_set<bid_type, bid_hash> dirty_bids;
 
     node_type n1(1, bid_type());
     node_type n2(2, bid_type());
     node_type n3(3, bid_type());
-    cache_type cache = cache_type(dirty_bids);
+    cache_type cache;
 
     bm->new_block(foxxll::default_alloc_strategy(), n1.get_bid());
     bm->new_block(foxxll::default_alloc_strategy(), n2.get_bid());
@@ -105,7 +103,7 @@ TEST_F(TestCacheWithNode, test_cache_with_node_evict) {
     n1.set_block(block_for_n1);
     n1.set_values_and_nodeIDs(values1, nodeIDs1);
     n1.set_buffer(buffer1);
-    dirty_bids.insert(n1.get_bid());
+    cache.mark_dirty(n1.get_bid());
 
     ASSERT_TRUE(cache.is_cached(n1.get_bid()));
     ASSERT_FALSE(cache.is_cached(n2.get_bid()));
@@ -122,7 +120,7 @@ TEST_F(TestCacheWithNode, test_cache_with_node_evict) {
     n2.set_block(block_for_n2);
     n2.set_values_and_nodeIDs(values2, nodeIDs2);
     n2.set_buffer(buffer2);
-    dirty_bids.insert(n2.get_bid());
+    cache.mark_dirty(n2.get_bid());
 
     ASSERT_TRUE(cache.is_cached(n1.get_bid()));
     ASSERT_TRUE(cache.is_cached(n2.get_bid()));
@@ -143,7 +141,7 @@ TEST_F(TestCacheWithNode, test_cache_with_node_evict) {
     n3.set_block(block_for_n3);
     n3.set_values_and_nodeIDs(values3, nodeIDs3);
     n3.set_buffer(buffer3);
-    dirty_bids.insert(n3.get_bid());
+    cache.mark_dirty(n3.get_bid());
 
     ASSERT_FALSE(cache.is_cached(n1.get_bid()));
     ASSERT_TRUE(cache.is_cached(n2.get_bid()));
@@ -238,12 +236,11 @@ TEST_F(TestCacheWithNode, test_cache_with_leaf_evict) {
     foxxll::block_manager* bm = foxxll::block_manager::get_instance();
     constexpr unsigned num_blocks_in_cache = 2;
     using cache_type = fractal_tree_cache<leaf_type::block_type, bid_type, bid_hash, num_blocks_in_cache>;
-    std::unordered_set<bid_type, bid_hash> dirty_bids;
 
     leaf_type n1(1, bid_type());
     leaf_type n2(2, bid_type());
     leaf_type n3(3, bid_type());
-    cache_type cache = cache_type(dirty_bids);
+    cache_type cache;
 
     bm->new_block(foxxll::default_alloc_strategy(), n1.get_bid());
     bm->new_block(foxxll::default_alloc_strategy(), n2.get_bid());
@@ -253,7 +250,7 @@ TEST_F(TestCacheWithNode, test_cache_with_leaf_evict) {
     leaf_type::block_type* block_for_n1 = cache.load(n1.get_bid());
     n1.set_block(block_for_n1);
     n1.set_buffer(buffer1);
-    dirty_bids.insert(n1.get_bid());
+    cache.mark_dirty(n1.get_bid());
 
     ASSERT_TRUE(cache.is_cached(n1.get_bid()));
     ASSERT_FALSE(cache.is_cached(n2.get_bid()));
@@ -267,7 +264,7 @@ TEST_F(TestCacheWithNode, test_cache_with_leaf_evict) {
     leaf_type::block_type* block_for_n2 = cache.load(n2.get_bid());
     n2.set_block(block_for_n2);
     n2.set_buffer(buffer2);
-    dirty_bids.insert(n2.get_bid());
+    cache.mark_dirty(n2.get_bid());
 
     ASSERT_TRUE(cache.is_cached(n1.get_bid()));
     ASSERT_TRUE(cache.is_cached(n2.get_bid()));
@@ -283,7 +280,7 @@ TEST_F(TestCacheWithNode, test_cache_with_leaf_evict) {
     leaf_type::block_type* block_for_n3 = cache.load(n3.get_bid());
     n3.set_block(block_for_n3);
     n3.set_buffer(buffer3);
-    dirty_bids.insert(n3.get_bid());
+    cache.mark_dirty(n3.get_bid());
 
     ASSERT_FALSE(cache.is_cached(n1.get_bid()));
     ASSERT_TRUE(cache.is_cached(n2.get_bid()));
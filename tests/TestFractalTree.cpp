@@ -5,6 +5,8 @@
 #include "../include/fractal_tree/fractal_tree.h"
 #include <random>
 #include <algorithm>
+#include <map>
+#include <functional>
 
 using key_type = int;
 using data_type = int;
@@ -14,6 +16,42 @@ constexpr unsigned RawBlockSize = 512;
 constexpr unsigned RawMemoryPoolSize = 4096;
 
 using ftree_type = stxxl::ftree<key_type, data_type, RawBlockSize, RawMemoryPoolSize>;
+// The tests of the shape of the tree count the splits of leaves
+// that take a fixed number of items (packed leaves take more).
+using shape_ftree_type = stxxl::ftree<key_type, data_type, RawBlockSize, RawMemoryPoolSize,
+                                      foxxll::default_alloc_strategy, stxxl::fractal_tree::lru_policy, false>;
+
+// Sequential keys only go to the rightmost leaf. It gets the upper
+// half of the root buffer when the root splits, and then a full node
+// buffer per flush; it splits in half (the mid item moves up to the
+// parent) when they do not fit. Number of leaves after num_flushes
+// such flushes (a node buffer can take fewer items than a leaf,
+// e.g. with the buffer filter).
+template<typename Tree>
+int num_leaves_after_sequential_flushes(int num_flushes) {
+    int num_buffer_items = Tree::max_num_buffer_items_in_node;
+    int num_leaves = 2;
+    int num_rightmost_items = num_buffer_items - 1 - (num_buffer_items - 1) / 2;
+    for (int i=0; i<num_flushes; i++) {
+        int num_items = num_rightmost_items + num_buffer_items;
+        if (num_items <= Tree::max_num_buffer_items_in_leaf) {
+            num_rightmost_items = num_items;
+        } else {
+            num_rightmost_items = num_items - 1 - (num_items - 1) / 2;
+            num_leaves++;
+        }
+    }
+    return num_leaves;
+}
+
+// Number of flushes (see above) until the tree has num_leaves leaves.
+template<typename Tree>
+int num_sequential_flushes_until_num_leaves(int num_leaves) {
+    int num_flushes = 0;
+    while (num_leaves_after_sequential_flushes<Tree>(num_flushes) < num_leaves)
+        num_flushes++;
+    return num_flushes;
+}
 
 class TestFractalTree : public ::testing::Test { };
 
@@ -118,24 +156,27 @@ TEST_F(TestFractalTree, test_fractal_tree_insert_split_singular_root) {
 }
 
 TEST_F(TestFractalTree, test_fractal_tree_insert_flush_bottom_buffer) {
-    stxxl::ftree<int, int, 512, 4096> f;
+    shape_ftree_type f;
     int max_num_root_insertions_without_split = f.max_num_buffer_items_in_node;
+    // The last of these flushes is the one below.
+    int num_flushes_until_leaf_split = num_sequential_flushes_until_num_leaves<shape_ftree_type>(3);
+    int num_insertions_until_flush = (1 + num_flushes_until_leaf_split) * max_num_root_insertions_without_split;
 
-    // Fill up root buffer twice (-> root has already split once now
-    // and its buffer is again full).
-    for (int i=0; i<2*max_num_root_insertions_without_split; i++)
+    // Fill up root buffer (-> root has already split once, flushed
+    // all but one of the buffers and its buffer is again full now).
+    for (int i=0; i<num_insertions_until_flush; i++)
         f.insert(value_type(i, 2*i));
 
     // Root buffer is now full, but root values are not at least half full
     // -> will flush_bottom_buffer(root)
-    f.insert(value_type(2*max_num_root_insertions_without_split, 2*2*max_num_root_insertions_without_split));
+    f.insert(value_type(num_insertions_until_flush, 2*num_insertions_until_flush));
 
     // Fill up root buffer again
-    for (int i=2*max_num_root_insertions_without_split+1; i<3*max_num_root_insertions_without_split; i++)
+    for (int i=num_insertions_until_flush+1; i<num_insertions_until_flush+max_num_root_insertions_without_split; i++)
         f.insert(value_type(i, 2*i));
 
     // Check inserted values are found
-    for (int i=0; i<3*max_num_root_insertions_without_split; i++) {
+    for (int i=0; i<num_insertions_until_flush+max_num_root_insertions_without_split; i++) {
         ASSERT_TRUE(f.find(i).second);
         ASSERT_EQ(f.find(i).first, 2*i);
     }
@@ -146,11 +187,13 @@ TEST_F(TestFractalTree, test_fractal_tree_insert_flush_bottom_buffer) {
 }
 
 TEST_F(TestFractalTree, test_fractal_tree_insert_split_root) {
-    stxxl::ftree<int, int, 512, 4096> f;
+    shape_ftree_type f;
     int max_num_values = f.max_num_values_in_node;
     int max_num_values_until_root_half_full = (max_num_values - 1)/2;
+    int num_flushes_until_root_values_half_full =
+            num_sequential_flushes_until_num_leaves<shape_ftree_type>(1 + max_num_values_until_root_half_full);
     int max_num_root_insertions_until_root_values_half_full =
-            f.max_num_buffer_items_in_node * (1 + max_num_values_until_root_half_full);
+            f.max_num_buffer_items_in_node * (2 + num_flushes_until_root_values_half_full);
 
     // Fill up root buffer until it is half full
     for (int i=0; i<max_num_root_insertions_until_root_values_half_full; i++)
@@ -171,13 +214,15 @@ TEST_F(TestFractalTree, test_fractal_tree_insert_split_root) {
 }
 
 TEST_F(TestFractalTree, test_fractal_tree_insert_flush_buffer) {
-    stxxl::ftree<int, int, 512, 4096> f;
+    shape_ftree_type f;
     int max_num_values = f.max_num_values_in_node;
     int max_num_values_until_root_half_full = (max_num_values - 1)/2;
+    int num_flushes_until_root_values_half_full =
+            num_sequential_flushes_until_num_leaves<shape_ftree_type>(1 + max_num_values_until_root_half_full);
     int max_num_root_insertions_until_root_values_half_full =
-            f.max_num_buffer_items_in_node * (1 + max_num_values_until_root_half_full);
+            f.max_num_buffer_items_in_node * (2 + num_flushes_until_root_values_half_full);
     int max_num_insertions_until_depth_3_root_flush =
-            f.max_num_buffer_items_in_node * (2 + max_num_values_until_root_half_full);
+            f.max_num_buffer_items_in_node * (3 + num_flushes_until_root_values_half_full);
 
     // Fill up root buffer to get depth three
     for (int i=0; i<max_num_insertions_until_depth_3_root_flush; i++)
@@ -194,8 +239,10 @@ TEST_F(TestFractalTree, test_fractal_tree_insert_flush_buffer) {
         ASSERT_EQ(f.find(i).first, 2*i);
     }
 
+    // The root flush makes its right child flush its full buffer.
     ASSERT_EQ(f.depth(), 3);
-    ASSERT_EQ(f.num_leaves(), 2 + max_num_values_until_root_half_full);
+    ASSERT_EQ(f.num_leaves(), num_leaves_after_sequential_flushes<shape_ftree_type>(
+            num_flushes_until_root_values_half_full + 1));
     ASSERT_EQ(f.num_nodes(), 3);
 
     std::cout << f.depth() << "     " << f.num_nodes() << "     " << f.num_leaves() << std::endl;
@@ -268,6 +315,56 @@ TEST_F(TestFractalTree, test_fractal_tree_insert_4mb) {
 }
 
 
+// The items with keys 0, ..., num_items - 1 (and datum 2 * key),
+// in a random order.
+std::vector<value_type> shuffled_items(int num_items) {
+    std::vector<value_type> items {};
+    items.reserve(num_items);
+    for (int i=0; i<num_items; i++)
+        items.emplace_back(i, 2*i);
+
+    auto rng = std::default_random_engine { 42 };
+    std::shuffle(std::begin(items), std::end(items), rng);
+    return items;
+}
+
+// Check that the tree has the items of shuffled_items(num_items).
+template<typename Tree>
+void find_shuffled_items(Tree& f, int num_items) {
+    for (int i=0; i<num_items; i++) {
+        ASSERT_TRUE(f.find(i).second);
+        ASSERT_EQ(f.find(i).first, 2*i);
+    }
+}
+
+// Insert the items of shuffled_items(num_items) and check that they are found.
+template<typename Tree>
+void insert_and_find_shuffled_items(Tree& f, int num_items) {
+    for (auto val : shuffled_items(num_items))
+        f.insert(val);
+    find_shuffled_items(f, num_items);
+}
+
+// Check that find gives the datum of every item of expected
+// (a std::map) with a key in [lo, hi].
+template<typename Tree, typename Map>
+void find_expected_items(Tree& f, const Map& expected,
+                         const typename Map::key_type& lo, const typename Map::key_type& hi) {
+    for (auto it = expected.lower_bound(lo); it != expected.upper_bound(hi); ++it)
+        ASSERT_EQ(f.find(it->first), std::make_pair(it->second, true));
+}
+
+// Check that the tree has exactly the items of expected with keys
+// in [lo, hi]: find gives their data, and range_find(lo, hi) gives
+// them (and nothing else) in order.
+template<typename Tree, typename Map>
+void expect_tree_matches(Tree& f, const Map& expected,
+                         const typename Map::key_type& lo, const typename Map::key_type& hi) {
+    find_expected_items(f, expected, lo, hi);
+    auto range = f.range_find(lo, hi);
+    ASSERT_EQ(range, decltype(range)(expected.lower_bound(lo), expected.upper_bound(hi)));
+}
+
 TEST_F(TestFractalTree, test_fractal_tree_range_search) {
     stxxl::ftree<int, int, 4096, 2*1024*1024> f;
 
@@ -330,4 +427,528 @@ TEST_F(TestFractalTree, test_fractal_tree_range_search) {
     ASSERT_TRUE(v.size() == 1);
     ASSERT_TRUE(v[0] == value_type(0,0));
 
-}
\ No newline at end of file
+}
+TEST_F(TestFractalTree, test_fractal_tree_range_search_missing_bounds) {
+    stxxl::ftree<int, int, 4096, 8*4096> f;
+
+    // Only even keys, so that odd bounds are not in the tree.
+    int values_to_insert = 64*1024;
+    for (int i=0; i<values_to_insert; i++)
+        f.insert(value_type(2*i, i));
+
+    // The key just above the range is not found.
+    std::vector<value_type> v = f.range_find(11, 21);
+    ASSERT_EQ(v.size(), 5);
+    ASSERT_TRUE(v.front() == value_type(12, 6));
+    ASSERT_TRUE(v.back() == value_type(20, 10));
+
+    v = f.range_find(1001, 1001);
+    ASSERT_TRUE(v.empty());
+
+    v = f.range_find(-1, 2*values_to_insert);
+    ASSERT_EQ(v.size(), values_to_insert);
+    for (int i=0; i<v.size(); i++)
+        ASSERT_TRUE(v[i] == value_type(2*i, i));
+}
+TEST_F(TestFractalTree, test_fractal_tree_range_search_read_ahead) {
+    stxxl::ftree<int, int, 4096, 8*4096> f;
+    insert_and_find_shuffled_items(f, 512*1024/8);
+
+    // Window is capped by the size of the leaf cache.
+    f.set_range_read_ahead(1000);
+    ASSERT_LT(f.range_read_ahead(), 1000);
+
+    // Same results with and without read-ahead.
+    for (int read_ahead : { 0, 1, f.range_read_ahead() }) {
+        f.set_range_read_ahead(read_ahead);
+        ASSERT_EQ(f.range_read_ahead(), read_ahead);
+
+        std::vector<value_type> v = f.range_find(1000, 40000);
+        ASSERT_EQ(v.size(), 40000 - 1000 + 1);
+        for (int i=0; i<v.size(); i++)
+            ASSERT_EQ(v[i], value_type(1000 + i, 2*(1000 + i)));
+    }
+}
+
+template <template<typename, typename, unsigned> class CachePolicy>
+void insert_and_find_with_policy() {
+    stxxl::ftree<int, int, 4096, 8*4096, foxxll::default_alloc_strategy, CachePolicy> f;
+    insert_and_find_shuffled_items(f, 512*1024/8);
+
+    std::vector<value_type> v = f.range_find(100, 20000);
+    ASSERT_EQ(v.size(), 20000 - 100 + 1);
+    for (int i=0; i<v.size(); i++)
+        ASSERT_EQ(v[i], value_type(100 + i, 2*(100 + i)));
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_cache_policies) {
+    insert_and_find_with_policy<stxxl::fractal_tree::lru_policy>();
+    insert_and_find_with_policy<stxxl::fractal_tree::clock_policy>();
+    insert_and_find_with_policy<stxxl::fractal_tree::two_queue_policy>();
+    insert_and_find_with_policy<stxxl::fractal_tree::arc_policy>();
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_pinned_levels) {
+    stxxl::ftree<int, int, 4096, 64*4096> f;
+
+    int values_to_insert = 512*1024/8;
+    std::vector<value_type> to_insert = shuffled_items(values_to_insert);
+
+    // Pin the top levels while the tree is still shallow, so that
+    // nodes are pinned when they are created, and unpinned when
+    // splitting the root pushes them below the pinned levels.
+    f.set_num_pinned_levels(2);
+    for (int i=0; i<values_to_insert/2; i++)
+        f.insert(to_insert[i]);
+    // Pin existing nodes.
+    f.set_num_pinned_levels(3);
+    ASSERT_GT(f.num_pinned_nodes(), 0);
+    for (int i=values_to_insert/2; i<values_to_insert; i++)
+        f.insert(to_insert[i]);
+    ASSERT_GT(f.depth(), 3);
+    ASSERT_GT(f.num_pinned_nodes(), 0);
+    find_shuffled_items(f, values_to_insert);
+
+    // Unpin everything but the root.
+    f.set_num_pinned_levels(1);
+    ASSERT_EQ(f.num_pinned_nodes(), 0);
+    find_shuffled_items(f, values_to_insert);
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_dirty_watermarks) {
+    stxxl::ftree<int, int, 4096, 16*4096> f;
+    f.set_dirty_watermarks(0.5, 0.25);
+    insert_and_find_shuffled_items(f, 512*1024/8);
+
+    std::vector<value_type> v = f.range_find(100, 20000);
+    ASSERT_EQ(v.size(), 20000 - 100 + 1);
+    for (int i=0; i<v.size(); i++)
+        ASSERT_EQ(v[i], value_type(100 + i, 2*(100 + i)));
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_stats) {
+    stxxl::ftree<int, int, 4096, 8*4096> f;
+
+    int values_to_insert = 512*1024/8;
+    for (int i=0; i<values_to_insert; i++)
+        f.insert(value_type((i * 7919) % values_to_insert, i));
+    stxxl::fractal_tree::fractal_tree_stats insert_stats = f.snapshot_and_reset_stats();
+    ASSERT_GT(insert_stats.node_cache.misses + insert_stats.leaf_cache.misses, 0);
+    ASSERT_GT(insert_stats.leaf_cache.dirty_writebacks, 0);
+
+    for (int i=0; i<1000; i++)
+        f.find(i);
+    stxxl::fractal_tree::fractal_tree_stats find_stats = f.stats();
+    ASSERT_EQ(find_stats.levels.size(), f.depth() + 1);
+    // All leaves are at the bottom level.
+    ASSERT_EQ(find_stats.levels[f.depth()].hits + find_stats.levels[f.depth()].misses,
+              find_stats.leaf_cache.hits + find_stats.leaf_cache.misses);
+    // The per-level statistics add up to the per-cache ones.
+    stxxl::fractal_tree::fractal_tree_cache_stats total;
+    for (const auto& level : find_stats.levels)
+        total += level;
+    ASSERT_EQ(total.misses, find_stats.node_cache.misses + find_stats.leaf_cache.misses);
+    ASSERT_EQ(total.evictions, find_stats.node_cache.evictions + find_stats.leaf_cache.evictions);
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_lazy_block_allocation) {
+    foxxll::block_manager* bm = foxxll::block_manager::get_instance();
+    foxxll::stats* stats = foxxll::stats::get_instance();
+    uint64_t allocation_begin = bm->get_total_allocation();
+    foxxll::stats_data stats_begin(*stats);
+
+    stxxl::ftree<int, int, 4096, 64*4096> f;
+
+    // A tree that fits into memory does not allocate any blocks.
+    int values_to_insert = 4096;
+    for (int i=0; i<values_to_insert; i++)
+        f.insert(value_type((i * 7919) % values_to_insert, i));
+    ASSERT_GT(f.depth(), 1);
+    for (int i=0; i<values_to_insert; i++)
+        ASSERT_TRUE(f.find(i).second);
+    ASSERT_EQ(bm->get_total_allocation(), allocation_begin);
+    ASSERT_EQ((foxxll::stats_data(*stats) - stats_begin).get_write_count(), 0);
+
+    // Blocks are allocated once they are evicted.
+    values_to_insert = 512*1024/8;
+    for (int i=0; i<values_to_insert; i++)
+        f.insert(value_type(i, 2*i));
+    ASSERT_GT(bm->get_total_allocation(), allocation_begin);
+    for (int i=0; i<values_to_insert; i++)
+        ASSERT_EQ(f.find(i).first, 2*i);
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_root_log) {
+    stxxl::fractal_tree::fractal_tree_root_log<int, int, 100> log;
+    ASSERT_TRUE(log.empty());
+    ASSERT_FALSE(log.find(0).second);
+
+    // Keys that need all passes of the radix sort (and negative ones).
+    std::vector<int> keys;
+    for (int i=0; i<50; i++)
+        keys.push_back((i % 2 == 0 ? 1 : -1) * i * 40503 * 1013);
+    for (int key : keys)
+        log.append(value_type(key, key % 1000));
+    // Replace the data of some keys
+    for (int i=0; i<50; i+=3)
+        log.append(value_type(keys[i], -1));
+    ASSERT_EQ(log.size(), 50);
+
+    for (int i=0; i<50; i++) {
+        ASSERT_TRUE(log.find(keys[i]).second);
+        ASSERT_EQ(log.find(keys[i]).first, i % 3 == 0 ? -1 : keys[i] % 1000);
+    }
+    ASSERT_FALSE(log.find(1).second);
+
+    std::vector<value_type> items = log.sorted_items();
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(items.size(), keys.size());
+    for (size_t i=0; i<items.size(); i++)
+        ASSERT_EQ(items[i].first, keys[i]);
+
+    log.clear();
+    ASSERT_TRUE(log.empty());
+    ASSERT_FALSE(log.find(keys[0]).second);
+    for (int i=0; i<100; i++)
+        log.append(value_type(i, i));
+    ASSERT_TRUE(log.full());
+
+    // Other key types are sorted with std::sort.
+    stxxl::fractal_tree::fractal_tree_root_log<double, int, 10> double_log;
+    for (int i=0; i<10; i++)
+        double_log.append(std::pair<double, int>(2.5 - i, i));
+    std::vector<std::pair<double, int>> double_items = double_log.sorted_items();
+    ASSERT_TRUE(std::is_sorted(double_items.begin(), double_items.end()));
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_insert_random_with_duplicates) {
+    // Items overwritten in the root log, in the root buffer,
+    // and further down the tree.
+    stxxl::ftree<int, int, 512, 8192> f;
+    std::map<int, int> expected;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> key_dist(-2000, 2000);
+    for (int i=0; i<20000; i++) {
+        int key = key_dist(gen);
+        f.insert(value_type(key, i));
+        expected[key] = i;
+        if (i % 997 == 0) {
+            // Not range_find, which would flush the root log and buffer.
+            for (int j=-2000; j<=2000; j++)
+                ASSERT_EQ(f.find(j).second, expected.count(j) == 1);
+            find_expected_items(f, expected, -2000, 2000);
+        }
+    }
+    expect_tree_matches(f, expected, -2000, 2000);
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_packed_leaves) {
+    // Close keys (and a few far apart ones) in random order,
+    // with duplicates.
+    stxxl::ftree<int, int, 512, 8192, foxxll::default_alloc_strategy,
+                 stxxl::fractal_tree::lru_policy, false> unpacked;
+    stxxl::ftree<int, int, 512, 8192, foxxll::default_alloc_strategy,
+                 stxxl::fractal_tree::lru_policy, true> packed;
+    std::map<int, int> expected;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> key_dist(0, 20000);
+    for (int i=0; i<30000; i++) {
+        int key = (i % 100 == 0) ? key_dist(gen) * 100000 : key_dist(gen);
+        unpacked.insert(value_type(key, i));
+        packed.insert(value_type(key, i));
+        expected[key] = i;
+    }
+
+    expect_tree_matches(packed, expected, std::numeric_limits<int>::min(), std::numeric_limits<int>::max());
+    for (int key=-10; key<0; key++)
+        ASSERT_EQ(packed.find(key).second, false);
+
+    // Packed leaves hold more items.
+    ASSERT_LT(packed.num_leaves(), unpacked.num_leaves());
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_block_compression) {
+    // Non-integer keys; the tree does not fit into memory,
+    // so leaves and nodes are written and read again.
+    stxxl::ftree<double, int, 64 * 1024, 1024 * 1024, foxxll::default_alloc_strategy,
+                 stxxl::fractal_tree::lru_policy, false,
+                 stxxl::fractal_tree::block_compression::leaves_and_nodes> f;
+    std::vector<int> keys(200000);
+    for (int i=0; i<(int) keys.size(); i++)
+        keys[i] = i;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+    for (int key : keys)
+        f.insert(std::pair<double, int>(key * 0.5, key % 10));
+
+    for (int key=0; key<(int) keys.size(); key += 7)
+        ASSERT_EQ(f.find(key * 0.5), std::make_pair(key % 10, true));
+    ASSERT_EQ(f.find(0.25).second, false);
+    std::vector<std::pair<double, int>> range = f.range_find(1000, 1100);
+    ASSERT_EQ(range.size(), 201u);
+    for (int i=0; i<(int) range.size(); i++)
+        ASSERT_EQ(range[i], std::make_pair(1000 + i * 0.5, (2000 + i) % 10));
+
+    stxxl::fractal_tree::fractal_tree_stats stats = f.stats();
+    ASSERT_GT(stats.leaf_codec.num_decompressed, 0u);
+    ASSERT_GT(stats.node_codec.num_decompressed, 0u);
+    ASSERT_GT(stats.leaf_codec.compression_ratio(), 1.0);
+    ASSERT_LT(stats.leaf_codec.bytes_written, stats.leaf_codec.raw_bytes);
+    ASSERT_LE(stats.leaf_codec.disk_bytes_used, stats.leaf_codec.disk_bytes_allocated);
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_string_keys) {
+    // Keys and data of random lengths (from empty up to about
+    // max_item_size), in random order with duplicates; the tree
+    // does not fit into memory.
+    using string_value_type = std::pair<std::string, std::string>;
+    using string_ftree_type = stxxl::ftree<std::string, std::string, 16384, 16384 * 64>;
+    ASSERT_GE(string_ftree_type::max_item_size, 100);
+    string_ftree_type f;
+    std::map<std::string, std::string> expected;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> key_dist(0, 50000);
+    std::uniform_int_distribution<int> length_dist(0, 40);
+    for (int i=0; i<100000; i++) {
+        std::string key = std::to_string(key_dist(gen));
+        key += std::string(length_dist(gen) % 8, key.back());
+        std::string datum(length_dist(gen) * (i % 50 == 0 ? 2 : 1), 'a' + i % 26);
+        f.insert(string_value_type(key, datum));
+        expected[key] = datum;
+    }
+    f.insert(string_value_type("", "empty"));
+    expected[""] = "empty";
+
+    find_expected_items(f, expected, expected.begin()->first, expected.rbegin()->first);
+    ASSERT_EQ(f.find("x").second, false);
+    ASSERT_EQ(f.find("1000a").second, false);
+
+    // Items that are too large are rejected and leave the tree as it was.
+    std::string too_long(string_ftree_type::max_item_size, 'x');
+    ASSERT_THROW(f.insert(string_value_type(too_long, "")), std::length_error);
+    ASSERT_THROW(f.insert(string_value_type("x", too_long)), std::length_error);
+    ASSERT_THROW(f.erase(too_long), std::length_error);
+    ASSERT_EQ(f.find("x").second, false);
+
+    auto lower = std::next(expected.begin(), 1000);
+    auto upper = std::next(lower, 5000);
+    expect_tree_matches(f, expected, lower->first, upper->first);
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_node_and_leaf_block_sizes) {
+    // Small nodes and large leaves; the tree does not fit into memory.
+    stxxl::ftree<int, int, 4096, 1024 * 1024> f;
+    stxxl::ftree_with_block_sizes<int, int, 4096, 64 * 1024, 1024 * 1024> g;
+    std::map<int, int> expected;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> key_dist(0, 1 << 20);
+    for (int i=0; i<300000; i++) {
+        int key = key_dist(gen);
+        f.insert(value_type(key, i));
+        g.insert(value_type(key, i));
+        expected[key] = i;
+    }
+
+    find_expected_items(g, expected, 0, 1 << 20);
+    ASSERT_EQ(g.find(-1).second, false);
+    expect_tree_matches(g, expected, 100000, 200000);
+
+    // The nodes are the same, but there are fewer (larger) leaves.
+    ASSERT_EQ(g.max_num_buffer_items_in_node, f.max_num_buffer_items_in_node);
+    ASSERT_GT(g.max_num_buffer_items_in_leaf, f.max_num_buffer_items_in_leaf);
+    ASSERT_LT(g.num_leaves(), f.num_leaves());
+}
+
+template <typename Epsilon>
+void test_fractal_tree_with_epsilon() {
+    stxxl::ftree<int, int, 4096, 64*4096, foxxll::default_alloc_strategy, stxxl::fractal_tree::lru_policy,
+                 stxxl::fractal_tree::default_packed_leaves, stxxl::fractal_tree::default_block_compression,
+                 stxxl::fractal_tree::lz_block_codec, Epsilon> f;
+    std::map<int, int> expected;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> key_dist(0, 100000);
+    for (int i=0; i<200000; i++) {
+        int key = key_dist(gen);
+        f.insert(value_type(key, i));
+        expected[key] = i;
+    }
+
+    expect_tree_matches(f, expected, 0, 100000);
+    ASSERT_EQ(f.find(-1).second, false);
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_epsilon) {
+    // Towards a buffered repository tree and towards a B-tree (as far
+    // as the values of a node with the Eytzinger index of its pivots,
+    // see key_search.h, leave room for a buffer in 4096 bytes).
+    test_fractal_tree_with_epsilon<std::ratio<1, 3>>();
+    test_fractal_tree_with_epsilon<std::ratio<3, 4>>();
+    test_fractal_tree_with_epsilon<std::ratio<4, 5>>();
+}
+
+template <typename FTreeType>
+void test_fractal_tree_erase_random() {
+    // Inserts and erasures of random keys (erasing keys that are
+    // in the tree and keys that are not), then erasing most keys.
+    // g gets the same operations except for the latter.
+    FTreeType f, g;
+    std::map<int, int> expected;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> key_dist(0, 20000);
+    for (int i=0; i<60000; i++) {
+        int key = key_dist(gen);
+        if (i % 3 == 0) {
+            f.erase(key);
+            g.erase(key);
+            expected.erase(key);
+        } else {
+            f.insert(value_type(key, i));
+            g.insert(value_type(key, i));
+            expected[key] = i;
+        }
+    }
+    for (int key=0; key<=20000; key++)
+        ASSERT_EQ(f.find(key).second, expected.count(key) == 1);
+    expect_tree_matches(f, expected, 0, 20000);
+
+    for (int key=0; key<=20000; key++) {
+        if (key % 50 != 0) {
+            f.erase(key);
+            expected.erase(key);
+        }
+    }
+    // Flush the tombstones down to the leaves.
+    for (int i=0; i<20000; i++) {
+        int key = 100000 + i * 50;
+        f.insert(value_type(key, i));
+        g.insert(value_type(key, i));
+        expected[key] = i;
+    }
+    for (int key=0; key<=20000; key++)
+        ASSERT_EQ(f.find(key).second, expected.count(key) == 1);
+    expect_tree_matches(f, expected, 0, expected.rbegin()->first);
+    g.range_find(0, 0);
+
+    // Sparse leaves were merged.
+    ASSERT_LT(f.num_leaves(), g.num_leaves());
+    ASSERT_LE(f.depth(), g.depth());
+}
+
+void test_fractal_tree_erase_pinned_levels() {
+    // Erasing until the root collapses (the nodes move up through
+    // the pinned levels), then inserting until the tree is as deep
+    // again (the nodes in the pinned levels split).
+    stxxl::ftree<int, int, 4096, 64*4096> f;
+    f.set_num_pinned_levels(3);
+    int num_items = 300000;
+    std::vector<value_type> items = shuffled_items(num_items);
+    for (const auto& item : items)
+        f.insert(item);
+    std::map<int, int> expected(items.begin(), items.end());
+    int full_depth = f.depth();
+    ASSERT_GT(full_depth, 3);
+    ASSERT_GT(f.num_pinned_nodes(), 0);
+
+    for (const auto& item : items) {
+        if (item.first % 50 != 0) {
+            f.erase(item.first);
+            expected.erase(item.first);
+        }
+    }
+    ASSERT_LT(f.depth(), full_depth);
+    for (int key=0; key<num_items; key++)
+        ASSERT_EQ(f.find(key).second, expected.count(key) == 1);
+
+    for (const auto& item : items) {
+        f.insert(value_type(num_items + item.first, item.second));
+        expected[num_items + item.first] = item.second;
+    }
+    ASSERT_GE(f.depth(), full_depth);
+    ASSERT_GT(f.num_pinned_nodes(), 0);
+    expect_tree_matches(f, expected, 0, 2 * num_items);
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_erase) {
+    ftree_type f;
+    f.insert(value_type(1, 1));
+    f.insert(value_type(2, 2));
+    f.erase(1);
+    f.erase(3);
+    ASSERT_EQ(f.find(1).second, false);
+    ASSERT_EQ(f.find(2), std::make_pair(2, true));
+    f.insert(value_type(1, 3));
+    ASSERT_EQ(f.find(1), std::make_pair(3, true));
+
+    test_fractal_tree_erase_random<stxxl::ftree<int, int, 512, 8192>>();
+    test_fractal_tree_erase_random<stxxl::ftree<int, int, 512, 8192, foxxll::default_alloc_strategy,
+                                                stxxl::fractal_tree::lru_policy, true>>();
+    test_fractal_tree_erase_random<stxxl::ftree<int, int, 4096, 64 * 4096>>();
+    test_fractal_tree_erase_pinned_levels();
+}
+
+template <typename FTreeType>
+void test_fractal_tree_upsert_random() {
+    // Counters: upserts add to the datum of random keys, mixed
+    // with insertions and erasures of the keys.
+    FTreeType f;
+    std::map<int, int> expected;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> key_dist(0, 20000);
+    for (int i=0; i<100000; i++) {
+        int key = key_dist(gen);
+        if (i % 10 == 0) {
+            f.insert(value_type(key, i));
+            expected[key] = i;
+        } else if (i % 10 == 1) {
+            f.erase(key);
+            expected.erase(key);
+        } else {
+            f.upsert(key, i % 7);
+            expected[key] += i % 7;
+        }
+    }
+    for (int key=0; key<=20000; key++)
+        ASSERT_EQ(f.find(key).second, expected.count(key) == 1);
+    expect_tree_matches(f, expected, 0, 20000);
+
+    // Upserts after range_find (which flushed all buffers) are
+    // combined with the data in the values and the leaves.
+    for (const auto& item : expected)
+        f.upsert(item.first, 1);
+    for (const auto& item : expected)
+        ASSERT_EQ(f.find(item.first), std::make_pair(item.second + 1, true));
+}
+
+TEST_F(TestFractalTree, test_fractal_tree_upsert) {
+    using upsert_ftree_type = stxxl::ftree<int, int, 512, 8192, foxxll::default_alloc_strategy,
+                                           stxxl::fractal_tree::lru_policy, false,
+                                           stxxl::fractal_tree::default_block_compression,
+                                           stxxl::fractal_tree::lz_block_codec,
+                                           stxxl::fractal_tree::default_epsilon, std::plus<int>>;
+    using packed_upsert_ftree_type = stxxl::ftree<int, int, 512, 8192, foxxll::default_alloc_strategy,
+                                                  stxxl::fractal_tree::lru_policy, true,
+                                                  stxxl::fractal_tree::default_block_compression,
+                                                  stxxl::fractal_tree::lz_block_codec,
+                                                  stxxl::fractal_tree::default_epsilon, std::plus<int>>;
+    using large_upsert_ftree_type = stxxl::ftree<int, int, 4096, 64 * 4096, foxxll::default_alloc_strategy,
+                                                 stxxl::fractal_tree::lru_policy,
+                                                 stxxl::fractal_tree::default_packed_leaves,
+                                                 stxxl::fractal_tree::default_block_compression,
+                                                 stxxl::fractal_tree::lz_block_codec,
+                                                 stxxl::fractal_tree::default_epsilon, std::plus<int>>;
+
+    upsert_ftree_type f;
+    f.upsert(1, 2);
+    f.upsert(1, 3);
+    ASSERT_EQ(f.find(1), std::make_pair(5, true));
+    f.erase(1);
+    ASSERT_EQ(f.find(1).second, false);
+    f.upsert(1, 4);
+    ASSERT_EQ(f.find(1), std::make_pair(4, true));
+    f.insert(value_type(1, 10));
+    f.upsert(1, 1);
+    ASSERT_EQ(f.find(1), std::make_pair(11, true));
+
+    test_fractal_tree_upsert_random<upsert_ftree_type>();
+    test_fractal_tree_upsert_random<packed_upsert_ftree_type>();
+    test_fractal_tree_upsert_random<large_upsert_ftree_type>();
+}
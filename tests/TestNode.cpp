@@ -4,6 +4,8 @@
 
 #include <gtest/gtest.h>
 #include <tlx/die.hpp>
+#include <map>
+#include <random>
 #include "../include/fractal_tree/node.h"
 #include "../include/fractal_tree/fractal_tree_cache.h"
 #include "../include/fractal_tree/fractal_tree.h"
@@ -35,6 +37,45 @@ TEST_F(TestNode, test_node_parameters) {
     stxxl::fractal_tree::node<std::pair<char, char>, int, RawBlockSize> n6(0, bid_type());
     stxxl::fractal_tree::node<std::pair<double, char>, bool, RawBlockSize> n7(0, bid_type());
     stxxl::fractal_tree::node<std::array<double, 10>, bool, RawBlockSize> n8(0, bid_type());
+
+    constexpr stxxl::fractal_tree::pivot_layout eytzinger = stxxl::fractal_tree::pivot_layout::eytzinger;
+    stxxl::fractal_tree::node<int, int, RawBlockSize, eytzinger> n9(0, bid_type());
+    stxxl::fractal_tree::node<double, double, RawBlockSize, eytzinger> n10(0, bid_type());
+    stxxl::fractal_tree::node<std::pair<char, char>, int, RawBlockSize, eytzinger> n11(0, bid_type());
+    stxxl::fractal_tree::node<std::array<double, 10>, bool, RawBlockSize, eytzinger> n12(0, bid_type());
+
+    constexpr stxxl::fractal_tree::pivot_layout sorted = stxxl::fractal_tree::pivot_layout::sorted;
+    stxxl::fractal_tree::node<int, int, RawBlockSize, sorted, true> n13(0, bid_type());
+    stxxl::fractal_tree::node<double, double, RawBlockSize, eytzinger, true> n14(0, bid_type());
+    stxxl::fractal_tree::node<std::pair<char, char>, int, RawBlockSize, sorted, true> n15(0, bid_type());
+    stxxl::fractal_tree::node<std::array<double, 10>, bool, RawBlockSize, sorted, true> n16(0, bid_type());
+}
+
+TEST_F(TestNode, test_node_parameters_epsilon) {
+    using stxxl::fractal_tree::NUM_NODE_VALUES;
+    using third = std::ratio<1, 3>;
+    using two_thirds = std::ratio<2, 3>;
+    using one = std::ratio<1, 1>;
+    // Roots that are integers are exact.
+    for (int k = 2; k < 100; k++) {
+        ASSERT_EQ(NUM_NODE_VALUES<third>(k * k * k), k);
+        ASSERT_EQ(NUM_NODE_VALUES<third>(k * k * k - 1), k - 1);
+        ASSERT_EQ(NUM_NODE_VALUES<two_thirds>(k * k * k), k * k);
+        ASSERT_EQ(NUM_NODE_VALUES<one>(k), k);
+    }
+
+    // More values leave less room for the buffer.
+    constexpr stxxl::fractal_tree::pivot_layout sorted = stxxl::fractal_tree::pivot_layout::sorted;
+    using third_node_type = stxxl::fractal_tree::node<int, int, RawBlockSize, sorted, false, third>;
+    using half_node_type = stxxl::fractal_tree::node<int, int, RawBlockSize, sorted, false, std::ratio<1, 2>>;
+    using three_quarters_node_type = stxxl::fractal_tree::node<int, int, RawBlockSize, sorted, false, std::ratio<3, 4>>;
+    ASSERT_EQ(third_node_type::max_num_values_in_node, 8);
+    ASSERT_EQ(half_node_type::max_num_values_in_node, 22);
+    ASSERT_EQ(three_quarters_node_type::max_num_values_in_node, 107);
+    ASSERT_GT(third_node_type::max_num_buffer_items_in_node, half_node_type::max_num_buffer_items_in_node);
+    ASSERT_GT(half_node_type::max_num_buffer_items_in_node, three_quarters_node_type::max_num_buffer_items_in_node);
+    third_node_type n(0, bid_type());
+    three_quarters_node_type n2(0, bid_type());
 }
 
 TEST_F(TestNode, test_leaf_parameters) {
@@ -76,6 +117,37 @@ TEST_F(TestNode, test_free_function_merge_into) {
     ASSERT_EQ(stxxl::fractal_tree::merge_into<value_type>(V1, V2), R);
 }
 
+// Compare lower_bound_index with std::lower_bound on sorted keys
+// (with duplicates) of all lengths up to max_num_keys.
+template<typename KeyType>
+void check_lower_bound_index(int max_num_keys) {
+    for (int num_keys=0; num_keys<=max_num_keys; num_keys++) {
+        // Negative keys only for signed types.
+        int min_key = std::is_signed<KeyType>::value ? -num_keys / 2 : 0;
+        std::vector<KeyType> keys;
+        for (int i=0; i<num_keys; i++)
+            keys.push_back(static_cast<KeyType>(min_key + 2 * (i / 2)));
+        int min_searched_key = std::is_signed<KeyType>::value ? min_key - 2 : 0;
+        for (int key=min_searched_key; key<=min_key+num_keys+2; key++) {
+            int expected = std::lower_bound(keys.begin(), keys.end(), static_cast<KeyType>(key)) - keys.begin();
+            ASSERT_EQ(stxxl::fractal_tree::lower_bound_index(keys.data(), num_keys, static_cast<KeyType>(key)), expected);
+        }
+    }
+}
+
+TEST_F(TestNode, test_free_function_lower_bound_index) {
+    check_lower_bound_index<int32_t>(100);
+    check_lower_bound_index<int64_t>(100);
+    check_lower_bound_index<float>(100);
+    check_lower_bound_index<double>(100);
+    check_lower_bound_index<char>(60);
+    check_lower_bound_index<unsigned>(100);
+
+    std::vector<std::pair<char, char>> keys = { {1,1}, {1,2}, {2,0} };
+    ASSERT_EQ(stxxl::fractal_tree::lower_bound_index(keys.data(), 3, std::pair<char, char>(1,2)), 1);
+    ASSERT_EQ(stxxl::fractal_tree::lower_bound_index(keys.data(), 3, std::pair<char, char>(3,0)), 3);
+}
+
 // Tests for node class -------------------------------------------------
 using node_type = stxxl::fractal_tree::node<key_type, data_type, RawBlockSize>;
 
@@ -172,8 +244,124 @@ TEST_F(TestNode, test_node_buffer_setters_add_to_buffer) {
     delete block;
 }
 
+TEST_F(TestNode, test_node_buffer_setters_add_to_buffer_span) {
+    node_type parent(10, bid_type());
+    node_type child(11, bid_type());
+    auto* parent_block = new node_type::block_type;
+    auto* child_block = new node_type::block_type;
+
+    parent.set_block(parent_block);
+    child.set_block(child_block);
+
+    std::vector<value_type> parent_buffer_items =
+            { {0,2}, {1,2}, {3,2}, {4,2}, {6,2}, {8,2} };
+    parent.add_to_buffer(parent_buffer_items);
+
+    std::vector<value_type> values = { {3,1}, {7,1} };
+    std::vector<int> nodeIDs = { 1, 2, 3 };
+    child.set_values_and_nodeIDs(values, nodeIDs);
+    std::vector<value_type> child_buffer_items = { {2,1}, {4,1}, {9,1} };
+    child.add_to_buffer(child_buffer_items);
+
+    // Push down the parent's items with keys in [1, 8)
+    // straight from the parent's block.
+    child.add_to_buffer(parent.buffer_span(1, 5));
+
+    std::vector<value_type> values_after_adding_to_buffer =
+            { {3,2}, {7,1} };
+    std::vector<value_type> buffer_after_adding_to_buffer =
+            { {1,2}, {2,1}, {4,2}, {6,2}, {9,1} };
+
+    ASSERT_EQ(child.get_buffer_items(), buffer_after_adding_to_buffer);
+    ASSERT_EQ(child.get_values(), values_after_adding_to_buffer);
+    ASSERT_EQ(parent.get_buffer_items(), parent_buffer_items);
+
+    // Empty span
+    child.add_to_buffer(parent.buffer_span(2, 2));
+    ASSERT_EQ(child.get_buffer_items(), buffer_after_adding_to_buffer);
+
+    delete parent_block;
+    delete child_block;
+}
+
 // Tests for node class: buffer getters ---------------------------------
 
+TEST_F(TestNode, test_free_function_buffer_filter) {
+    constexpr int capacity = 1000;
+    stxxl::fractal_tree::buffer_filter<key_type, capacity, true> filter;
+
+    for (int i = 0; i < capacity; i++)
+        filter.insert(3 * i);
+
+    // No false negatives, few false positives.
+    int num_false_positives = 0;
+    for (int i = 0; i < 3 * capacity; i++) {
+        if (i % 3 == 0)
+            ASSERT_TRUE(filter.may_contain(i));
+        else
+            num_false_positives += filter.may_contain(i);
+    }
+    ASSERT_LT(num_false_positives, 2 * capacity / 20);
+
+    filter.clear();
+    for (int i = 0; i < 3 * capacity; i++)
+        ASSERT_FALSE(filter.may_contain(i));
+}
+
+TEST_F(TestNode, test_node_buffer_getters_buffer_find_filter) {
+    // A node with a buffer filter has to find the
+    // same items as one without.
+    using filter_node_type = stxxl::fractal_tree::node<key_type, data_type, RawBlockSize,
+                                                       stxxl::fractal_tree::pivot_layout::sorted, true>;
+    using plain_node_type = stxxl::fractal_tree::node<key_type, data_type, RawBlockSize,
+                                                      stxxl::fractal_tree::pivot_layout::sorted, false>;
+    ASSERT_LT(filter_node_type::max_num_buffer_items_in_node, plain_node_type::max_num_buffer_items_in_node);
+
+    filter_node_type n(10, bid_type());
+    auto* block = new filter_node_type::block_type;
+    n.set_block(block);
+    plain_node_type m(11, bid_type());
+    auto* plain_block = new plain_node_type::block_type;
+    m.set_block(plain_block);
+
+    const int max_key = 4 * filter_node_type::max_num_buffer_items_in_node;
+    auto assert_same_finds = [&]() {
+        ASSERT_EQ(n.get_buffer_items(), m.get_buffer_items());
+        for (key_type key = -1; key <= max_key; key++)
+            ASSERT_EQ(n.buffer_find(key), m.buffer_find(key));
+    };
+
+    // Add every fourth key in two batches.
+    std::vector<value_type> new_buffer_items;
+    for (int i = 0; i < max_key; i += 8)
+        new_buffer_items.emplace_back(i, i);
+    n.add_to_buffer(new_buffer_items);
+    m.add_to_buffer(new_buffer_items);
+    assert_same_finds();
+
+    new_buffer_items.clear();
+    for (int i = 4; i < max_key; i += 8)
+        new_buffer_items.emplace_back(i, i);
+    n.add_to_buffer(new_buffer_items);
+    m.add_to_buffer(new_buffer_items);
+    assert_same_finds();
+
+    n.remove_from_buffer(8);
+    m.remove_from_buffer(8);
+    assert_same_finds();
+
+    n.truncate_buffer(n.num_items_in_buffer() / 2);
+    m.truncate_buffer(m.num_items_in_buffer() / 2);
+    assert_same_finds();
+
+    n.clear_buffer();
+    m.clear_buffer();
+    assert_same_finds();
+
+    delete block;
+    delete plain_block;
+}
+
 TEST_F(TestNode, test_node_buffer_getters_basic) {
     node_type n(10, bid_type());
     auto* block = new node_type::block_type;
@@ -361,6 +549,131 @@ TEST_F(TestNode, test_node_buffer_getters_buffer_find) {
     delete block;
 }
 
+TEST_F(TestNode, test_node_buffer_setters_remove_from_buffer) {
+    node_type n(10, bid_type());
+    auto* block = new node_type::block_type;
+    n.set_block(block);
+
+    std::vector<value_type> buffer_items =
+            { {1,2}, {2,2}, {4,2}, {6,2}, {7,2}, {9,2}, {10,2} };
+    n.set_buffer(buffer_items);
+
+    ASSERT_FALSE(n.remove_from_buffer(3));
+    ASSERT_FALSE(n.remove_from_buffer(11));
+    ASSERT_EQ(n.get_buffer_items(), buffer_items);
+
+    ASSERT_TRUE(n.remove_from_buffer(4));
+    ASSERT_TRUE(n.remove_from_buffer(10));
+    ASSERT_TRUE(n.remove_from_buffer(1));
+    std::vector<value_type> remaining_items = { {2,2}, {6,2}, {7,2}, {9,2} };
+    ASSERT_EQ(n.get_buffer_items(), remaining_items);
+    ASSERT_FALSE(n.buffer_find(4).second);
+
+    delete block;
+}
+
+TEST_F(TestNode, test_node_buffer_setters_add_to_buffer_tombstones) {
+    using tombstone_span_type = stxxl::fractal_tree::tombstone_span<key_type, data_type>;
+    node_type n(10, bid_type());
+    auto* block = new node_type::block_type;
+    n.set_block(block);
+    bool erased;
+
+    // Case: no values (the root), the tombstones are applied
+    std::vector<value_type> buffer_items = { {1,2}, {3,2}, {5,2}, {7,2} };
+    n.add_to_buffer(buffer_items);
+    std::vector<key_type> erased_keys = { 2, 3, 7 };
+    n.add_to_buffer(tombstone_span_type(erased_keys));
+    std::vector<value_type> remaining_items = { {1,2}, {5,2} };
+    ASSERT_EQ(n.get_buffer_items(), remaining_items);
+    ASSERT_FALSE(n.buffer_find(3, erased).second);
+    ASSERT_FALSE(erased);
+
+    // Case: values, the tombstones replace the items with their keys
+    // (and are pushed down later), or mark the values as erased
+    n.clear();
+    std::vector<value_type> values = { {4,1}, {8,1} };
+    std::vector<int> nodeIDs = { 10, 11, 12 };
+    n.set_values_and_nodeIDs(values, nodeIDs);
+    buffer_items = { {1,2}, {3,2}, {5,2} };
+    n.add_to_buffer(buffer_items);
+    erased_keys = { 3, 6, 8 };
+    n.add_to_buffer(tombstone_span_type(erased_keys));
+    ASSERT_EQ(n.num_items_in_buffer(), 4);
+    ASSERT_EQ(n.buffer_find(1, erased), std::make_pair(2, true));
+    ASSERT_FALSE(erased);
+    ASSERT_FALSE(n.buffer_find(3, erased).second);
+    ASSERT_TRUE(erased);
+    ASSERT_FALSE(n.buffer_find(6, erased).second);
+    ASSERT_TRUE(erased);
+    ASSERT_FALSE(n.value_erased(0));
+    ASSERT_TRUE(n.value_erased(1));
+    ASSERT_FALSE(n.values_find(8, erased).second);
+    ASSERT_TRUE(erased);
+
+    // Inserting the key again revives it
+    buffer_items = { {3,4}, {8,4} };
+    n.add_to_buffer(buffer_items);
+    ASSERT_EQ(n.buffer_find(3, erased), std::make_pair(4, true));
+    ASSERT_FALSE(erased);
+    ASSERT_FALSE(n.value_erased(1));
+    ASSERT_EQ(n.values_find(8, erased).second, true);
+
+    delete block;
+}
+
+TEST_F(TestNode, test_node_buffer_setters_add_to_buffer_upserts) {
+    using upsert_node_type = stxxl::fractal_tree::node<key_type, data_type, RawBlockSize,
+                                                       stxxl::fractal_tree::default_pivot_layout,
+                                                       stxxl::fractal_tree::default_buffer_filter,
+                                                       stxxl::fractal_tree::default_epsilon, std::plus<data_type>>;
+    using upsert_span_type = stxxl::fractal_tree::upsert_span<key_type, data_type>;
+    using tombstone_span_type = stxxl::fractal_tree::tombstone_span<key_type, data_type>;
+    using stxxl::fractal_tree::message_type;
+    upsert_node_type n(10, bid_type());
+    auto* block = new upsert_node_type::block_type;
+    n.set_block(block);
+    message_type message;
+
+    // Case: no values (the root), the upserts are applied
+    std::vector<value_type> buffer_items = { {1,2}, {3,2} };
+    n.add_to_buffer(buffer_items);
+    std::vector<value_type> upserts = { {1,5}, {2,5} };
+    n.add_to_buffer(upsert_span_type(upserts));
+    std::vector<value_type> applied_items = { {1,7}, {2,5}, {3,2} };
+    ASSERT_EQ(n.get_buffer_items(), applied_items);
+    ASSERT_EQ(n.buffer_find(2), std::make_pair(5, true));
+
+    // Case: values, upserts are combined with the items with their
+    // keys (and stay upserts if there are none), and with the values
+    n.clear();
+    std::vector<value_type> values = { {4,1}, {8,1} };
+    std::vector<int> nodeIDs = { 10, 11, 12 };
+    n.set_values_and_nodeIDs(values, nodeIDs);
+    buffer_items = { {1,2} };
+    n.add_to_buffer(buffer_items);
+    std::vector<key_type> erased_keys = { 3, 8 };
+    n.add_to_buffer(tombstone_span_type(erased_keys));
+    upserts = { {1,5}, {3,5}, {4,5}, {5,5}, {8,5} };
+    n.add_to_buffer(upsert_span_type(upserts));
+    upserts = { {5,1} };
+    n.add_to_buffer(upsert_span_type(upserts));
+    ASSERT_EQ(n.buffer_find_message(1, message), std::make_pair(7, true));
+    ASSERT_EQ(message, message_type::insert);
+    ASSERT_EQ(n.buffer_find_message(3, message), std::make_pair(5, true));
+    ASSERT_EQ(message, message_type::insert);
+    ASSERT_EQ(n.buffer_find_message(5, message), std::make_pair(6, true));
+    ASSERT_EQ(message, message_type::upsert);
+    ASSERT_FALSE(n.buffer_find(5).second);
+    // Values are never upserts
+    bool erased;
+    ASSERT_EQ(n.values_find(4, erased).first.first, 6);
+    ASSERT_EQ(n.values_find(8, erased).first.first, 5);
+    ASSERT_FALSE(erased);
+
+    delete block;
+}
+
 // Tests for node class: values -----------------------------------------
 
 // Tests for node class: values setters ---------------------------------
@@ -622,6 +935,49 @@ TEST_F(TestNode, test_node_values_getters_values_find) {
     delete block;
 }
 
+TEST_F(TestNode, test_node_values_getters_values_find_eytzinger) {
+    // Fill a node with the Eytzinger layout and one with the sorted
+    // layout value by value (in random order), and compare the
+    // results of values_find after every insertion.
+    using eytzinger_node_type = stxxl::fractal_tree::node<key_type, data_type, RawBlockSize,
+                                                          stxxl::fractal_tree::pivot_layout::eytzinger>;
+    using sorted_node_type = stxxl::fractal_tree::node<key_type, data_type, RawBlockSize,
+                                                       stxxl::fractal_tree::pivot_layout::sorted>;
+    eytzinger_node_type n(10, bid_type());
+    auto* block = new eytzinger_node_type::block_type;
+    n.set_block(block);
+    sorted_node_type m(11, bid_type());
+    auto* sorted_block = new sorted_node_type::block_type;
+    m.set_block(sorted_block);
+
+    const int max_num_values = eytzinger_node_type::max_num_values_in_node;
+    std::vector<key_type> keys;
+    for (int i = 0; i < max_num_values; i++)
+        keys.push_back(2 * i + 1);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+
+    std::vector<value_type> values = { {keys[0], 0} };
+    std::vector<int> nodeIDs = { 0, 1 };
+    n.set_values_and_nodeIDs(values, nodeIDs);
+    m.set_values_and_nodeIDs(values, nodeIDs);
+
+    int next_id = 2;
+    for (int i = 1; i <= max_num_values; i++) {
+        ASSERT_EQ(n.get_values(), m.get_values());
+        for (key_type key = -1; key <= 2 * max_num_values + 1; key++)
+            ASSERT_EQ(n.values_find(key), m.values_find(key));
+        if (i == max_num_values)
+            break;
+        value_type value(keys[i], i);
+        n.add_to_values(value, next_id, next_id + 1);
+        m.add_to_values(value, next_id, next_id + 1);
+        next_id += 2;
+    }
+
+    delete block;
+    delete sorted_block;
+}
+
 // Tests for leaf class -------------------------------------------------
 using leaf_type = stxxl::fractal_tree::leaf<key_type, data_type, RawBlockSize>;
 
@@ -707,6 +1063,173 @@ TEST_F(TestNode, test_leaf_buffer_setters_add_to_buffer) {
     delete block;
 }
 
+TEST_F(TestNode, test_leaf_buffer_setters_merge_and_split) {
+    node_type parent(10, bid_type());
+    leaf_type left(11, bid_type());
+    leaf_type right(12, bid_type());
+    auto* parent_block = new node_type::block_type;
+    auto* left_block = new leaf_type::block_type;
+    auto* right_block = new leaf_type::block_type;
+
+    parent.set_block(parent_block);
+    left.set_block(left_block);
+    right.set_block(right_block);
+
+    // Full leaf with the even keys, parent buffer with
+    // every third key (some of them duplicates).
+    std::vector<value_type> leaf_items;
+    for (int i = 0; i < left.max_buffer_size(); i++)
+        leaf_items.emplace_back(2 * i, 1);
+    left.set_buffer(leaf_items);
+
+    std::vector<value_type> parent_buffer_items;
+    for (int i = 0; i < parent.max_buffer_size(); i++)
+        parent_buffer_items.emplace_back(3 * i, 2);
+    parent.add_to_buffer(parent_buffer_items);
+
+    value_type mid_value = left.merge_and_split(parent.buffer_span(), right);
+
+    std::vector<value_type> merged = stxxl::fractal_tree::merge_into(parent_buffer_items, leaf_items);
+    int mid = (merged.size() - 1) / 2;
+
+    ASSERT_EQ(mid_value, merged[mid]);
+    ASSERT_EQ(left.get_buffer_items(), std::vector<value_type>(merged.begin(), merged.begin() + mid));
+    ASSERT_EQ(right.get_buffer_items(), std::vector<value_type>(merged.begin() + mid + 1, merged.end()));
+
+    delete parent_block;
+    delete left_block;
+    delete right_block;
+}
+
+TEST_F(TestNode, test_leaf_buffer_setters_tombstones_and_try_merge) {
+    using tombstone_span_type = stxxl::fractal_tree::tombstone_span<key_type, data_type>;
+    leaf_type left(11, bid_type());
+    leaf_type right(12, bid_type());
+    auto* left_block = new leaf_type::block_type;
+    auto* right_block = new leaf_type::block_type;
+    left.set_block(left_block);
+    right.set_block(right_block);
+
+    // A full leaf takes tombstones and new items
+    // as long as the result fits.
+    std::vector<value_type> leaf_items;
+    for (int i = 0; i < left.max_buffer_size(); i++)
+        leaf_items.emplace_back(2 * i, 1);
+    left.set_buffer(leaf_items);
+    std::vector<key_type> erased_keys;
+    for (int i = 0; i < left.max_buffer_size(); i++)
+        erased_keys.push_back(i);
+    ASSERT_TRUE(left.try_add_to_buffer(tombstone_span_type(erased_keys)));
+    ASSERT_EQ(left.get_buffer_items(), std::vector<value_type>(leaf_items.begin() + (left.max_buffer_size() + 1) / 2,
+                                                               leaf_items.end()));
+    ASSERT_TRUE(left.underflows() == (left.num_items_in_buffer() < left.max_buffer_size() / 4));
+
+    std::vector<value_type> remaining_items = { {0,1}, {2,1} };
+    left.set_buffer(remaining_items);
+    ASSERT_TRUE(left.underflows());
+    std::vector<value_type> right_items = { {6,1}, {8,1} };
+    right.set_buffer(right_items);
+
+    // The pivot goes between the leaves
+    ASSERT_TRUE(left.try_merge(std::vector<value_type>({ {4,2} }), right));
+    std::vector<value_type> merged_items = { {0,1}, {2,1}, {4,2}, {6,1}, {8,1} };
+    ASSERT_EQ(left.get_buffer_items(), merged_items);
+
+    // Too many items for one leaf
+    right.set_buffer(leaf_items);
+    ASSERT_FALSE(left.try_merge(std::vector<value_type>(), right));
+    ASSERT_EQ(left.get_buffer_items(), merged_items);
+
+    delete left_block;
+    delete right_block;
+}
+
+TEST_F(TestNode, test_leaf_buffer_setters_upserts) {
+    using upsert_leaf_type = stxxl::fractal_tree::leaf<key_type, data_type, RawBlockSize, std::plus<data_type>>;
+    using upsert_span_type = stxxl::fractal_tree::upsert_span<key_type, data_type>;
+    upsert_leaf_type left(11, bid_type());
+    upsert_leaf_type right(12, bid_type());
+    auto* left_block = new upsert_leaf_type::block_type;
+    auto* right_block = new upsert_leaf_type::block_type;
+    left.set_block(left_block);
+    right.set_block(right_block);
+
+    // Upserts are applied: combined with the items with
+    // their keys, or combined with a default datum
+    std::vector<value_type> leaf_items = { {0,1}, {2,1} };
+    left.set_buffer(leaf_items);
+    std::vector<value_type> upserts = { {0,3}, {1,3} };
+    ASSERT_TRUE(left.try_add_to_buffer(upsert_span_type(upserts)));
+    std::vector<value_type> applied_items = { {0,4}, {1,3}, {2,1} };
+    ASSERT_EQ(left.get_buffer_items(), applied_items);
+
+    // Same when splitting (e.g. with the upserts of a node buffer)
+    stxxl::fractal_tree::item_array<key_type, data_type, 3, true> node_items;
+    node_items.set(0, value_type(1, 1), stxxl::fractal_tree::message_type::upsert);
+    node_items.set(1, value_type(3, 2), stxxl::fractal_tree::message_type::upsert);
+    node_items.set(2, value_type(4, 2), stxxl::fractal_tree::message_type::upsert);
+    value_type mid = left.merge_and_split(node_items.span(0, 3), right);
+    ASSERT_EQ(mid, value_type(2, 1));
+    std::vector<value_type> left_items = { {0,4}, {1,4} };
+    std::vector<value_type> right_items = { {3,2}, {4,2} };
+    ASSERT_EQ(left.get_buffer_items(), left_items);
+    ASSERT_EQ(right.get_buffer_items(), right_items);
+
+    delete left_block;
+    delete right_block;
+}
+
+TEST_F(TestNode, test_node_values_setters_try_merge_and_remove_value) {
+    node_type parent(10, bid_type());
+    node_type left(11, bid_type());
+    node_type right(12, bid_type());
+    auto* parent_block = new node_type::block_type;
+    auto* left_block = new node_type::block_type;
+    auto* right_block = new node_type::block_type;
+    parent.set_block(parent_block);
+    left.set_block(left_block);
+    right.set_block(right_block);
+
+    std::vector<value_type> values = { {5,1}, {10,1} };
+    std::vector<int> nodeIDs = { 11, 12, 13 };
+    parent.set_values_and_nodeIDs(values, nodeIDs);
+    values = { {2,1} };
+    nodeIDs = { 20, 21 };
+    left.set_values_and_nodeIDs(values, nodeIDs);
+    std::vector<value_type> buffer_items = { {1,3}, {3,3} };
+    left.add_to_buffer(buffer_items);
+    values = { {7,1} };
+    nodeIDs = { 22, 23 };
+    right.set_values_and_nodeIDs(values, nodeIDs);
+    buffer_items = { {6,3}, {8,3} };
+    right.add_to_buffer(buffer_items);
+
+    // The erased pivot separates the children of the merged node
+    ASSERT_TRUE(left.try_merge(parent.get_value(0), true, right));
+    parent.remove_value(0);
+
+    std::vector<value_type> values_result = { {2,1}, {5,1}, {7,1} };
+    std::vector<int> nodeIDs_result = { 20, 21, 22, 23 };
+    ASSERT_EQ(left.get_values(), values_result);
+    ASSERT_EQ(left.get_nodeIDs(0, left.num_children()), nodeIDs_result);
+    ASSERT_TRUE(left.value_erased(1));
+    ASSERT_FALSE(left.value_erased(2));
+    std::vector<value_type> buffer_result = { {1,3}, {3,3}, {6,3}, {8,3} };
+    ASSERT_EQ(left.get_buffer_items(), buffer_result);
+    ASSERT_EQ(left.buffer_find(8), std::make_pair(3, true));
+    ASSERT_EQ(left.values_find(7).first.first, 1);
+
+    values_result = { {10,1} };
+    nodeIDs_result = { 11, 13 };
+    ASSERT_EQ(parent.get_values(), values_result);
+    ASSERT_EQ(parent.get_nodeIDs(0, parent.num_children()), nodeIDs_result);
+    ASSERT_EQ(parent.values_find(12).first.second, 13);
+
+    delete parent_block;
+    delete left_block;
+    delete right_block;
+}
+
 // Tests for node class: buffer getters ---------------------------------
 
 TEST_F(TestNode, test_leaf_buffer_getters_buffer_find) {
@@ -740,3 +1263,296 @@ TEST_F(TestNode, test_leaf_buffer_getters_buffer_find) {
 
     delete block;
 }
+
+// Tests for packed_leaf class ------------------------------------------
+
+using packed_leaf_type = stxxl::fractal_tree::packed_leaf<key_type, data_type, RawBlockSize>;
+
+TEST_F(TestNode, test_packed_leaf_buffer_getters_buffer_find) {
+    packed_leaf_type n(10, bid_type());
+    auto* block = new packed_leaf_type::block_type;
+    n.set_block(block);
+
+    // Close keys, and outliers below and above them.
+    std::vector<value_type> buffer_items =
+            { {-1000000, 1}, {-7, 2}, {0, 3}, {1, 4}, {3, 5}, {4, 6}, {9, 7}, {12, 8},
+              {100000, 9}, {std::numeric_limits<key_type>::max(), 10} };
+    n.set_buffer(buffer_items);
+    ASSERT_EQ(n.get_buffer_items(), buffer_items);
+    ASSERT_EQ(n.num_items_in_buffer(), (int) buffer_items.size());
+
+    for (int i = 0; i < (int) buffer_items.size(); i++) {
+        key_type key = buffer_items[i].first;
+        ASSERT_EQ(n.buffer_find(key), std::make_pair(buffer_items[i].second, true));
+        // key + 1 would overflow.
+        if (key == std::numeric_limits<key_type>::max())
+            continue;
+        for (key_type other_key : { key - 1, key + 1 }) {
+            if (!std::binary_search(buffer_items.begin(), buffer_items.end(), value_type(other_key, 0),
+                                    [](value_type v1, value_type v2) { return v1.first < v2.first; })) {
+                ASSERT_EQ(n.buffer_find(other_key).second, false);
+            }
+        }
+    }
+
+    // The keys above stored with base -7 in a window of
+    // 5 bits (the cheapest packing), the others unpacked.
+    n.set_buffer(std::vector<value_type>(buffer_items.begin() + 1, buffer_items.end()));
+    ASSERT_EQ(n.get_packing().base, -7);
+    ASSERT_EQ(n.get_packing().bit_width, 5);
+    ASSERT_EQ(n.get_packing().num_low, 0);
+    ASSERT_EQ(n.get_packing().num_packed, 7);
+    ASSERT_EQ(n.get_packing().num_high, 2);
+    ASSERT_EQ(n.buffer_find(-1000000).second, false);
+    ASSERT_EQ(n.buffer_find(100000), std::make_pair(9, true));
+
+    // Keys below the base: add -1000000 with the packing kept.
+    n.add_to_buffer(std::vector<value_type>(buffer_items.begin(), buffer_items.begin() + 1));
+    ASSERT_EQ(n.get_buffer_items(), buffer_items);
+    ASSERT_EQ(n.buffer_find(-1000000), std::make_pair(1, true));
+    ASSERT_EQ(n.buffer_find(-1000001).second, false);
+
+    // Test with empty buffer
+    n.clear_buffer();
+    ASSERT_TRUE(n.buffer_empty());
+    for (int i=-10; i<15; i++)
+        ASSERT_EQ(n.buffer_find(i).second, false);
+
+    delete block;
+
+    // 64 bit keys
+    using packed_leaf_64_type = stxxl::fractal_tree::packed_leaf<int64_t, int, RawBlockSize>;
+    packed_leaf_64_type n64(11, bid_type());
+    auto* block64 = new packed_leaf_64_type::block_type;
+    n64.set_block(block64);
+    std::vector<std::pair<int64_t, int>> items64 =
+            { {std::numeric_limits<int64_t>::min(), 1}, {-1, 2}, {int64_t(1) << 40, 3},
+              {(int64_t(1) << 40) + 3, 4}, {std::numeric_limits<int64_t>::max(), 5} };
+    n64.set_buffer(items64);
+    ASSERT_EQ(n64.get_buffer_items(), items64);
+    for (const auto& item : items64)
+        ASSERT_EQ(n64.buffer_find(item.first), std::make_pair(item.second, true));
+    ASSERT_EQ(n64.buffer_find(0).second, false);
+    ASSERT_EQ(n64.buffer_find((int64_t(1) << 40) + 1).second, false);
+    delete block64;
+}
+
+TEST_F(TestNode, test_packed_leaf_buffer_setters_try_add_to_buffer) {
+    packed_leaf_type n(10, bid_type());
+    auto* block = new packed_leaf_type::block_type;
+    n.set_block(block);
+
+    // Add batches of close random keys (with duplicates)
+    // until they do not fit anymore.
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<key_type> dist(0, 1 << 16);
+    std::map<key_type, data_type> expected;
+    while (true) {
+        std::map<key_type, data_type> batch;
+        for (int i = 0; i < 64; i++)
+            batch[dist(gen)] = (int) expected.size() + i;
+        std::vector<value_type> new_items(batch.begin(), batch.end());
+        if (!n.try_add_to_buffer(new_items))
+            break;
+        for (const auto& item : new_items)
+            expected[item.first] = item.second;
+    }
+
+    // The leaf is unchanged by the failed add, and holds more
+    // items than an unpacked leaf.
+    ASSERT_EQ(n.get_buffer_items(), std::vector<value_type>(expected.begin(), expected.end()));
+    ASSERT_GT(n.num_items_in_buffer(), (int) leaf_type::max_num_buffer_items_in_leaf);
+    ASSERT_LE(packed_leaf_type::area_bytes(n.get_packing()), (size_t) packed_leaf_type::area_size);
+    for (const auto& item : expected)
+        ASSERT_EQ(n.buffer_find(item.first), std::make_pair(item.second, true));
+
+    delete block;
+}
+
+TEST_F(TestNode, test_packed_leaf_buffer_setters_merge_and_split) {
+    node_type parent(10, bid_type());
+    packed_leaf_type left(11, bid_type());
+    packed_leaf_type right(12, bid_type());
+    auto* parent_block = new node_type::block_type;
+    auto* left_block = new packed_leaf_type::block_type;
+    auto* right_block = new packed_leaf_type::block_type;
+
+    parent.set_block(parent_block);
+    left.set_block(left_block);
+    right.set_block(right_block);
+
+    // Leaf with the even keys as long as they fit, parent
+    // buffer with far apart keys (that are not packed).
+    std::vector<value_type> leaf_items;
+    for (int i = 0; left.try_add_to_buffer(std::vector<value_type>{ value_type(2 * i, 1) }); i++)
+        leaf_items.emplace_back(2 * i, 1);
+
+    std::vector<value_type> parent_buffer_items;
+    for (int i = 0; i < parent.max_buffer_size(); i++)
+        parent_buffer_items.emplace_back(i * (1 << 20), 2);
+    parent.add_to_buffer(parent_buffer_items);
+
+    value_type mid_value = left.merge_and_split(parent.buffer_span(), right);
+
+    std::vector<value_type> merged = stxxl::fractal_tree::merge_into(parent_buffer_items, leaf_items);
+    std::vector<value_type> left_items = left.get_buffer_items();
+    std::vector<value_type> right_items = right.get_buffer_items();
+    ASSERT_FALSE(left_items.empty());
+    ASSERT_FALSE(right_items.empty());
+    ASSERT_EQ(mid_value, merged[left_items.size()]);
+    ASSERT_EQ(left_items, std::vector<value_type>(merged.begin(), merged.begin() + left_items.size()));
+    ASSERT_EQ(right_items, std::vector<value_type>(merged.begin() + left_items.size() + 1, merged.end()));
+
+    delete parent_block;
+    delete left_block;
+    delete right_block;
+}
+
+using string_value_type = std::pair<std::string, std::string>;
+using slotted_node_type = stxxl::fractal_tree::slotted_node<std::string, std::string, RawBlockSize>;
+using slotted_leaf_type = stxxl::fractal_tree::slotted_leaf<std::string, std::string, RawBlockSize>;
+
+// Sorted items with distinct keys of random lengths.
+std::vector<string_value_type> random_string_items(int num_items, int max_length, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> length_dist(0, max_length);
+    std::uniform_int_distribution<int> char_dist('a', 'z');
+    std::map<std::string, std::string> items;
+    while ((int) items.size() < num_items) {
+        std::string key(length_dist(gen), ' ');
+        for (char& c : key)
+            c = char_dist(gen);
+        items[key] = std::string(length_dist(gen), 'x');
+    }
+    return std::vector<string_value_type>(items.begin(), items.end());
+}
+
+TEST_F(TestNode, test_slotted_node_buffer_setters_add_to_buffer) {
+    slotted_node_type n(10, bid_type());
+    auto* block = new slotted_node_type::block_type;
+    n.set_block(block);
+    ASSERT_TRUE(n.buffer_empty());
+    ASSERT_EQ(n.buffer_space(), (int) slotted_node_type::buffer_area_size);
+
+    // Add short items until the buffer is full; it holds more of them
+    // than a buffer of fixed-size items with max_item_size bytes would.
+    std::vector<string_value_type> items = random_string_items(1000, 12, 1);
+    std::map<std::string, std::string> expected;
+    for (int i = 0; i < (int) items.size() && !n.buffer_full(); i++) {
+        n.add_to_buffer(items[i]);
+        expected.insert(items[i]);
+    }
+    ASSERT_TRUE(n.buffer_full());
+    ASSERT_EQ(n.get_buffer_items(), std::vector<string_value_type>(expected.begin(), expected.end()));
+    ASSERT_GT(n.num_items_in_buffer(), (int) slotted_node_type::buffer_area_size / (int) slotted_node_type::max_item_size);
+    for (const auto& item : expected)
+        ASSERT_EQ(n.buffer_find(item.first), std::make_pair(item.second, true));
+    ASSERT_EQ(n.buffer_find("~").second, false);
+
+    // Duplicates replace items, also when they are longer.
+    std::string key = expected.begin()->first;
+    n.truncate_buffer(n.num_items_in_buffer() / 2);
+    n.add_to_buffer(string_value_type(key, std::string(100, 'y')));
+    ASSERT_EQ(n.buffer_find(key), std::make_pair(std::string(100, 'y'), true));
+    ASSERT_TRUE(n.remove_from_buffer(key));
+    ASSERT_EQ(n.buffer_find(key).second, false);
+
+    // num_items_that_fit counts bytes.
+    n.clear_buffer();
+    std::vector<string_value_type> long_items;
+    for (int i = 0; i < 1000; i++)
+        long_items.emplace_back(std::to_string(100000 + i), std::string(100, 'z'));
+    int num_items_that_fit = n.num_items_that_fit(long_items);
+    ASSERT_EQ(num_items_that_fit, n.buffer_space() / (int) (sizeof(stxxl::fractal_tree::slot) + 6 + 100));
+    n.add_to_buffer(std::vector<string_value_type>(long_items.begin(), long_items.begin() + num_items_that_fit));
+    ASSERT_EQ(n.num_items_in_buffer(), num_items_that_fit);
+
+    delete block;
+}
+
+TEST_F(TestNode, test_slotted_node_values_setters_add_to_values) {
+    slotted_node_type n(10, bid_type());
+    auto* block = new slotted_node_type::block_type;
+    n.set_block(block);
+
+    std::vector<string_value_type> items = random_string_items(slotted_node_type::max_num_values_in_node, 20, 2);
+    // Add the values in random order (with consecutive child ids).
+    std::vector<int> order(items.size());
+    for (int i = 0; i < (int) order.size(); i++)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), std::mt19937(3));
+    std::map<std::string, std::string> expected;
+    n.add_to_values(items[order[0]], 0, 1);
+    expected.insert(items[order[0]]);
+    for (int i = 1; i < (int) order.size(); i++) {
+        const string_value_type& value = items[order[i]];
+        int index = std::distance(expected.begin(), expected.lower_bound(value.first));
+        n.add_to_values(value, n.get_child_id(index), i + 1);
+        expected.insert(value);
+    }
+    ASSERT_EQ(n.get_values(), std::vector<string_value_type>(expected.begin(), expected.end()));
+    ASSERT_EQ(n.num_children(), n.num_values() + 1);
+    for (int i = 0; i < (int) items.size(); i++) {
+        auto found = n.values_find(items[i].first);
+        ASSERT_TRUE(found.second);
+        ASSERT_EQ(found.first.first, items[i].second);
+    }
+    ASSERT_EQ(n.values_find("~").second, false);
+
+    // Items in the buffer with keys of values replace their data.
+    n.add_to_buffer(std::vector<string_value_type>{ string_value_type(items[0].first, "new"), string_value_type("~", "buffer") });
+    ASSERT_EQ(n.values_find(items[0].first).first.first, "new");
+    ASSERT_EQ(n.get_buffer_items(), std::vector<string_value_type>{ string_value_type("~", "buffer") });
+
+    delete block;
+}
+
+TEST_F(TestNode, test_slotted_leaf_buffer_setters_merge_and_split) {
+    slotted_node_type parent(10, bid_type());
+    slotted_leaf_type left(11, bid_type());
+    slotted_leaf_type right(12, bid_type());
+    auto* parent_block = new slotted_node_type::block_type;
+    auto* left_block = new slotted_leaf_type::block_type;
+    auto* right_block = new slotted_leaf_type::block_type;
+
+    parent.set_block(parent_block);
+    left.set_block(left_block);
+    right.set_block(right_block);
+
+    // Fill the leaf as long as items fit, then merge a full buffer
+    // of the parent (with duplicates) into it.
+    std::vector<string_value_type> items = random_string_items(4000, 16, 4);
+    std::vector<string_value_type> leaf_items;
+    std::vector<string_value_type> parent_buffer_items;
+    for (int i = 0; i < (int) items.size(); i++) {
+        if (i % 2 == 0 && left.try_add_to_buffer(std::vector<string_value_type>{ items[i] }))
+            leaf_items.push_back(items[i]);
+        else if (i % 3 == 0)
+            parent_buffer_items.push_back(items[i]);
+    }
+    for (int i = 0; i < (int) leaf_items.size(); i += 5)
+        parent_buffer_items.emplace_back(leaf_items[i].first, "duplicate");
+    std::sort(parent_buffer_items.begin(), parent_buffer_items.end());
+    parent_buffer_items.resize(parent.num_items_that_fit(parent_buffer_items));
+    parent.add_to_buffer(parent_buffer_items);
+    ASSERT_LE(left.num_bytes_in_buffer(), (int) slotted_leaf_type::leaf_area_size);
+    ASSERT_FALSE(left.try_add_to_buffer(parent.buffer_span()));
+    ASSERT_EQ(left.get_buffer_items(), leaf_items);
+
+    string_value_type mid_value = left.merge_and_split(parent.buffer_span(), right);
+
+    std::vector<string_value_type> merged = stxxl::fractal_tree::merge_into(parent_buffer_items, leaf_items);
+    std::vector<string_value_type> left_items = left.get_buffer_items();
+    std::vector<string_value_type> right_items = right.get_buffer_items();
+    ASSERT_FALSE(left_items.empty());
+    ASSERT_FALSE(right_items.empty());
+    ASSERT_EQ(mid_value, merged[left_items.size()]);
+    ASSERT_EQ(left_items, std::vector<string_value_type>(merged.begin(), merged.begin() + left_items.size()));
+    ASSERT_EQ(right_items, std::vector<string_value_type>(merged.begin() + left_items.size() + 1, merged.end()));
+    for (int i = 0; i < (int) right_items.size(); i += 7)
+        ASSERT_EQ(right.buffer_find(right_items[i].first), std::make_pair(right_items[i].second, true));
+
+    delete parent_block;
+    delete left_block;
+    delete right_block;
+}